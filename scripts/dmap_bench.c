@@ -0,0 +1,399 @@
+/*
+ * Benchmark and byte equivalence check for the DAAP song list encoder in
+ * src/dmap_common.c. Synthetic songs are encoded with dmap_encode_plan_new()
+ * and dmap_encode_file_metadata(), and with the encoder that was used before
+ * the encode plans (kept below as old_encode_file_metadata()). The outputs
+ * must be identical. The values include NULL, empty, zero, negative and
+ * overflowing strings, so the rules for leaving out fields are covered too.
+ * The program exits with status 1 if the outputs differ, so run it after
+ * changing the encoder or the field table.
+ *
+ * It includes dmap_common.c, so it must be built in a configured tree where
+ * make has generated dmap_fields_hash.h and parsers/daap_parser.h, e.g.:
+ *
+ *   cc -O2 -DHAVE_CONFIG_H -I. -Isrc -o dmap_bench scripts/dmap_bench.c -levent
+ *   ./dmap_bench 100000
+ *
+ * The argument is the number of songs, default is 20000.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "dmap_common.c"
+
+#define ROUNDS 5
+
+// Meta list like the one iTunes and Remote send for a song list
+static const char *itunes_meta[] =
+  {
+    "dmap.itemkind", "dmap.itemid", "dmap.itemname", "dmap.persistentid", "dmap.containeritemid",
+    "daap.songalbum", "daap.songalbumid", "daap.songartist", "daap.songalbumartist", "daap.songgenre",
+    "daap.songcomposer", "daap.songtime", "daap.songtracknumber", "daap.songtrackcount",
+    "daap.songdiscnumber", "daap.songdisccount", "daap.songyear", "daap.songdatakind",
+    "daap.songcodectype", "daap.songbitrate", "daap.songsamplerate", "daap.songuserrating",
+    "daap.songdateadded", "daap.songdatemodified", "daap.songformat", "com.apple.itunes.mediakind",
+    "com.apple.itunes.extended-media-kind", "daap.songextradata", "daap.songartworkcount",
+  };
+
+
+/* ------------------ Stubs for what dmap_common.c links to ----------------- */
+
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (severity > E_LOG)
+    return;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Same parsing as the versions in misc.c, without the logging
+int
+safe_atoi64(const char *str, int64_t *val)
+{
+  char *end;
+  long long intval;
+
+  if (!str)
+    return -1;
+
+  errno = 0;
+  intval = strtoll(str, &end, 10);
+  if (((errno == ERANGE) && ((intval == LLONG_MAX) || (intval == LLONG_MIN))) || ((errno != 0) && (intval == 0)) || (end == str))
+    return -1;
+
+  *val = intval;
+  return 0;
+}
+
+int
+safe_atou64(const char *str, uint64_t *val)
+{
+  char *end;
+  unsigned long long intval;
+
+  if (!str)
+    return -1;
+
+  errno = 0;
+  intval = strtoull(str, &end, 10);
+  if (((errno == ERANGE) && (intval == ULLONG_MAX)) || ((errno != 0) && (intval == 0)) || (end == str))
+    return -1;
+
+  *val = intval;
+  return 0;
+}
+
+int
+safe_atoi32(const char *str, int32_t *val)
+{
+  int64_t intval;
+
+  if (safe_atoi64(str, &intval) < 0 || intval > INT32_MAX)
+    return -1;
+
+  *val = (int32_t)intval;
+  return 0;
+}
+
+int
+safe_atou32(const char *str, uint32_t *val)
+{
+  uint64_t intval;
+
+  if (safe_atou64(str, &intval) < 0 || intval > UINT32_MAX)
+    return -1;
+
+  *val = (uint32_t)intval;
+  return 0;
+}
+
+char *
+safe_strdup(const char *str)
+{
+  return str ? strdup(str) : NULL;
+}
+
+void
+log_fatal_err(int domain, const char *func, int line, int err)
+{
+  fprintf(stderr, "%s failed at line %d, error %d\n", func, line, err);
+  abort();
+}
+
+void
+log_fatal_null(int domain, const char *func, int line)
+{
+  fprintf(stderr, "%s returned NULL at line %d\n", func, line);
+  abort();
+}
+
+int
+daap_lex_parse(struct daap_result *result, const char *input)
+{
+  return -1;
+}
+
+
+/* ------------------ The encoder from before encode plans ------------------ */
+
+static int
+old_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  const struct dmap_field_map *dfm;
+  const struct dmap_field *df;
+  char **strval;
+  int32_t val;
+  int want_mikd = 0;
+  int want_asdk = 0;
+  int want_ased = 0;
+  int i;
+
+  for (i = 0; ; i++)
+    {
+      if (nmeta > 0)
+	{
+	  if (i == nmeta)
+	    break;
+
+	  df = meta[i];
+	  if (df->dfm)
+	    dfm = df->dfm;
+	  else
+	    break;
+	}
+      else
+	{
+	  if (i == (sizeof(dmap_fields) / sizeof(dmap_fields[0])))
+	    break;
+
+	  df = &dmap_fields[i];
+	  dfm = dmap_fields[i].dfm;
+	}
+
+      if (dfm == &dfm_dmap_ased)
+	{
+	  want_ased = 1;
+	  continue;
+	}
+
+      if (dfm->mfi_offset < 0)
+	continue;
+
+      if (dfm == &dfm_dmap_mikd)
+	{
+	  want_mikd = 1;
+	  continue;
+	}
+      else if (dfm == &dfm_dmap_asdk)
+	{
+	  want_asdk = 1;
+	  continue;
+	}
+
+      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+
+      if (!(*strval) || (**strval == '\0'))
+	continue;
+
+      if (dfm == &dfm_dmap_ascd)
+	{
+	  dmap_add_literal(song, df->tag, *strval, 4);
+	  continue;
+	}
+
+      dmap_add_field(song, df, *strval, 0);
+    }
+
+  if (want_ased)
+    {
+      dmap_add_short(song, "ased", 1);
+      dmap_add_short(song, "asac", 1);
+    }
+
+  if (sort_tags)
+    {
+      dmap_add_string(song, "assn", dbmfi->title_sort);
+      dmap_add_string(song, "assa", dbmfi->artist_sort);
+      dmap_add_string(song, "assu", dbmfi->album_sort);
+      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+
+      if (dbmfi->composer_sort)
+	dmap_add_string(song, "assc", dbmfi->composer_sort);
+    }
+
+  val = 0;
+  if (want_mikd)
+    val += 9;
+  if (want_asdk)
+    val += 9;
+
+  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
+
+  if (want_mikd)
+    {
+      if (safe_atoi32(dbmfi->item_kind, &val) < 0)
+	val = 2;
+      dmap_add_char(songlist, "mikd", val);
+    }
+  if (want_asdk)
+    {
+      if (safe_atoi32(dbmfi->data_kind, &val) < 0)
+	val = 0;
+      dmap_add_char(songlist, "asdk", val);
+    }
+
+  return evbuffer_add_buffer(songlist, song);
+}
+
+
+/* ---------------------------------- Main ---------------------------------- */
+
+static const char *value_samples[] =
+  {
+    "0", "1", "7", "255", "256", "65535", "65536", "-1", "-32768", "2147483647", "2147483648",
+    "4294967295", "4294967296", "-9223372036854775808", "99999999999999999999", "12abc", "abc",
+    "mp3a", "alac", "Some Title", "Ärger über Öl", "A much longer string that looks like a path or a comment",
+  };
+
+// The values are padded, since ascd is always sent as 4 bytes
+static char *
+value_make(void)
+{
+  const char *s;
+  char *val;
+  int r;
+
+  r = rand() % 100;
+  if (r < 10)
+    return NULL;
+  else if (r < 15)
+    s = "";
+  else
+    s = value_samples[rand() % (sizeof(value_samples) / sizeof(value_samples[0]))];
+
+  val = calloc(1, strlen(s) + 8);
+  strcpy(val, s);
+  return val;
+}
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+run(const char *name, struct db_media_file_info *songs, int nsongs, const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  struct dmap_encode_plan *plan;
+  struct evbuffer *old;
+  struct evbuffer *new;
+  struct evbuffer *song;
+  double old_ms = 0;
+  double new_ms = 0;
+  double t;
+  int ok = 1;
+  int i;
+  int j;
+
+  song = evbuffer_new();
+
+  for (j = 0; j < ROUNDS; j++)
+    {
+      old = evbuffer_new();
+      new = evbuffer_new();
+
+      t = now_ms();
+      for (i = 0; i < nsongs; i++)
+	old_encode_file_metadata(old, song, &songs[i], meta, nmeta, sort_tags);
+      old_ms += now_ms() - t;
+
+      t = now_ms();
+      plan = dmap_encode_plan_new(meta, nmeta, sort_tags);
+      for (i = 0; i < nsongs; i++)
+	dmap_encode_file_metadata(new, plan, &songs[i]);
+      dmap_encode_plan_free(plan);
+      new_ms += now_ms() - t;
+
+      if (evbuffer_get_length(old) != evbuffer_get_length(new)
+	  || memcmp(evbuffer_pullup(old, -1), evbuffer_pullup(new, -1), evbuffer_get_length(old)) != 0)
+	ok = 0;
+
+      evbuffer_free(old);
+      evbuffer_free(new);
+    }
+
+  evbuffer_free(song);
+
+  printf("%-3s %-24s old %8.1f ms  new %8.1f ms  x%.2f\n", ok ? "ok" : "!!", name, old_ms / ROUNDS, new_ms / ROUNDS, old_ms / new_ms);
+
+  return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+  const struct dmap_field *meta[sizeof(itunes_meta) / sizeof(itunes_meta[0])];
+  struct db_media_file_info *songs;
+  char **fields;
+  int nfields;
+  int nsongs;
+  int nmeta;
+  int ok;
+  int i;
+  int j;
+
+  nsongs = (argc > 1) ? atoi(argv[1]) : 20000;
+
+  // All members of db_media_file_info are strings
+  nfields = sizeof(struct db_media_file_info) / sizeof(char *);
+  songs = calloc(nsongs, sizeof(struct db_media_file_info));
+  if (!songs)
+    return 1;
+
+  srand(1);
+  for (i = 0; i < nsongs; i++)
+    {
+      fields = (char **)&songs[i];
+      for (j = 0; j < nfields; j++)
+	fields[j] = value_make();
+    }
+
+  for (i = 0, nmeta = 0; i < sizeof(itunes_meta) / sizeof(itunes_meta[0]); i++)
+    {
+      meta[nmeta] = dmap_find_field(itunes_meta[i], strlen(itunes_meta[i]));
+      if (meta[nmeta])
+	nmeta++;
+      else
+	fprintf(stderr, "Unknown meta field %s\n", itunes_meta[i]);
+    }
+
+  ok = run("all fields", songs, nsongs, NULL, 0, 0);
+  ok &= run("all fields, sort tags", songs, nsongs, NULL, 0, 1);
+  ok &= run("iTunes meta", songs, nsongs, meta, nmeta, 0);
+  ok &= run("iTunes meta, sort tags", songs, nsongs, meta, nmeta, 1);
+
+  for (i = 0; i < nsongs; i++)
+    {
+      fields = (char **)&songs[i];
+      for (j = 0; j < nfields; j++)
+	free(fields[j]);
+    }
+  free(songs);
+
+  return ok ? 0 : 1;
+}
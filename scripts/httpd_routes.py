@@ -0,0 +1,455 @@
+#!/usr/bin/env python3
+#
+# Equivalence check and benchmark for the URI router in src/httpd_router.c.
+# The handler tables of all the httpd modules are read from src/httpd_*.c, and
+# paths are generated from each handler's regex, plus variations that should
+# not match it (extra or missing segments, bad ids etc.). Each path is routed
+# with every method by httpd_router_match() and by the matching that was used
+# before the router: regexec() of each handler in table order. Both must pick
+# the same handler, and the ids the router captures must be the values of the
+# "[[:digit:]]+" segments. If anything differs, the script exits with status 1.
+#
+# The driver is compiled with cc, so libevent headers are needed (for
+# httpd_internal.h). Run it from the top of the source tree after changing the
+# router or a handler table, e.g.:
+#
+#   scripts/httpd_routes.py -r 200
+#
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+try:
+    import re._parser as sre_parse
+except ImportError:
+    import sre_parse
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src')
+
+MODULES = ['artworkapi', 'daap', 'dacp', 'jsonapi', 'oauth', 'rsp', 'streaming']
+
+# Must match enum httpd_methods in src/httpd_internal.h, 0 is "any method"
+METHODS = ['0', 'HTTPD_METHOD_GET', 'HTTPD_METHOD_POST', 'HTTPD_METHOD_HEAD', 'HTTPD_METHOD_PUT',
+           'HTTPD_METHOD_DELETE', 'HTTPD_METHOD_OPTIONS', 'HTTPD_METHOD_PATCH']
+
+POSIX_CLASSES = {'[:digit:]': '0-9', '[:alpha:]': 'A-Za-z', '[:alnum:]': 'A-Za-z0-9',
+                 '[:upper:]': 'A-Z', '[:lower:]': 'a-z', '[:space:]': ' \\t'}
+
+# Characters that paths are generated from, where a regex allows anything
+PATH_CHARS = 'abcxyzABC019_-.%'
+
+DRIVER = r'''
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <regex.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "httpd_internal.h"
+#include "httpd_router.h"
+
+struct table
+{
+  const char *name;
+  struct httpd_uri_map *handlers;
+  const char **paths;
+};
+
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (severity > E_LOG)
+    return;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+void
+log_fatal_null(int domain, const char *func, int line)
+{
+  fprintf(stderr, "%%s returned NULL at line %%d\n", func, line);
+  abort();
+}
+
+static int
+handler_dummy(struct httpd_request *hreq)
+{
+  return 0;
+}
+
+%(tables)s
+
+static const int methods[] = { %(methods)s };
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// The matching from before the router
+static int
+old_match(regex_t *pregs, struct httpd_uri_map *handlers, const char *path, int method)
+{
+  int i;
+
+  for (i = 0; handlers[i].handler; i++)
+    {
+      if (handlers[i].method && method && !(handlers[i].method & method))
+	continue;
+
+      if (regexec(&pregs[i], path, 0, NULL, 0) == 0)
+	return i;
+    }
+
+  return -1;
+}
+
+// Values of the path segments where the regex has "[[:digit:]]+"
+static int
+ids_expected(int64_t *ids, const char *regexp, const char *path)
+{
+  const char *seg;
+  char *end;
+  int nids = 0;
+
+  for (regexp += 2, seg = path + 1; *regexp && nids < HTTPD_PATH_IDS_MAX; )
+    {
+      if (strncmp(regexp, "[[:digit:]]+", 12) == 0)
+	{
+	  errno = 0;
+	  ids[nids] = strtoll(seg, &end, 10);
+	  if (errno == ERANGE)
+	    ids[nids] = -1;
+	  nids++;
+	}
+
+      regexp = strchr(regexp, '/');
+      seg = strchr(seg, '/');
+      if (!regexp || !seg)
+	break;
+      regexp++;
+      seg++;
+    }
+
+  return nids;
+}
+
+static int
+check(struct table *t, regex_t *pregs)
+{
+  struct httpd_router *router;
+  struct httpd_router_match match;
+  int64_t ids[HTTPD_PATH_IDS_MAX];
+  int nids;
+  int old;
+  int nfailed = 0;
+  int i;
+  int j;
+
+  router = httpd_router_new(t->handlers);
+  if (!router)
+    return 1;
+
+  for (i = 0; t->paths[i]; i++)
+    for (j = 0; j < sizeof(methods) / sizeof(methods[0]); j++)
+      {
+	old = old_match(pregs, t->handlers, t->paths[i], methods[j]);
+	httpd_router_match(&match, router, t->handlers, t->paths[i], methods[j]);
+
+	if (match.handler != old)
+	  {
+	    printf("!! %%s %%s (method %%d): old %%s, router %%s\n", t->name, t->paths[i], methods[j],
+		   old >= 0 ? t->handlers[old].regexp : "no match", match.handler >= 0 ? t->handlers[match.handler].regexp : "no match");
+	    nfailed++;
+	    continue;
+	  }
+
+	if (old < 0 || t->handlers[old].preg)
+	  continue;
+
+	nids = ids_expected(ids, t->handlers[old].regexp, t->paths[i]);
+	if (match.nids != nids || memcmp(match.ids, ids, nids * sizeof(int64_t)) != 0)
+	  {
+	    printf("!! %%s %%s: router has %%d ids, expected %%d\n", t->name, t->paths[i], match.nids, nids);
+	    nfailed++;
+	  }
+      }
+
+  httpd_router_free(router, t->handlers);
+
+  return nfailed;
+}
+
+static void
+bench(struct table *t, regex_t *pregs, int rounds)
+{
+  struct httpd_router *router;
+  struct httpd_router_match match;
+  double old_ms;
+  double new_ms;
+  double start;
+  int npaths;
+  int i;
+  int k;
+
+  router = httpd_router_new(t->handlers);
+  if (!router)
+    return;
+
+  for (npaths = 0; t->paths[npaths]; npaths++)
+    ;
+
+  start = now_ms();
+  for (k = 0; k < rounds; k++)
+    for (i = 0; i < npaths; i++)
+      old_match(pregs, t->handlers, t->paths[i], HTTPD_METHOD_GET);
+  old_ms = now_ms() - start;
+
+  start = now_ms();
+  for (k = 0; k < rounds; k++)
+    for (i = 0; i < npaths; i++)
+      httpd_router_match(&match, router, t->handlers, t->paths[i], HTTPD_METHOD_GET);
+  new_ms = now_ms() - start;
+
+  printf("%%-12s %%5d paths  old %%8.2f us/path  router %%8.2f us/path  x%%.1f\n", t->name, npaths,
+	 1000 * old_ms / (rounds * npaths), 1000 * new_ms / (rounds * npaths), old_ms / new_ms);
+
+  httpd_router_free(router, t->handlers);
+}
+
+int
+main(int argc, char **argv)
+{
+  regex_t *pregs;
+  int rounds;
+  int nfailed = 0;
+  int n;
+  int i;
+  int j;
+
+  rounds = (argc > 1) ? atoi(argv[1]) : 100;
+
+  for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++)
+    {
+      for (n = 0; tables[i].handlers[n].handler; n++)
+	;
+
+      pregs = calloc(n, sizeof(regex_t));
+      for (j = 0; j < n; j++)
+	{
+	  if (regcomp(&pregs[j], tables[i].handlers[j].regexp, REG_EXTENDED | REG_NOSUB) != 0)
+	    {
+	      printf("!! %%s: invalid regex '%%s'\n", tables[i].name, tables[i].handlers[j].regexp);
+	      return 1;
+	    }
+	}
+
+      nfailed += check(&tables[i], pregs);
+      bench(&tables[i], pregs, rounds);
+
+      for (j = 0; j < n; j++)
+	regfree(&pregs[j]);
+      free(pregs);
+    }
+
+  printf("%%d of the routed paths differ from the regex matching\n", nfailed);
+
+  return nfailed ? 1 : 0;
+}
+'''
+
+
+def c_array(src, name):
+    '''Returns the body of the initializer of the array called name'''
+    m = re.search(r'\b' + name + r'\[\]\s*=\s*\{(.*?)\n\s*\};', src, re.S)
+    if not m:
+        sys.exit('Could not find %s[] in the source' % name)
+    # Drop comments so they can't be mistaken for entries
+    return re.sub(r'//[^\n]*|/\*.*?\*/', '', m.group(1), flags=re.S)
+
+
+def c_entries(body):
+    '''Splits the body of an array initializer into the top level {...}'''
+    entries = []
+    depth = 0
+    for i, c in enumerate(body):
+        if c == '{':
+            if depth == 0:
+                start = i + 1
+            depth += 1
+        elif c == '}':
+            depth -= 1
+            if depth == 0:
+                entries.append(body[start:i])
+    return entries
+
+
+def handlers_parse(src, module):
+    '''Returns (method, regexp) of each handler in the module's table'''
+    name = re.search(r'struct httpd_uri_map (\w+)\[\]\s*=', src).group(1)
+    handlers = []
+    for entry in c_entries(c_array(src, name)):
+        if '.regexp' in entry:
+            regexp = re.search(r'\.regexp\s*=\s*(NULL|"(?:[^"\\]|\\.)*")', entry).group(1)
+            method = re.search(r'\.method\s*=\s*([^,]+)', entry)
+            method = method.group(1).strip() if method else '0'
+        else:
+            fields = [f.strip() for f in entry.split(',')]
+            method, regexp = fields[0], fields[1]
+        if regexp == 'NULL':
+            break
+        handlers.append((method, regexp[1:-1].replace('\\\\', '\\')))
+    if not handlers:
+        sys.exit('No handlers found in httpd_%s.c' % module)
+    return handlers
+
+
+def posix_to_python(regexp):
+    for cls, chars in POSIX_CLASSES.items():
+        regexp = regexp.replace(cls, chars)
+    return regexp
+
+
+def sample_make(parsed):
+    '''Returns a random string matching the parsed regex'''
+    out = ''
+    for op, av in parsed:
+        name = str(op)
+        if name == 'LITERAL':
+            out += chr(av)
+        elif name == 'ANY':
+            out += random.choice(PATH_CHARS)
+        elif name == 'NOT_LITERAL':
+            out += random.choice(PATH_CHARS.replace(chr(av), ''))
+        elif name == 'IN':
+            allowed = [c for c in PATH_CHARS + 'Z' if re.fullmatch(sample_in(av), c)]
+            out += random.choice(allowed)
+        elif name in ('MAX_REPEAT', 'MIN_REPEAT'):
+            lo, hi, sub = av
+            if random.random() < 0.1:
+                # Sometimes a long one, e.g. an id that doesn't fit in int64
+                n = min(hi, lo + 20)
+            else:
+                n = random.randint(lo, min(hi, lo + 3))
+            out += ''.join(sample_make(sub) for _ in range(n))
+        elif name == 'SUBPATTERN':
+            out += sample_make(av[-1])
+        elif name == 'BRANCH':
+            out += sample_make(random.choice(av[1]))
+        elif name == 'AT':
+            pass
+        else:
+            sys.exit('Unsupported regex element %s' % name)
+    return out
+
+
+def sample_in(av):
+    '''Returns a Python character class for an IN element'''
+    negate = ''
+    chars = ''
+    for op, val in av:
+        name = str(op)
+        if name == 'NEGATE':
+            negate = '^'
+        elif name == 'LITERAL':
+            chars += re.escape(chr(val))
+        elif name == 'RANGE':
+            chars += '%s-%s' % (re.escape(chr(val[0])), re.escape(chr(val[1])))
+        else:
+            sys.exit('Unsupported character class element %s' % name)
+    return '[%s%s]' % (negate, chars)
+
+
+def paths_make(handlers, nsamples):
+    '''Paths matching each handler, and variations that might not'''
+    paths = set(['', '/', '//'])
+    for _, regexp in handlers:
+        parsed = sre_parse.parse(posix_to_python(regexp))
+        for _ in range(nsamples):
+            path = sample_make(parsed)
+            segments = path.split('/')
+            paths.add(path)
+            paths.add(path + '/')
+            paths.add(path + '/x')
+            paths.add(path[:-1])
+            paths.add(path.upper())
+            paths.add('/'.join(segments[:-1]))
+            paths.add(path.replace('/', '//', 1))
+            paths.add(path[1:])
+            i = random.randrange(1, len(segments))
+            for seg in ['', '12a', '-1', 'x.y']:
+                paths.add('/'.join(segments[:i] + [seg] + segments[i + 1:]))
+    return sorted(paths)
+
+
+def c_str(s):
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+
+def tables_make(nsamples):
+    out = []
+    names = []
+    for module in MODULES:
+        with open(os.path.join(SRC_DIR, 'httpd_%s.c' % module)) as f:
+            handlers = handlers_parse(f.read(), module)
+
+        out.append('static struct httpd_uri_map handlers_%s[] =\n  {' % module)
+        for method, regexp in handlers:
+            out.append('    { %s, %s, handler_dummy },' % (method, c_str(regexp)))
+        out.append('    { 0, NULL, NULL }\n  };\n')
+
+        out.append('static const char *paths_%s[] =\n  {' % module)
+        for path in paths_make(handlers, nsamples):
+            out.append('    %s,' % c_str(path))
+        out.append('    NULL\n  };\n')
+
+        names.append('    { "%s", handlers_%s, paths_%s },' % (module, module, module))
+
+    out.append('static struct table tables[] =\n  {\n%s\n  };' % '\n'.join(names))
+    return '\n'.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare the URI router with regex matching of the handler tables')
+    parser.add_argument('-s', '--samples', type=int, default=20, help='paths generated per handler (default: 20)')
+    parser.add_argument('-r', '--rounds', type=int, default=100, help='benchmark rounds (default: 100)')
+    parser.add_argument('--cc', default=os.environ.get('CC', 'cc'), help='C compiler (default: $CC or cc)')
+    args = parser.parse_args()
+
+    random.seed(1)
+    driver = DRIVER % {'tables': tables_make(args.samples), 'methods': ', '.join(METHODS)}
+
+    with tempfile.TemporaryDirectory() as tmp:
+        driver_c = os.path.join(tmp, 'httpd_routes.c')
+        driver_bin = os.path.join(tmp, 'httpd_routes')
+        with open(driver_c, 'w') as f:
+            f.write(driver)
+
+        # The defines stand in for config.h, which misc.h otherwise depends on
+        cmd = [args.cc, '-O2', '-DHAVE_CLOCK_GETTIME', '-DHAVE_TIMER_SETTIME', '-I', SRC_DIR, '-o', driver_bin,
+               driver_c, os.path.join(SRC_DIR, 'httpd_router.c')]
+        if subprocess.call(cmd) != 0:
+            sys.exit('Could not build the driver')
+
+        return subprocess.call([driver_bin, str(args.rounds)])
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,296 @@
+/*
+ * Benchmark and equivalence check for the kernels in src/pcm.c. Each kernel is
+ * run on random audio and compared byte for byte with a plain C reference
+ * loop, and both are timed. The program exits with status 1 if any kernel
+ * gives a different result than its reference, so run it after changing one
+ * of the kernels, e.g.:
+ *
+ *   cc -O2 -Isrc -DHAVE_CLOCK_GETTIME -DHAVE_TIMER_SETTIME -o pcm_bench \
+ *     scripts/pcm_bench.c src/pcm.c -lm && ./pcm_bench
+ *
+ * The defines stand in for config.h, which misc.h otherwise depends on.
+ *
+ * Which SIMD version pcm_init() selected is printed first. Sizes are in
+ * samples per channel of stereo audio, default is 441000 (10 s at 44.1 kHz).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "pcm.h"
+
+#define CHANNELS 2
+#define ROUNDS 20
+
+// pcm.c only logs from pcm_init()
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int32_t
+get(const uint8_t *in, int bps)
+{
+  uint32_t v = 0;
+  int i;
+
+  for (i = 0; i < bps / 8; i++)
+    v |= (uint32_t)in[i] << (32 - bps + 8 * i);
+
+  return (int32_t)v >> (32 - bps);
+}
+
+static void
+put(uint8_t *out, int bps, int64_t value)
+{
+  int i;
+
+  for (i = 0; i < bps / 8; i++)
+    out[i] = value >> (8 * i);
+}
+
+
+/* ---------------------------- Reference loops ----------------------------- */
+
+static void
+ref_convert(uint8_t *out, int dst_bps, const uint8_t *in, int src_bps, int nvalues)
+{
+  int32_t v;
+  int i;
+
+  for (i = 0; i < nvalues; i++)
+    {
+      v = get(in + i * src_bps / 8, src_bps);
+      v = (dst_bps > src_bps) ? (int32_t)((uint32_t)v << (dst_bps - src_bps)) : (v >> (src_bps - dst_bps));
+      put(out + i * dst_bps / 8, dst_bps, v);
+    }
+}
+
+static void
+ref_to_float(float *out, const uint8_t *in, int bps, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++)
+    out[i] = get(in + i * bps / 8, bps) / ldexpf(1.0f, bps - 1);
+}
+
+static void
+ref_from_float(uint8_t *out, int bps, const float *in, int nvalues)
+{
+  double scale = ldexp(1.0, bps - 1);
+  double v;
+  int i;
+
+  for (i = 0; i < nvalues; i++)
+    {
+      v = (bps == 32) ? (double)in[i] * scale : (double)(in[i] * (float)scale);
+      v = fmin(fmax(v, -scale), scale - 1);
+      put(out + i * bps / 8, bps, llrint(v));
+    }
+}
+
+static void
+ref_volume(uint8_t *buf, int bps, int nvalues, int volume)
+{
+  int64_t gain = ((int64_t)volume << 15) / 100;
+  int i;
+
+  for (i = 0; i < nvalues; i++)
+    put(buf + i * bps / 8, bps, (get(buf + i * bps / 8, bps) * gain) >> 15);
+}
+
+static void
+ref_interleave(uint8_t *out, const uint8_t **planes, int bps, int channels, int nsamples)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < nsamples; i++)
+    for (j = 0; j < channels; j++)
+      memcpy(out + (i * channels + j) * bps / 8, planes[j] + i * bps / 8, bps / 8);
+}
+
+
+/* ---------------------------------- Main ---------------------------------- */
+
+static int failed;
+
+static void
+report(const char *name, double ref_ms, double pcm_ms, const void *ref, const void *res, size_t len)
+{
+  int ok = (memcmp(ref, res, len) == 0);
+
+  printf("%-3s %-24s ref %8.2f ms  pcm %8.2f ms  x%.1f\n", ok ? "ok" : "!!", name, ref_ms, pcm_ms, ref_ms / pcm_ms);
+  if (!ok)
+    failed = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  const int bps_list[] = { 16, 24, 32 };
+  struct media_quality src = { 44100, 0, CHANNELS, 0 };
+  struct media_quality dst = { 44100, 0, CHANNELS, 0 };
+  const uint8_t *planes[CHANNELS];
+  uint8_t *in;
+  uint8_t *ref;
+  uint8_t *res;
+  float *fref;
+  float *fres;
+  char name[64];
+  double t;
+  double ref_ms;
+  double pcm_ms;
+  int nsamples;
+  int nvalues;
+  int i;
+  int j;
+  int k;
+
+  nsamples = (argc > 1) ? atoi(argv[1]) : 441000;
+  nvalues = nsamples * CHANNELS;
+
+  in = malloc(4 * nvalues);
+  ref = malloc(4 * nvalues);
+  res = malloc(4 * nvalues);
+  fref = malloc(sizeof(float) * nvalues);
+  fres = malloc(sizeof(float) * nvalues);
+  if (!in || !ref || !res || !fref || !fres)
+    return 1;
+
+  srand(1);
+  for (i = 0; i < 4 * nvalues; i++)
+    in[i] = rand();
+
+  pcm_init();
+
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+      {
+	if (i == j)
+	  continue;
+
+	src.bits_per_sample = bps_list[i];
+	dst.bits_per_sample = bps_list[j];
+	snprintf(name, sizeof(name), "convert s%d to s%d", bps_list[i], bps_list[j]);
+
+	t = now_ms();
+	for (k = 0; k < ROUNDS; k++)
+	  ref_convert(ref, bps_list[j], in, bps_list[i], nvalues);
+	ref_ms = now_ms() - t;
+
+	t = now_ms();
+	for (k = 0; k < ROUNDS; k++)
+	  pcm_convert(res, &dst, in, &src, nsamples);
+	pcm_ms = now_ms() - t;
+
+	report(name, ref_ms, pcm_ms, ref, res, nvalues * bps_list[j] / 8);
+      }
+
+  for (i = 0; i < 3; i++)
+    {
+      snprintf(name, sizeof(name), "s%d to float", bps_list[i]);
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	ref_to_float(fref, in, bps_list[i], nvalues);
+      ref_ms = now_ms() - t;
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	pcm_to_float(fres, in, bps_list[i], nvalues);
+      pcm_ms = now_ms() - t;
+
+      report(name, ref_ms, pcm_ms, fref, fres, sizeof(float) * nvalues);
+
+      // Slightly out of range values check the clamping
+      for (k = 0; k < nvalues; k += 97)
+	fres[k] *= 1.01f;
+
+      snprintf(name, sizeof(name), "float to s%d", bps_list[i]);
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	ref_from_float(ref, bps_list[i], fres, nvalues);
+      ref_ms = now_ms() - t;
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	pcm_from_float(res, bps_list[i], fres, nvalues);
+      pcm_ms = now_ms() - t;
+
+      report(name, ref_ms, pcm_ms, ref, res, nvalues * bps_list[i] / 8);
+    }
+
+  // Volume works in place, so each round starts from a fresh copy
+  for (i = 0; i < 3; i++)
+    {
+      snprintf(name, sizeof(name), "volume s%d", bps_list[i]);
+
+      ref_ms = 0;
+      pcm_ms = 0;
+      for (k = 0; k < ROUNDS; k++)
+	{
+	  memcpy(ref, in, nvalues * bps_list[i] / 8);
+	  t = now_ms();
+	  ref_volume(ref, bps_list[i], nvalues, 1 + k * 98 / ROUNDS);
+	  ref_ms += now_ms() - t;
+
+	  memcpy(res, in, nvalues * bps_list[i] / 8);
+	  t = now_ms();
+	  pcm_volume(res, bps_list[i], nvalues, 1 + k * 98 / ROUNDS);
+	  pcm_ms += now_ms() - t;
+	}
+
+      report(name, ref_ms, pcm_ms, ref, res, nvalues * bps_list[i] / 8);
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      planes[0] = in;
+      planes[1] = in + nsamples * bps_list[i] / 8;
+      snprintf(name, sizeof(name), "interleave s%d", bps_list[i]);
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	ref_interleave(ref, planes, bps_list[i], CHANNELS, nsamples);
+      ref_ms = now_ms() - t;
+
+      t = now_ms();
+      for (k = 0; k < ROUNDS; k++)
+	pcm_interleave(res, planes, bps_list[i], CHANNELS, nsamples);
+      pcm_ms = now_ms() - t;
+
+      report(name, ref_ms, pcm_ms, ref, res, nvalues * bps_list[i] / 8);
+    }
+
+  free(in);
+  free(ref);
+  free(res);
+  free(fref);
+  free(fres);
+
+  return failed;
+}
@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+#
+# Builds a throwaway library database from the schema in src/db_init.c, fills
+# it with synthetic tracks and prints the EXPLAIN QUERY PLAN of the common
+# sorted queries that src/db.c makes. Queries that scan the files table or sort
+# with a temp b-tree are flagged. If one of the queries that there is an index
+# for is flagged, the script exits with status 1.
+#
+# Run it from the top of the source tree after changing an index, a sort clause
+# or one of the list queries, e.g.:
+#
+#   scripts/query_plans.py -n 100000
+#
+# It is also run by make check.
+#
+
+import argparse
+import os
+import random
+import re
+import sqlite3
+import sys
+import time
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src')
+
+# Must match enum sort_type in src/db.h
+SORT_NAMES = ['S_NONE', 'S_NAME', 'S_ALBUM', 'S_ARTIST', 'S_PLAYLIST', 'S_YEAR', 'S_GENRE',
+              'S_COMPOSER', 'S_DISC', 'S_TRACK', 'S_VPATH', 'S_POS', 'S_SHUFFLE_POS',
+              'S_DATE_RELEASED']
+
+# Sorts that don't apply to the files table
+SORT_SKIP = ['S_NONE', 'S_PLAYLIST', 'S_POS', 'S_SHUFFLE_POS']
+
+# Queries that should be fully served by an index, see the I_* in db_init.c
+INDEXED = ['items S_NAME', 'items S_GENRE', 'items S_COMPOSER', 'items S_DATE_RELEASED',
+           'items of album S_ALBUM', 'items time_added DESC', 'playlist items',
+           'album stats S_ALBUM', 'artist stats S_ARTIST']
+
+Q_GROUP_ALBUMS = (
+    "SELECT g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id) AS track_count,"
+    " 1 AS album_count, f.album_artist, f.songartistid,"
+    " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released),"
+    " MAX(f.time_added) AS time_added, MAX(f.time_played), MAX(f.seek) "
+    "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s GROUP BY f.songalbumid %s LIMIT 50")
+
+Q_GROUP_ARTISTS = (
+    "SELECT g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id) AS track_count,"
+    " COUNT(DISTINCT f.songalbumid) AS album_count, f.album_artist, f.songartistid,"
+    " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released),"
+    " MAX(f.time_added) AS time_added, MAX(f.time_played), MAX(f.seek) "
+    "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s GROUP BY f.songartistid %s LIMIT 50")
+
+# Must match db_build_query_group_stats(), the part after UNION ALL groups the
+# dirty groups from files
+Q_GROUP_STATS = (
+    "SELECT g.id, g.persistentid, %(name)s, f.track_count, f.album_count, f.album_artist, f.songartistid,"
+    " f.song_length, f.data_kind, f.media_kind, f.year, f.date_released, f.time_added,"
+    " f.time_played, f.seek, f.album_sort AS sort_album, f.album_artist_sort AS sort_artist "
+    "FROM group_stats f JOIN groups g ON f.persistentid = g.persistentid "
+    "WHERE f.type = %(type)d AND f.scope = %(scope)d AND f.dirty = 0 "
+    "UNION ALL SELECT"
+    " g.id, g.persistentid, %(name)s, COUNT(f.id), %(album_count)s, f.album_artist, f.songartistid,"
+    " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released), MAX(f.time_added),"
+    " MAX(f.time_played), MAX(f.seek), f.album_sort, f.album_artist_sort "
+    "FROM files f JOIN groups g ON f.%(id)s = g.persistentid "
+    "WHERE f.disabled = 0 AND f.media_kind = %(scope)d"
+    " AND f.%(id)s IN (SELECT persistentid FROM group_stats WHERE type = %(type)d AND scope = %(scope)d AND dirty = 1) "
+    "GROUP BY f.%(id)s %(order)s LIMIT 50")
+
+Q_BROWSE = (
+    "SELECT %s, COUNT(f.id), COUNT(DISTINCT f.songalbumid), COUNT(DISTINCT f.songartistid),"
+    " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released),"
+    " MAX(f.time_added), MAX(f.time_played), MAX(f.seek) "
+    "FROM files f WHERE f.disabled = 0 AND %s != '' GROUP BY %s ORDER BY %s")
+
+
+def c_string(body):
+    '''Concatenates the C string literals in body'''
+    strings = re.findall(r'"((?:[^"\\]|\\.)*)"', body)
+    return ''.join(strings).replace('\\"', '"').replace('\\n', '\n')
+
+
+def c_macros(src):
+    '''Returns a dict of the string valued #define's in src'''
+    macros = {}
+    for m in re.finditer(r'^#define (\w+)[ \t]*\\\n((?:.*\\\n)*.*)$', src, re.M):
+        macros[m.group(1)] = c_string(m.group(2))
+    return macros
+
+
+def c_array(src, name):
+    '''Returns the body of the initializer of the array called name'''
+    m = re.search(r'\b' + name + r'\[\]\s*=\s*\{(.*?)\};', src, re.S)
+    if not m:
+        sys.exit('Could not find %s[] in the source' % name)
+    # Drop comments so they can't be mistaken for entries
+    return re.sub(r'//[^\n]*|/\*.*?\*/', '', m.group(1), flags=re.S)
+
+
+def daap_collation(a, b):
+    a = a.lower()
+    b = b.lower()
+    return (a > b) - (a < b)
+
+
+def schema_create(db, db_init):
+    macros = c_macros(db_init)
+
+    for kind in ['table', 'index']:
+        names = re.findall(r'\{\s*(\w+)\s*,', c_array(db_init, 'db_init_%s_queries' % kind))
+        for name in names:
+            try:
+                db.executescript(macros[name])
+            except sqlite3.Error as e:
+                # E.g. a Python sqlite3 built without FTS5
+                print('Skipping %s: %s' % (name, e), file=sys.stderr)
+
+
+def library_fill(db, ntracks):
+    random.seed(1)
+    nartists = max(ntracks // 40, 1)
+    nalbums = max(ntracks // 10, 1)
+
+    rows = []
+    for i in range(1, ntracks + 1):
+        album = random.randint(1, nalbums)
+        artist = album % nartists + 1
+        path = '/music/%d/%d/%d.mp3' % (artist, album, i)
+        rows.append((i, path, '/file:' + path, '%d.mp3' % i, 'Track %d' % i, 'track %d' % i,
+                     'Artist %d' % artist, 'artist %d' % artist, 'Album %d' % album, 'album %d' % album,
+                     'Artist %d' % artist, 'artist %d' % artist, 'Genre %d' % (album % 30),
+                     'Composer %d' % (album % 200), 'composer %d' % (album % 200),
+                     1 if i % 20 else 2, 0 if i % 100 else 1, album, artist, album % 3, i % 15,
+                     1970 + album % 50, i * 10, album * 7, album))
+
+    db.executemany(
+        "INSERT INTO files (id, path, virtual_path, fname, title, title_sort, artist, artist_sort,"
+        " album, album_sort, album_artist, album_artist_sort, genre, composer, composer_sort,"
+        " media_kind, disabled, songalbumid, songartistid, disc, track, year, time_added,"
+        " date_released, directory_id, idx, tv_episode_sort, tv_season_num)"
+        " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, 0, 0)", rows)
+
+    db.execute("INSERT INTO groups (type, name, persistentid) SELECT DISTINCT 1, album, songalbumid FROM files")
+    db.execute("INSERT INTO groups (type, name, persistentid) SELECT DISTINCT 2, album_artist, songartistid FROM files")
+    db.execute("INSERT INTO playlists (id, title, type, path, virtual_path, db_timestamp, idx)"
+               " VALUES (10, 'Playlist', 0, '/p.m3u', '/file:/p.m3u', 0, 0)")
+    db.execute("INSERT INTO playlistitems (playlistid, filepath) SELECT 10, path FROM files WHERE id % 50 = 0")
+
+    db.execute("ANALYZE")
+
+
+def queries_make(db_c):
+    sort_clause = re.findall(r'"([^"]*)"', c_array(db_c, 'sort_clause'))
+    if len(sort_clause) != len(SORT_NAMES):
+        sys.exit('sort_clause[] has %d entries, expected %d' % (len(sort_clause), len(SORT_NAMES)))
+    sort = dict(zip(SORT_NAMES, sort_clause))
+
+    browse = re.findall(r'\{\s*"([^"]*)",\s*"([^"]*)",\s*"([^"]*)"\s*\}', c_array(db_c, 'browse_clause'))
+
+    queries = {}
+
+    for name, clause in sort.items():
+        if name in SORT_SKIP:
+            continue
+        queries['items %s' % name] = \
+            "SELECT f.* FROM files f WHERE f.disabled = 0 AND f.media_kind = 1 ORDER BY %s LIMIT 50" % clause
+
+    queries['items of album S_ALBUM'] = \
+        "SELECT f.* FROM files f WHERE f.disabled = 0 AND f.songalbumid = 17 ORDER BY %s" % sort['S_ALBUM']
+    queries['items of artist S_ARTIST'] = \
+        "SELECT f.* FROM files f WHERE f.disabled = 0 AND f.songartistid = 17 ORDER BY %s" % sort['S_ARTIST']
+    queries['items time_added DESC'] = \
+        "SELECT f.* FROM files f WHERE f.disabled = 0 AND f.media_kind = 1 ORDER BY f.time_added DESC LIMIT 50"
+    queries['items in directory S_VPATH'] = \
+        "SELECT f.* FROM files f WHERE f.disabled = 0 AND f.directory_id = 5 ORDER BY %s" % sort['S_VPATH']
+    queries['playlist items'] = \
+        "SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath" \
+        " WHERE f.disabled = 0 AND pi.playlistid = 10 ORDER BY pi.id ASC"
+    queries['playlists S_PLAYLIST'] = \
+        "SELECT f.* FROM playlists f WHERE f.disabled = 0 AND f.directory_id = 5 ORDER BY %s" % sort['S_PLAYLIST']
+
+    queries['albums S_ALBUM'] = Q_GROUP_ALBUMS % ("WHERE f.disabled = 0 AND f.media_kind = 1", "ORDER BY " + sort['S_ALBUM'])
+    queries['albums of artist S_ALBUM'] = Q_GROUP_ALBUMS % ("WHERE f.disabled = 0 AND f.songartistid = 17", "ORDER BY " + sort['S_ALBUM'])
+    queries['albums time_added DESC'] = Q_GROUP_ALBUMS % ("WHERE f.disabled = 0 AND f.media_kind = 1", "ORDER BY time_added DESC")
+    queries['artists S_ARTIST'] = Q_GROUP_ARTISTS % ("WHERE f.disabled = 0 AND f.media_kind = 1", "ORDER BY " + sort['S_ARTIST'])
+
+    queries['album stats S_ALBUM'] = Q_GROUP_STATS % {
+        'name': 'f.album, f.album_sort', 'album_count': '1', 'id': 'songalbumid',
+        'type': 1, 'scope': 1, 'order': 'ORDER BY sort_album'}
+    queries['artist stats S_ARTIST'] = Q_GROUP_STATS % {
+        'name': 'f.album_artist, f.album_artist_sort', 'album_count': 'COUNT(DISTINCT f.songalbumid)', 'id': 'songartistid',
+        'type': 2, 'scope': 1, 'order': 'ORDER BY sort_artist, sort_album'}
+
+    for select, where, group in browse:
+        if not select:
+            continue
+        queries['browse %s' % where] = Q_BROWSE % (select, where, group, group)
+
+    return queries
+
+
+def plan_is_bad(plan):
+    '''plan is the rows of EXPLAIN QUERY PLAN. The right part of a compound is
+    the group_stats fallback for dirty groups, which is expected to sort.'''
+    right = set()
+    for node, parent, _, step in plan:
+        if parent in right or step == 'RIGHT':
+            right.add(node)
+            continue
+        if re.search(r'TEMP B-TREE FOR (RIGHT PART OF )?(ORDER|GROUP) BY', step):
+            return True
+        if re.match(r'SCAN (f|files)\b', step) and 'INDEX' not in step:
+            return True
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Show the query plans of the common library queries')
+    parser.add_argument('-n', '--tracks', type=int, default=40000, help='number of synthetic tracks (default: 40000)')
+    parser.add_argument('-d', '--database', default=':memory:', help='where to build the database (default: in memory)')
+    args = parser.parse_args()
+
+    with open(os.path.join(SRC_DIR, 'db_init.c')) as f:
+        db_init = f.read()
+    with open(os.path.join(SRC_DIR, 'db.c')) as f:
+        db_c = f.read()
+
+    if args.database != ':memory:' and os.path.exists(args.database):
+        sys.exit('%s already exists' % args.database)
+
+    db = sqlite3.connect(args.database)
+    db.create_collation('DAAP', daap_collation)
+
+    schema_create(db, db_init)
+    library_fill(db, args.tracks)
+
+    # group_stats is filled like db_group_stats_refresh() would, with a few
+    # groups left dirty
+    db.execute("INSERT INTO group_stats (type, persistentid, scope, dirty, album, album_sort, album_artist, album_artist_sort, time_added)"
+               " SELECT 1, songalbumid, media_kind, songalbumid % 100 = 0, album, album_sort, album_artist, album_artist_sort, MAX(time_added)"
+               " FROM files WHERE disabled = 0 GROUP BY songalbumid, media_kind")
+    db.execute("INSERT INTO group_stats (type, persistentid, scope, dirty, album_artist, album_artist_sort, time_added)"
+               " SELECT 2, songartistid, media_kind, songartistid % 100 = 0, album_artist, album_artist_sort, MAX(time_added)"
+               " FROM files WHERE disabled = 0 GROUP BY songartistid, media_kind")
+    db.execute("ANALYZE")
+
+    nbad = 0
+    for name, query in queries_make(db_c).items():
+        plan = db.execute('EXPLAIN QUERY PLAN ' + query).fetchall()
+
+        start = time.monotonic()
+        db.execute(query).fetchall()
+        msec = (time.monotonic() - start) * 1000
+
+        if not plan_is_bad(plan):
+            mark = 'ok'
+        elif name in INDEXED:
+            mark = '!!'
+            nbad += 1
+        else:
+            mark = '--'
+
+        print('%s %-32s %8.1f ms  %s' % (mark, name, msec, ' | '.join(row[3] for row in plan)))
+
+    print('%d of the indexed queries (marked !!) scan or sort without an index' % nbad)
+
+    return 1 if nbad else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -32,6 +32,8 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <time.h>
 
 #include "db.h"
 #include "misc.h"
@@ -42,6 +44,8 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "player.h"
+#include "evthr.h"
 
 #include "artwork.h"
 
@@ -69,6 +73,91 @@
 #define ART_E_ERROR -1
 #define ART_E_ABORT -2
 
+// See dir_cache_check()
+#define DIR_CACHE_SIZE 1024
+#define DIR_CACHE_ENTRIES_MAX 8192
+#define DIR_CACHE_TTL 300
+
+// Number of threads for looking up the artwork in a batch request
+#define ARTWORK_BATCH_NTHREADS 4
+
+// See warmer_run()
+#define ARTWORK_WARMER_INTERVAL_MS 100
+#define ARTWORK_WARMER_PAUSE_MS 10000
+
+// Requested sizes are rounded up to one of these, so the cache only holds a few
+// versions of each image no matter what sizes clients ask for
+static const int artwork_size_ladder[] = { 75, 150, 300, 600, 1200 };
+
+typedef int (*artwork_lookup_fn)(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
+
+// An artwork lookup in progress, see single_flight()
+struct artwork_flight {
+  artwork_lookup_fn lookup;
+  int id;
+  int max_w;
+  int max_h;
+  int format;
+
+  int waiters;
+  bool done;
+  int result;
+  uint8_t *data;
+  size_t len;
+
+  struct artwork_flight *next;
+};
+
+static struct artwork_flight *flights;
+static pthread_mutex_t flights_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flights_cond = PTHREAD_COND_INITIALIZER;
+
+// The image files in a directory, see dir_cache_check()
+struct dir_listing {
+  char *dir;
+  uint32_t hash;
+  time_t expires;
+  bool exists;
+  char **names;
+  int nnames;
+
+  struct dir_listing *next;
+};
+
+static struct dir_listing *dir_cache[DIR_CACHE_SIZE];
+static int dir_cache_count;
+static pthread_mutex_t dir_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+struct artwork_warmer {
+  pthread_t tid;
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  bool triggered;
+  bool exit;
+
+  struct artwork_warmer_status status;
+};
+
+static struct artwork_warmer warmer = { .lck = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Lookups for a batch request that are not in the cache, see artwork_get_batch()
+struct artwork_batch {
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  int pending;
+  int max_w;
+  int max_h;
+};
+
+struct batch_job {
+  struct artwork_batch *batch;
+  struct artwork_batch_item *item;
+};
+
+static struct evthr_pool *batch_threadpool;
+// Makes the other sizes of the ladder in the background, see size_ladder_schedule()
+static struct evthr_pool *ladder_threadpool;
+
 // See online_source_is_failing()
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 3
@@ -621,6 +710,9 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
 
   DPRINTF(E_SPAM, L_ART, "Getting artwork (max destination width %d height %d)\n", req_params.max_w, req_params.max_h);
 
+  xcode_decode_args.max_w = req_params.max_w;
+  xcode_decode_args.max_h = req_params.max_h;
+
   // At this point we don't know if we will need to rescale/reformat, and we
   // won't know until probing the source (which the transcode module does). The
   // act of probing uses evbuffer_remove(), thus consuming some of the buffer.
@@ -759,6 +851,203 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
   return ret;
 }
 
+/* ----------------------- DIRECTORY LISTING CACHE ------------------------- */
+
+/* Looking for cover files means testing every configured basename with every
+ * extension, which is a lot of failed syscalls per directory (and slow on
+ * network filesystems). Instead we read each directory once and remember the
+ * image files in it. Entries are dropped by the filescanner when something in
+ * the directory changes (see artwork_dir_invalidate), and otherwise expire, so
+ * that we also pick up changes that inotify doesn't report, e.g. on NFS.
+ */
+static void
+dir_listing_free(struct dir_listing *listing)
+{
+  int i;
+
+  for (i = 0; i < listing->nnames; i++)
+    free(listing->names[i]);
+
+  free(listing->names);
+  free(listing->dir);
+  free(listing);
+}
+
+static bool
+dir_listing_is_image(const char *name)
+{
+  const char *ext;
+  int i;
+
+  ext = strrchr(name, '.');
+  if (!ext)
+    return false;
+
+  for (i = 0; i < ARRAY_SIZE(cover_extension); i++)
+    {
+      if (strcasecmp(ext + 1, cover_extension[i]) == 0)
+	return true;
+    }
+
+  return false;
+}
+
+static struct dir_listing *
+dir_listing_read(const char *dir, uint32_t hash)
+{
+  struct dir_listing *listing;
+  struct dirent *de;
+  DIR *dirp;
+
+  CHECK_NULL(L_ART, listing = calloc(1, sizeof(struct dir_listing)));
+  CHECK_NULL(L_ART, listing->dir = strdup(dir));
+  listing->hash = hash;
+  listing->expires = time(NULL) + DIR_CACHE_TTL;
+
+  dirp = opendir(dir);
+  if (!dirp)
+    return listing;
+
+  listing->exists = true;
+
+  while ((de = readdir(dirp)))
+    {
+      if (!dir_listing_is_image(de->d_name))
+	continue;
+
+      CHECK_NULL(L_ART, listing->names = realloc(listing->names, (listing->nnames + 1) * sizeof(char *)));
+      CHECK_NULL(L_ART, listing->names[listing->nnames] = strdup(de->d_name));
+      listing->nnames++;
+    }
+
+  closedir(dirp);
+
+  return listing;
+}
+
+// Must be called with the lock held
+static struct dir_listing **
+dir_cache_find(const char *dir, uint32_t hash)
+{
+  struct dir_listing **listing;
+
+  for (listing = &dir_cache[hash % DIR_CACHE_SIZE]; *listing; listing = &(*listing)->next)
+    {
+      if ((*listing)->hash == hash && strcmp((*listing)->dir, dir) == 0)
+	break;
+    }
+
+  return listing;
+}
+
+// Must be called with the lock held
+static void
+dir_cache_clear(void)
+{
+  struct dir_listing *listing;
+  int i;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+      while ((listing = dir_cache[i]))
+	{
+	  dir_cache[i] = listing->next;
+	  dir_listing_free(listing);
+	}
+    }
+
+  dir_cache_count = 0;
+}
+
+/* Returns 1 if the directory has a file with the given name, 0 if it doesn't
+ * and -1 if the directory doesn't exist. With filename NULL it just checks if
+ * the directory exists. A filename with a '/' (e.g. an artwork_basenames entry
+ * like "Scans/front") isn't in the listing, so that one is checked with stat.
+ * Names are compared ignoring case, like the filesystem would on e.g. vfat or
+ * CIFS, and if found filename is replaced by the name on disk.
+ */
+static int
+dir_cache_check(const char *dir, char *filename)
+{
+  struct dir_listing **listing;
+  struct dir_listing *new;
+  struct stat sb;
+  char path[PATH_MAX];
+  uint32_t hash;
+  int ret;
+  int i;
+
+  if (filename && strchr(filename, '/'))
+    {
+      ret = dir_cache_check(dir, NULL);
+      if (ret < 0)
+	return -1;
+
+      ret = snprintf(path, sizeof(path), "%s/%s", dir, filename);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	return 0;
+
+      return (stat(path, &sb) == 0 && S_ISREG(sb.st_mode));
+    }
+
+  hash = djb_hash(dir, strlen(dir));
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&dir_cache_lck));
+
+  listing = dir_cache_find(dir, hash);
+  if (!*listing || (*listing)->expires < time(NULL))
+    {
+      // Don't hold the lock while reading the directory
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_cache_lck));
+      new = dir_listing_read(dir, hash);
+      CHECK_ERR(L_ART, pthread_mutex_lock(&dir_cache_lck));
+
+      // The table may have changed while the lock was released
+      listing = dir_cache_find(dir, hash);
+      if (*listing)
+	{
+	  new->next = (*listing)->next;
+	  dir_listing_free(*listing);
+	  *listing = new;
+	}
+      else
+	{
+	  if (dir_cache_count >= DIR_CACHE_ENTRIES_MAX)
+	    {
+	      dir_cache_clear();
+	      listing = dir_cache_find(dir, hash);
+	    }
+
+	  *listing = new;
+	  dir_cache_count++;
+	}
+    }
+
+  if (!(*listing)->exists)
+    ret = -1;
+  else if (!filename)
+    ret = 1;
+  else
+    {
+      ret = 0;
+      for (i = 0; i < (*listing)->nnames; i++)
+	{
+	  if (strcasecmp((*listing)->names[i], filename) == 0)
+	    {
+	      // Same length, strcasecmp only folds ASCII
+	      memcpy(filename, (*listing)->names[i], strlen(filename));
+	      ret = 1;
+	      break;
+	    }
+	}
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_cache_lck));
+
+  return ret;
+}
+
+
 /*
  * Checks if an image file with one of the configured artwork_basenames exists in
  * the given directory "dir". Returns 0 if an image exists, -1 if no image was
@@ -813,8 +1102,10 @@ dir_image_find(char *out_path, size_t len, const char *dir)
 
 	  DPRINTF(E_SPAM, L_ART, "Trying directory artwork file %s\n", path);
 
-	  ret = access(path, F_OK);
-	  if (ret == 0)
+	  ret = dir_cache_check(dir, path + path_len + 1);
+	  if (ret < 0)
+	    return -1;
+	  else if (ret > 0)
 	    {
 	      snprintf(out_path, len, "%s", path);
 	      return 0;
@@ -883,8 +1174,10 @@ parent_dir_image_find(char *out_path, size_t len, const char *dir)
 
       DPRINTF(E_SPAM, L_ART, "Trying parent directory artwork file %s\n", path);
 
-      ret = access(path, F_OK);
-      if (ret == 0)
+      ret = dir_cache_check(dir, path + path_len + 1);
+      if (ret < 0)
+	return -1;
+      else if (ret > 0)
 	{
 	  snprintf(out_path, len, "%s", path);
 	  return 0;
@@ -1461,7 +1754,7 @@ source_group_dir_get(struct artwork_ctx *ctx)
   while (((ret = db_query_fetch_string(&dir, &qp)) == 0) && (dir))
     {
       /* The db query may return non-directories (eg if item is an internet stream or Spotify) */
-      if (access(dir, F_OK) < 0)
+      if (dir_cache_check(dir, NULL) < 0)
 	continue;
 
       ret = artwork_get_bydir(ctx->evbuf, ctx->path, sizeof(ctx->path), dir, ctx->req_params);
@@ -1983,10 +2276,266 @@ process_group(struct artwork_ctx *ctx)
 }
 
 
-/* ------------------------------ ARTWORK API ------------------------------ */
+/* ---------------------------- SIZE LADDER ------------------------------- */
 
-int
-artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+/* Rounds the requested size up to the nearest step of the ladder. The image of
+ * that step is then scaled down to the requested size, see size_ladder_scale(),
+ * unless the source is smaller. Requests for the original size (zero) or larger
+ * than the top step are left alone.
+ */
+static int
+size_ladder_snap(int size)
+{
+  int i;
+
+  if (size <= 0)
+    return size;
+
+  for (i = 0; i < ARRAY_SIZE(artwork_size_ladder); i++)
+    {
+      if (size <= artwork_size_ladder[i])
+	return artwork_size_ladder[i];
+    }
+
+  return size;
+}
+
+/* Scales the image in evbuf, which was looked up with the ladder step sizes,
+ * down to the size that was requested. Returns the format of the image, which
+ * is left as it is if scaling fails.
+ */
+static int
+size_ladder_scale(struct evbuffer *evbuf, int format, int max_w, int max_h, int req_format)
+{
+  struct artwork_req_params req_params = { .max_w = max_w, .max_h = max_h, .format = req_format };
+  struct evbuffer *step;
+  int ret;
+
+  if (format <= 0 || (size_ladder_snap(max_w) == max_w && size_ladder_snap(max_h) == max_h))
+    return format;
+
+  CHECK_NULL(L_ART, step = evbuffer_new());
+  evbuffer_add_buffer(step, evbuf);
+
+  ret = artwork_get(evbuf, NULL, step, false, DATA_KIND_FILE, req_params);
+  if (ret <= 0)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not scale artwork down to %dx%d, sending it as cached\n", max_w, max_h);
+      evbuffer_drain(evbuf, -1);
+      evbuffer_add_buffer(evbuf, step);
+      ret = format;
+    }
+
+  evbuffer_free(step);
+  return ret;
+}
+
+struct size_ladder_job {
+  int type;
+  int64_t persistentid;
+  int format;
+  int max_w;
+  int max_h;
+  char path[PATH_MAX];
+};
+
+// Thread: ladder pool
+static void
+ladder_thread_init_cb(struct evthr *thr, void *shared)
+{
+#ifdef __linux__
+  struct sched_param param;
+  int ret;
+
+  // Param must be 0 for the SCHED_IDLE policy
+  memset(&param, 0, sizeof(struct sched_param));
+  ret = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_ART, "Warning: Could not set artwork ladder thread priority to SCHED_IDLE\n");
+#endif
+
+  thread_setname(pthread_self(), "artwork ladder");
+
+  CHECK_ERR(L_ART, db_perthread_init());
+}
+
+// Thread: ladder pool
+static void
+ladder_thread_exit_cb(struct evthr *thr, void *shared)
+{
+  db_perthread_deinit();
+}
+
+// Thread: ladder pool
+static void
+size_ladder_generate(struct evthr *thr, void *arg, void *shared)
+{
+  struct size_ladder_job *job = arg;
+  struct artwork_req_params req_params = { .format = job->format };
+  struct evbuffer *evbuf;
+  bool is_embedded;
+  int cached;
+  int format;
+  int size;
+  int i;
+  int ret;
+
+  is_embedded = !artwork_extension_is_artwork(job->path);
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  for (i = 0; i < ARRAY_SIZE(artwork_size_ladder); i++)
+    {
+      size = artwork_size_ladder[i];
+      if (size == job->max_w && size == job->max_h)
+	continue;
+
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+
+      ret = cache_artwork_get(job->type, job->persistentid, size, size, &cached, &format, evbuf);
+      if (ret < 0 || cached)
+	continue;
+
+      req_params.max_w = size;
+      req_params.max_h = size;
+
+      ret = artwork_get(evbuf, job->path, NULL, is_embedded, DATA_KIND_FILE, req_params);
+      if (ret <= 0)
+	break;
+
+      cache_artwork_add(job->type, job->persistentid, size, size, ret, job->path, evbuf);
+    }
+
+  DPRINTF(E_DBG, L_ART, "Finished pregenerating artwork sizes for '%s'\n", job->path);
+
+  evbuffer_free(evbuf);
+  free(job);
+}
+
+/* After a lookup that found artwork in a local file, the other sizes of the
+ * ladder are made in the background, so later requests from clients that want
+ * another size can be served from the cache right away. This runs on its own
+ * thread with idle priority, so it doesn't hold up the shared worker threads
+ * or take CPU from playback.
+ */
+static void
+size_ladder_schedule(int type, int64_t persistentid, int max_w, int max_h, int format, const char *path)
+{
+  struct size_ladder_job *job;
+
+  if (!ladder_threadpool || path[0] != '/')
+    return;
+
+  // The warmer only makes the sizes the user configured
+  if (warmer.status.enabled && pthread_equal(pthread_self(), warmer.tid))
+    return;
+
+  CHECK_NULL(L_ART, job = calloc(1, sizeof(struct size_ladder_job)));
+  job->type = type;
+  job->persistentid = persistentid;
+  job->format = format;
+  job->max_w = max_w;
+  job->max_h = max_h;
+  snprintf(job->path, sizeof(job->path), "%s", path);
+
+  if (evthr_pool_defer(ladder_threadpool, size_ladder_generate, job) != EVTHR_RES_OK)
+    free(job);
+}
+
+
+/* ---------------------------- SINGLE FLIGHT ------------------------------ */
+
+/* A lookup can take long (e.g. online sources), and clients often ask for the
+ * same artwork several times at once, e.g. an album grid that requests the
+ * covers in two sizes. Only the first request does the lookup, the others wait
+ * for it and get a copy of the result.
+ */
+static int
+single_flight(artwork_lookup_fn lookup, struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+{
+  struct artwork_flight *flight;
+  struct artwork_flight **prev;
+  uint8_t *data;
+  size_t offset;
+  int ret;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&flights_lck));
+
+  for (flight = flights; flight; flight = flight->next)
+    {
+      if (flight->lookup == lookup && flight->id == id && flight->max_w == max_w && flight->max_h == max_h && flight->format == format)
+	break;
+    }
+
+  if (flight)
+    {
+      DPRINTF(E_DBG, L_ART, "Waiting for lookup of artwork id %d already in progress\n", id);
+
+      flight->waiters++;
+      while (!flight->done)
+	CHECK_ERR(L_ART, pthread_cond_wait(&flights_cond, &flights_lck));
+
+      ret = flight->result;
+      if (ret > 0 && evbuffer_add(evbuf, flight->data, flight->len) < 0)
+	ret = -1;
+
+      flight->waiters--;
+      if (flight->waiters == 0)
+	{
+	  free(flight->data);
+	  free(flight);
+	}
+
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&flights_lck));
+      return ret;
+    }
+
+  CHECK_NULL(L_ART, flight = calloc(1, sizeof(struct artwork_flight)));
+  flight->lookup = lookup;
+  flight->id = id;
+  flight->max_w = max_w;
+  flight->max_h = max_h;
+  flight->format = format;
+  flight->next = flights;
+  flights = flight;
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&flights_lck));
+
+  offset = evbuffer_get_length(evbuf);
+  ret = lookup(evbuf, id, max_w, max_h, format);
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&flights_lck));
+
+  // Only copy the image if someone is actually waiting for it
+  flight->result = ret;
+  if (ret > 0 && flight->waiters > 0)
+    {
+      flight->len = evbuffer_get_length(evbuf) - offset;
+      data = evbuffer_pullup(evbuf, -1);
+      CHECK_NULL(L_ART, flight->data = malloc(flight->len));
+      memcpy(flight->data, data + offset, flight->len);
+    }
+
+  for (prev = &flights; *prev != flight; prev = &(*prev)->next)
+    ;
+  *prev = flight->next;
+
+  flight->done = true;
+  if (flight->waiters == 0)
+    free(flight);
+  else
+    CHECK_ERR(L_ART, pthread_cond_broadcast(&flights_cond));
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&flights_lck));
+
+  return ret;
+}
+
+
+/* ---------------------------- LOOKUP OF ARTWORK ---------------------------- */
+
+static int
+lookup_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
   struct artwork_ctx ctx;
   char filter[32];
@@ -2021,7 +2570,10 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	  size_ladder_schedule(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, format, ctx.path);
+	}
 
       return ret;
     }
@@ -2033,7 +2585,10 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	  size_ladder_schedule(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, ctx.path);
+	}
 
       return ret;
     }
@@ -2046,8 +2601,8 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   return -1;
 }
 
-int
-artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+static int
+lookup_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
   struct artwork_ctx ctx;
   int ret;
@@ -2077,7 +2632,10 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	{
+	  cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	  size_ladder_schedule(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, ctx.path);
+	}
 
       return ret;
     }
@@ -2090,6 +2648,422 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   return -1;
 }
 
+
+/* ----------------------------- BATCH LOOKUP ------------------------------ */
+
+// Thread: batch pool
+static void
+batch_thread_init_cb(struct evthr *thr, void *shared)
+{
+  thread_setname(pthread_self(), "artwork batch");
+
+  CHECK_ERR(L_ART, db_perthread_init());
+}
+
+// Thread: batch pool
+static void
+batch_thread_exit_cb(struct evthr *thr, void *shared)
+{
+  db_perthread_deinit();
+}
+
+// Thread: batch pool
+static void
+batch_job_cb(struct evthr *thr, void *arg, void *shared)
+{
+  struct batch_job *job = arg;
+  struct artwork_batch *batch = job->batch;
+  struct artwork_batch_item *item = job->item;
+
+  item->format = single_flight(item->is_group ? lookup_group : lookup_item, item->evbuf, item->id, batch->max_w, batch->max_h, 0);
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&batch->lck));
+  batch->pending--;
+  if (batch->pending == 0)
+    CHECK_ERR(L_ART, pthread_cond_signal(&batch->cond));
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&batch->lck));
+
+  free(job);
+}
+
+/* Group artwork that is already cached is fetched with a single cache query,
+ * the rest is looked up in parallel by the batch thread pool.
+ */
+static void
+batch_cache_get(struct artwork_batch_item *items, int nitems, int max_w, int max_h)
+{
+  struct evbuffer **evbufs;
+  int64_t *persistentids;
+  int *formats;
+  int *idx;
+  int n;
+  int i;
+  int ret;
+
+  CHECK_NULL(L_ART, persistentids = calloc(nitems, sizeof(int64_t)));
+  CHECK_NULL(L_ART, evbufs = calloc(nitems, sizeof(struct evbuffer *)));
+  CHECK_NULL(L_ART, formats = calloc(nitems, sizeof(int)));
+  CHECK_NULL(L_ART, idx = calloc(nitems, sizeof(int)));
+
+  for (i = 0, n = 0; i < nitems; i++)
+    {
+      if (!items[i].is_group || db_group_persistentid_byid(items[i].id, &persistentids[n]) < 0)
+	continue;
+
+      evbufs[n] = items[i].evbuf;
+      idx[n] = i;
+      n++;
+    }
+
+  ret = (n > 0) ? cache_artwork_get_batch(CACHE_ARTWORK_GROUP, persistentids, n, max_w, max_h, formats, evbufs) : -1;
+  for (i = 0; ret == 0 && i < n; i++)
+    {
+      // Cached with format 0 means we know there is no artwork
+      if (formats[i] > 0)
+	items[idx[i]].format = formats[i];
+      else if (formats[i] == 0)
+	items[idx[i]].format = ART_E_ERROR;
+    }
+
+  free(persistentids);
+  free(evbufs);
+  free(formats);
+  free(idx);
+}
+
+
+/* ---------------------------- ARTWORK WARMER ----------------------------- */
+
+/* After a library scan the warmer looks up the artwork of the albums that got
+ * new tracks, so the first browse doesn't have to wait for it. It runs in its
+ * own thread with idle priority, waits a bit between each album and pauses
+ * while something is playing.
+ */
+
+// Returns false if we should stop
+static bool
+warmer_wait(int ms)
+{
+  struct timespec deadline;
+  bool exit;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  if (!warmer.exit)
+    pthread_cond_timedwait(&warmer.cond, &warmer.lck, &deadline);
+  exit = warmer.exit;
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+  return !exit;
+}
+
+static bool
+warmer_wait_for_playback(void)
+{
+  struct player_status status;
+  bool paused = false;
+
+  while (player_get_status(&status) == 0 && status.status == PLAY_PLAYING)
+    {
+      if (!paused)
+	{
+	  DPRINTF(E_DBG, L_ART, "Pausing artwork warmer during playback\n");
+	  paused = true;
+	  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+	  warmer.status.paused = true;
+	  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+	}
+
+      if (!warmer_wait(ARTWORK_WARMER_PAUSE_MS))
+	return false;
+    }
+
+  if (paused)
+    {
+      CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+      warmer.status.paused = false;
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+    }
+
+  return true;
+}
+
+// The ids are collected before the lookups start, so we don't keep a query
+// open (and the db locked) while the warmer works
+static int
+warmer_groups_get(int **ids, int *nids, int64_t since)
+{
+  struct query_params qp;
+  struct db_group_info dbgri;
+  char filter[64];
+  int n;
+  int ret;
+
+  *ids = NULL;
+  *nids = 0;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUP_ALBUMS;
+  qp.filter = filter;
+  snprintf(filter, sizeof(filter), "f.time_added >= %" PRIi64, since);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    return -1;
+
+  n = 0;
+  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
+    {
+      if (*nids == n)
+	{
+	  n = n ? 2 * n : 64;
+	  CHECK_NULL(L_ART, *ids = realloc(*ids, n * sizeof(int)));
+	}
+
+      if (safe_atoi32(dbgri.id, &(*ids)[*nids]) == 0)
+	(*nids)++;
+    }
+
+  db_query_end(&qp);
+
+  return ret < 0 ? -1 : 0;
+}
+
+static void
+warmer_run(void)
+{
+  struct evbuffer *evbuf;
+  cfg_t *lib;
+  int64_t since;
+  time_t started;
+  int *ids;
+  int nids;
+  int nsizes;
+  int size;
+  int i;
+  int j;
+  int ret;
+
+  lib = cfg_getsec(cfg, "library");
+  nsizes = cfg_size(lib, "artwork_warmer_sizes");
+
+  started = time(NULL);
+  if (db_admin_getint64(&since, DB_ADMIN_ARTWORK_WARMED) < 0)
+    since = 0;
+
+  ret = warmer_groups_get(&ids, &nids, since);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Artwork warmer could not get the list of albums\n");
+      free(ids);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_ART, "Artwork warmer starting, %d albums to check\n", nids);
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  warmer.status.active = true;
+  warmer.status.groups_total = nids;
+  warmer.status.groups_done = 0;
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  for (i = 0; i < nids; i++)
+    {
+      if (!warmer_wait_for_playback())
+	break;
+
+      for (j = 0; j < nsizes; j++)
+	{
+	  size = size_ladder_snap(cfg_getnint(lib, "artwork_warmer_sizes", j));
+	  single_flight(lookup_group, evbuf, ids[i], size, size, 0);
+	  evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	}
+
+      CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+      warmer.status.groups_done++;
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+      if (!warmer_wait(ARTWORK_WARMER_INTERVAL_MS))
+	break;
+    }
+
+  // Next run only needs to look at albums that get new tracks after this one
+  if (i == nids)
+    {
+      db_admin_setint64(DB_ADMIN_ARTWORK_WARMED, started);
+      DPRINTF(E_INFO, L_ART, "Artwork warmer done, checked %d albums\n", nids);
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  warmer.status.active = false;
+  warmer.status.paused = false;
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+  evbuffer_free(evbuf);
+  free(ids);
+}
+
+static void *
+warmer_thread(void *arg)
+{
+#ifdef __linux__
+  struct sched_param param;
+#endif
+  int ret;
+
+#ifdef __linux__
+  // Param must be 0 for the SCHED_IDLE policy
+  memset(&param, 0, sizeof(struct sched_param));
+  ret = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_ART, "Warning: Could not set artwork warmer thread priority to SCHED_IDLE\n");
+#endif
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Error: DB init failed, artwork warmer will be disabled\n");
+      pthread_exit(NULL);
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  while (!warmer.exit)
+    {
+      if (!warmer.triggered)
+	{
+	  CHECK_ERR(L_ART, pthread_cond_wait(&warmer.cond, &warmer.lck));
+	  continue;
+	}
+
+      warmer.triggered = false;
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+      warmer_run();
+
+      CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+    }
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+
+/* ------------------------------ ARTWORK API ------------------------------ */
+
+int
+artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+{
+  int ret;
+
+  ret = single_flight(lookup_item, evbuf, id, size_ladder_snap(max_w), size_ladder_snap(max_h), format);
+
+  return size_ladder_scale(evbuf, ret, max_w, max_h, format);
+}
+
+int
+artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+{
+  int ret;
+
+  ret = single_flight(lookup_group, evbuf, id, size_ladder_snap(max_w), size_ladder_snap(max_h), format);
+
+  return size_ladder_scale(evbuf, ret, max_w, max_h, format);
+}
+
+int
+artwork_get_batch(struct artwork_batch_item *items, int nitems, int max_w, int max_h)
+{
+  struct artwork_batch batch = { .lck = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+  struct batch_job *job;
+  enum evthr_res res;
+  int i;
+
+  batch.max_w = size_ladder_snap(max_w);
+  batch.max_h = size_ladder_snap(max_h);
+
+  for (i = 0; i < nitems; i++)
+    items[i].format = 0;
+
+  batch_cache_get(items, nitems, batch.max_w, batch.max_h);
+
+  for (i = 0; i < nitems; i++)
+    {
+      if (items[i].format != 0)
+	continue;
+
+      CHECK_NULL(L_ART, job = malloc(sizeof(struct batch_job)));
+      job->batch = &batch;
+      job->item = &items[i];
+
+      CHECK_ERR(L_ART, pthread_mutex_lock(&batch.lck));
+      batch.pending++;
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&batch.lck));
+
+      res = batch_threadpool ? evthr_pool_defer(batch_threadpool, batch_job_cb, job) : EVTHR_RES_NOCB;
+      if (res != EVTHR_RES_OK)
+	batch_job_cb(NULL, job, NULL); // Do it ourselves then
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&batch.lck));
+  while (batch.pending > 0)
+    CHECK_ERR(L_ART, pthread_cond_wait(&batch.cond, &batch.lck));
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&batch.lck));
+
+  for (i = 0; i < nitems; i++)
+    items[i].format = size_ladder_scale(items[i].evbuf, items[i].format, max_w, max_h, 0);
+
+  return 0;
+}
+
+void
+artwork_warmer_trigger(void)
+{
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  warmer.triggered = true;
+  CHECK_ERR(L_ART, pthread_cond_signal(&warmer.cond));
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+}
+
+void
+artwork_warmer_status_get(struct artwork_warmer_status *status)
+{
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  *status = warmer.status;
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+}
+
+void
+artwork_dir_invalidate(const char *dir)
+{
+  struct dir_listing **listing;
+  struct dir_listing *found;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&dir_cache_lck));
+
+  listing = dir_cache_find(dir, djb_hash(dir, strlen(dir)));
+  found = *listing;
+  if (found)
+    {
+      *listing = found->next;
+      dir_listing_free(found);
+      dir_cache_count--;
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_cache_lck));
+}
+
 /* Checks if the file is an artwork file */
 bool
 artwork_file_is_artwork(const char *filename)
@@ -2152,3 +3126,53 @@ artwork_extension_is_artwork(const char *path)
 
   return false;
 }
+
+int
+artwork_init(void)
+{
+  int ret;
+
+  CHECK_NULL(L_ART, batch_threadpool = evthr_pool_wexit_new(ARTWORK_BATCH_NTHREADS, batch_thread_init_cb, batch_thread_exit_cb, NULL));
+  CHECK_ERR(L_ART, evthr_pool_start(batch_threadpool));
+
+  CHECK_NULL(L_ART, ladder_threadpool = evthr_pool_wexit_new(1, ladder_thread_init_cb, ladder_thread_exit_cb, NULL));
+  CHECK_ERR(L_ART, evthr_pool_start(ladder_threadpool));
+
+  warmer.status.enabled = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_warmer");
+  if (!warmer.status.enabled)
+    return 0;
+
+  ret = pthread_create(&warmer.tid, NULL, warmer_thread, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not spawn artwork warmer thread: %s\n", strerror(ret));
+      warmer.status.enabled = false;
+      return -1;
+    }
+
+  thread_setname(warmer.tid, "artwork");
+
+  return 0;
+}
+
+void
+artwork_deinit(void)
+{
+  evthr_pool_stop(batch_threadpool);
+  evthr_pool_free(batch_threadpool);
+  batch_threadpool = NULL;
+
+  evthr_pool_stop(ladder_threadpool);
+  evthr_pool_free(ladder_threadpool);
+  ladder_threadpool = NULL;
+
+  if (!warmer.status.enabled)
+    return;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&warmer.lck));
+  warmer.exit = true;
+  CHECK_ERR(L_ART, pthread_cond_signal(&warmer.cond));
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&warmer.lck));
+
+  pthread_join(warmer.tid, NULL);
+}
@@ -38,6 +38,70 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
 int
 artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
 
+struct artwork_batch_item {
+  // Input: a group id (is_group) or an item id
+  bool is_group;
+  int id;
+  // Output: the (scaled) image and its format (ART_FMT_*), or -1 if none
+  struct evbuffer *evbuf;
+  int format;
+};
+
+struct artwork_warmer_status {
+  // Configured with artwork_warmer
+  bool enabled;
+  // Currently looking up artwork
+  bool active;
+  // Waiting for playback to stop
+  bool paused;
+  // Albums to look up in the current run, and how many have been done
+  int groups_total;
+  int groups_done;
+};
+
+/*
+ * Gets the artwork for a number of items and/or groups. Cached artwork is
+ * fetched with one cache query, the rest is looked up in parallel.
+ *
+ * @in  items    Items to get artwork for, each with an evbuffer for the image
+ * @in  nitems   Number of items
+ * @in  max_w    Requested maximum image width (may not be obeyed)
+ * @in  max_h    Requested maximum image height (may not be obeyed)
+ * @return       0 when all items have been processed
+ */
+int
+artwork_get_batch(struct artwork_batch_item *items, int nitems, int max_w, int max_h);
+
+/*
+ * Starts the artwork lookup threads, and the artwork warmer if enabled in the
+ * config. Must be called after the player has been initialized.
+ */
+int
+artwork_init(void);
+
+void
+artwork_deinit(void);
+
+/*
+ * Makes the artwork warmer look up artwork for albums that have new tracks,
+ * should be called when a library scan completes. Does nothing if the warmer
+ * is disabled.
+ */
+void
+artwork_warmer_trigger(void);
+
+void
+artwork_warmer_status_get(struct artwork_warmer_status *status);
+
+/*
+ * Drops what is known about the artwork files in a directory, should be called
+ * when a file in the directory has been added, removed or renamed
+ *
+ * @in  dir      Path to the directory
+ */
+void
+artwork_dir_invalidate(const char *dir);
+
 /*
  * Checks if the file is an artwork file (based on user config)
  *
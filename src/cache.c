@@ -31,12 +31,19 @@
 #include <time.h>
 #include <string.h>
 #include <pthread.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sched.h>
+#endif
 
 #include <event2/event.h>
 #include <sqlite3.h>
 
 #include "conffile.h"
 #include "logger.h"
+#include "misc.h"
 #include "httpd.h" // TODO get rid of this, only used for httpd_gzip_deflate
 #include "httpd_daap.h"
 #include "transcode.h"
@@ -45,6 +52,17 @@
 #include "cache.h"
 #include "listener.h"
 #include "commands.h"
+#include "evthr.h"
+#include "player.h"
+
+// What a cached DAAP reply was built from, so a library event only needs to
+// invalidate the replies that could have changed
+enum cache_daap_deps
+{
+  CACHE_DAAP_DEP_FILES     = (1 << 0),
+  CACHE_DAAP_DEP_PLAYLISTS = (1 << 1),
+  CACHE_DAAP_DEP_RATING    = (1 << 2),
+};
 
 struct cache_arg
 {
@@ -69,9 +87,71 @@ struct cache_arg
   int cached;
   int del;
 
+  int64_t *persistentids; // artwork batch
+  int *formats;
+  struct evbuffer **evbufs;
+  int nitems;
+
+  short event_mask; // library listener events
+  enum play_status play_status; // player listener events
+
+  enum transcode_profile xcode_profile; // transcoding segments
+  int bit_rate;
+  uint32_t len_ms;
+
   struct evbuffer *evbuf;
 };
 
+// Gzipped DAAP reply held in memory, so httpd threads can serve cache hits
+// without a round trip to the cache thread and its database. The data is
+// handed to readers by reference, so the entry is freed when both the cache
+// and the replies using it have dropped their reference.
+struct cache_daap_mem_entry
+{
+  char *query;
+  uint32_t hash;
+  int deps;
+  uint8_t *data;
+  size_t len;
+  int refcount;    // atomic
+  bool referenced; // atomic, set by readers, cleared by the clock hand
+
+  struct cache_daap_mem_entry *prev;
+  struct cache_daap_mem_entry *next;
+};
+
+// Entries are kept in the order they were added, newest first. Readers only
+// take the lock for reading, so recency is tracked with the referenced flag.
+struct cache_daap_mem_shard
+{
+  pthread_rwlock_t lck;
+  struct cache_daap_mem_entry *head;
+  struct cache_daap_mem_entry *tail;
+  size_t size;
+};
+
+// On-disk layout of the song list snapshot, followed by the query and then
+// the gzipped reply. The version is CACHE_DAAP_VERSION of the writer, so a
+// snapshot with replies in an older format is not served after an upgrade.
+struct cache_daap_snapshot_header
+{
+  char magic[8];
+  int64_t stamp;
+  uint32_t query_len;
+  uint32_t version;
+  uint64_t reply_len;
+};
+
+struct cache_daap_snapshot
+{
+  pthread_mutex_t lck;
+  int fd;
+  char *query;
+  int64_t stamp;
+  off_t reply_offset;
+  size_t reply_len;
+};
+
 struct cachelist
 {
   uint32_t id;
@@ -101,10 +181,32 @@ struct cache_xcode_job
 
   struct event *ev;
   bool is_encoding;
+  struct timespec start;
 
   struct evbuffer *header;
 };
 
+struct cache_xcode_segments_job
+{
+  uint32_t file_id;
+  uint32_t time_modified;
+  uint32_t len_ms;
+  char *file_path;
+  enum transcode_profile profile;
+  int bit_rate;
+
+  struct event *ev;
+  bool is_encoding;
+};
+
+struct cache_xcode_segments_dir
+{
+  uint32_t file_id;
+  uint32_t time_modified;
+  time_t mtime;
+  off_t size;
+};
+
 
 /* --------------------------------- GLOBALS -------------------------------- */
 
@@ -130,12 +232,35 @@ static bool cache_is_suspended;
   }
 
 // DAAP cache
-#define CACHE_DAAP_VERSION 5
+#define CACHE_DAAP_VERSION 6
 static sqlite3 *cache_daap_hdl;
 static struct event *cache_daap_updateev;
 // The user may configure a threshold (in msec), and queries slower than
 // that will have their reply cached
 static int cache_daap_threshold;
+// In-memory first tier in front of the replies table. Entries are spread over
+// shards by query hash, each with its own lock, but the size limit is shared.
+#define CACHE_DAAP_MEM_SHARDS 8
+static struct cache_daap_mem_shard cache_daap_mem[CACHE_DAAP_MEM_SHARDS];
+static size_t cache_daap_mem_size_max;
+static size_t cache_daap_mem_size;
+static int cache_daap_mem_hand;
+static struct cache_daap_stats cache_daap_stats;
+// The reply to an unfiltered song list is usually by far the biggest, and the
+// one clients want first. The reply for one such query is also kept in a file,
+// so it survives restarts and can be sent with sendfile(). The file is stamped
+// with DB_ADMIN_DB_UPDATE, and is only valid while the stamp is unchanged.
+// Replies with ratings use DB_ADMIN_DB_MODIFIED instead, see
+// daap_snapshot_stamp_get().
+#define CACHE_DAAP_SNAPSHOT_FILE "daap_songlist.snapshot"
+#define CACHE_DAAP_SNAPSHOT_MAGIC "OTDAAPS1"
+static char cache_daap_snapshot_path[PATH_MAX];
+static struct cache_daap_snapshot cache_daap_snapshot = { .fd = -1 };
+// A save that had to wait for the stamp's second to pass, see
+// daap_snapshot_update()
+static struct timeval cache_daap_snapshot_retry_wait = { 2, 0 };
+static struct event *cache_daap_snapshot_retryev;
+static char *cache_daap_snapshot_retry_query;
 static struct cache_db_def cache_daap_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -155,7 +280,8 @@ static struct cache_db_def cache_daap_db_def[] = {
     "   user_agent         VARCHAR(1024),"
     "   is_remote          INTEGER DEFAULT 0,"
     "   msec               INTEGER DEFAULT 0,"
-    "   timestamp          INTEGER DEFAULT 0"
+    "   timestamp          INTEGER DEFAULT 0,"
+    "   deps               INTEGER DEFAULT 0"
     ");",
     "DROP TABLE IF EXISTS queries;",
   },
@@ -166,10 +292,15 @@ static struct cache_db_def cache_daap_db_def[] = {
   },
 };
 
-// Artwork cache
-#define CACHE_ARTWORK_VERSION 5
+// Artwork cache. The images are stored as files named by a hash of their
+// content, <cache_dir>/artwork/<first two of hash>/<hash>, so identical images
+// (e.g. the same cover for each track of an album) are only stored once. The
+// table maps the requested artwork and size to the hash.
+#define CACHE_ARTWORK_VERSION 6
+#define CACHE_ARTWORK_BLOBS_DIR "artwork/"
 static sqlite3 *cache_artwork_hdl;
 static struct cache_artwork_stash cache_stash;
+static char cache_artwork_blobs_path[PATH_MAX];
 static struct cache_db_def cache_artwork_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -183,10 +314,15 @@ static struct cache_db_def cache_artwork_db_def[] = {
     "   format              INTEGER NOT NULL,"
     "   filepath            VARCHAR(4096) NOT NULL,"
     "   db_timestamp        INTEGER DEFAULT 0,"
-    "   data                BLOB"
+    "   hash                VARCHAR(32) DEFAULT NULL"
     ");",
     "DROP TABLE IF EXISTS artwork;",
   },
+  {
+    "idx_hash",
+    "CREATE INDEX IF NOT EXISTS idx_hash ON artwork(hash);",
+    "DROP INDEX IF EXISTS idx_hash;",
+  },
   {
     "idx_persistentidwh",
     "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h);",
@@ -201,13 +337,19 @@ static struct cache_db_def cache_artwork_db_def[] = {
 
 // Transcoding cache
 #define CACHE_XCODE_VERSION 1
-#define CACHE_XCODE_NTHREADS 4
+#define CACHE_XCODE_NTHREADS_MAX 16
 #define CACHE_XCODE_FORMAT_MP4 "mp4"
 static sqlite3 *cache_xcode_hdl;
 static struct event *cache_xcode_updateev;
 static struct event *cache_xcode_prepareev;
-static struct cache_xcode_job cache_xcode_jobs[CACHE_XCODE_NTHREADS];
+static struct evthr_pool *cache_xcode_threadpool;
+static struct cache_xcode_job *cache_xcode_jobs;
+static int cache_xcode_nthreads;
 static bool cache_xcode_is_enabled;
+static bool cache_xcode_is_paused;
+// For progress reporting, counts headers prepared since startup
+static int cache_xcode_ndone;
+static int64_t cache_xcode_done_usec;
 static struct cache_db_def cache_xcode_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -233,6 +375,17 @@ static struct cache_db_def cache_xcode_db_def[] = {
   },
 };
 
+// Transcoded output stored on disk in segments, so that range requests can be
+// served without decoding everything up to the requested offset. Files go in
+// <cache_dir>/xcode/<file id>-<time modified>/<profile>-<bit rate>.<segment>
+#define CACHE_XCODE_SEGMENTS_NTHREADS 2
+#define CACHE_XCODE_SEGMENT_SIZE (1024 * 1024)
+#define CACHE_XCODE_SEGMENTS_DIR "xcode/"
+static char cache_xcode_segments_path[PATH_MAX];
+static off_t cache_xcode_segments_max;
+static struct event *cache_xcode_segments_purgeev;
+static struct cache_xcode_segments_job cache_xcode_segments_jobs[CACHE_XCODE_SEGMENTS_NTHREADS];
+
 
 /* --------------------------------- HELPERS -------------------------------- */
 
@@ -256,1062 +409,2415 @@ remove_tag(char *in, const char *tag)
     *(s - 1) = '\0';
 }
 
+/* Works out which kinds of library changes can alter the reply to a query.
+ * Every reply is built from the files table, and container replies also depend
+ * on playlists and on ratings, since smart playlists may select by rating.
+ * Other rating changes (which with db_rating_updates happen on every play) only
+ * invalidate replies that ask for a rating field.
+ */
+static int
+cache_daap_query_deps(const char *query)
+{
+  const char *meta;
+  int deps;
+
+  deps = CACHE_DAAP_DEP_FILES;
 
-/* ---------------------------------- MAIN ---------------------------------- */
-/*                                Thread: cache                               */
+  if (strncmp(query, "/databases/1/containers", strlen("/databases/1/containers")) == 0)
+    deps |= CACHE_DAAP_DEP_PLAYLISTS | CACHE_DAAP_DEP_RATING;
 
-static int
-cache_tables_create(sqlite3 *hdl, int version, struct cache_db_def *db_def, int db_def_size)
+  // The default meta of all our replies is without rating fields
+  meta = strstr(query, "meta=");
+  if (meta && strstr(meta, "rating"))
+    deps |= CACHE_DAAP_DEP_RATING;
+
+  return deps;
+}
+
+
+/* ------------------------- DAAP reply memory cache ------------------------ */
+/*            Thread: httpd (lookups) and cache (adding, invalidating)         */
+
+static struct cache_daap_mem_shard *
+daap_mem_shard_get(uint32_t hash)
 {
-#define Q_CACHE_VERSION "INSERT INTO admin (key, value) VALUES ('cache_version', '%d');"
-  char *query;
-  char *errmsg;
-  int ret;
-  int i;
+  return &cache_daap_mem[hash % CACHE_DAAP_MEM_SHARDS];
+}
 
-  for (i = 0; i < db_def_size; i++)
-    {
-      ret = sqlite3_exec(hdl, db_def[i].create_query, NULL, NULL, &errmsg);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_FATAL, L_CACHE, "Error creating cache db entity '%s': %s\n", db_def[i].name, errmsg);
-	  sqlite3_free(errmsg);
-	  return -1;
-	}
-    }
+static void
+daap_mem_entry_unref(struct cache_daap_mem_entry *entry)
+{
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
 
-  query = sqlite3_mprintf(Q_CACHE_VERSION, version);
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_FATAL, L_CACHE, "Error inserting cache version: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return -1;
-    }
+  free(entry->query);
+  free(entry->data);
+  free(entry);
+}
 
-  return 0;
-#undef Q_CACHE_VERSION
+// Called by libevent from whatever thread frees the reply evbuffer
+static void
+daap_mem_entry_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  daap_mem_entry_unref(extra);
 }
 
-static int
-cache_tables_drop(sqlite3 *hdl, struct cache_db_def *db_def, int db_def_size)
+// Must be called with the shard write locked
+static void
+daap_mem_entry_unlink(struct cache_daap_mem_shard *shard, struct cache_daap_mem_entry *entry)
 {
-#define Q_VACUUM	"VACUUM;"
-  char *errmsg;
-  int ret;
-  int i;
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    shard->head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    shard->tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
 
-  for (i = 0; i < db_def_size; i++)
-    {
-      ret = sqlite3_exec(hdl, db_def[i].drop_query, NULL, NULL, &errmsg);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_FATAL, L_CACHE, "Error dropping cache db entity '%s': %s\n", db_def[i].name, errmsg);
-	  sqlite3_free(errmsg);
-	  return -1;
-	}
-    }
+// Must be called with the shard write locked
+static void
+daap_mem_entry_link(struct cache_daap_mem_shard *shard, struct cache_daap_mem_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = shard->head;
 
-  ret = sqlite3_exec(hdl, Q_VACUUM, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  if (shard->head)
+    shard->head->prev = entry;
+  else
+    shard->tail = entry;
+
+  shard->head = entry;
+}
+
+// Must be called with the shard write locked
+static void
+daap_mem_entry_remove(struct cache_daap_mem_shard *shard, struct cache_daap_mem_entry *entry)
+{
+  daap_mem_entry_unlink(shard, entry);
+  shard->size -= entry->len;
+  __atomic_sub_fetch(&cache_daap_mem_size, entry->len, __ATOMIC_RELAXED);
+  daap_mem_entry_unref(entry);
+}
+
+// Must be called with the shard locked
+static struct cache_daap_mem_entry *
+daap_mem_entry_find(struct cache_daap_mem_shard *shard, const char *query, uint32_t hash)
+{
+  struct cache_daap_mem_entry *entry;
+
+  for (entry = shard->head; entry; entry = entry->next)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error vacuuming cache database: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return -1;
+      if (entry->hash == hash && strcmp(entry->query, query) == 0)
+	return entry;
     }
 
-  return 0;
-#undef Q_VACUUM
+  return NULL;
 }
 
+// Adds the reply for query to evbuf if we have it in memory. The data is not
+// copied, evbuf gets a reference that keeps the entry alive until it is sent.
 static int
-cache_version_check(int *have_version, sqlite3 *hdl, int want_version)
+daap_mem_get(struct evbuffer *evbuf, const char *query)
 {
-#define Q_VER "SELECT value FROM admin WHERE key = 'cache_version';"
-  sqlite3_stmt *stmt;
+  struct cache_daap_mem_shard *shard;
+  struct cache_daap_mem_entry *entry;
+  uint32_t hash;
   int ret;
 
-  *have_version = 0;
+  if (cache_daap_mem_size_max == 0)
+    return -1;
 
-  ret = sqlite3_prepare_v2(hdl, Q_VER, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      return 0; // Virgin database, admin table doesn't exists
-    }
+  hash = djb_hash(query, strlen(query));
+  shard = daap_mem_shard_get(hash);
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)
+  CHECK_ERR(L_CACHE, pthread_rwlock_rdlock(&shard->lck));
+  entry = daap_mem_entry_find(shard, query, hash);
+  if (entry)
     {
-      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      sqlite3_finalize(stmt);
-      return -1;
+      __atomic_store_n(&entry->referenced, true, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
     }
+  CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
 
-  *have_version = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  if (!entry)
+    return -1;
 
-  return 0;
-#undef Q_VER
+  ret = evbuffer_add_reference(evbuf, entry->data, entry->len, daap_mem_entry_unref_cb, entry);
+  if (ret < 0)
+    daap_mem_entry_unref(entry);
+
+  return ret;
 }
 
+/* Evicts a reply with the clock (second chance) algorithm. The hand goes round
+ * the shards, and in each shard looks at the oldest entry. If it has been read
+ * since the hand last passed it gets moved to the front of its shard, otherwise
+ * it is evicted. Returns -1 if the cache is empty. Only the cache thread adds
+ * and removes entries, so there are no other writers.
+ */
 static int
-cache_pragma_set(sqlite3 *hdl)
+daap_mem_evict(void)
 {
-#define Q_PRAGMA_CACHE_SIZE "PRAGMA cache_size=%d;"
-#define Q_PRAGMA_JOURNAL_MODE "PRAGMA journal_mode=%s;"
-#define Q_PRAGMA_SYNCHRONOUS "PRAGMA synchronous=%d;"
-#define Q_PRAGMA_MMAP_SIZE "PRAGMA mmap_size=%d;"
-  char *errmsg;
-  int ret;
-  int cache_size;
-  char *journal_mode;
-  int synchronous;
-  int mmap_size;
-  char *query;
-
-  // Set page cache size in number of pages
-  cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_cache");
-  if (cache_size > -1)
-    {
-      query = sqlite3_mprintf(Q_PRAGMA_CACHE_SIZE, cache_size);
-      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_cache_size_cache: %s\n", errmsg);
+  struct cache_daap_mem_shard *shard;
+  struct cache_daap_mem_entry *entry;
+  int empty;
 
-	  sqlite3_free(errmsg);
-	  return -1;
-	}
-    }
+  if (__atomic_load_n(&cache_daap_mem_size, __ATOMIC_RELAXED) == 0)
+    return -1;
 
-  // Set journal mode
-  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
-  if (journal_mode)
+  for (empty = 0; empty < CACHE_DAAP_MEM_SHARDS; cache_daap_mem_hand = (cache_daap_mem_hand + 1) % CACHE_DAAP_MEM_SHARDS)
     {
-      query = sqlite3_mprintf(Q_PRAGMA_JOURNAL_MODE, journal_mode);
-      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_journal_mode: %s\n", errmsg);
+      shard = &cache_daap_mem[cache_daap_mem_hand];
 
-	  sqlite3_free(errmsg);
-	  return -1;
+      CHECK_ERR(L_CACHE, pthread_rwlock_wrlock(&shard->lck));
+      entry = shard->tail;
+      if (!entry)
+	{
+	  CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
+	  empty++;
+	  continue;
 	}
-    }
 
-  // Set synchronous flag
-  synchronous = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_synchronous");
-  if (synchronous > -1)
-    {
-      query = sqlite3_mprintf(Q_PRAGMA_SYNCHRONOUS, synchronous);
-      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
+      empty = 0;
+      if (__atomic_exchange_n(&entry->referenced, false, __ATOMIC_RELAXED))
 	{
-	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_synchronous: %s\n", errmsg);
-
-	  sqlite3_free(errmsg);
-	  return -1;
+	  daap_mem_entry_unlink(shard, entry);
+	  daap_mem_entry_link(shard, entry);
+	  CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
+	  continue;
 	}
-    }
 
-  // Set mmap size
-  mmap_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_mmap_size_cache");
-  if (synchronous > -1)
-    {
-      query = sqlite3_mprintf(Q_PRAGMA_MMAP_SIZE, mmap_size);
-      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_mmap_size: %s\n", errmsg);
+      DPRINTF(E_DBG, L_CACHE, "Evicting DAAP reply from memory cache: %s\n", entry->query);
+      daap_mem_entry_remove(shard, entry);
+      CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
 
-	  sqlite3_free(errmsg);
-	  return -1;
-	}
+      cache_daap_mem_hand = (cache_daap_mem_hand + 1) % CACHE_DAAP_MEM_SHARDS;
+      return 0;
     }
 
-  return 0;
-#undef Q_PRAGMA_CACHE_SIZE
-#undef Q_PRAGMA_JOURNAL_MODE
-#undef Q_PRAGMA_SYNCHRONOUS
-#undef Q_PRAGMA_MMAP_SIZE
+  return -1;
 }
 
+/* Adds a copy of the reply, evicting replies that haven't been used recently if
+ * there isn't room. Replies larger than the whole cache are not kept.
+ */
 static void
-cache_close_one(sqlite3 **hdl)
+daap_mem_add(const char *query, int deps, const uint8_t *data, size_t len)
 {
-  sqlite3_stmt *stmt;
+  struct cache_daap_mem_shard *shard;
+  struct cache_daap_mem_entry *entry;
+  struct cache_daap_mem_entry *old;
+  uint32_t hash;
 
-  if (!*hdl)
+  if (len > cache_daap_mem_size_max)
     return;
 
-  /* Tear down anything that's in flight */
-  while ((stmt = sqlite3_next_stmt(*hdl, 0)))
-    sqlite3_finalize(stmt);
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_daap_mem_entry)));
+  CHECK_NULL(L_CACHE, entry->query = strdup(query));
+  CHECK_NULL(L_CACHE, entry->data = malloc(len));
+  memcpy(entry->data, data, len);
 
-  sqlite3_close(*hdl);
-  *hdl = NULL;
-}
+  hash = djb_hash(query, strlen(query));
+  shard = daap_mem_shard_get(hash);
 
-static void
-cache_close(void)
-{
-  cache_close_one(&cache_daap_hdl);
-  cache_close_one(&cache_artwork_hdl);
-  cache_close_one(&cache_xcode_hdl);
+  entry->hash = hash;
+  entry->deps = deps;
+  entry->len = len;
+  entry->refcount = 1;
 
-  DPRINTF(E_DBG, L_CACHE, "Cache closed\n");
+  CHECK_ERR(L_CACHE, pthread_rwlock_wrlock(&shard->lck));
+  old = daap_mem_entry_find(shard, query, hash);
+  if (old)
+    daap_mem_entry_remove(shard, old);
+  CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
+
+  while (__atomic_load_n(&cache_daap_mem_size, __ATOMIC_RELAXED) + len > cache_daap_mem_size_max)
+    {
+      if (daap_mem_evict() < 0)
+	break;
+    }
+
+  CHECK_ERR(L_CACHE, pthread_rwlock_wrlock(&shard->lck));
+  daap_mem_entry_link(shard, entry);
+  shard->size += len;
+  __atomic_add_fetch(&cache_daap_mem_size, len, __ATOMIC_RELAXED);
+  CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
 }
 
-static int
-cache_open_one(sqlite3 **hdl, const char *path, const char *name, int want_version, struct cache_db_def *db_def, int db_def_size)
+// Drops the replies that depend on any of deps
+static void
+daap_mem_invalidate(int deps)
 {
-  sqlite3 *h;
-  int have_version;
-  int ret;
+  struct cache_daap_mem_shard *shard;
+  struct cache_daap_mem_entry *entry;
+  struct cache_daap_mem_entry *next;
+  int i;
 
-  ret = sqlite3_open(path, &h);
-  if (ret != SQLITE_OK)
+  for (i = 0; i < CACHE_DAAP_MEM_SHARDS; i++)
     {
-      DPRINTF(E_LOG, L_CACHE, "Could not open '%s': %s\n", path, sqlite3_errmsg(h));
-      goto error;
+      shard = &cache_daap_mem[i];
+
+      CHECK_ERR(L_CACHE, pthread_rwlock_wrlock(&shard->lck));
+      for (entry = shard->head; entry; entry = next)
+	{
+	  next = entry->next;
+	  if (entry->deps & deps)
+	    daap_mem_entry_remove(shard, entry);
+	}
+      CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
     }
+}
 
-  ret = cache_version_check(&have_version, h, want_version);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Could not check cache '%s' database version\n", name);
-      goto error;
-    }
-
-  if (have_version > 0 && have_version < want_version)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Database schema outdated, deleting cache '%s' v%d -> v%d\n", name, have_version, want_version);
-
-      ret = cache_tables_drop(h, db_def, db_def_size);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error deleting '%s' database tables\n", name);
-	  goto error;
-	}
-    }
-
-  if (have_version < want_version)
-    {
-      ret = cache_tables_create(h, want_version, db_def, db_def_size);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Could not create cache '%s' database tables\n", name);
-	  goto error;
-	}
-
-      DPRINTF(E_INFO, L_CACHE, "Cache '%s' database tables created\n", name);
-    }
+static void
+daap_mem_init(size_t size_max)
+{
+  int i;
 
-  *hdl = h;
-  return 0;
+  cache_daap_mem_size_max = size_max;
 
- error:
-  sqlite3_close(h);
-  return -1;
+  for (i = 0; i < CACHE_DAAP_MEM_SHARDS; i++)
+    CHECK_ERR(L_CACHE, pthread_rwlock_init(&cache_daap_mem[i].lck, NULL));
 }
 
-static int
-cache_open(void)
+static void
+daap_mem_deinit(void)
 {
-  const char *directory;
-  const char *filename;
-  char *daap_db_path;
-  char *artwork_db_path;
-  char *xcode_db_path;
-  int ret;
+  int i;
 
-  directory = cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir");
+  // Every reply depends on the files table, so this drops them all
+  daap_mem_invalidate(CACHE_DAAP_DEP_FILES);
 
-  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_daap_filename"));
-  CHECK_NULL(L_DB, daap_db_path = safe_asprintf("%s%s", directory, filename));
+  for (i = 0; i < CACHE_DAAP_MEM_SHARDS; i++)
+    CHECK_ERR(L_CACHE, pthread_rwlock_destroy(&cache_daap_mem[i].lck));
+}
 
-  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_artwork_filename"));
-  CHECK_NULL(L_DB, artwork_db_path = safe_asprintf("%s%s", directory, filename));
 
-  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_xcode_filename"));
-  CHECK_NULL(L_DB, xcode_db_path = safe_asprintf("%s%s", directory, filename));
+/* -------------------------- DAAP song list snapshot ----------------------- */
+/*               Thread: httpd (reading) and cache (writing, loading)          */
 
-  ret = cache_open_one(&cache_daap_hdl, daap_db_path, "daap", CACHE_DAAP_VERSION, cache_daap_db_def, ARRAY_SIZE(cache_daap_db_def));
-  if (ret < 0)
-    goto error;
+static bool
+daap_snapshot_is_candidate(const char *query)
+{
+  return (strncmp(query, "/databases/1/items?", strlen("/databases/1/items?")) == 0 && !strstr(query, "query="));
+}
 
-  ret = cache_open_one(&cache_artwork_hdl, artwork_db_path, "artwork", CACHE_ARTWORK_VERSION, cache_artwork_db_def, ARRAY_SIZE(cache_artwork_db_def));
-  if (ret < 0)
-    goto error;
+// Must be called with the lock held
+static void
+daap_snapshot_set(int fd, char *query, int64_t stamp, off_t reply_offset, size_t reply_len)
+{
+  struct cache_daap_snapshot *snapshot = &cache_daap_snapshot;
 
-  ret = cache_open_one(&cache_xcode_hdl, xcode_db_path, "xcode", CACHE_XCODE_VERSION, cache_xcode_db_def, ARRAY_SIZE(cache_xcode_db_def));
-  if (ret < 0)
-    goto error;
+  if (snapshot->fd >= 0)
+    close(snapshot->fd);
+  free(snapshot->query);
 
-  ret = cache_pragma_set(cache_artwork_hdl);
-  if (ret < 0)
-    goto error;
+  snapshot->fd = fd;
+  snapshot->query = query;
+  snapshot->stamp = stamp;
+  snapshot->reply_offset = reply_offset;
+  snapshot->reply_len = reply_len;
+}
 
-  DPRINTF(E_DBG, L_CACHE, "Cache opened\n");
+// Play counts etc. change DB_ADMIN_DB_MODIFIED on every play, so that stamp is
+// only used for replies that would actually change, i.e. those with ratings
+static int64_t
+daap_snapshot_stamp_get(const char *query)
+{
+  int64_t stamp = 0;
 
-  free(daap_db_path);
-  free(artwork_db_path);
-  free(xcode_db_path);
-  return 0;
+  if (cache_daap_query_deps(query) & CACHE_DAAP_DEP_RATING)
+    db_admin_getint64(&stamp, DB_ADMIN_DB_MODIFIED);
+  else
+    db_admin_getint64(&stamp, DB_ADMIN_DB_UPDATE);
 
- error:
-  cache_close();
-  free(daap_db_path);
-  free(artwork_db_path);
-  free(xcode_db_path);
-  return -1;
+  return stamp;
 }
 
-
-/* Adds the reply (stored in evbuf) to the cache */
 static int
-cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
+daap_snapshot_get(struct evbuffer *evbuf, const char *query)
 {
-#define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
-  sqlite3_stmt *stmt;
-  unsigned char *data;
-  size_t datalen;
-  int ret;
+  struct cache_daap_snapshot *snapshot = &cache_daap_snapshot;
+  int64_t stamp;
+  off_t offset;
+  size_t len;
+  int fd;
 
-  datalen = evbuffer_get_length(evbuf);
-  data = evbuffer_pullup(evbuf, -1);
+  if (!daap_snapshot_is_candidate(query))
+    return -1;
 
-  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
+  stamp = daap_snapshot_stamp_get(query);
 
-  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+  fd = -1;
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_DONE)
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&snapshot->lck));
+  if (snapshot->fd >= 0 && snapshot->stamp == stamp && strcmp(snapshot->query, query) == 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(hdl));
-      sqlite3_finalize(stmt);
-      return -1;
+      fd = dup(snapshot->fd);
+      offset = snapshot->reply_offset;
+      len = snapshot->reply_len;
     }
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&snapshot->lck));
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
+  if (fd < 0)
+    return -1;
+
+  // The file segment takes ownership of fd, and with this flag it will be sent
+  // with sendfile() when possible
+  evbuffer_set_flags(evbuf, EVBUFFER_FLAG_DRAINS_TO_FD);
+  if (evbuffer_add_file(evbuf, fd, offset, len) < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for cache update: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_CACHE, "Could not add DAAP song list snapshot to reply\n");
+      close(fd);
       return -1;
     }
 
-  //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
-
   return 0;
-#undef Q_TMPL
 }
 
-/* Adds the query to the list of queries for which we will build and cache a reply */
-static enum command_state
-cache_daap_query_add(void *arg, int *retval)
+/* Writes a new snapshot to a temporary file, which then replaces the current
+ * one. Readers that already have the old file open are not affected.
+ */
+static void
+daap_snapshot_save(const char *query, int64_t stamp, struct evbuffer *gzbuf)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ");"
-#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
-  struct cache_arg *cmdarg = arg;
-  struct timeval delay = { 60, 0 };
-  char *query;
-  char *errmsg;
+  struct cache_daap_snapshot_header header = { 0 };
+  char tmp_path[PATH_MAX];
+  char *query_copy;
+  uint8_t *data;
+  size_t len;
+  int fd;
   int ret;
 
-  if (!cmdarg->ua)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Couldn't add slow query to cache, unknown user-agent\n");
+  if (cache_daap_snapshot_path[0] == '\0')
+    return;
 
-      goto error_add;
-    }
+  len = evbuffer_get_length(gzbuf);
+  data = evbuffer_pullup(gzbuf, -1);
 
-  // Currently we are only able to pre-build and cache these reply types
-  if ( (strncmp(cmdarg->query, "/databases/1/containers/", strlen("/databases/1/containers/")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/groups?", strlen("/databases/1/groups?")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/items?", strlen("/databases/1/items?")) != 0) &&
-       (strncmp(cmdarg->query, "/databases/1/browse/", strlen("/databases/1/browse/")) != 0) )
-    goto error_add;
+  memcpy(header.magic, CACHE_DAAP_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = CACHE_DAAP_VERSION;
+  header.stamp = stamp;
+  header.query_len = strlen(query);
+  header.reply_len = len;
 
-  remove_tag(cmdarg->query, "session-id");
-  remove_tag(cmdarg->query, "revision-number");
+  ret = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_daap_snapshot_path);
+  if (ret < 0 || ret >= sizeof(tmp_path))
+    return;
 
-  query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL));
-  if (!query)
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
-
-      goto error_add;
+      DPRINTF(E_LOG, L_CACHE, "Could not create DAAP song list snapshot '%s': %s\n", tmp_path, strerror(errno));
+      return;
     }
 
-  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, query, header.query_len) != header.query_len ||
+      write(fd, data, len) != len)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error adding query to query list: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      goto error_add;
+      DPRINTF(E_LOG, L_CACHE, "Error writing DAAP song list snapshot '%s': %s\n", tmp_path, strerror(errno));
+      goto error;
     }
 
-  DPRINTF(E_INFO, L_CACHE, "Slow query (%d ms) added to cache: '%s' (user-agent: '%s')\n", cmdarg->msec, cmdarg->query, cmdarg->ua);
-
-  free(cmdarg->ua);
-  free(cmdarg->query);
+  close(fd);
 
-  // Limits the size of the cache to only contain replies for 20 most recent queries
-  ret = sqlite3_exec(cmdarg->hdl, Q_CLEANUP, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  if (rename(tmp_path, cache_daap_snapshot_path) < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error cleaning up query list before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Could not rename DAAP song list snapshot to '%s': %s\n", cache_daap_snapshot_path, strerror(errno));
+      unlink(tmp_path);
+      return;
     }
 
-  // Will set of cache regeneration after waiting a bit (so there is less risk
-  // of disturbing the user)
-  evtimer_add(cache_daap_updateev, &delay);
+  fd = open(cache_daap_snapshot_path, O_RDONLY);
+  if (fd < 0)
+    return;
 
-  *retval = 0;
-  return COMMAND_END;
+  CHECK_NULL(L_CACHE, query_copy = strdup(query));
 
- error_add:
-  if (cmdarg->ua)
-    free(cmdarg->ua);
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_snapshot.lck));
+  daap_snapshot_set(fd, query_copy, stamp, sizeof(header) + header.query_len, len);
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_snapshot.lck));
 
-  if (cmdarg->query)
-    free(cmdarg->query);
+  DPRINTF(E_INFO, L_CACHE, "Saved DAAP song list snapshot (%zu bytes): %s\n", len, query);
+  return;
 
-  *retval = -1;
-  return COMMAND_END;
-#undef Q_CLEANUP
-#undef Q_TMPL
+ error:
+  close(fd);
+  unlink(tmp_path);
 }
 
-// Gets a reply from the cache.
-// cmdarg->evbuf will be filled with the reply (gzipped)
-static enum command_state
-cache_daap_query_get(void *arg, int *retval)
+// True if the update should save query's reply as the new snapshot, which is
+// the case if there is no valid snapshot, or if it is for the same query
+static bool
+daap_snapshot_wanted(const char *query, int64_t stamp)
+{
+  struct cache_daap_snapshot *snapshot = &cache_daap_snapshot;
+  bool wanted;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&snapshot->lck));
+  wanted = (snapshot->fd < 0 || snapshot->stamp != stamp || strcmp(snapshot->query, query) == 0);
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&snapshot->lck));
+
+  return wanted;
+}
+
+/* Saves the reply the cache update just built for query, if it should be the
+ * snapshot. The stamp only has a resolution of seconds, so if the library was
+ * changed this very second, another change could follow with the same stamp.
+ * In that case the save is retried from the replies table when the second has
+ * passed, since a change would have dropped the reply from there.
+ */
+static void
+daap_snapshot_update(const char *query, struct evbuffer *gzbuf)
+{
+  int64_t stamp;
+
+  if (!daap_snapshot_is_candidate(query))
+    return;
+
+  stamp = daap_snapshot_stamp_get(query);
+  if (!daap_snapshot_wanted(query, stamp))
+    return;
+
+  if (stamp < (int64_t)time(NULL))
+    {
+      daap_snapshot_save(query, stamp, gzbuf);
+      return;
+    }
+
+  free(cache_daap_snapshot_retry_query);
+  CHECK_NULL(L_CACHE, cache_daap_snapshot_retry_query = strdup(query));
+  evtimer_add(cache_daap_snapshot_retryev, &cache_daap_snapshot_retry_wait);
+}
+
+static void
+daap_snapshot_retry_cb(int fd, short what, void *arg)
 {
 #define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
-  struct cache_arg *cmdarg = arg;
+  struct evbuffer *gzbuf;
   sqlite3_stmt *stmt;
   char *query;
-  int datalen;
   int ret;
 
-  query = cmdarg->query;
-  remove_tag(query, "session-id");
-  remove_tag(query, "revision-number");
+  query = cache_daap_snapshot_retry_query;
+  cache_daap_snapshot_retry_query = NULL;
+  if (!query)
+    return;
 
-  // Look in the DB
-  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  ret = sqlite3_prepare_v2(cache_daap_hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for DAAP song list snapshot: %s\n", sqlite3_errmsg(cache_daap_hdl));
       free(query);
-      *retval = -1;
-      return COMMAND_END;
+      return;
     }
 
   sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
 
+  // If the reply is gone the library changed, and the update that rebuilds it
+  // will also save the snapshot
   ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)  
+  if (ret == SQLITE_ROW)
     {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(cmdarg->hdl));
-      goto error_get;
+      CHECK_NULL(L_CACHE, gzbuf = evbuffer_new());
+      evbuffer_add(gzbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+      daap_snapshot_update(query, gzbuf);
+      evbuffer_free(gzbuf);
     }
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error stepping query for DAAP song list snapshot: %s\n", sqlite3_errmsg(cache_daap_hdl));
 
-  datalen = sqlite3_column_bytes(stmt, 0);
+  sqlite3_finalize(stmt);
+  free(query);
+#undef Q_TMPL
+}
 
-  if (!cmdarg->evbuf)
+static void
+daap_snapshot_load(void)
+{
+  struct cache_daap_snapshot_header header;
+  struct stat sb;
+  char *query;
+  int fd;
+
+  fd = open(cache_daap_snapshot_path, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  if (fstat(fd, &sb) < 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, CACHE_DAAP_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.query_len >= PATH_MAX ||
+      sb.st_size != sizeof(header) + header.query_len + header.reply_len)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
-      goto error_get;
+      DPRINTF(E_LOG, L_CACHE, "Ignoring invalid DAAP song list snapshot '%s'\n", cache_daap_snapshot_path);
+      close(fd);
+      return;
     }
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), datalen);
-  if (ret < 0)
+  if (header.version != CACHE_DAAP_VERSION)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
-      goto error_get;
+      DPRINTF(E_INFO, L_CACHE, "Ignoring DAAP song list snapshot with version %" PRIu32 ", expected %d\n", header.version, CACHE_DAAP_VERSION);
+      close(fd);
+      return;
     }
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(cmdarg->hdl));
+  CHECK_NULL(L_CACHE, query = calloc(1, header.query_len + 1));
+  if (read(fd, query, header.query_len) != header.query_len)
+    {
+      free(query);
+      close(fd);
+      return;
+    }
 
-  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
+  daap_snapshot_set(fd, query, header.stamp, sizeof(header) + header.query_len, header.reply_len);
 
-  free(query);
+  DPRINTF(E_DBG, L_CACHE, "Loaded DAAP song list snapshot: %s\n", query);
+}
+
+static void
+daap_snapshot_init(const char *cache_dir)
+{
+  int ret;
+
+  CHECK_ERR(L_CACHE, mutex_init(&cache_daap_snapshot.lck));
+
+  ret = snprintf(cache_daap_snapshot_path, sizeof(cache_daap_snapshot_path), "%s%s", cache_dir, CACHE_DAAP_SNAPSHOT_FILE);
+  if (ret < 0 || ret >= sizeof(cache_daap_snapshot_path))
+    {
+      DPRINTF(E_LOG, L_CACHE, "Path to DAAP song list snapshot is too long\n");
+      cache_daap_snapshot_path[0] = '\0';
+      return;
+    }
+
+  daap_snapshot_load();
+}
+
+static void
+daap_snapshot_deinit(void)
+{
+  daap_snapshot_set(-1, NULL, 0, 0, 0);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_destroy(&cache_daap_snapshot.lck));
+}
+
+
+/* ---------------------------------- MAIN ---------------------------------- */
+/*                                Thread: cache                               */
+
+static int
+cache_tables_create(sqlite3 *hdl, int version, struct cache_db_def *db_def, int db_def_size)
+{
+#define Q_CACHE_VERSION "INSERT INTO admin (key, value) VALUES ('cache_version', '%d');"
+  char *query;
+  char *errmsg;
+  int ret;
+  int i;
+
+  for (i = 0; i < db_def_size; i++)
+    {
+      ret = sqlite3_exec(hdl, db_def[i].create_query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_FATAL, L_CACHE, "Error creating cache db entity '%s': %s\n", db_def[i].name, errmsg);
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  query = sqlite3_mprintf(Q_CACHE_VERSION, version);
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error inserting cache version: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_CACHE_VERSION
+}
+
+static int
+cache_tables_drop(sqlite3 *hdl, struct cache_db_def *db_def, int db_def_size)
+{
+#define Q_VACUUM	"VACUUM;"
+  char *errmsg;
+  int ret;
+  int i;
+
+  for (i = 0; i < db_def_size; i++)
+    {
+      ret = sqlite3_exec(hdl, db_def[i].drop_query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_FATAL, L_CACHE, "Error dropping cache db entity '%s': %s\n", db_def[i].name, errmsg);
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  ret = sqlite3_exec(hdl, Q_VACUUM, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error vacuuming cache database: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_VACUUM
+}
+
+static int
+cache_version_check(int *have_version, sqlite3 *hdl, int want_version)
+{
+#define Q_VER "SELECT value FROM admin WHERE key = 'cache_version';"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  *have_version = 0;
+
+  ret = sqlite3_prepare_v2(hdl, Q_VER, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      return 0; // Virgin database, admin table doesn't exists
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  *have_version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return 0;
+#undef Q_VER
+}
+
+static int
+cache_pragma_set(sqlite3 *hdl)
+{
+#define Q_PRAGMA_CACHE_SIZE "PRAGMA cache_size=%d;"
+#define Q_PRAGMA_JOURNAL_MODE "PRAGMA journal_mode=%s;"
+#define Q_PRAGMA_SYNCHRONOUS "PRAGMA synchronous=%d;"
+#define Q_PRAGMA_MMAP_SIZE "PRAGMA mmap_size=%d;"
+  char *errmsg;
+  int ret;
+  int cache_size;
+  char *journal_mode;
+  int synchronous;
+  int mmap_size;
+  char *query;
+
+  // Set page cache size in number of pages
+  cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_cache");
+  if (cache_size > -1)
+    {
+      query = sqlite3_mprintf(Q_PRAGMA_CACHE_SIZE, cache_size);
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_cache_size_cache: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  // Set journal mode
+  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  if (journal_mode)
+    {
+      query = sqlite3_mprintf(Q_PRAGMA_JOURNAL_MODE, journal_mode);
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_journal_mode: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  // Set synchronous flag
+  synchronous = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_synchronous");
+  if (synchronous > -1)
+    {
+      query = sqlite3_mprintf(Q_PRAGMA_SYNCHRONOUS, synchronous);
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_synchronous: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  // Set mmap size
+  mmap_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_mmap_size_cache");
+  if (synchronous > -1)
+    {
+      query = sqlite3_mprintf(Q_PRAGMA_MMAP_SIZE, mmap_size);
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_mmap_size: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  return 0;
+#undef Q_PRAGMA_CACHE_SIZE
+#undef Q_PRAGMA_JOURNAL_MODE
+#undef Q_PRAGMA_SYNCHRONOUS
+#undef Q_PRAGMA_MMAP_SIZE
+}
+
+static void
+cache_close_one(sqlite3 **hdl)
+{
+  sqlite3_stmt *stmt;
+
+  if (!*hdl)
+    return;
+
+  /* Tear down anything that's in flight */
+  while ((stmt = sqlite3_next_stmt(*hdl, 0)))
+    sqlite3_finalize(stmt);
+
+  sqlite3_close(*hdl);
+  *hdl = NULL;
+}
+
+static void
+cache_close(void)
+{
+  cache_close_one(&cache_daap_hdl);
+  cache_close_one(&cache_artwork_hdl);
+  cache_close_one(&cache_xcode_hdl);
+
+  DPRINTF(E_DBG, L_CACHE, "Cache closed\n");
+}
+
+static int
+cache_open_one(sqlite3 **hdl, const char *path, const char *name, int want_version, struct cache_db_def *db_def, int db_def_size)
+{
+  sqlite3 *h;
+  int have_version;
+  int ret;
+
+  ret = sqlite3_open(path, &h);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open '%s': %s\n", path, sqlite3_errmsg(h));
+      goto error;
+    }
+
+  ret = cache_version_check(&have_version, h, want_version);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not check cache '%s' database version\n", name);
+      goto error;
+    }
+
+  if (have_version > 0 && have_version < want_version)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Database schema outdated, deleting cache '%s' v%d -> v%d\n", name, have_version, want_version);
+
+      ret = cache_tables_drop(h, db_def, db_def_size);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error deleting '%s' database tables\n", name);
+	  goto error;
+	}
+    }
+
+  if (have_version < want_version)
+    {
+      ret = cache_tables_create(h, want_version, db_def, db_def_size);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not create cache '%s' database tables\n", name);
+	  goto error;
+	}
+
+      DPRINTF(E_INFO, L_CACHE, "Cache '%s' database tables created\n", name);
+    }
+
+  *hdl = h;
+  return 0;
+
+ error:
+  sqlite3_close(h);
+  return -1;
+}
+
+static int
+cache_open(void)
+{
+  const char *directory;
+  const char *filename;
+  char *daap_db_path;
+  char *artwork_db_path;
+  char *xcode_db_path;
+  int ret;
+
+  directory = cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir");
+
+  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_daap_filename"));
+  CHECK_NULL(L_DB, daap_db_path = safe_asprintf("%s%s", directory, filename));
+
+  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_artwork_filename"));
+  CHECK_NULL(L_DB, artwork_db_path = safe_asprintf("%s%s", directory, filename));
+
+  CHECK_NULL(L_DB, filename = cfg_getstr(cfg_getsec(cfg, "general"), "cache_xcode_filename"));
+  CHECK_NULL(L_DB, xcode_db_path = safe_asprintf("%s%s", directory, filename));
+
+  ret = cache_open_one(&cache_daap_hdl, daap_db_path, "daap", CACHE_DAAP_VERSION, cache_daap_db_def, ARRAY_SIZE(cache_daap_db_def));
+  if (ret < 0)
+    goto error;
+
+  ret = cache_open_one(&cache_artwork_hdl, artwork_db_path, "artwork", CACHE_ARTWORK_VERSION, cache_artwork_db_def, ARRAY_SIZE(cache_artwork_db_def));
+  if (ret < 0)
+    goto error;
+
+  ret = cache_open_one(&cache_xcode_hdl, xcode_db_path, "xcode", CACHE_XCODE_VERSION, cache_xcode_db_def, ARRAY_SIZE(cache_xcode_db_def));
+  if (ret < 0)
+    goto error;
+
+  ret = cache_pragma_set(cache_artwork_hdl);
+  if (ret < 0)
+    goto error;
+
+  DPRINTF(E_DBG, L_CACHE, "Cache opened\n");
+
+  free(daap_db_path);
+  free(artwork_db_path);
+  free(xcode_db_path);
+  return 0;
+
+ error:
+  cache_close();
+  free(daap_db_path);
+  free(artwork_db_path);
+  free(xcode_db_path);
+  return -1;
+}
+
+
+/* Adds the reply (stored in evbuf) to the cache */
+static int
+cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
+{
+#define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
+  sqlite3_stmt *stmt;
+  unsigned char *data;
+  size_t datalen;
+  int ret;
+
+  datalen = evbuffer_get_length(evbuf);
+  data = evbuffer_pullup(evbuf, -1);
+
+  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for cache update: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
+
+  return 0;
+#undef Q_TMPL
+}
+
+/* Drops the replies that depend on any of deps, along with replies for queries
+ * that are no longer in the query list. The queries themselves are kept, so
+ * the next cache update will rebuild just the dropped replies.
+ */
+static int
+cache_daap_invalidate(sqlite3 *hdl, int deps)
+{
+#define Q_TMPL "DELETE FROM replies WHERE query NOT IN (SELECT query FROM queries WHERE (deps & %d) = 0);"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, deps);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+      return -1;
+    }
+
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error invalidating DAAP reply cache: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Invalidated %d DAAP cache replies (deps %d)\n", sqlite3_changes(hdl), deps);
+
+  daap_mem_invalidate(deps);
+
+  return 0;
+#undef Q_TMPL
+}
+
+/* Adds the query to the list of queries for which we will build and cache a reply */
+static enum command_state
+cache_daap_query_add(void *arg, int *retval)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp, deps) VALUES ('%q', %d, '%q', %d, %" PRIi64 ", %d);"
+#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
+  struct cache_arg *cmdarg = arg;
+  struct timeval delay = { 60, 0 };
+  char *query;
+  char *errmsg;
+  int ret;
+
+  if (!cmdarg->ua)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Couldn't add slow query to cache, unknown user-agent\n");
+
+      goto error_add;
+    }
+
+  // Currently we are only able to pre-build and cache these reply types
+  if ( (strncmp(cmdarg->query, "/databases/1/containers/", strlen("/databases/1/containers/")) != 0) &&
+       (strncmp(cmdarg->query, "/databases/1/groups?", strlen("/databases/1/groups?")) != 0) &&
+       (strncmp(cmdarg->query, "/databases/1/items?", strlen("/databases/1/items?")) != 0) &&
+       (strncmp(cmdarg->query, "/databases/1/browse/", strlen("/databases/1/browse/")) != 0) )
+    goto error_add;
+
+  remove_tag(cmdarg->query, "session-id");
+  remove_tag(cmdarg->query, "revision-number");
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL), cache_daap_query_deps(cmdarg->query));
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+
+      goto error_add;
+    }
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error adding query to query list: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      goto error_add;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Slow query (%d ms) added to cache: '%s' (user-agent: '%s')\n", cmdarg->msec, cmdarg->query, cmdarg->ua);
+
+  free(cmdarg->ua);
+  free(cmdarg->query);
+
+  // Limits the size of the cache to only contain replies for 20 most recent queries
+  ret = sqlite3_exec(cmdarg->hdl, Q_CLEANUP, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error cleaning up query list before update: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  // Will set of cache regeneration after waiting a bit (so there is less risk
+  // of disturbing the user)
+  evtimer_add(cache_daap_updateev, &delay);
+
+  *retval = 0;
+  return COMMAND_END;
+
+ error_add:
+  if (cmdarg->ua)
+    free(cmdarg->ua);
+
+  if (cmdarg->query)
+    free(cmdarg->query);
+
+  *retval = -1;
+  return COMMAND_END;
+#undef Q_CLEANUP
+#undef Q_TMPL
+}
+
+// Gets a reply from the cache.
+// cmdarg->evbuf will be filled with the reply (gzipped)
+static enum command_state
+cache_daap_query_get(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int datalen;
+  int ret;
+
+  query = cmdarg->query;
+  remove_tag(query, "session-id");
+  remove_tag(query, "revision-number");
+
+  // Look in the DB
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      free(query);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)  
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      __atomic_add_fetch(&cache_daap_stats.misses, 1, __ATOMIC_RELAXED);
+      goto error_get;
+    }
+
+  datalen = sqlite3_column_bytes(stmt, 0);
+
+  if (!cmdarg->evbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
+      goto error_get;
+    }
+
+  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), datalen);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
+      goto error_get;
+    }
+
+  // Promote to the memory tier, so next time the httpd thread can get it itself
+  daap_mem_add(query, cache_daap_query_deps(query), sqlite3_column_blob(stmt, 0), datalen);
+  __atomic_add_fetch(&cache_daap_stats.db_hits, 1, __ATOMIC_RELAXED);
+
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(cmdarg->hdl));
+
+  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
+
+  free(query);
+
+  *retval = 0;
+  return COMMAND_END;
+
+ error_get:
+  sqlite3_finalize(stmt);
+  free(query);
+  *retval = -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+/* Removes the query from the cache */
+static int
+cache_daap_query_delete(sqlite3 *hdl, const int id)
+{
+#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_TMPL
+}
+
+/* Here we actually update the cache by asking httpd_daap for responses
+ * to the queries set for caching. Only queries that don't have a reply, i.e.
+ * new ones and those invalidated by library changes, are built. Until then a
+ * request for them is just a cache miss, so the slowest are built first.
+ */
+static void
+cache_daap_update_cb(int fd, short what, void *arg)
+{
+#define Q_TMPL "SELECT id, user_agent, is_remote, query FROM queries WHERE query NOT IN (SELECT query FROM replies) ORDER BY msec DESC;"
+  sqlite3 *hdl = cache_daap_hdl;
+  sqlite3_stmt *stmt;
+  struct evbuffer *evbuf;
+  struct evbuffer *gzbuf;
+  char *query;
+  int nbuilt;
+  int ret;
+
+  if (cache_is_suspended)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
+      return;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Beginning DAAP cache update\n");
+
+  // Gets rid of replies for queries that were pushed out of the query list
+  ret = cache_daap_invalidate(hdl, 0);
+  if (ret < 0)
+    return;
+
+  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(hdl));
+      return;
+    }
+
+  nbuilt = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      query = strdup((char *)sqlite3_column_text(stmt, 3));
+
+      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+      if (!evbuf)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
+	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
+	  free(query);
+
+	  continue;
+	}
+
+      gzbuf = httpd_gzip_deflate(evbuf);
+      if (!gzbuf)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
+	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
+	  free(query);
+	  evbuffer_free(evbuf);
+
+	  continue;
+	}
+
+      evbuffer_free(evbuf);
+
+      ret = cache_daap_reply_add(hdl, query, gzbuf);
+      if (ret == 0)
+	{
+	  daap_mem_add(query, cache_daap_query_deps(query), evbuffer_pullup(gzbuf, -1), evbuffer_get_length(gzbuf));
+	  nbuilt++;
+	}
+
+      daap_snapshot_update(query, gzbuf);
+
+      free(query);
+      evbuffer_free(gzbuf);
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+
+  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated (%d replies rebuilt)\n", nbuilt);
+#undef Q_TMPL
+}
+
+
+/* ----------------------- Caching of transcoded data ----------------------- */
+
+static void
+xcode_job_clear(struct cache_xcode_job *job)
+{
+  free(job->file_path);
+  if (job->header)
+    evbuffer_free(job->header);
+
+  // Can't just memset to zero, because *ev is persistent
+  job->format = NULL;
+  job->file_path = NULL;
+  job->file_id = 0;
+  job->header = NULL;
+  job->is_encoding = false;
+}
+
+static enum command_state
+xcode_header_get(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT header FROM data WHERE length(header) > 0 AND file_id = ? AND format = ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt = NULL;
+  int ret;
+
+  cmdarg->cached = 0;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    goto error;
+
+  sqlite3_bind_int(stmt, 1, cmdarg->id);
+  sqlite3_bind_text(stmt, 2, cmdarg->header_format, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_DONE)
+    goto end;
+  else if (ret != SQLITE_ROW)
+    goto error;
+
+  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+  if (ret < 0)
+    goto error;
+
+  cmdarg->cached = 1;
+
+  DPRINTF(E_DBG, L_CACHE, "Cache header hit (%zu bytes)\n", evbuffer_get_length(cmdarg->evbuf));
+
+ end:
+  sqlite3_finalize(stmt);
+  *retval = 0;
+  return COMMAND_END;
+
+ error:
+  DPRINTF(E_LOG, L_CACHE, "Database error getting prepared header from cache: %s\n", sqlite3_errmsg(cmdarg->hdl));
+  if (stmt)
+    sqlite3_finalize(stmt);
+  *retval = -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static void
+xcode_trigger(void)
+{
+  struct timeval delay_xcode = { 5, 0 };
+
+  if (cache_xcode_is_enabled)
+    event_add(cache_xcode_updateev, &delay_xcode);
+}
+
+static enum command_state
+xcode_toggle(void *arg, int *retval)
+{
+  bool *enable = arg;
+
+  if (*enable == cache_xcode_is_enabled)
+    goto end;
+
+  cache_xcode_is_enabled = *enable;
+  xcode_trigger();
+
+ end:
+  *retval = 0;
+  return COMMAND_END;
+}
+
+static int
+xcode_add_entry(sqlite3 *hdl, uint32_t id, uint32_t ts, const char *path)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO files (id, time_modified, filepath) VALUES (%d, %d, '%q');"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_SPAM, L_CACHE, "Adding xcode file id %d, path '%s'\n", id, path);
+
+  query = sqlite3_mprintf(Q_TMPL, id, ts, path);
+
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error adding row to cache: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_TMPL
+}
+
+static int
+xcode_del_entry(sqlite3 *hdl, uint32_t id)
+{
+#define Q_TMPL_FILES "DELETE FROM files WHERE id = %d;"
+#define Q_TMPL_DATA "DELETE FROM data WHERE file_id = %d;"
+  char query[256];
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_SPAM, L_CACHE, "Deleting xcode file id %d\n", id);
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL_FILES, (int)id);
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting row from xcode files: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL_DATA, (int)id);
+  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting rows from xcode_data: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_TMPL_DATA
+#undef Q_TMPL_FILES
+}
+
+/* In the xcode table we keep a prepared header for files that could be subject
+ * to transcoding. Whenever the library changes, this callback runs, and the
+ * list of files in the xcode table is synced with the main files table.
+ *
+ * In practice we compare two tables, both sorted by id:
+ *
+ * From files:                         From the cache
+ *  | id      |  time_modified  |       | id       | time_modified | data    |
+ *
+ * We do it one item at the time from files, and then going through cache table
+ * rows until: table end OR id is larger OR id is equal and time equal or newer
+ */
+static int
+xcode_sync_with_files(sqlite3 *hdl)
+{
+  sqlite3_stmt *stmt;
+  struct cachelist *cachelist = NULL;
+  size_t cachelist_size = 0;
+  size_t cachelist_len = 0;
+  struct query_params qp = { .type = Q_ITEMS, .filter = "f.data_kind = 0", .order = "f.id" };
+  struct db_media_file_info dbmfi;
+  struct db_media_file_info *rowA;
+  struct cachelist *rowB;
+  uint32_t id;
+  uint32_t ts;
+  int cmp;
+  int i;
+  int ret;
+
+  // Both lists must be sorted by id, otherwise the compare below won't work
+  ret = sqlite3_prepare_v2(hdl, "SELECT id, time_modified FROM files ORDER BY id;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    goto error;
+
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      if (cachelist_len + 1 > cachelist_size)
+	{
+	  cachelist_size += 1024;
+	  CHECK_NULL(L_CACHE, cachelist = realloc(cachelist, cachelist_size * sizeof(struct cachelist)));
+	}
+      cachelist[cachelist_len].id = sqlite3_column_int(stmt, 0);
+      cachelist[cachelist_len].ts = sqlite3_column_int(stmt, 1);
+      cachelist_len++;
+    }
+  sqlite3_finalize(stmt);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    goto error;
+
+  // Silence false maybe-uninitialized warning
+  rowB = NULL;
+
+  // Loop while either list ("A" files list, "B" cache list) has remaining items
+  for(i = 0, cmp = 0;;)
+    {
+      if (cmp <= 0)
+        rowA = (db_query_fetch_file(&dbmfi, &qp) == 0) ? &dbmfi : NULL;;
+      if (cmp >= 0)
+        rowB = (i < cachelist_len) ? &cachelist[i++] : NULL;
+      if (!rowA && !rowB)
+        break; // Done with both lists
+
+#if 0
+      if (rowA)
+	DPRINTF(E_DBG, L_CACHE, "cmp %d, rowA->id %s\n", cmp, rowA->id);
+      if (rowB)
+	DPRINTF(E_DBG, L_CACHE, "cmp %d, rowB->id %u, i %d, cachelist_len %zu\n", cmp, rowB->id, i, cachelist_len);
+#endif
+
+      if (rowA)
+	{
+	  safe_atou32(rowA->id, &id);
+	  safe_atou32(rowA->time_modified, &ts);
+	}
+
+      cmp = 0; // In both lists - unless:
+      if (!rowB || (rowA && rowB->id > id)) // A had an item not in B
+	{
+	  xcode_add_entry(hdl, id, ts, rowA->path);
+	  cmp = -1;
+	}
+      else if (!rowA || (rowB && rowB->id < id)) // B had an item not in A
+	{
+	  xcode_del_entry(hdl, rowB->id);
+	  cmp = 1;
+	}
+      else if (rowB->id == id && rowB->ts < ts) // Item in B is too old
+	{
+	  xcode_del_entry(hdl, rowB->id);
+	  xcode_add_entry(hdl, id, ts, rowA->path);
+	}
+    }
+
+  db_query_end(&qp);
+
+  free(cachelist);
+  return 0;
+
+ error:
+  DPRINTF(E_LOG, L_CACHE, "Database error while processing xcode files table\n");
+  free(cachelist);
+  return -1;
+}
+
+static int
+xcode_header_save(sqlite3 *hdl, int file_id, const char *format, uint8_t *data, size_t datalen)
+{
+#define Q_TMPL "INSERT INTO data (timestamp, file_id, format, header) VALUES (?, ?, ?, ?);"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing xcode data for cache update: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, (uint64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, file_id);
+  sqlite3_bind_text(stmt, 3, format, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 4, data, datalen, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error stepping xcode data for cache update: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  sqlite3_finalize(stmt);
+  return 0;
+#undef Q_TMPL
+}
+
+static int
+xcode_file_next(int *file_id, char **file_path, sqlite3 *hdl, const char *format)
+{
+#define Q_TMPL "SELECT f.id, f.filepath, d.id FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL LIMIT 1;"
+  sqlite3_stmt *stmt;
+  char query[256];
+  int ret;
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL, format);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error occured while finding next file to prepare header for\n");
+      return -1;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      sqlite3_finalize(stmt);
+      return -1; // All done
+    }
+
+  *file_id = sqlite3_column_int(stmt, 0);
+  *file_path = strdup((char *)sqlite3_column_text(stmt, 1));
+
+  sqlite3_finalize(stmt);
+
+  // Save an empty header so next call to this function will return a new file
+  return xcode_header_save(hdl, *file_id, format, NULL, 0);
+#undef Q_TMPL
+}
+
+// Thread: xcode
+static void
+xcode_worker(struct evthr *thr, void *arg, void *shared)
+{
+  struct cache_xcode_job *job = arg;
+  int ret;
+
+  DPRINTF(E_DBG, L_CACHE, "Preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
+
+  if (strcmp(job->format, CACHE_XCODE_FORMAT_MP4) == 0)
+    {
+      ret = transcode_prepare_header(&job->header, XCODE_MP4_ALAC, job->file_path);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_CACHE, "Error preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
+    }
+
+  // Tell the cache thread that we are done. Only the cache thread can save the
+  // result to the DB.
+  event_active(job->ev, 0, 0);
+}
+
+static void
+cache_xcode_job_complete_cb(int fd, short what, void *arg)
+{
+  struct cache_xcode_job *job = arg;
+  struct timespec now;
+  uint8_t *data;
+  size_t datalen;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  cache_xcode_done_usec += timespec_diff_us(now, job->start);
+  cache_xcode_ndone++;
+
+  if (job->header)
+    {
+#if 1
+      datalen = evbuffer_get_length(job->header);
+      data = evbuffer_pullup(job->header, -1);
+#else
+      data = (unsigned char*)"dummy";
+      datalen = 6;
+#endif
+      xcode_header_save(cache_xcode_hdl, job->file_id, job->format, data, datalen);
+    }
+
+  xcode_job_clear(job); // Makes the job available again
+  event_active(cache_xcode_prepareev, 0, 0);
+}
+
+// Preparing headers can take very long, so we use worker threads. However, all
+// DB access must be from the cache thread. So this function will find the next
+// file from the db and then dispatch a thread for the encoding.
+static void
+cache_xcode_prepare_cb(int fd, short what, void *arg)
+{
+  struct cache_xcode_job *job = NULL;
+  bool is_encoding = false;
+  int ret;
+  int i;
+
+  if (!cache_is_initialized)
+    return;
+
+  // We don't want to compete with playback, xcode_player_update() will kick us
+  // off again when playback stops. Jobs in progress are allowed to finish.
+  if (cache_xcode_is_paused)
+    return;
+
+  for (i = 0; i < cache_xcode_nthreads; i++)
+    {
+      if (cache_xcode_jobs[i].is_encoding)
+	is_encoding = true;
+      else if (!job)
+	job = &cache_xcode_jobs[i];
+    }
+
+  if (!job)
+    return; // No available thread right now, wait for cache_xcode_job_complete_cb()
+
+  ret = xcode_file_next(&job->file_id, &job->file_path, cache_xcode_hdl, CACHE_XCODE_FORMAT_MP4);
+  if (ret < 0)
+    {
+      if (!is_encoding)
+	DPRINTF(E_LOG, L_CACHE, "Header generation completed\n");
+
+      return;
+    }
+  else if (!is_encoding)
+    DPRINTF(E_LOG, L_CACHE, "Kicking off header generation\n");
+
+  job->is_encoding = true;
+  job->format = CACHE_XCODE_FORMAT_MP4;
+  clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+  evthr_pool_defer(cache_xcode_threadpool, xcode_worker, job);
+
+  // Set off more threads
+  event_active(cache_xcode_prepareev, 0, 0);
+}
+
+static void
+cache_xcode_update_cb(int fd, short what, void *arg)
+{
+  if (xcode_sync_with_files(cache_xcode_hdl) < 0)
+    return;
+
+  event_active(cache_xcode_prepareev, 0, 0);
+}
+
+static enum command_state
+xcode_player_update(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+  bool is_paused;
+
+  is_paused = (cmdarg->play_status == PLAY_PLAYING);
+  if (is_paused == cache_xcode_is_paused)
+    goto end;
+
+  cache_xcode_is_paused = is_paused;
+  if (cache_xcode_is_paused)
+    DPRINTF(E_DBG, L_CACHE, "Pausing header generation during playback\n");
+  else if (cache_xcode_is_enabled)
+    event_active(cache_xcode_prepareev, 0, 0);
+
+ end:
+  *retval = 0;
+  return COMMAND_END;
+}
+
+static enum command_state
+xcode_progress_get(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL;"
+  struct cache_xcode_progress *progress = arg;
+  sqlite3_stmt *stmt;
+  char query[256];
+  int ret;
+  int i;
+
+  memset(progress, 0, sizeof(struct cache_xcode_progress));
+
+  progress->is_enabled = cache_xcode_is_enabled;
+  progress->is_paused = cache_xcode_is_paused;
+  progress->nthreads = cache_xcode_nthreads;
+  progress->files_done = cache_xcode_ndone;
+  progress->eta_sec = -1;
+
+  for (i = 0; i < cache_xcode_nthreads; i++)
+    {
+      if (cache_xcode_jobs[i].is_encoding)
+	progress->files_active++;
+    }
 
-  *retval = 0;
-  return COMMAND_END;
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL, CACHE_XCODE_FORMAT_MP4);
+
+  ret = sqlite3_prepare_v2(cache_xcode_hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error counting files without prepared header: %s\n", sqlite3_errmsg(cache_xcode_hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    progress->files_remaining = sqlite3_column_int(stmt, 0);
 
- error_get:
   sqlite3_finalize(stmt);
-  free(query);
-  *retval = -1;
+
+  // Estimate based on the average time per file, which the threads share
+  if (cache_xcode_ndone > 0 && cache_xcode_nthreads > 0)
+    progress->eta_sec = (int64_t)(progress->files_remaining + progress->files_active) * (cache_xcode_done_usec / cache_xcode_ndone) / cache_xcode_nthreads / 1000000;
+
+  *retval = 0;
   return COMMAND_END;
 #undef Q_TMPL
 }
 
-/* Removes the query from the cache */
+
+/* ---------------------- Segments of transcoded data ----------------------- */
+
 static int
-cache_daap_query_delete(sqlite3 *hdl, const int id)
+xcode_segment_path(char *path, size_t size, uint32_t id, uint32_t time_modified, enum transcode_profile profile, int bit_rate, const char *suffix)
 {
-#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
-  char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  ret = snprintf(path, size, "%s%" PRIu32 "-%" PRIu32 "/%d-%d.%s", cache_xcode_segments_path, id, time_modified, profile, bit_rate, suffix);
+  if ((ret < 0) || (ret >= size))
     {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
+      DPRINTF(E_LOG, L_CACHE, "Path to transcoding segment for file id %" PRIu32 " is too long\n", id);
       return -1;
     }
 
   return 0;
-#undef Q_TMPL
 }
 
-/* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
- */
-static void
-cache_daap_update_cb(int fd, short what, void *arg)
+static int
+xcode_segment_dir_remove(const char *dirname)
 {
-  sqlite3 *hdl = cache_daap_hdl;
-  sqlite3_stmt *stmt;
-  struct evbuffer *evbuf;
-  struct evbuffer *gzbuf;
-  char *errmsg;
-  char *query;
+  struct dirent *de;
+  DIR *dir;
+  char path[PATH_MAX];
   int ret;
 
-  if (cache_is_suspended)
-    {
-      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
-      return;
-    }
+  ret = snprintf(path, sizeof(path), "%s%s", cache_xcode_segments_path, dirname);
+  if ((ret < 0) || (ret >= sizeof(path)))
+    return -1;
 
-  DPRINTF(E_INFO, L_CACHE, "Beginning DAAP cache update\n");
+  dir = opendir(path);
+  if (!dir)
+    return -1;
 
-  ret = sqlite3_exec(hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  while ((de = readdir(dir)))
     {
-      DPRINTF(E_LOG, L_CACHE, "Error clearing reply cache before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return;
-    }
+      if (de->d_name[0] == '.')
+	continue;
 
-  ret = sqlite3_prepare_v2(hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(hdl));
-      return;
-    }
+      ret = snprintf(path, sizeof(path), "%s%s/%s", cache_xcode_segments_path, dirname, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
+      unlink(path);
+    }
 
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
-      if (!evbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
-	  free(query);
+  closedir(dir);
 
-	  continue;
-	}
+  snprintf(path, sizeof(path), "%s%s", cache_xcode_segments_path, dirname);
+  return rmdir(path);
+}
 
-      gzbuf = httpd_gzip_deflate(evbuf);
-      if (!gzbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
-	  free(query);
-	  evbuffer_free(evbuf);
+// Writes len bytes from evbuf as the given segment. The segment is written to a
+// temporary file first, so readers will never see an incomplete segment.
+static int
+xcode_segment_write(struct cache_xcode_segments_job *job, int segment, struct evbuffer *evbuf, size_t len)
+{
+  char suffix[32];
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  int fd;
+  int ret;
 
-	  continue;
-	}
+  snprintf(suffix, sizeof(suffix), "%d", segment);
+  if (xcode_segment_path(path, sizeof(path), job->file_id, job->time_modified, job->profile, job->bit_rate, suffix) < 0)
+    return -1;
 
-      evbuffer_free(evbuf);
+  // Already there from an earlier, interrupted prefetch
+  if (access(path, F_OK) == 0)
+    return evbuffer_drain(evbuf, len);
 
-      cache_daap_reply_add(hdl, query, gzbuf);
+  snprintf(suffix, sizeof(suffix), "%d.tmp", segment);
+  if (xcode_segment_path(tmp_path, sizeof(tmp_path), job->file_id, job->time_modified, job->profile, job->bit_rate, suffix) < 0)
+    return -1;
 
-      free(query);
-      evbuffer_free(gzbuf);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create transcoding segment '%s': %s\n", tmp_path, strerror(errno));
+      return -1;
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(hdl));
-
-  sqlite3_finalize(stmt);
-
-  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated\n");
-}
+  while (len > 0)
+    {
+      ret = evbuffer_write_atmost(evbuf, fd, len);
+      if (ret <= 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not write transcoding segment '%s': %s\n", tmp_path, strerror(errno));
+	  close(fd);
+	  unlink(tmp_path);
+	  return -1;
+	}
 
+      len -= ret;
+    }
 
-/* ----------------------- Caching of transcoded data ----------------------- */
+  close(fd);
 
-static void
-xcode_job_clear(struct cache_xcode_job *job)
-{
-  free(job->file_path);
-  if (job->header)
-    evbuffer_free(job->header);
+  ret = rename(tmp_path, path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not rename transcoding segment '%s': %s\n", tmp_path, strerror(errno));
+      unlink(tmp_path);
+      return -1;
+    }
 
-  // Can't just memset to zero, because *ev is persistent
-  job->format = NULL;
-  job->file_path = NULL;
-  job->file_id = 0;
-  job->header = NULL;
-  job->is_encoding = false;
+  return 0;
 }
 
-static enum command_state
-xcode_header_get(void *arg, int *retval)
+// Thread: xcode
+static void
+xcode_segments_worker(struct evthr *thr, void *arg, void *shared)
 {
-#define Q_TMPL "SELECT header FROM data WHERE length(header) > 0 AND file_id = ? AND format = ?;"
-  struct cache_arg *cmdarg = arg;
-  sqlite3_stmt *stmt = NULL;
+  struct cache_xcode_segments_job *job = arg;
+  struct transcode_decode_setup_args decode_args = { 0 };
+  struct transcode_encode_setup_args encode_args = { 0 };
+  struct media_quality quality = { 0 };
+  struct transcode_ctx *xcode = NULL;
+  struct evbuffer *evbuf = NULL;
+  char path[PATH_MAX];
+  size_t len;
+  int segment;
+  int fd;
   int ret;
 
-  cmdarg->cached = 0;
+  DPRINTF(E_DBG, L_CACHE, "Prefetching transcoding segments for '%s' (file id %" PRIu32 ")\n", job->file_path, job->file_id);
 
-  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  // Must match stream_new_transcode() in httpd.c, otherwise the output would
+  // not be the same as what we would stream
+  quality.bit_rate = job->bit_rate;
+  decode_args.profile = job->profile;
+  decode_args.path    = job->file_path;
+  decode_args.len_ms  = job->len_ms;
+  encode_args.profile = job->profile;
+  encode_args.quality = &quality;
+
+  xcode = transcode_setup(decode_args, encode_args);
+  if (!xcode)
     goto error;
 
-  sqlite3_bind_int(stmt, 1, cmdarg->id);
-  sqlite3_bind_text(stmt, 2, cmdarg->header_format, -1, SQLITE_STATIC);
+  CHECK_NULL(L_CACHE, evbuf = evbuffer_new());
 
-  ret = sqlite3_step(stmt);
-  if (ret == SQLITE_DONE)
-    goto end;
-  else if (ret != SQLITE_ROW)
-    goto error;
+  segment = 0;
+  ret = 1;
+  do
+    {
+      // Fill up a segment, transcode() returns 0 at EOF
+      while (ret > 0 && evbuffer_get_length(evbuf) < CACHE_XCODE_SEGMENT_SIZE)
+	ret = transcode(evbuf, NULL, xcode, CACHE_XCODE_SEGMENT_SIZE - evbuffer_get_length(evbuf));
+      if (ret < 0)
+	goto error;
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
-  if (ret < 0)
+      // All segments are full size, except the last one which is shorter and
+      // maybe empty. That is how cache_xcode_segment_read() finds the end.
+      len = MIN(evbuffer_get_length(evbuf), CACHE_XCODE_SEGMENT_SIZE);
+      if (xcode_segment_write(job, segment, evbuf, len) < 0)
+	goto error;
+
+      segment++;
+    }
+  while (len == CACHE_XCODE_SEGMENT_SIZE);
+
+  // Marks that all segments are there
+  if (xcode_segment_path(path, sizeof(path), job->file_id, job->time_modified, job->profile, job->bit_rate, "done") < 0)
     goto error;
 
-  cmdarg->cached = 1;
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0)
+    close(fd);
 
-  DPRINTF(E_DBG, L_CACHE, "Cache header hit (%zu bytes)\n", evbuffer_get_length(cmdarg->evbuf));
+  DPRINTF(E_DBG, L_CACHE, "Prefetched %d transcoding segments for '%s' (file id %" PRIu32 ")\n", segment, job->file_path, job->file_id);
 
- end:
-  sqlite3_finalize(stmt);
-  *retval = 0;
-  return COMMAND_END;
+  evbuffer_free(evbuf);
+  transcode_cleanup(&xcode);
+  event_active(job->ev, 0, 0);
+  return;
 
  error:
-  DPRINTF(E_LOG, L_CACHE, "Database error getting prepared header from cache: %s\n", sqlite3_errmsg(cmdarg->hdl));
-  if (stmt)
-    sqlite3_finalize(stmt);
-  *retval = -1;
-  return COMMAND_END;
-#undef Q_TMPL
+  DPRINTF(E_LOG, L_CACHE, "Error prefetching transcoding segments for '%s' (file id %" PRIu32 ")\n", job->file_path, job->file_id);
+  if (evbuf)
+    evbuffer_free(evbuf);
+  transcode_cleanup(&xcode);
+  event_active(job->ev, 0, 0);
 }
 
 static void
-xcode_trigger(void)
-{
-  struct timeval delay_xcode = { 5, 0 };
-
-  if (cache_xcode_is_enabled)
-    event_add(cache_xcode_updateev, &delay_xcode);
-}
-
-static enum command_state
-xcode_toggle(void *arg, int *retval)
+cache_xcode_segments_job_complete_cb(int fd, short what, void *arg)
 {
-  bool *enable = arg;
+  struct cache_xcode_segments_job *job = arg;
 
-  if (*enable == cache_xcode_is_enabled)
-    goto end;
-
-  cache_xcode_is_enabled = *enable;
-  xcode_trigger();
+  free(job->file_path);
+  job->file_path = NULL;
+  job->is_encoding = false;
 
- end:
-  *retval = 0;
-  return COMMAND_END;
+  event_active(cache_xcode_segments_purgeev, 0, 0);
 }
 
-static int
-xcode_add_entry(sqlite3 *hdl, uint32_t id, uint32_t ts, const char *path)
+static enum command_state
+xcode_segments_prefetch(void *arg, int *retval)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO files (id, time_modified, filepath) VALUES (%d, %d, '%q');"
-  char *query;
-  char *errmsg;
+  struct cache_arg *cmdarg = arg;
+  struct cache_xcode_segments_job *job = NULL;
+  char path[PATH_MAX];
   int ret;
+  int i;
 
-  DPRINTF(E_SPAM, L_CACHE, "Adding xcode file id %d, path '%s'\n", id, path);
-
-  query = sqlite3_mprintf(Q_TMPL, id, ts, path);
-
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  for (i = 0; i < ARRAY_SIZE(cache_xcode_segments_jobs); i++)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error adding row to cache: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return -1;
-    }
-
-  return 0;
-#undef Q_TMPL
-}
+      if (!cache_xcode_segments_jobs[i].is_encoding)
+	{
+	  job = job ? job : &cache_xcode_segments_jobs[i];
+	  continue;
+	}
 
-static int
-xcode_del_entry(sqlite3 *hdl, uint32_t id)
-{
-#define Q_TMPL_FILES "DELETE FROM files WHERE id = %d;"
-#define Q_TMPL_DATA "DELETE FROM data WHERE file_id = %d;"
-  char query[256];
-  char *errmsg;
-  int ret;
+      if (cache_xcode_segments_jobs[i].file_id == cmdarg->id && cache_xcode_segments_jobs[i].profile == cmdarg->xcode_profile &&
+	  cache_xcode_segments_jobs[i].bit_rate == cmdarg->bit_rate)
+	goto end; // Already being prefetched
+    }
 
-  DPRINTF(E_SPAM, L_CACHE, "Deleting xcode file id %d\n", id);
+  ret = xcode_segment_path(path, sizeof(path), cmdarg->id, cmdarg->mtime, cmdarg->xcode_profile, cmdarg->bit_rate, "done");
+  if (ret < 0 || access(path, F_OK) == 0)
+    goto end; // Error or all segments already there
 
-  sqlite3_snprintf(sizeof(query), query, Q_TMPL_FILES, (int)id);
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  if (!job)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting row from xcode files: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return -1;
+      DPRINTF(E_DBG, L_CACHE, "No free thread for prefetching transcoding segments for file id %" PRIu32 "\n", cmdarg->id);
+      goto end;
     }
 
-  sqlite3_snprintf(sizeof(query), query, Q_TMPL_DATA, (int)id);
-  ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  ret = snprintf(path, sizeof(path), "%s%" PRIu32 "-%" PRIu32, cache_xcode_segments_path, cmdarg->id, (uint32_t)cmdarg->mtime);
+  if ((ret < 0) || (ret >= sizeof(path)) || (mkdir(path, 0755) < 0 && errno != EEXIST))
     {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting rows from xcode_data: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return -1;
+      DPRINTF(E_LOG, L_CACHE, "Could not create directory for transcoding segments for file id %" PRIu32 "\n", cmdarg->id);
+      goto end;
     }
 
-  return 0;
-#undef Q_TMPL_DATA
-#undef Q_TMPL_FILES
+  job->file_id = cmdarg->id;
+  job->time_modified = cmdarg->mtime;
+  job->len_ms = cmdarg->len_ms;
+  job->profile = cmdarg->xcode_profile;
+  job->bit_rate = cmdarg->bit_rate;
+  job->file_path = cmdarg->pathcopy;
+  job->is_encoding = true;
+
+  cmdarg->pathcopy = NULL; // Now owned by the job
+
+  // Runs on the low priority pool, so it doesn't compete with the streaming
+  // and playback that use the general worker threads
+  evthr_pool_defer(cache_xcode_threadpool, xcode_segments_worker, job);
+
+ end:
+  free(cmdarg->pathcopy);
+  *retval = 0;
+  return COMMAND_END;
 }
 
-/* In the xcode table we keep a prepared header for files that could be subject
- * to transcoding. Whenever the library changes, this callback runs, and the
- * list of files in the xcode table is synced with the main files table.
- *
- * In practice we compare two tables, both sorted by id:
- *
- * From files:                         From the cache
- *  | id      |  time_modified  |       | id       | time_modified | data    |
- *
- * We do it one item at the time from files, and then going through cache table
- * rows until: table end OR id is larger OR id is equal and time equal or newer
- */
 static int
-xcode_sync_with_files(sqlite3 *hdl)
+xcode_segments_dir_compare(const void *a, const void *b)
 {
-  sqlite3_stmt *stmt;
-  struct cachelist *cachelist = NULL;
-  size_t cachelist_size = 0;
-  size_t cachelist_len = 0;
-  struct query_params qp = { .type = Q_ITEMS, .filter = "f.data_kind = 0", .order = "f.id" };
-  struct db_media_file_info dbmfi;
-  struct db_media_file_info *rowA;
-  struct cachelist *rowB;
-  uint32_t id;
-  uint32_t ts;
-  int cmp;
-  int i;
+  const struct cache_xcode_segments_dir *dir_a = a;
+  const struct cache_xcode_segments_dir *dir_b = b;
+
+  return (dir_a->mtime > dir_b->mtime) - (dir_a->mtime < dir_b->mtime);
+}
+
+static off_t
+xcode_segments_dir_size(const char *dirname)
+{
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char path[PATH_MAX];
+  off_t size = 0;
   int ret;
 
-  // Both lists must be sorted by id, otherwise the compare below won't work
-  ret = sqlite3_prepare_v2(hdl, "SELECT id, time_modified FROM files ORDER BY id;", -1, &stmt, 0);
-  if (ret != SQLITE_OK)
-    goto error;
+  ret = snprintf(path, sizeof(path), "%s%s", cache_xcode_segments_path, dirname);
+  if ((ret < 0) || (ret >= sizeof(path)))
+    return 0;
 
-  while (sqlite3_step(stmt) == SQLITE_ROW)
+  dir = opendir(path);
+  if (!dir)
+    return 0;
+
+  while ((de = readdir(dir)))
     {
-      if (cachelist_len + 1 > cachelist_size)
-	{
-	  cachelist_size += 1024;
-	  CHECK_NULL(L_CACHE, cachelist = realloc(cachelist, cachelist_size * sizeof(struct cachelist)));
-	}
-      cachelist[cachelist_len].id = sqlite3_column_int(stmt, 0);
-      cachelist[cachelist_len].ts = sqlite3_column_int(stmt, 1);
-      cachelist_len++;
+      ret = snprintf(path, sizeof(path), "%s%s/%s", cache_xcode_segments_path, dirname, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)) || (de->d_name[0] == '.'))
+	continue;
+
+      if (stat(path, &sb) == 0)
+	size += sb.st_size;
     }
-  sqlite3_finalize(stmt);
 
-  ret = db_query_start(&qp);
-  if (ret < 0)
-    goto error;
+  closedir(dir);
+  return size;
+}
 
-  // Silence false maybe-uninitialized warning
-  rowB = NULL;
+/* Removes segments of files that have been modified or removed from the
+ * library, and then removes the oldest segments until we are below the size
+ * limit. Segments that are being written by a prefetch job are left alone.
+ */
+static void
+cache_xcode_segments_purge_cb(int fd, short what, void *arg)
+{
+  struct cache_xcode_segments_dir *dirs = NULL;
+  struct cache_xcode_segments_dir *d;
+  struct media_file_info *mfi;
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char dirname[64];
+  char path[PATH_MAX];
+  size_t dirs_size = 0;
+  size_t dirs_len = 0;
+  off_t total = 0;
+  uint32_t id;
+  uint32_t time_modified;
+  bool is_encoding;
+  int i;
+  int j;
 
-  // Loop while either list ("A" files list, "B" cache list) has remaining items
-  for(i = 0, cmp = 0;;)
+  dir = opendir(cache_xcode_segments_path);
+  if (!dir)
+    return;
+
+  while ((de = readdir(dir)))
     {
-      if (cmp <= 0)
-        rowA = (db_query_fetch_file(&dbmfi, &qp) == 0) ? &dbmfi : NULL;;
-      if (cmp >= 0)
-        rowB = (i < cachelist_len) ? &cachelist[i++] : NULL;
-      if (!rowA && !rowB)
-        break; // Done with both lists
+      if (sscanf(de->d_name, "%" SCNu32 "-%" SCNu32, &id, &time_modified) != 2)
+	continue;
 
-#if 0
-      if (rowA)
-	DPRINTF(E_DBG, L_CACHE, "cmp %d, rowA->id %s\n", cmp, rowA->id);
-      if (rowB)
-	DPRINTF(E_DBG, L_CACHE, "cmp %d, rowB->id %u, i %d, cachelist_len %zu\n", cmp, rowB->id, i, cachelist_len);
-#endif
+      for (i = 0, is_encoding = false; i < ARRAY_SIZE(cache_xcode_segments_jobs); i++)
+	is_encoding |= (cache_xcode_segments_jobs[i].is_encoding && cache_xcode_segments_jobs[i].file_id == id);
+      if (is_encoding)
+	continue;
 
-      if (rowA)
+      mfi = db_file_fetch_byid(id);
+      if (!mfi || mfi->time_modified != time_modified)
 	{
-	  safe_atou32(rowA->id, &id);
-	  safe_atou32(rowA->time_modified, &ts);
+	  DPRINTF(E_DBG, L_CACHE, "Removing outdated transcoding segments for file id %" PRIu32 "\n", id);
+	  xcode_segment_dir_remove(de->d_name);
+	  free_mfi(mfi, 0);
+	  continue;
 	}
+      free_mfi(mfi, 0);
 
-      cmp = 0; // In both lists - unless:
-      if (!rowB || (rowA && rowB->id > id)) // A had an item not in B
-	{
-	  xcode_add_entry(hdl, id, ts, rowA->path);
-	  cmp = -1;
-	}
-      else if (!rowA || (rowB && rowB->id < id)) // B had an item not in A
-	{
-	  xcode_del_entry(hdl, rowB->id);
-	  cmp = 1;
-	}
-      else if (rowB->id == id && rowB->ts < ts) // Item in B is too old
+      snprintf(path, sizeof(path), "%s%s", cache_xcode_segments_path, de->d_name);
+      if (stat(path, &sb) < 0)
+	continue;
+
+      if (dirs_len + 1 > dirs_size)
 	{
-	  xcode_del_entry(hdl, rowB->id);
-	  xcode_add_entry(hdl, id, ts, rowA->path);
+	  dirs_size += 64;
+	  CHECK_NULL(L_CACHE, dirs = realloc(dirs, dirs_size * sizeof(struct cache_xcode_segments_dir)));
 	}
+
+      d = &dirs[dirs_len++];
+      d->file_id = id;
+      d->time_modified = time_modified;
+      d->mtime = sb.st_mtime;
+      d->size = xcode_segments_dir_size(de->d_name);
+      total += d->size;
     }
 
-  db_query_end(&qp);
+  closedir(dir);
 
-  free(cachelist);
-  return 0;
+  if (total > cache_xcode_segments_max)
+    qsort(dirs, dirs_len, sizeof(struct cache_xcode_segments_dir), xcode_segments_dir_compare);
 
- error:
-  DPRINTF(E_LOG, L_CACHE, "Database error while processing xcode files table\n");
-  free(cachelist);
-  return -1;
+  for (j = 0; j < dirs_len && total > cache_xcode_segments_max; j++)
+    {
+      snprintf(dirname, sizeof(dirname), "%" PRIu32 "-%" PRIu32, dirs[j].file_id, dirs[j].time_modified);
+
+      DPRINTF(E_DBG, L_CACHE, "Removing transcoding segments for file id %" PRIu32 " to free up space\n", dirs[j].file_id);
+      xcode_segment_dir_remove(dirname);
+      total -= dirs[j].size;
+    }
+
+  free(dirs);
 }
 
-static int
-xcode_header_save(sqlite3 *hdl, int file_id, const char *format, uint8_t *data, size_t datalen)
+
+/* Sets off an update by activating the event. The delay is because we are low
+ * priority compared to other listeners of database updates. The DAAP replies
+ * that are affected by the change are dropped right away, so they won't be
+ * served stale while we wait.
+ */
+static enum command_state
+cache_database_update(void *arg, int *retval)
 {
-#define Q_TMPL "INSERT INTO data (timestamp, file_id, format, header) VALUES (?, ?, ?, ?);"
-  sqlite3_stmt *stmt;
-  int ret;
+  struct cache_arg *cmdarg = arg;
+  struct timeval delay_daap = { 10, 0 };
+  struct timeval delay_segments = { 60, 0 };
+  int deps;
 
-  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  deps = 0;
+  if (cmdarg->event_mask & LISTENER_DATABASE)
+    deps |= CACHE_DAAP_DEP_FILES;
+  if (cmdarg->event_mask & LISTENER_STORED_PLAYLIST)
+    deps |= CACHE_DAAP_DEP_PLAYLISTS;
+  if (cmdarg->event_mask & LISTENER_RATING)
+    deps |= CACHE_DAAP_DEP_RATING;
+
+  if (cache_daap_threshold > 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing xcode data for cache update: %s\n", sqlite3_errmsg(hdl));
-      return -1;
+      cache_daap_invalidate(cache_daap_hdl, deps);
+      event_add(cache_daap_updateev, &delay_daap);
     }
 
-  sqlite3_bind_int(stmt, 1, (uint64_t)time(NULL));
-  sqlite3_bind_int(stmt, 2, file_id);
-  sqlite3_bind_text(stmt, 3, format, -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 4, data, datalen, SQLITE_STATIC);
+// TODO unlink or rename cache.db
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_DONE)
+  if (cmdarg->event_mask & LISTENER_DATABASE)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error stepping xcode data for cache update: %s\n", sqlite3_errmsg(hdl));
-      return -1;
+      xcode_trigger();
+
+      if (cache_xcode_segments_max > 0)
+	event_add(cache_xcode_segments_purgeev, &delay_segments);
     }
 
-  sqlite3_finalize(stmt);
-  return 0;
-#undef Q_TMPL
+  *retval = 0;
+  return COMMAND_END;
 }
 
-static int
-xcode_file_next(int *file_id, char **file_path, sqlite3 *hdl, const char *format)
+/* Callback from filescanner thread */
+static void
+cache_daap_listener_cb(short event_mask)
 {
-#define Q_TMPL "SELECT f.id, f.filepath, d.id FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL LIMIT 1;"
-  sqlite3_stmt *stmt;
-  char query[256];
-  int ret;
-
-  sqlite3_snprintf(sizeof(query), query, Q_TMPL, format);
+  struct cache_arg *cmdarg;
 
-  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error occured while finding next file to prepare header for\n");
-      return -1;
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
     }
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)
+  cmdarg->event_mask = event_mask;
+
+  commands_exec_async(cmdbase, cache_database_update, cmdarg);
+}
+
+/* Callback from player thread (must not block) */
+static void
+cache_player_listener_cb(short event_mask)
+{
+  struct cache_arg *cmdarg;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
     {
-      sqlite3_finalize(stmt);
-      return -1; // All done
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
     }
 
-  *file_id = sqlite3_column_int(stmt, 0);
-  *file_path = strdup((char *)sqlite3_column_text(stmt, 1));
-
-  sqlite3_finalize(stmt);
+  // We are in the player thread, so player_get_status() would deadlock
+  cmdarg->play_status = player_state_get();
 
-  // Save an empty header so next call to this function will return a new file
-  return xcode_header_save(hdl, *file_id, format, NULL, 0);
-#undef Q_TMPL
+  commands_exec_async(cmdbase, xcode_player_update, cmdarg);
 }
 
-// Thread: worker
-static void
-xcode_worker(void *arg)
+
+/* ------------------------- Artwork content store -------------------------- */
+
+// The hash is the 64 bit murmur hash of the image followed by its length. If
+// data is NULL the path is made from an existing hash.
+static int
+artwork_blob_path(char *path, size_t size, char *hash, size_t hash_size, const uint8_t *data, size_t len)
 {
-  struct cache_xcode_job *job = *(struct cache_xcode_job **)arg;
   int ret;
 
-  DPRINTF(E_DBG, L_CACHE, "Preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
-
-  if (strcmp(job->format, CACHE_XCODE_FORMAT_MP4) == 0)
+  if (data)
     {
-      ret = transcode_prepare_header(&job->header, XCODE_MP4_ALAC, job->file_path);
-      if (ret < 0)
-	DPRINTF(E_LOG, L_CACHE, "Error preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
+      ret = snprintf(hash, hash_size, "%016" PRIx64 "%08zx", murmur_hash64(data, len, 0), len);
+      if (ret < 0 || ret >= hash_size)
+	return -1;
     }
 
-  // Tell the cache thread that we are done. Only the cache thread can save the
-  // result to the DB.
-  event_active(job->ev, 0, 0);
+  if (cache_artwork_blobs_path[0] == '\0' || strlen(hash) < 2 || strchr(hash, '/'))
+    return -1;
+
+  ret = snprintf(path, size, "%s%.2s/%s", cache_artwork_blobs_path, hash, hash);
+  if (ret < 0 || ret >= size)
+    return -1;
+
+  return 0;
 }
 
-static void
-cache_xcode_job_complete_cb(int fd, short what, void *arg)
+/* Writes the image in evbuf to the store, unless an identical image is already
+ * there, and sets hash to its key.
+ */
+static int
+artwork_blob_write(char *hash, size_t hash_size, struct evbuffer *evbuf)
 {
-  struct cache_xcode_job *job = arg;
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  char *ptr;
   uint8_t *data;
-  size_t datalen;
+  size_t len;
+  int fd;
+  int ret;
 
-  if (job->header)
+  len = evbuffer_get_length(evbuf);
+  data = evbuffer_pullup(evbuf, -1);
+
+  ret = artwork_blob_path(path, sizeof(path), hash, hash_size, data, len);
+  if (ret < 0)
+    return -1;
+
+  if (access(path, F_OK) == 0)
+    return 0;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s", path);
+  ptr = strrchr(tmp_path, '/');
+  *ptr = '\0';
+  if (mkdir(tmp_path, 0755) < 0 && errno != EEXIST)
     {
-#if 1
-      datalen = evbuffer_get_length(job->header);
-      data = evbuffer_pullup(job->header, -1);
-#else
-      data = (unsigned char*)"dummy";
-      datalen = 6;
-#endif
-      xcode_header_save(cache_xcode_hdl, job->file_id, job->format, data, datalen);
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork cache directory '%s': %s\n", tmp_path, strerror(errno));
+      return -1;
     }
 
-  xcode_job_clear(job); // Makes the job available again
-  event_active(cache_xcode_prepareev, 0, 0);
-}
+  // Written to a temporary file first so a reader never sees a partial image
+  ret = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  if (ret < 0 || ret >= sizeof(tmp_path))
+    return -1;
 
-// Preparing headers can take very long, so we use worker threads. However, all
-// DB access must be from the cache thread. So this function will find the next
-// file from the db and then dispatch a thread for the encoding.
-static void
-cache_xcode_prepare_cb(int fd, short what, void *arg)
-{
-  struct cache_xcode_job *job = NULL;
-  bool is_encoding = false;
-  int ret;
-  int i;
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork cache file '%s': %s\n", tmp_path, strerror(errno));
+      return -1;
+    }
 
-  if (!cache_is_initialized)
-    return;
+  if (write(fd, data, len) != len)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error writing artwork cache file '%s': %s\n", tmp_path, strerror(errno));
+      close(fd);
+      unlink(tmp_path);
+      return -1;
+    }
 
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
+  close(fd);
+
+  if (rename(tmp_path, path) < 0)
     {
-      if (cache_xcode_jobs[i].is_encoding)
-	is_encoding = true;
-      else if (!job)
-	job = &cache_xcode_jobs[i];
+      DPRINTF(E_LOG, L_CACHE, "Could not rename artwork cache file to '%s': %s\n", path, strerror(errno));
+      unlink(tmp_path);
+      return -1;
     }
 
-  if (!job)
-    return; // No available thread right now, wait for cache_xcode_job_complete_cb()
+  return 0;
+}
 
-  ret = xcode_file_next(&job->file_id, &job->file_path, cache_xcode_hdl, CACHE_XCODE_FORMAT_MP4);
+static int
+artwork_blob_read(struct evbuffer *evbuf, char *hash)
+{
+  struct evbuffer_iovec iov;
+  struct stat sb;
+  char path[PATH_MAX];
+  ssize_t got;
+  int fd;
+  int ret;
+
+  ret = artwork_blob_path(path, sizeof(path), hash, 0, NULL, 0);
   if (ret < 0)
-    {
-      if (!is_encoding)
-	DPRINTF(E_LOG, L_CACHE, "Header generation completed\n");
+    return -1;
 
-      return;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      DPRINTF(E_WARN, L_CACHE, "Could not open artwork cache file '%s': %s\n", path, strerror(errno));
+      return -1;
     }
-  else if (!is_encoding)
-    DPRINTF(E_LOG, L_CACHE, "Kicking off header generation\n");
 
-  job->is_encoding = true;
-  job->format = CACHE_XCODE_FORMAT_MP4;
+  if (fstat(fd, &sb) < 0 || sb.st_size == 0 || evbuffer_reserve_space(evbuf, sb.st_size, &iov, 1) < 1)
+    goto error;
+
+  got = read(fd, iov.iov_base, sb.st_size);
+  if (got != sb.st_size)
+    goto error;
+
+  iov.iov_len = got;
+  if (evbuffer_commit_space(evbuf, &iov, 1) < 0)
+    goto error;
 
-  worker_execute(xcode_worker, &job, sizeof(struct cache_xcode_job *), 0);
+  close(fd);
+  return 0;
 
-  // Set off more threads
-  event_active(cache_xcode_prepareev, 0, 0);
+ error:
+  DPRINTF(E_LOG, L_CACHE, "Error reading artwork cache file '%s'\n", path);
+  close(fd);
+  return -1;
 }
 
+/* Removes the images that no row in the artwork table refers to */
 static void
-cache_xcode_update_cb(int fd, short what, void *arg)
+artwork_blobs_purge(sqlite3 *hdl)
 {
-  if (xcode_sync_with_files(cache_xcode_hdl) < 0)
+  sqlite3_stmt *stmt;
+  DIR *topdir;
+  DIR *subdir;
+  struct dirent *dt;
+  struct dirent *de;
+  char path[PATH_MAX];
+  int removed;
+  int ret;
+
+  topdir = opendir(cache_artwork_blobs_path);
+  if (!topdir)
     return;
 
-  event_active(cache_xcode_prepareev, 0, 0);
-}
+  ret = sqlite3_prepare_v2(hdl, "SELECT 1 FROM artwork WHERE hash = ? LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      closedir(topdir);
+      return;
+    }
 
-/* Sets off an update by activating the event. The delay is because we are low
- * priority compared to other listeners of database updates.
- */
-static enum command_state
-cache_database_update(void *arg, int *retval)
-{
-  struct timeval delay_daap = { 10, 0 };
+  removed = 0;
+  while ((dt = readdir(topdir)))
+    {
+      if (dt->d_name[0] == '.')
+	continue;
 
-  event_add(cache_daap_updateev, &delay_daap);
+      snprintf(path, sizeof(path), "%s%s", cache_artwork_blobs_path, dt->d_name);
+      subdir = opendir(path);
+      if (!subdir)
+	continue;
 
-// TODO unlink or rename cache.db
+      while ((de = readdir(subdir)))
+	{
+	  if (de->d_name[0] == '.')
+	    continue;
 
-  xcode_trigger();
+	  sqlite3_reset(stmt);
+	  sqlite3_bind_text(stmt, 1, de->d_name, -1, SQLITE_STATIC);
+	  if (sqlite3_step(stmt) == SQLITE_ROW)
+	    continue;
 
-  *retval = 0;
-  return COMMAND_END;
-}
+	  snprintf(path, sizeof(path), "%s%s/%s", cache_artwork_blobs_path, dt->d_name, de->d_name);
+	  if (unlink(path) == 0)
+	    removed++;
+	}
 
-/* Callback from filescanner thread */
-static void
-cache_daap_listener_cb(short event_mask)
-{
-  commands_exec_async(cmdbase, cache_database_update, NULL);
-}
+      closedir(subdir);
+    }
+
+  sqlite3_finalize(stmt);
+  closedir(topdir);
 
+  DPRINTF(E_DBG, L_CACHE, "Removed %d unused images from the artwork cache\n", removed);
+}
 
 /*
  * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
@@ -1448,6 +2954,8 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Purged %d rows\n", sqlite3_changes(cmdarg->hdl));
 
+  artwork_blobs_purge(cmdarg->hdl);
+
   *retval = 0;
   return COMMAND_END;
 
@@ -1468,14 +2976,47 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 static enum command_state
 cache_artwork_add_impl(void *arg, int *retval)
 {
+#define Q_TMPL_DEL "DELETE FROM artwork WHERE type = %d AND persistentid = %" PRIi64 " AND max_w = %d AND max_h = %d;"
   struct cache_arg *cmdarg = arg;
   sqlite3_stmt *stmt;
   char *query;
-  uint8_t *data;
-  int datalen;
+  char *errmsg;
+  char hash[32];
   int ret;
 
-  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
+  // An entry without an image records that there is no artwork
+  hash[0] = '\0';
+  if (cmdarg->format > 0 && evbuffer_get_length(cmdarg->evbuf) > 0)
+    {
+      ret = artwork_blob_write(hash, sizeof(hash), cmdarg->evbuf);
+      if (ret < 0)
+	{
+	  *retval = -1;
+	  return COMMAND_END;
+	}
+    }
+
+  // Replaces any earlier entry, e.g. one whose image has gone missing from the
+  // store. Its image is removed by the next purge if nothing else uses it.
+  query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting old artwork cache entry: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, hash, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
 
   ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
   if (ret != SQLITE_OK)
@@ -1485,16 +3026,16 @@ cache_artwork_add_impl(void *arg, int *retval)
       return COMMAND_END;
     }
 
-  datalen = evbuffer_get_length(cmdarg->evbuf);
-  data = evbuffer_pullup(cmdarg->evbuf, -1);
-
   sqlite3_bind_int64(stmt, 1, cmdarg->persistentid);
   sqlite3_bind_int(stmt, 2, cmdarg->max_w);
   sqlite3_bind_int(stmt, 3, cmdarg->max_h);
   sqlite3_bind_int(stmt, 4, cmdarg->format);
   sqlite3_bind_text(stmt, 5, cmdarg->path, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 6, (uint64_t)time(NULL));
-  sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
+  if (hash[0] != '\0')
+    sqlite3_bind_text(stmt, 7, hash, -1, SQLITE_STATIC);
+  else
+    sqlite3_bind_null(stmt, 7);
   sqlite3_bind_int(stmt, 8, cmdarg->type);
 
   ret = sqlite3_step(stmt);
@@ -1516,6 +3057,7 @@ cache_artwork_add_impl(void *arg, int *retval)
 
   *retval = 0;
   return COMMAND_END;
+#undef Q_TMPL_DEL
 }
 
 /*
@@ -1536,11 +3078,11 @@ cache_artwork_add_impl(void *arg, int *retval)
 static enum command_state
 cache_artwork_get_impl(void *arg, int *retval)
 {
-#define Q_TMPL "SELECT a.format, a.data FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
+#define Q_TMPL "SELECT a.format, a.hash FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
   struct cache_arg *cmdarg = arg;
   sqlite3_stmt *stmt;
   char *query;
-  int datalen;
+  char *hash;
   int ret;
 
   query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
@@ -1581,7 +3123,6 @@ cache_artwork_get_impl(void *arg, int *retval)
     }
 
   cmdarg->format = sqlite3_column_int(stmt, 0);
-  datalen = sqlite3_column_bytes(stmt, 1);
   if (!cmdarg->evbuf)
     {
       DPRINTF(E_LOG, L_CACHE, "Error: Artwork evbuffer is NULL\n");
@@ -1589,11 +3130,12 @@ cache_artwork_get_impl(void *arg, int *retval)
       goto error_get;
     }
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 1), datalen);
-  if (ret < 0)
+  // If the image has gone missing from the store it is just a cache miss
+  hash = (char *)sqlite3_column_text(stmt, 1);
+  if (hash && artwork_blob_read(cmdarg->evbuf, hash) < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork evbuffer\n");
-      ret = -1;
+      cmdarg->cached = 0;
+      ret = 0;
       goto error_get;
     }
 
@@ -1619,6 +3161,88 @@ cache_artwork_get_impl(void *arg, int *retval)
 #undef Q_TMPL
 }
 
+/*
+ * Gets the cached artwork for a number of persistentids with one query
+ *
+ * @param cmdarg->type individual or group artwork
+ * @param cmdarg->persistentids persistent itemids, songalbumids or songartistids
+ * @param cmdarg->nitems number of persistentids
+ * @param cmdarg->max_w maximum image width
+ * @param cmdarg->max_h maximum image height
+ * @param cmdarg->formats set by this function to the format of each cache entry, or -1 if there is none
+ * @param cmdarg->evbufs event buffers filled by this function with the scaled images
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_get_batch_impl(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT a.persistentid, a.format, a.hash FROM artwork a WHERE a.type = %d AND a.persistentid IN (%s) AND a.max_w = %d AND a.max_h = %d;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  struct evbuffer *ids;
+  char *query;
+  char *hash;
+  int64_t persistentid;
+  int format;
+  int ret;
+  int i;
+
+  for (i = 0; i < cmdarg->nitems; i++)
+    cmdarg->formats[i] = -1;
+
+  CHECK_NULL(L_CACHE, ids = evbuffer_new());
+  for (i = 0; i < cmdarg->nitems; i++)
+    evbuffer_add_printf(ids, "%s%" PRIi64, (i == 0) ? "" : ",", cmdarg->persistentids[i]);
+  evbuffer_add(ids, "", 1);
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, (char *)evbuffer_pullup(ids, -1), cmdarg->max_w, cmdarg->max_h);
+  evbuffer_free(ids);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      sqlite3_free(query);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      persistentid = sqlite3_column_int64(stmt, 0);
+      format = sqlite3_column_int(stmt, 1);
+      hash = (char *)sqlite3_column_text(stmt, 2);
+
+      // The same id may have been requested more than once
+      for (i = 0; i < cmdarg->nitems; i++)
+	{
+	  if (cmdarg->persistentids[i] != persistentid || cmdarg->formats[i] >= 0)
+	    continue;
+
+	  if (hash && artwork_blob_read(cmdarg->evbufs[i], hash) < 0)
+	    continue;
+
+	  cmdarg->formats[i] = format;
+	}
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(cmdarg->hdl));
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  *retval = (ret == SQLITE_DONE) ? 0 : -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
 static enum command_state
 cache_artwork_stash_impl(void *arg, int *retval)
 {
@@ -1684,6 +3308,25 @@ cache_artwork_read_impl(void *arg, int *retval)
   return COMMAND_END;
 }
 
+// Thread: xcode
+static void
+xcode_thread_init_cb(struct evthr *thr, void *shared)
+{
+#ifdef __linux__
+  struct sched_param param;
+  int ret;
+
+  // Header generation is a background task, so only use the CPU when nothing
+  // else wants it. Param must be 0 for the SCHED_IDLE policy.
+  memset(&param, 0, sizeof(struct sched_param));
+  ret = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_CACHE, "Warning: Could not set thread priority to SCHED_IDLE\n");
+#endif
+
+  thread_setname(pthread_self(), "xcode");
+}
+
 static void *
 cache(void *arg)
 {
@@ -1709,13 +3352,21 @@ cache(void *arg)
     }
 
   CHECK_NULL(L_CACHE, cache_daap_updateev = evtimer_new(evbase_cache, cache_daap_update_cb, NULL));
+  CHECK_NULL(L_CACHE, cache_daap_snapshot_retryev = evtimer_new(evbase_cache, daap_snapshot_retry_cb, NULL));
   CHECK_NULL(L_CACHE, cache_xcode_updateev = evtimer_new(evbase_cache, cache_xcode_update_cb, NULL));
   CHECK_NULL(L_CACHE, cache_xcode_prepareev = evtimer_new(evbase_cache, cache_xcode_prepare_cb, NULL));
   CHECK_ERR(L_CACHE, event_priority_set(cache_xcode_prepareev, 0));
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
+  for (i = 0; i < cache_xcode_nthreads; i++)
     CHECK_NULL(L_CACHE, cache_xcode_jobs[i].ev = evtimer_new(evbase_cache, cache_xcode_job_complete_cb, &cache_xcode_jobs[i]));
+  CHECK_NULL(L_CACHE, cache_xcode_segments_purgeev = evtimer_new(evbase_cache, cache_xcode_segments_purge_cb, NULL));
+  for (i = 0; i < ARRAY_SIZE(cache_xcode_segments_jobs); i++)
+    CHECK_NULL(L_CACHE, cache_xcode_segments_jobs[i].ev = evtimer_new(evbase_cache, cache_xcode_segments_job_complete_cb, &cache_xcode_segments_jobs[i]));
 
-  CHECK_ERR(L_CACHE, listener_add(cache_daap_listener_cb, LISTENER_DATABASE));
+  if (cache_xcode_segments_max > 0)
+    event_active(cache_xcode_segments_purgeev, 0, 0);
+
+  CHECK_ERR(L_CACHE, listener_add(cache_daap_listener_cb, LISTENER_DATABASE | LISTENER_STORED_PLAYLIST | LISTENER_RATING));
+  CHECK_ERR(L_CACHE, listener_add(cache_player_listener_cb, LISTENER_PLAYER));
 
   cache_is_initialized = 1;
 
@@ -1727,13 +3378,20 @@ cache(void *arg)
       cache_is_initialized = 0;
     }
 
+  listener_remove(cache_player_listener_cb);
   listener_remove(cache_daap_listener_cb);
 
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
+  for (i = 0; i < ARRAY_SIZE(cache_xcode_segments_jobs); i++)
+    event_free(cache_xcode_segments_jobs[i].ev);
+  event_free(cache_xcode_segments_purgeev);
+  for (i = 0; i < cache_xcode_nthreads; i++)
     event_free(cache_xcode_jobs[i].ev);
   event_free(cache_xcode_prepareev);
   event_free(cache_xcode_updateev);
+  event_free(cache_daap_snapshot_retryev);
   event_free(cache_daap_updateev);
+  free(cache_daap_snapshot_retry_query);
+  cache_daap_snapshot_retry_query = NULL;
 
   db_perthread_deinit();
 
@@ -1768,12 +3426,33 @@ int
 cache_daap_get(struct evbuffer *evbuf, const char *query)
 {
   struct cache_arg cmdarg;
+  char *key;
 
-  if (!cache_is_initialized)
+  if (!cache_is_initialized || cache_daap_threshold == 0)
     return -1;
 
+  CHECK_NULL(L_CACHE, key = strdup(query));
+  remove_tag(key, "session-id");
+  remove_tag(key, "revision-number");
+
+  if (daap_snapshot_get(evbuf, key) == 0)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Snapshot cache hit: %s\n", key);
+      __atomic_add_fetch(&cache_daap_stats.snapshot_hits, 1, __ATOMIC_RELAXED);
+      free(key);
+      return 0;
+    }
+
+  if (daap_mem_get(evbuf, key) == 0)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Memory cache hit: %s\n", key);
+      __atomic_add_fetch(&cache_daap_stats.mem_hits, 1, __ATOMIC_RELAXED);
+      free(key);
+      return 0;
+    }
+
   cmdarg.hdl = cache_daap_hdl;
-  cmdarg.query = strdup(query);
+  cmdarg.query = key;
   cmdarg.evbuf = evbuf;
 
   return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
@@ -1784,7 +3463,7 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec)
 {
   struct cache_arg *cmdarg;
 
-  if (!cache_is_initialized)
+  if (!cache_is_initialized || cache_daap_threshold == 0)
     return;
 
   cmdarg = calloc(1, sizeof(struct cache_arg));
@@ -1809,6 +3488,38 @@ cache_daap_threshold_get(void)
   return cache_daap_threshold;
 }
 
+int
+cache_daap_stats_get(struct cache_daap_stats *stats)
+{
+  struct cache_daap_mem_shard *shard;
+  struct cache_daap_mem_entry *entry;
+  int i;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  memset(stats, 0, sizeof(struct cache_daap_stats));
+
+  stats->snapshot_hits = __atomic_load_n(&cache_daap_stats.snapshot_hits, __ATOMIC_RELAXED);
+  stats->mem_hits = __atomic_load_n(&cache_daap_stats.mem_hits, __ATOMIC_RELAXED);
+  stats->db_hits = __atomic_load_n(&cache_daap_stats.db_hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&cache_daap_stats.misses, __ATOMIC_RELAXED);
+  stats->mem_size_max = cache_daap_mem_size_max;
+
+  for (i = 0; i < CACHE_DAAP_MEM_SHARDS; i++)
+    {
+      shard = &cache_daap_mem[i];
+
+      CHECK_ERR(L_CACHE, pthread_rwlock_rdlock(&shard->lck));
+      for (entry = shard->head; entry; entry = entry->next)
+	stats->mem_entries++;
+      stats->mem_size += shard->size;
+      CHECK_ERR(L_CACHE, pthread_rwlock_unlock(&shard->lck));
+    }
+
+  return 0;
+}
+
 
 /* --------------------------- Transcode cache API  ------------------------- */
 
@@ -1842,6 +3553,125 @@ cache_xcode_toggle(bool enable)
   return commands_exec_sync(cmdbase, xcode_toggle, NULL, &enable);
 }
 
+int
+cache_xcode_progress_get(struct cache_xcode_progress *progress)
+{
+  if (!cache_is_initialized)
+    return -1;
+
+  return commands_exec_sync(cmdbase, xcode_progress_get, NULL, progress);
+}
+
+
+// Makes seg the segment with the given index, opening it if it isn't already
+static int
+xcode_segment_open(struct cache_xcode_segment *seg, int index, uint32_t id, uint32_t time_modified, enum transcode_profile profile, int bit_rate)
+{
+  struct stat sb;
+  char path[PATH_MAX];
+  char suffix[32];
+  int fd;
+
+  if (seg->fd >= 0 && seg->index == index)
+    return 0;
+
+  snprintf(suffix, sizeof(suffix), "%d", index);
+  if (xcode_segment_path(path, sizeof(path), id, time_modified, profile, bit_rate, suffix) < 0)
+    return -1;
+
+  // The segment files are only read here, never changed once written, so no
+  // need to go through the cache thread
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error reading transcoding segment '%s'\n", path);
+      close(fd);
+      return -1;
+    }
+
+  cache_xcode_segment_close(seg);
+
+  seg->fd = fd;
+  seg->index = index;
+  seg->size = sb.st_size;
+
+  return 0;
+}
+
+/* Reads from the transcoding segment that holds offset, so at most until the
+ * end of that segment. The segment is kept open in seg for the next read.
+ * Returns -1 if the segment is not cached, in which case the caller must
+ * transcode, and 0 if offset is past the end of the output.
+ */
+int
+cache_xcode_segment_read(struct evbuffer *evbuf, struct cache_xcode_segment *seg, uint32_t id, uint32_t time_modified, enum transcode_profile profile, int bit_rate, off_t offset, size_t len)
+{
+  struct evbuffer_iovec iov;
+  off_t segment_offset;
+  ssize_t got;
+
+  if (!cache_is_initialized || cache_xcode_segments_max == 0)
+    return -1;
+
+  if (xcode_segment_open(seg, offset / CACHE_XCODE_SEGMENT_SIZE, id, time_modified, profile, bit_rate) < 0)
+    return -1;
+
+  // Only the last segment is shorter than the segment size
+  segment_offset = offset % CACHE_XCODE_SEGMENT_SIZE;
+  if (segment_offset >= seg->size)
+    return 0;
+
+  len = MIN(len, seg->size - segment_offset);
+
+  if (evbuffer_reserve_space(evbuf, len, &iov, 1) < 1)
+    return -1;
+
+  got = pread(seg->fd, iov.iov_base, len, segment_offset);
+  if (got <= 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error reading transcoding segment %d of file id %" PRIu32 "\n", seg->index, id);
+      cache_xcode_segment_close(seg);
+      return -1;
+    }
+
+  iov.iov_len = got;
+  evbuffer_commit_space(evbuf, &iov, 1);
+
+  return got;
+}
+
+void
+cache_xcode_segment_close(struct cache_xcode_segment *seg)
+{
+  if (seg->fd >= 0)
+    close(seg->fd);
+
+  seg->fd = -1;
+}
+
+void
+cache_xcode_segments_prefetch(uint32_t id, uint32_t time_modified, uint32_t len_ms, const char *path, enum transcode_profile profile, int bit_rate)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized || cache_xcode_segments_max == 0)
+    return;
+
+  CHECK_NULL(L_CACHE, cmdarg = calloc(1, sizeof(struct cache_arg)));
+
+  cmdarg->id = id;
+  cmdarg->mtime = time_modified;
+  cmdarg->len_ms = len_ms;
+  cmdarg->pathcopy = strdup(path);
+  cmdarg->xcode_profile = profile;
+  cmdarg->bit_rate = bit_rate;
+
+  commands_exec_async(cmdbase, xcode_segments_prefetch, cmdarg);
+}
+
 
 /* ---------------------------- Artwork cache API  -------------------------- */
 
@@ -1994,6 +3824,31 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
   return ret;
 }
 
+int
+cache_artwork_get_batch(int type, int64_t *persistentids, int nitems, int max_w, int max_h, int *formats, struct evbuffer **evbufs)
+{
+  struct cache_arg cmdarg;
+  int i;
+
+  if (!cache_is_initialized)
+    {
+      for (i = 0; i < nitems; i++)
+	formats[i] = -1;
+      return 0;
+    }
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentids = persistentids;
+  cmdarg.nitems = nitems;
+  cmdarg.max_w = max_w;
+  cmdarg.max_h = max_h;
+  cmdarg.formats = formats;
+  cmdarg.evbufs = evbufs;
+
+  return commands_exec_sync(cmdbase, cache_artwork_get_batch_impl, NULL, &cmdarg);
+}
+
 /*
  * Put an artwork image in the in-memory stash (the previous will be deleted)
  *
@@ -2050,12 +3905,47 @@ cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
 int
 cache_init(void)
 {
+  int ret;
+
+  ret = snprintf(cache_artwork_blobs_path, sizeof(cache_artwork_blobs_path), "%s%s", cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir"), CACHE_ARTWORK_BLOBS_DIR);
+  if ((ret < 0) || (ret >= sizeof(cache_artwork_blobs_path)) || (mkdir(cache_artwork_blobs_path, 0755) < 0 && errno != EEXIST))
+    DPRINTF(E_LOG, L_CACHE, "Could not create directory for the artwork cache\n");
+
+  cache_xcode_segments_max = (off_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_xcode_segments_size") * 1024 * 1024;
+  if (cache_xcode_segments_max > 0)
+    {
+      ret = snprintf(cache_xcode_segments_path, sizeof(cache_xcode_segments_path), "%s%s", cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir"), CACHE_XCODE_SEGMENTS_DIR);
+      if ((ret < 0) || (ret >= sizeof(cache_xcode_segments_path)) || (mkdir(cache_xcode_segments_path, 0755) < 0 && errno != EEXIST))
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not create directory for transcoding segments, disabling segment cache\n");
+	  cache_xcode_segments_max = 0;
+	}
+    }
+
+  // The segment cache also needs the cache thread, so only the DAAP part is
+  // disabled if it is in use
   cache_daap_threshold = cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_threshold");
-  if (cache_daap_threshold == 0)
+  if (cache_daap_threshold == 0 && cache_xcode_segments_max == 0)
     {
       DPRINTF(E_LOG, L_CACHE, "Cache threshold set to 0, disabling cache\n");
       return 0;
     }
+  else if (cache_daap_threshold == 0)
+    DPRINTF(E_LOG, L_CACHE, "Cache threshold set to 0, disabling DAAP cache\n");
+
+  daap_mem_init(cache_daap_threshold ? (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_memory_size") * 1024 * 1024 : 0);
+  daap_snapshot_init(cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir"));
+
+  cache_xcode_nthreads = cfg_getint(cfg_getsec(cfg, "general"), "cache_xcode_threads");
+  if (cache_xcode_nthreads < 1 || cache_xcode_nthreads > CACHE_XCODE_NTHREADS_MAX)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Invalid number of threads for header generation (%d), using 1\n", cache_xcode_nthreads);
+      cache_xcode_nthreads = 1;
+    }
+
+  CHECK_NULL(L_CACHE, cache_xcode_jobs = calloc(cache_xcode_nthreads, sizeof(struct cache_xcode_job)));
+  CHECK_NULL(L_CACHE, cache_xcode_threadpool = evthr_pool_wexit_new(cache_xcode_nthreads, xcode_thread_init_cb, NULL, NULL));
+  CHECK_ERR(L_CACHE, evthr_pool_start(cache_xcode_threadpool));
 
   CHECK_NULL(L_CACHE, evbase_cache = event_base_new());
   CHECK_ERR(L_CACHE, event_base_priority_init(evbase_cache, 8));
@@ -2079,6 +3969,10 @@ cache_deinit(void)
 
   cache_is_initialized = 0;
 
+  // Stop this first, since the jobs signal completion to the cache thread
+  evthr_pool_stop(cache_xcode_threadpool);
+  evthr_pool_free(cache_xcode_threadpool);
+
   commands_base_destroy(cmdbase);
 
   ret = pthread_join(tid_cache, NULL);
@@ -2089,4 +3983,8 @@ cache_deinit(void)
     }
 
   event_base_free(evbase_cache);
+  free(cache_xcode_jobs);
+
+  daap_mem_deinit();
+  daap_snapshot_deinit();
 }
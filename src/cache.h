@@ -4,6 +4,8 @@
 
 #include <event2/buffer.h>
 
+#include "transcode.h"
+
 /* ----------------------------- DAAP cache API  ---------------------------- */
 
 void
@@ -21,15 +23,61 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
 int
 cache_daap_threshold_get(void);
 
+struct cache_daap_stats
+{
+  uint64_t snapshot_hits; // Served from the song list snapshot file
+  uint64_t mem_hits;  // Served from memory by the httpd thread
+  uint64_t db_hits;   // Served from the cache database
+  uint64_t misses;
+  int mem_entries;
+  size_t mem_size;
+  size_t mem_size_max;
+};
+
+int
+cache_daap_stats_get(struct cache_daap_stats *stats);
+
 
 /* --------------------------- Transcode cache API  ------------------------- */
 
 int
 cache_xcode_header_get(struct evbuffer *evbuf, int *cached, uint32_t id, const char *format);
 
+struct cache_xcode_progress
+{
+  bool is_enabled;
+  bool is_paused;    // Paused because the player is playing
+  int nthreads;
+  int files_active;  // Files currently being processed
+  int files_remaining;
+  int files_done;    // Files processed since startup
+  int eta_sec;       // Estimated time to completion, -1 if unknown
+};
+
 int
 cache_xcode_toggle(bool enable);
 
+int
+cache_xcode_progress_get(struct cache_xcode_progress *progress);
+
+// The segment file being read from by a stream, which is kept open until the
+// stream moves on to the next segment. Initialize fd to -1.
+struct cache_xcode_segment
+{
+  int fd;
+  int index;
+  off_t size;
+};
+
+int
+cache_xcode_segment_read(struct evbuffer *evbuf, struct cache_xcode_segment *seg, uint32_t id, uint32_t time_modified, enum transcode_profile profile, int bit_rate, off_t offset, size_t len);
+
+void
+cache_xcode_segment_close(struct cache_xcode_segment *seg);
+
+void
+cache_xcode_segments_prefetch(uint32_t id, uint32_t time_modified, uint32_t len_ms, const char *path, enum transcode_profile profile, int bit_rate);
+
 
 /* ---------------------------- Artwork cache API  -------------------------- */
 
@@ -51,6 +99,11 @@ cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int form
 int
 cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf);
 
+// Like cache_artwork_get(), but for a number of persistentids at once. Each
+// format is set to -1 if there is no cache entry for the persistentid.
+int
+cache_artwork_get_batch(int type, int64_t *persistentids, int nitems, int max_w, int max_h, int *formats, struct evbuffer **evbufs);
+
 int
 cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
 
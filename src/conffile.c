@@ -58,6 +58,15 @@ static cfg_opt_t sec_general[] =
     CFG_STR("cache_dir", STATEDIR "/cache/" PACKAGE, CFGF_NONE),
     CFG_STR("cache_path", NULL, CFGF_DEPRECATED),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_memory_size", 16, CFGF_NONE),
+    CFG_INT("cache_xcode_segments_size", 1024, CFGF_NONE),
+    CFG_INT("cache_xcode_threads", 2, CFGF_NONE),
+    CFG_INT("httpd_threads", 1, CFGF_NONE),
+    CFG_INT("httpd_threads_default", 4, CFGF_NONE),
+    CFG_INT("httpd_threads_artwork", 2, CFGF_NONE),
+    CFG_INT("httpd_threads_stream", 2, CFGF_NONE),
+    CFG_INT("gzip_level", -1, CFGF_NONE),
+    CFG_INT("gzip_min_size", 512, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -107,6 +116,8 @@ static cfg_opt_t sec_library[] =
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
+    CFG_BOOL("artwork_warmer", cfg_false, CFGF_NONE),
+    CFG_INT_LIST("artwork_warmer_sizes", "{600}", CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
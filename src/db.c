@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -507,7 +508,7 @@ static const char *sort_clause[] =
     "f.type, f.parent_id, f.special_id, f.title",
     "f.year",
     "f.genre",
-    "f.composer_sort",
+    "f.composer_sort, f.composer",
     "f.disc",
     "f.track",
     "f.virtual_path COLLATE NOCASE",
@@ -710,6 +711,92 @@ db_mprintf(const char *fmt, ...)
   return query;
 }
 
+// Columns of files that are in the files_fts full-text index
+static const char *db_fts_columns[] = { "title", "artist", "album", "album_artist", "composer", "genre" };
+
+static bool
+db_fts_column_is_indexed(const char *column, size_t len)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_fts_columns); i++)
+    {
+      if (strlen(db_fts_columns[i]) == len && strncmp(db_fts_columns[i], column, len) == 0)
+	return true;
+    }
+
+  return false;
+}
+
+// The tokenizer splits on anything that isn't a letter or digit, so a word
+// without any of those would be an empty phrase
+static bool
+db_fts_word_is_searchable(const char *word)
+{
+  const uint8_t *ptr;
+  ucs4_t uc;
+
+  ptr = (const uint8_t *)word;
+  while ((ptr = u8_next(&uc, ptr)))
+    {
+      if (uc_is_alnum(uc))
+	return true;
+    }
+
+  return false;
+}
+
+char *
+db_fts_filter(const char *column, const char *query)
+{
+  char *expr;
+  char *words;
+  char *word;
+  char *ptr;
+  char *out;
+  char *filter;
+  size_t len;
+
+  if (strncmp(column, "f.", 2) == 0)
+    column += 2;
+
+  len = strlen(column);
+  if (!db_fts_column_is_indexed(column, len))
+    return NULL;
+
+  // Each word becomes a quoted prefix query that must match, like
+  // title : "word1"* AND title : "word2"*. Quotes are escaped by doubling.
+  CHECK_NULL(L_DB, words = strdup(query));
+  CHECK_NULL(L_DB, expr = calloc(1, (len + 16) * (strlen(query) / 2 + 1) + 2 * strlen(query) + 1));
+  out = expr;
+  for (word = strtok_r(words, " \t", &ptr); word; word = strtok_r(NULL, " \t", &ptr))
+    {
+      if (!db_fts_word_is_searchable(word))
+	continue;
+
+      if (out != expr)
+	out += sprintf(out, " AND ");
+
+      out += sprintf(out, "%s : \"", column);
+      for (; *word; word++)
+	{
+	  if (*word == '"')
+	    *out++ = '"';
+	  *out++ = *word;
+	}
+      out += sprintf(out, "\"*");
+    }
+
+  if (out == expr)
+    filter = NULL;
+  else
+    filter = db_mprintf("(f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH '%q'))", expr);
+
+  free(words);
+  free(expr);
+  return filter;
+}
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...)
 {
@@ -1615,6 +1702,26 @@ db_pragma_optimize(void)
     }
 }
 
+/* A scan leaves many small segments in the full-text index, merging them
+ * makes searches faster */
+static void
+db_fts_optimize(void)
+{
+  const char *query = "INSERT INTO files_fts (files_fts) VALUES ('optimize');";
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Optimizing full-text index failed: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+    }
+}
+
 /* Set names of default playlists according to config */
 static void
 db_set_cfg_names(void)
@@ -1671,6 +1778,10 @@ db_hook_post_scan(void)
 
   db_pragma_optimize();
 
+  db_fts_optimize();
+
+  db_group_stats_refresh();
+
   DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
 }
 
@@ -1975,6 +2086,7 @@ static struct query_clause *
 db_build_query_clause(struct query_params *qp)
 {
   struct query_clause *qc;
+  char *tmp;
 
   qc = calloc(1, sizeof(struct query_clause));
   if (!qc)
@@ -1996,6 +2108,13 @@ db_build_query_clause(struct query_params *qp)
   else
     qc->where = sqlite3_mprintf("");
 
+  if (qp->media_kind && qc->where)
+    {
+      tmp = sqlite3_mprintf("%s %s f.media_kind = %d", qc->where, (qc->where[0] == '\0') ? "WHERE" : "AND", qp->media_kind);
+      sqlite3_free(qc->where);
+      qc->where = tmp;
+    }
+
   if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
     qc->having = sqlite3_mprintf("HAVING %s", qp->having);
   else
@@ -2192,6 +2311,287 @@ db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
   return db_build_query_check(qp, count, query);
 }
 
+/* Smart playlist membership cache
+ *
+ * Evaluating a smart playlist rule means scanning files, so the resulting ids
+ * are kept in smartpl_items and the rule they were built from in
+ * smartpl_cache. The membership is stale when the library has changed since,
+ * which for rules that look at play state also includes play count, rating
+ * etc. updates. Rules with relative dates ('now') also expire after a while.
+ * Only the library thread rebuilds the cache, see db_smartpl_cache_refresh().
+ * Readers use it while it is fresh, and otherwise evaluate the rule.
+ */
+#define SMARTPL_CACHE_TTL 300
+
+static const char *smartpl_playstate_columns[] =
+  {
+    "play_count", "skip_count", "time_played", "time_skipped", "rating", "seek", "usermark",
+  };
+
+// Goes through the identifiers of the SQL of a rule, i.e. the column names
+// without the "f." prefix, skipping string literals
+static bool
+smartpl_sql_has_playstate(const char *sql)
+{
+  const char *ptr;
+  size_t len;
+  int i;
+
+  for (ptr = sql; *ptr; ptr += len)
+    {
+      if (*ptr == '\'')
+	{
+	  // A quote inside a literal is escaped by doubling it
+	  ptr++;
+	  while (*ptr && !(ptr[0] == '\'' && ptr[1] != '\''))
+	    ptr += (ptr[0] == '\'') ? 2 : 1;
+
+	  len = (*ptr) ? 1 : 0; // The closing quote
+	  continue;
+	}
+
+      for (len = 0; isalnum((unsigned char)ptr[len]) || ptr[len] == '_'; len++)
+	;
+      if (len == 0)
+	{
+	  len = 1;
+	  continue;
+	}
+
+      for (i = 0; i < ARRAY_SIZE(smartpl_playstate_columns); i++)
+	{
+	  if (strlen(smartpl_playstate_columns[i]) == len && strncmp(ptr, smartpl_playstate_columns[i], len) == 0)
+	    return true;
+	}
+    }
+
+  return false;
+}
+
+static bool
+smartpl_uses_playstate(struct playlist_info *pli)
+{
+  return smartpl_sql_has_playstate(pli->query) || (pli->query_order && smartpl_sql_has_playstate(pli->query_order));
+}
+
+// Returns 0 if the cached membership of the playlist is current, 1 if it must
+// be rebuilt and -1 if the cache can't be used
+static int
+smartpl_cache_check(struct playlist_info *pli, const char *key)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM smartpl_cache WHERE playlistid = %d AND query = '%q' AND built > %" PRIi64 " AND (expires = 0 OR expires > %" PRIi64 ");"
+  int64_t stamp;
+  char *query;
+  int ret;
+
+  if (pli->type != PL_SMART || !pli->query)
+    return -1;
+
+  // Random order must be evaluated on every request
+  if (pli->query_order && strcasestr(pli->query_order, "random"))
+    return -1;
+
+  // The stamps are in seconds, so a build in the same second as the change is
+  // stale. The library thread waits a bit before rebuilding, see
+  // library_playstate_trigger().
+  ret = db_admin_getint64(&stamp, smartpl_uses_playstate(pli) ? DB_ADMIN_DB_MODIFIED : DB_ADMIN_DB_UPDATE);
+  if (ret < 0)
+    return -1;
+
+  query = sqlite3_mprintf(Q_TMPL, pli->id, key, stamp, (int64_t) time(NULL));
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_get_one_int(query);
+  sqlite3_free(query);
+  if (ret < 0)
+    return -1;
+
+  return (ret > 0) ? 0 : 1;
+#undef Q_TMPL
+}
+
+static int
+smartpl_cache_build(struct playlist_info *pli, const char *key)
+{
+#define Q_DELETE "DELETE FROM smartpl_items WHERE playlistid = %d;"
+#define Q_ITEMS "INSERT INTO smartpl_items (playlistid, fileid) SELECT %d, f.id FROM files f WHERE f.disabled = 0 AND %s %s%s LIMIT %d;"
+#define Q_CACHE "INSERT OR REPLACE INTO smartpl_cache (playlistid, query, built, expires) VALUES (%d, '%q', %" PRIi64 ", %" PRIi64 ");"
+  char *query;
+  int64_t now;
+  int ret;
+
+  now = (int64_t) time(NULL);
+
+  // A savepoint instead of a transaction, since we may be called from within one
+  ret = db_query_run("SAVEPOINT smartpl_cache;", 0, 0);
+  if (ret < 0)
+    return -1;
+
+  query = sqlite3_mprintf(Q_DELETE, pli->id);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto out;
+
+  query = sqlite3_mprintf(Q_ITEMS, pli->id, pli->query, pli->query_order ? "ORDER BY " : "", pli->query_order ? pli->query_order : "",
+			  pli->query_limit ? pli->query_limit : -1);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto out;
+
+  query = sqlite3_mprintf(Q_CACHE, pli->id, key, now, strstr(pli->query, "'now") ? now + SMARTPL_CACHE_TTL : 0);
+  ret = db_query_run(query, 1, 0);
+
+ out:
+  if (ret < 0)
+    db_query_run("ROLLBACK TO smartpl_cache;", 0, 0);
+
+  db_query_run("RELEASE smartpl_cache;", 0, 0);
+
+  return ret;
+#undef Q_CACHE
+#undef Q_ITEMS
+#undef Q_DELETE
+}
+
+// The order and limit are part of the key, since they decide the membership
+static char *
+smartpl_cache_key(struct playlist_info *pli)
+{
+  return sqlite3_mprintf("%s\n%s\n%u", pli->query, pli->query_order ? pli->query_order : "", pli->query_limit);
+}
+
+static bool
+smartpl_cache_is_fresh(struct playlist_info *pli)
+{
+  char *key;
+  int ret;
+
+  key = smartpl_cache_key(pli);
+  if (!key)
+    return false;
+
+  ret = smartpl_cache_check(pli, key);
+
+  sqlite3_free(key);
+  return (ret == 0);
+}
+
+static int
+smartpl_cache_update(struct playlist_info *pli)
+{
+  char *key;
+  int ret;
+
+  key = smartpl_cache_key(pli);
+  if (!key)
+    return -1;
+
+  ret = smartpl_cache_check(pli, key);
+  if (ret > 0)
+    {
+      DPRINTF(E_DBG, L_DB, "Rebuilding cached items of smart playlist '%s'\n", pli->path);
+      ret = smartpl_cache_build(pli, key);
+    }
+
+  sqlite3_free(key);
+  return ret;
+}
+
+int
+db_smartpl_cache_refresh(void)
+{
+#define Q_PURGE_ITEMS "DELETE FROM smartpl_items WHERE playlistid NOT IN (SELECT id FROM playlists WHERE type = %d AND disabled = 0);"
+#define Q_PURGE_CACHE "DELETE FROM smartpl_cache WHERE playlistid NOT IN (SELECT id FROM playlists WHERE type = %d AND disabled = 0);"
+#define Q_EXPIRES "SELECT MAX(MIN(expires) - %" PRIi64 ", 1) FROM smartpl_cache WHERE expires > 0;"
+  struct query_params qp;
+  struct db_playlist_info dbpli;
+  struct playlist_info *pli;
+  char *query;
+  int *ids;
+  int nids;
+  int id;
+  int i;
+  int ret;
+
+  // Drops the items of playlists that were deleted or are no longer smart
+  query = sqlite3_mprintf(Q_PURGE_ITEMS, PL_SMART);
+  db_query_run(query, 1, 0);
+  query = sqlite3_mprintf(Q_PURGE_CACHE, PL_SMART);
+  db_query_run(query, 1, 0);
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_PL;
+  CHECK_NULL(L_DB, qp.filter = db_mprintf("f.type = %d", PL_SMART));
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      free(qp.filter);
+      return -1;
+    }
+
+  // The ids are collected first, so the query isn't open while we rebuild
+  CHECK_NULL(L_DB, ids = calloc(qp.results > 0 ? qp.results : 1, sizeof(int)));
+  nids = 0;
+  while (((ret = db_query_fetch_pl(&dbpli, &qp)) == 0) && (dbpli.id) && (nids < qp.results))
+    {
+      if (safe_atoi32(dbpli.id, &id) == 0)
+	ids[nids++] = id;
+    }
+
+  db_query_end(&qp);
+  free(qp.filter);
+
+  for (i = 0; i < nids; i++)
+    {
+      pli = db_pl_fetch_byid(ids[i]);
+      if (!pli)
+	continue;
+
+      smartpl_cache_update(pli);
+      free_pli(pli, 0);
+    }
+
+  free(ids);
+
+  query = sqlite3_mprintf(Q_EXPIRES, (int64_t) time(NULL));
+  if (!query)
+    return -1;
+
+  ret = db_get_one_int(query);
+  sqlite3_free(query);
+
+  return ret;
+#undef Q_EXPIRES
+#undef Q_PURGE_CACHE
+#undef Q_PURGE_ITEMS
+}
+
+static char *
+db_build_query_plitems_smart_cached(struct query_params *qp, struct playlist_info *pli)
+{
+  struct query_clause *qc;
+  char *count;
+  char *query;
+
+  qc = db_build_query_clause(qp);
+  if (!qc)
+    return NULL;
+
+  // Unless the caller wants another order, items keep the order of the rule
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN smartpl_items s ON f.id = s.fileid %s AND s.playlistid = %d;", qc->where, pli->id);
+  query = sqlite3_mprintf("SELECT f.* FROM files f JOIN smartpl_items s ON f.id = s.fileid %s AND s.playlistid = %d %s %s;",
+			  qc->where, pli->id, qc->order[0] ? qc->order : "ORDER BY s.id", qc->index);
+
+  db_free_query_clause(qc);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
 {
@@ -2210,8 +2610,15 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
 
   switch (pli->type)
     {
-      case PL_SPECIAL:
       case PL_SMART:
+	if (smartpl_cache_is_fresh(pli))
+	  {
+	    query = db_build_query_plitems_smart_cached(qp, pli);
+	    break;
+	  }
+	/* FALLTHROUGH */
+
+      case PL_SPECIAL:
 	query = db_build_query_plitems_smart(qp, pli);
 	break;
 
@@ -2232,12 +2639,150 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
+/* Recomputes the group_stats rows that the trg_stats_* triggers marked as
+ * dirty. Rows that are still dirty afterwards belong to groups that no longer
+ * have enabled files.
+ */
+#define Q_STATS_COLUMNS \
+  "type, persistentid, scope, dirty, album, album_sort, album_artist, album_artist_sort, songartistid," \
+  " track_count, album_count, song_length, data_kind, media_kind, year, date_released, time_added," \
+  " time_played, seek"
+#define Q_STATS_AGGREGATES \
+  " f.album, f.album_sort, f.album_artist, f.album_artist_sort, f.songartistid, COUNT(f.id), %s," \
+  " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released)," \
+  " MAX(f.time_added), MAX(f.time_played), MAX(f.seek)"
+
+static const char *db_group_stats_refresh_queries[] =
+  {
+    "INSERT OR REPLACE INTO group_stats (" Q_STATS_COLUMNS ") SELECT 1, f.songalbumid, 0, 0," Q_STATS_AGGREGATES
+    " FROM files f WHERE f.disabled = 0 AND f.songalbumid IN (SELECT persistentid FROM group_stats WHERE type = 1 AND scope = 0 AND dirty = 1)"
+    " GROUP BY f.songalbumid;",
+    "INSERT OR REPLACE INTO group_stats (" Q_STATS_COLUMNS ") SELECT 1, f.songalbumid, f.media_kind, 0," Q_STATS_AGGREGATES
+    " FROM files f WHERE f.disabled = 0 AND (f.songalbumid, f.media_kind) IN (SELECT persistentid, scope FROM group_stats WHERE type = 1 AND scope <> 0 AND dirty = 1)"
+    " GROUP BY f.songalbumid, f.media_kind;",
+    "INSERT OR REPLACE INTO group_stats (" Q_STATS_COLUMNS ") SELECT 2, f.songartistid, 0, 0," Q_STATS_AGGREGATES
+    " FROM files f WHERE f.disabled = 0 AND f.songartistid IN (SELECT persistentid FROM group_stats WHERE type = 2 AND scope = 0 AND dirty = 1)"
+    " GROUP BY f.songartistid;",
+    "INSERT OR REPLACE INTO group_stats (" Q_STATS_COLUMNS ") SELECT 2, f.songartistid, f.media_kind, 0," Q_STATS_AGGREGATES
+    " FROM files f WHERE f.disabled = 0 AND (f.songartistid, f.media_kind) IN (SELECT persistentid, scope FROM group_stats WHERE type = 2 AND scope <> 0 AND dirty = 1)"
+    " GROUP BY f.songartistid, f.media_kind;",
+    "DELETE FROM group_stats WHERE dirty = 1;",
+  };
+
+int
+db_group_stats_refresh(void)
+{
+  char *query;
+  int i;
+  int ret;
+
+  ret = db_get_one_int("SELECT EXISTS (SELECT 1 FROM group_stats WHERE dirty = 1);");
+  if (ret <= 0)
+    return ret;
+
+  // A savepoint instead of a transaction, since we may be called from within one
+  ret = db_query_run("SAVEPOINT group_stats;", 0, 0);
+  if (ret < 0)
+    return -1;
+
+  for (i = 0; i < ARRAY_SIZE(db_group_stats_refresh_queries); i++)
+    {
+      // Albums have album_count 1, artists count their distinct albums
+      query = sqlite3_mprintf(db_group_stats_refresh_queries[i], (i < 2) ? "1" : "COUNT(DISTINCT f.songalbumid)");
+
+      ret = db_query_run(query, 1, 0);
+      if (ret < 0)
+	{
+	  db_query_run("ROLLBACK TO group_stats;", 0, 0);
+	  break;
+	}
+    }
+
+  db_query_run("RELEASE group_stats;", 0, 0);
+
+  return ret;
+}
+
+#undef Q_STATS_COLUMNS
+#undef Q_STATS_AGGREGATES
+
+/* Album and artist lists that are unfiltered, or only filtered by media kind,
+ * can be read from group_stats instead of grouping all of files. The library
+ * thread refreshes the stats after changes, until then the groups that are
+ * dirty are grouped from files, see db_build_query_group_stats().
+ */
+static bool
+db_group_stats_usable(struct query_params *qp)
+{
+  if (qp->filter || qp->having || qp->order || qp->with_disabled)
+    return false;
+
+  return (qp->sort == S_NONE || qp->sort == S_ALBUM || qp->sort == S_ARTIST);
+}
+
+/* The groups with a clean row come from group_stats, the dirty ones (usually
+ * none or a few) are grouped from files. The sort keys are extra columns at the
+ * end, so both parts of the compound can be ordered the same way.
+ */
+static char *
+db_build_query_group_stats(struct query_params *qp, struct query_clause *qc, int type)
+{
+  const char *order;
+  const char *name;
+  const char *id;
+  char media_kind[32];
+  char *count;
+  char *query;
+
+  if (qp->sort == S_ALBUM)
+    order = "ORDER BY sort_album";
+  else if (qp->sort == S_ARTIST)
+    order = "ORDER BY sort_artist, sort_album";
+  else
+    order = "";
+
+  name = (type == 1) ? "f.album, f.album_sort" : "f.album_artist, f.album_artist_sort";
+  id = (type == 1) ? "songalbumid" : "songartistid";
+
+  if (qp->media_kind)
+    snprintf(media_kind, sizeof(media_kind), "AND f.media_kind = %d", qp->media_kind);
+  else
+    media_kind[0] = '\0';
+
+  count = sqlite3_mprintf("SELECT (SELECT COUNT(*) FROM group_stats f WHERE f.type = %d AND f.scope = %d AND f.dirty = 0)" \
+			  " + (SELECT COUNT(DISTINCT f.%s) FROM files f WHERE f.disabled = 0 %s" \
+			  " AND f.%s IN (SELECT persistentid FROM group_stats WHERE type = %d AND scope = %d AND dirty = 1));",
+			  type, qp->media_kind, id, media_kind, id, type, qp->media_kind);
+  query = sqlite3_mprintf("SELECT" \
+			  " g.id, g.persistentid, %s, f.track_count, f.album_count, f.album_artist, f.songartistid," \
+			  " f.song_length, f.data_kind, f.media_kind, f.year, f.date_released, f.time_added," \
+			  " f.time_played, f.seek, f.album_sort AS sort_album, f.album_artist_sort AS sort_artist " \
+			  "FROM group_stats f JOIN groups g ON f.persistentid = g.persistentid " \
+			  "WHERE f.type = %d AND f.scope = %d AND f.dirty = 0 " \
+			  "UNION ALL SELECT" \
+			  " g.id, g.persistentid, %s, COUNT(f.id), %s, f.album_artist, f.songartistid," \
+			  " SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind), MAX(f.year), MAX(f.date_released), MAX(f.time_added)," \
+			  " MAX(f.time_played), MAX(f.seek), f.album_sort, f.album_artist_sort " \
+			  "FROM files f JOIN groups g ON f.%s = g.persistentid " \
+			  "WHERE f.disabled = 0 %s AND f.%s IN (SELECT persistentid FROM group_stats WHERE type = %d AND scope = %d AND dirty = 1) " \
+			  "GROUP BY f.%s %s %s;",
+			  name, type, qp->media_kind,
+			  name, (type == 1) ? "1" : "COUNT(DISTINCT f.songalbumid)",
+			  id, media_kind, id, type, qp->media_kind,
+			  id, order, qc->index);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 {
   char *count;
   char *query;
 
+  if (db_group_stats_usable(qp))
+    return db_build_query_group_stats(qp, qc, 1);
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id) AS track_count," \
@@ -2257,6 +2802,9 @@ db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
   char *count;
   char *query;
 
+  if (db_group_stats_usable(qp))
+    return db_build_query_group_stats(qp, qc, 2);
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id) AS track_count," \
@@ -2882,6 +3430,14 @@ db_files_get_count(uint32_t *nitems, uint32_t *nstreams, const char *filter)
   return -1;
 }
 
+// Smart playlists with play state rules are rebuilt by the library thread
+static void
+playstate_modified(void)
+{
+  db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+  library_playstate_trigger();
+}
+
 static void
 db_file_inc_playcount_byfilter(const char *filter)
 {
@@ -2925,7 +3481,7 @@ db_file_inc_playcount_byfilter(const char *filter)
   // cause a lot of useless cache updates
   ret = db_query_run(query, 1, db_rating_updates ? LISTENER_RATING : 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    playstate_modified();
 #undef Q_TMPL
 #undef Q_TMPL_WITH_RATING
 }
@@ -2991,7 +3547,7 @@ db_file_inc_skipcount(int id)
 
   ret = db_query_run(query, 1, db_rating_updates ? LISTENER_RATING : 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    playstate_modified();
 #undef Q_TMPL
 #undef Q_TMPL_WITH_RATING
 }
@@ -3013,7 +3569,7 @@ db_file_reset_playskip_count(int id)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    playstate_modified();
 #undef Q_TMPL
 }
 
@@ -3500,7 +4056,7 @@ db_file_seek_update(int id, uint32_t seek)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    playstate_modified();
 #undef Q_TMPL
 }
 
@@ -70,6 +70,7 @@ enum query_type {
 #define DB_ADMIN_DB_UPDATE "db_update"
 #define DB_ADMIN_DB_MODIFIED "db_modified"
 #define DB_ADMIN_START_TIME "start_time"
+#define DB_ADMIN_ARTWORK_WARMED "artwork_warmed"
 #define DB_ADMIN_LASTFM_SESSION_KEY "lastfm_sk"
 #define DB_ADMIN_SPOTIFY_REFRESH_TOKEN "spotify_refresh_token"
 
@@ -94,6 +95,9 @@ struct query_params {
   char *group;
 
   char *filter;
+  // Only include files of this media kind, 0 means all. Prefer this over a
+  // filter, since album and artist lists can then use group_stats.
+  int media_kind;
 
   int with_disabled;
 
@@ -582,6 +586,19 @@ db_mprintf(const char *fmt, ...);
 int
 db_snprintf(char *s, int n, const char *fmt, ...);
 
+/*
+ * Makes a query filter that uses the full-text index to find the files where
+ * all the words in query appear, as word prefixes, in the column.
+ *
+ * @in  column   Column to search, e.g. "f.title"
+ * @in  query    Search string from the user
+ * @return       Filter to be freed by the caller, or NULL if the column is
+ *               not in the index or the query has no words with letters or
+ *               digits (then use LIKE instead)
+ */
+char *
+db_fts_filter(const char *column, const char *query);
+
 void
 free_pi(struct pairing_info *pi, int content_only);
 
@@ -798,6 +815,18 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path);
 int
 db_groups_cleanup();
 
+// Updates the album/artist aggregates in group_stats after library and play
+// state changes. Only the library thread calls this, readers group the dirty
+// groups from files.
+int
+db_group_stats_refresh(void);
+
+// Rebuilds the stale smart playlist memberships and drops those of deleted
+// playlists. Only called by the library thread. Returns the seconds until a
+// membership expires (rules with 'now'), 0 if none do, or -1 on error.
+int
+db_smartpl_cache_refresh(void);
+
 int
 db_group_persistentid_byid(int id, int64_t *persistentid);
 
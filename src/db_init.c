@@ -102,6 +102,15 @@
   "   lyrics             TEXT DEFAULT NULL COLLATE DAAP"		\
   ");"
 
+// Full-text index for searching, kept in sync with files by the trg_fts_*
+// triggers. The tokenizer folds case and diacritics like the DAAP collation.
+#define T_FILES_FTS							\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("		\
+  "   title, artist, album, album_artist, composer, genre,"		\
+  "   content = 'files', content_rowid = 'id',"			\
+  "   tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3'"	\
+  ");"
+
 #define T_PL					\
   "CREATE TABLE IF NOT EXISTS playlists ("		\
   "   id             INTEGER PRIMARY KEY NOT NULL,"	\
@@ -130,6 +139,25 @@
   "   filepath       VARCHAR(4096) NOT NULL"		\
   ");"
 
+/* Cached membership of smart playlists, see db_build_query_plitems_smart().
+ * Like playlistitems the order of the items is the order of the ids. The query
+ * is the rule (with order and limit) that the items were built from.
+ */
+#define T_SMARTPL_CACHE				\
+  "CREATE TABLE IF NOT EXISTS smartpl_cache ("		\
+  "   playlistid     INTEGER PRIMARY KEY NOT NULL,"	\
+  "   query          TEXT NOT NULL,"			\
+  "   built          INTEGER NOT NULL,"			\
+  "   expires        INTEGER DEFAULT 0"			\
+  ");"
+
+#define T_SMARTPL_ITEMS				\
+  "CREATE TABLE IF NOT EXISTS smartpl_items ("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL"			\
+  ");"
+
 #define T_GROUPS							\
   "CREATE TABLE IF NOT EXISTS groups ("					\
   "   id             INTEGER PRIMARY KEY NOT NULL,"			\
@@ -139,6 +167,37 @@
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+/* Aggregates of the enabled files per album (type 1) and artist (type 2), as
+ * Q_GROUP_ALBUMS/ARTISTS would compute them. There is a row for all media kinds
+ * (scope 0) and one per media kind (scope is the media kind). The trg_stats_*
+ * triggers mostly just set dirty, db_group_stats_refresh() recomputes the
+ * values. The play state maxima (time_played, seek) change all the time, so
+ * the triggers raise those directly, only a decrease makes the row dirty.
+ */
+#define T_GROUP_STATS							\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   type              INTEGER NOT NULL,"				\
+  "   persistentid      INTEGER NOT NULL,"				\
+  "   scope             INTEGER NOT NULL,"				\
+  "   dirty             INTEGER DEFAULT 1,"				\
+  "   album             VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_sort        VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_artist      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_artist_sort VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   songartistid      INTEGER DEFAULT 0,"				\
+  "   track_count       INTEGER DEFAULT 0,"				\
+  "   album_count       INTEGER DEFAULT 0,"				\
+  "   song_length       INTEGER DEFAULT 0,"				\
+  "   data_kind         INTEGER DEFAULT 0,"				\
+  "   media_kind        INTEGER DEFAULT 0,"				\
+  "   year              INTEGER DEFAULT 0,"				\
+  "   date_released     INTEGER DEFAULT 0,"				\
+  "   time_added        INTEGER DEFAULT 0,"				\
+  "   time_played       INTEGER DEFAULT 0,"				\
+  "   seek              INTEGER DEFAULT 0,"				\
+  "   PRIMARY KEY (type, persistentid, scope)"				\
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -269,9 +328,13 @@ static const struct db_init_query db_init_table_queries[] =
   {
     { T_ADMIN,     "create table admin" },
     { T_FILES,     "create table files" },
+    { T_FILES_FTS, "create table files_fts" },
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
+    { T_SMARTPL_CACHE, "create table smartpl_cache" },
+    { T_SMARTPL_ITEMS, "create table smartpl_items" },
     { T_GROUPS,    "create table groups" },
+    { T_GROUP_STATS, "create table group_stats" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
@@ -305,9 +368,9 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_SONGARTISTID				\
   "CREATE INDEX IF NOT EXISTS idx_sari ON files(songartistid);"
 
-/* Used by Q_GROUP_ALBUMS */
+/* Used by Q_GROUP_ALBUMS and for the tracks of an album sorted by S_ALBUM */
 #define I_SONGALBUMID				\
-  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort, disc, track);"
+  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, album_sort, disc, track, media_kind);"
 
 /* Used by Q_GROUP_ARTISTS */
 #define I_STATEMKINDSARI				\
@@ -342,8 +405,13 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_FILE_DIR					\
   "CREATE INDEX IF NOT EXISTS idx_file_dir ON files(disabled, directory_id);"
 
+/* Used for S_DATE_RELEASED */
 #define I_DATE_RELEASED                    \
-  "CREATE INDEX IF NOT EXISTS idx_date_released ON files(disabled, date_released DESC, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_date_released ON files(disabled, date_released DESC, title_sort DESC, media_kind);"
+
+/* Used for tracks sorted by "time_added DESC", e.g. by smart playlists */
+#define I_TIME_ADDED                    \
+  "CREATE INDEX IF NOT EXISTS idx_time_added ON files(disabled, time_added, media_kind);"
 
 #define I_PL_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path);"
@@ -352,7 +420,7 @@ static const struct db_init_query db_init_table_queries[] =
   "CREATE INDEX IF NOT EXISTS idx_pl_disabled ON playlists(disabled, type, virtual_path, db_timestamp);"
 
 #define I_PL_DIR					\
-  "CREATE INDEX IF NOT EXISTS idx_pl_dir ON files(disabled, directory_id);"
+  "CREATE INDEX IF NOT EXISTS idx_pl_dir ON playlists(disabled, directory_id);"
 
 #define I_FILEPATH							\
   "CREATE INDEX IF NOT EXISTS idx_filepath ON playlistitems(filepath ASC);"
@@ -360,9 +428,21 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_PLITEMID							\
   "CREATE INDEX IF NOT EXISTS idx_playlistid ON playlistitems(playlistid, filepath);"
 
+#define I_SMARTPL_ITEMS							\
+  "CREATE INDEX IF NOT EXISTS idx_smartpl_items ON smartpl_items(playlistid);"
+
 #define I_GRP_PERSIST				\
   "CREATE INDEX IF NOT EXISTS idx_grp_persist ON groups(persistentid);"
 
+#define I_GRP_STATS_DIRTY			\
+  "CREATE INDEX IF NOT EXISTS idx_grp_stats_dirty ON group_stats(dirty);"
+
+#define I_GRP_STATS_ALBUM			\
+  "CREATE INDEX IF NOT EXISTS idx_grp_stats_album ON group_stats(type, scope, album_sort);"
+
+#define I_GRP_STATS_ARTIST			\
+  "CREATE INDEX IF NOT EXISTS idx_grp_stats_artist ON group_stats(type, scope, album_artist_sort, album_sort);"
+
 #define I_PAIRING				\
   "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
 
@@ -395,6 +475,7 @@ static const struct db_init_query db_init_index_queries[] =
     { I_FILELIST,  "create filelist index" },
     { I_FILE_DIR,  "create file dir index" },
     { I_DATE_RELEASED, "create date_released index" },
+    { I_TIME_ADDED, "create time_added index" },
 
     { I_PL_PATH,   "create playlist path index" },
     { I_PL_DISABLED, "create playlist state index" },
@@ -402,8 +483,12 @@ static const struct db_init_query db_init_index_queries[] =
 
     { I_FILEPATH,  "create file path index" },
     { I_PLITEMID,  "create playlist id index" },
+    { I_SMARTPL_ITEMS, "create smart playlist items index" },
 
     { I_GRP_PERSIST, "create groups persistentid index" },
+    { I_GRP_STATS_DIRTY, "create group_stats dirty index" },
+    { I_GRP_STATS_ALBUM, "create group_stats album index" },
+    { I_GRP_STATS_ARTIST, "create group_stats artist index" },
 
     { I_PAIRING,   "create pairing guid index" },
 
@@ -431,10 +516,95 @@ static const struct db_init_query db_init_index_queries[] =
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
   " END;"
 
+#define TRG_FTS_INSERT										\
+  "CREATE TRIGGER trg_fts_insert AFTER INSERT ON files FOR EACH ROW"					\
+  " BEGIN"												\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"		\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre);"	\
+  " END;"
+
+#define TRG_FTS_DELETE										\
+  "CREATE TRIGGER trg_fts_delete AFTER DELETE ON files FOR EACH ROW"					\
+  " BEGIN"												\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre);"	\
+  " END;"
+
+// Rescans update all columns, so only reindex if a searchable one changed
+#define TRG_FTS_UPDATE										\
+  "CREATE TRIGGER trg_fts_update AFTER UPDATE OF title, artist, album, album_artist, composer, genre ON files FOR EACH ROW"	\
+  "   WHEN OLD.title IS NOT NEW.title OR OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"	\
+  "     OR OLD.album_artist IS NOT NEW.album_artist OR OLD.composer IS NOT NEW.composer OR OLD.genre IS NOT NEW.genre"	\
+  " BEGIN"												\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre);"	\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"		\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre);"	\
+  " END;"
+
+#define Q_STATS_DIRTY(ROW)											\
+  "   INSERT INTO group_stats (type, persistentid, scope) VALUES"						\
+  "     (1, " ROW ".songalbumid, 0), (1, " ROW ".songalbumid, " ROW ".media_kind),"				\
+  "     (2, " ROW ".songartistid, 0), (2, " ROW ".songartistid, " ROW ".media_kind)"				\
+  "     ON CONFLICT (type, persistentid, scope) DO UPDATE SET dirty = 1;"
+
+#define TRG_STATS_INSERT										\
+  "CREATE TRIGGER trg_stats_insert AFTER INSERT ON files FOR EACH ROW"					\
+  " BEGIN"												\
+  Q_STATS_DIRTY("NEW")											\
+  " END;"
+
+#define TRG_STATS_DELETE										\
+  "CREATE TRIGGER trg_stats_delete AFTER DELETE ON files FOR EACH ROW"					\
+  " BEGIN"												\
+  Q_STATS_DIRTY("OLD")											\
+  " END;"
+
+// Play count and play state updates don't change the stats, so check the columns
+#define TRG_STATS_UPDATE										\
+  "CREATE TRIGGER trg_stats_update AFTER UPDATE ON files FOR EACH ROW"					\
+  "   WHEN OLD.disabled IS NOT NEW.disabled OR OLD.media_kind IS NOT NEW.media_kind"			\
+  "     OR OLD.songalbumid IS NOT NEW.songalbumid OR OLD.songartistid IS NOT NEW.songartistid"		\
+  "     OR OLD.album IS NOT NEW.album OR OLD.album_sort IS NOT NEW.album_sort"				\
+  "     OR OLD.album_artist IS NOT NEW.album_artist OR OLD.album_artist_sort IS NOT NEW.album_artist_sort"	\
+  "     OR OLD.song_length IS NOT NEW.song_length OR OLD.data_kind IS NOT NEW.data_kind"			\
+  "     OR OLD.year IS NOT NEW.year OR OLD.date_released IS NOT NEW.date_released"			\
+  "     OR OLD.time_added IS NOT NEW.time_added"							\
+  " BEGIN"												\
+  Q_STATS_DIRTY("OLD")											\
+  Q_STATS_DIRTY("NEW")											\
+  " END;"
+
+// Rows that are dirty get the play state with the next refresh
+#define TRG_STATS_PLAYSTATE_UP										\
+  "CREATE TRIGGER trg_stats_playstate_up AFTER UPDATE OF time_played, seek ON files FOR EACH ROW"	\
+  "   WHEN NEW.disabled = 0 AND NEW.time_played >= OLD.time_played AND NEW.seek >= OLD.seek"		\
+  " BEGIN"												\
+  "   UPDATE group_stats SET time_played = MAX(time_played, NEW.time_played), seek = MAX(seek, NEW.seek)"	\
+  "     WHERE ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid))"	\
+  "       AND scope IN (0, NEW.media_kind) AND dirty = 0;"						\
+  " END;"
+
+// The file may have had the group's max, so the group must be recomputed
+#define TRG_STATS_PLAYSTATE_DOWN									\
+  "CREATE TRIGGER trg_stats_playstate_down AFTER UPDATE OF time_played, seek ON files FOR EACH ROW"	\
+  "   WHEN NEW.time_played < OLD.time_played OR NEW.seek < OLD.seek"					\
+  " BEGIN"												\
+  Q_STATS_DIRTY("NEW")											\
+  " END;"
+
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_FTS_INSERT,              "create trigger trg_fts_insert" },
+    { TRG_FTS_DELETE,              "create trigger trg_fts_delete" },
+    { TRG_FTS_UPDATE,              "create trigger trg_fts_update" },
+    { TRG_STATS_INSERT,            "create trigger trg_stats_insert" },
+    { TRG_STATS_DELETE,            "create trigger trg_stats_delete" },
+    { TRG_STATS_UPDATE,            "create trigger trg_stats_update" },
+    { TRG_STATS_PLAYSTATE_UP,      "create trigger trg_stats_playstate_up" },
+    { TRG_STATS_PLAYSTATE_DOWN,    "create trigger trg_stats_playstate_down" },
   };
 
 
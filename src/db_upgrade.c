@@ -1265,6 +1265,135 @@ static const struct db_upgrade_query db_upgrade_v2202_queries[] =
   };
 
 
+/* ---------------------------- 22.02 -> 22.03 ------------------------------ */
+
+#define U_v2203_CREATE_FILES_FTS					\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("		\
+  "   title, artist, album, album_artist, composer, genre,"		\
+  "   content = 'files', content_rowid = 'id',"			\
+  "   tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3'"	\
+  ");"
+// The triggers that keep it updated are created after the upgrade
+#define U_v2203_REBUILD_FILES_FTS \
+  "INSERT INTO files_fts (files_fts) VALUES ('rebuild');"
+
+#define U_v2203_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2203_SCVER_MINOR                    \
+  "UPDATE admin SET value = '03' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2203_queries[] =
+  {
+    { U_v2203_CREATE_FILES_FTS, "create table files_fts" },
+    { U_v2203_REBUILD_FILES_FTS, "build full-text index files_fts" },
+
+    { U_v2203_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2203_SCVER_MINOR,    "set schema_version_minor to 03" },
+  };
+
+
+/* ---------------------------- 22.03 -> 22.04 ------------------------------ */
+
+// Only the indices changed, they are recreated after any upgrade
+
+#define U_v2204_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2204_SCVER_MINOR                    \
+  "UPDATE admin SET value = '04' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2204_queries[] =
+  {
+    { U_v2204_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2204_SCVER_MINOR,    "set schema_version_minor to 04" },
+  };
+
+
+/* ---------------------------- 22.04 -> 22.05 ------------------------------ */
+
+#define U_v2205_CREATE_GROUP_STATS							\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   type              INTEGER NOT NULL,"				\
+  "   persistentid      INTEGER NOT NULL,"				\
+  "   scope             INTEGER NOT NULL,"				\
+  "   dirty             INTEGER DEFAULT 1,"				\
+  "   album             VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_sort        VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_artist      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   album_artist_sort VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   songartistid      INTEGER DEFAULT 0,"				\
+  "   track_count       INTEGER DEFAULT 0,"				\
+  "   album_count       INTEGER DEFAULT 0,"				\
+  "   song_length       INTEGER DEFAULT 0,"				\
+  "   data_kind         INTEGER DEFAULT 0,"				\
+  "   media_kind        INTEGER DEFAULT 0,"				\
+  "   year              INTEGER DEFAULT 0,"				\
+  "   date_released     INTEGER DEFAULT 0,"				\
+  "   time_added        INTEGER DEFAULT 0,"				\
+  "   time_played       INTEGER DEFAULT 0,"				\
+  "   seek              INTEGER DEFAULT 0,"				\
+  "   PRIMARY KEY (type, persistentid, scope)"				\
+  ");"
+
+// Rows are created dirty, so the stats are computed by the first refresh
+#define U_v2205_GROUP_STATS_ALBUMS \
+  "INSERT OR IGNORE INTO group_stats (type, persistentid, scope) SELECT DISTINCT 1, songalbumid, 0 FROM files;"
+#define U_v2205_GROUP_STATS_ALBUMS_MKIND \
+  "INSERT OR IGNORE INTO group_stats (type, persistentid, scope) SELECT DISTINCT 1, songalbumid, media_kind FROM files;"
+#define U_v2205_GROUP_STATS_ARTISTS \
+  "INSERT OR IGNORE INTO group_stats (type, persistentid, scope) SELECT DISTINCT 2, songartistid, 0 FROM files;"
+#define U_v2205_GROUP_STATS_ARTISTS_MKIND \
+  "INSERT OR IGNORE INTO group_stats (type, persistentid, scope) SELECT DISTINCT 2, songartistid, media_kind FROM files;"
+
+#define U_v2205_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2205_SCVER_MINOR                    \
+  "UPDATE admin SET value = '05' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2205_queries[] =
+  {
+    { U_v2205_CREATE_GROUP_STATS, "create table group_stats" },
+    { U_v2205_GROUP_STATS_ALBUMS, "add album rows to group_stats" },
+    { U_v2205_GROUP_STATS_ALBUMS_MKIND, "add album media kind rows to group_stats" },
+    { U_v2205_GROUP_STATS_ARTISTS, "add artist rows to group_stats" },
+    { U_v2205_GROUP_STATS_ARTISTS_MKIND, "add artist media kind rows to group_stats" },
+
+    { U_v2205_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2205_SCVER_MINOR,    "set schema_version_minor to 05" },
+  };
+
+
+/* ---------------------------- 22.05 -> 22.06 ------------------------------ */
+
+#define U_v2206_CREATE_SMARTPL_CACHE				\
+  "CREATE TABLE IF NOT EXISTS smartpl_cache ("		\
+  "   playlistid     INTEGER PRIMARY KEY NOT NULL,"	\
+  "   query          TEXT NOT NULL,"			\
+  "   built          INTEGER NOT NULL,"			\
+  "   expires        INTEGER DEFAULT 0"			\
+  ");"
+
+#define U_v2206_CREATE_SMARTPL_ITEMS				\
+  "CREATE TABLE IF NOT EXISTS smartpl_items ("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL"			\
+  ");"
+
+#define U_v2206_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2206_SCVER_MINOR                    \
+  "UPDATE admin SET value = '06' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2206_queries[] =
+  {
+    { U_v2206_CREATE_SMARTPL_CACHE, "create table smartpl_cache" },
+    { U_v2206_CREATE_SMARTPL_ITEMS, "create table smartpl_items" },
+
+    { U_v2206_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2206_SCVER_MINOR,    "set schema_version_minor to 06" },
+  };
+
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1489,6 +1618,34 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2202:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2203_queries, ARRAY_SIZE(db_upgrade_v2203_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2203:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2204_queries, ARRAY_SIZE(db_upgrade_v2204_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2204:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2205_queries, ARRAY_SIZE(db_upgrade_v2205_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2205:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2206_queries, ARRAY_SIZE(db_upgrade_v2206_queries));
+      if (ret < 0)
+	return -1;
+
       /* Last case statement is the only one that ends with a break statement! */
       break;
 
@@ -20,6 +20,8 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -359,34 +361,167 @@ dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errms
   dmap_add_string(evbuf, "msts", errmsg);
 }
 
-int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+/* An encoding plan is the list of song fields to send, resolved once per
+ * request, so encoding a song is just a matter of collecting the values. The
+ * song is then written with a single reservation in the song list, instead of
+ * an evbuffer_add() for each tag, length and value.
+ */
+struct dmap_encode_step
 {
-  const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
-  int32_t val;
-  int want_mikd;
-  int want_asdk;
-  int want_ased;
+  ssize_t mfi_offset;
+  int size; // Size of the value, 0 means it has no value
+
+  // Scratch for the song being encoded
+  int len;
+  const char *str;
+  uint64_t val;
+};
+
+struct dmap_encode_plan
+{
+  struct dmap_encode_step *steps;
+  int nsteps;
+
+  bool want_mikd;
+  bool want_asdk;
+  bool want_ased;
+  bool sort_tags;
+};
+
+static int
+dmap_type_size(enum dmap_type type)
+{
+  switch (type)
+    {
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_BYTE:
+	return 1;
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_SHORT:
+	return 2;
+      case DMAP_TYPE_UINT:
+      case DMAP_TYPE_INT:
+      case DMAP_TYPE_DATE:
+	return 4;
+      case DMAP_TYPE_ULONG:
+      case DMAP_TYPE_LONG:
+	return 8;
+      default:
+	return 0;
+    }
+}
+
+static inline uint8_t *
+dmap_put_header(uint8_t *p, const char *tag, uint32_t len)
+{
+  memcpy(p, tag, 4);
+  p[4] = (len >> 24) & 0xff;
+  p[5] = (len >> 16) & 0xff;
+  p[6] = (len >> 8) & 0xff;
+  p[7] = len & 0xff;
+
+  return p + 8;
+}
+
+static inline uint8_t *
+dmap_put_value(uint8_t *p, uint64_t val, int size)
+{
   int i;
-  int ret;
 
-  want_mikd = 0;
-  want_asdk = 0;
-  want_ased = 0;
+  for (i = size - 1; i >= 0; i--)
+    {
+      p[i] = val & 0xff;
+      val >>= 8;
+    }
+
+  return p + size;
+}
 
-  i = -1;
-  while (1)
+static inline uint8_t *
+dmap_put_string(uint8_t *p, const char *tag, const char *str, int len)
+{
+  p = dmap_put_header(p, tag, len);
+  if (len > 0)
+    memcpy(p, str, len);
+
+  return p + len;
+}
+
+// Same conversion as dmap_add_field(), returns false if the field should be
+// left out because the value is 0
+static bool
+dmap_step_value_get(struct dmap_encode_step *step, const char *strval)
+{
+  uint32_t u32;
+  int32_t i32;
+  uint64_t u64;
+  int64_t i64;
+
+  switch (step->df->type)
     {
-      i++;
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_UINT:
+	if (safe_atou32(strval, &u32) < 0)
+	  u32 = 0;
+	step->val = u32;
+	break;
+
+      case DMAP_TYPE_BYTE:
+      case DMAP_TYPE_SHORT:
+      case DMAP_TYPE_INT:
+	if (safe_atoi32(strval, &i32) < 0)
+	  i32 = 0;
+	step->val = (int64_t)i32;
+	break;
+
+      case DMAP_TYPE_ULONG:
+	if (safe_atou64(strval, &u64) < 0)
+	  u64 = 0;
+	step->val = u64;
+	break;
+
+      case DMAP_TYPE_LONG:
+	if (safe_atoi64(strval, &i64) < 0)
+	  i64 = 0;
+	step->val = i64;
+	break;
+
+      case DMAP_TYPE_DATE:
+	if (safe_atoi64(strval, &i64) < 0)
+	  i64 = 0;
+	step->val = (uint32_t)i64;
+	break;
+
+      default:
+	return false;
+    }
+
+  return (step->val != 0);
+}
 
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  struct dmap_encode_plan *plan;
+  const struct dmap_field_map *dfm;
+  const struct dmap_field *df;
+  int nfields;
+  int i;
+
+  nfields = (nmeta > 0) ? nmeta : (sizeof(dmap_fields) / sizeof(dmap_fields[0]));
+
+  CHECK_NULL(L_DAAP, plan = calloc(1, sizeof(struct dmap_encode_plan)));
+  CHECK_NULL(L_DAAP, plan->steps = calloc(nfields, sizeof(struct dmap_encode_step)));
+
+  plan->sort_tags = sort_tags;
+
+  for (i = 0; i < nfields; i++)
+    {
       /* Specific meta tags requested (or default list) */
       if (nmeta > 0)
 	{
-	  if (i == nmeta)
-	    break;
-
 	  df = meta[i];
 	  if (df->dfm)
 	    dfm = df->dfm;
@@ -396,10 +531,6 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       /* No specific meta tags requested, send out everything */
       else
 	{
-	  /* End of list */
-	  if (i == (sizeof(dmap_fields) / sizeof(dmap_fields[0])))
-	    break;
-
 	  df = &dmap_fields[i];
 	  dfm = dmap_fields[i].dfm;
 	}
@@ -407,7 +538,7 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       /* Extradata not in media_file_info but flag for reply */
       if (dfm == &dfm_dmap_ased)
 	{
-	  want_ased = 1;
+	  plan->want_ased = true;
 	  continue;
 	}
 
@@ -418,80 +549,168 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       /* Will be prepended to the list */
       if (dfm == &dfm_dmap_mikd)
 	{
-	  /* item kind */
-	  want_mikd = 1;
+	  plan->want_mikd = true;
 	  continue;
 	}
       else if (dfm == &dfm_dmap_asdk)
 	{
-	  /* data kind */
-	  want_asdk = 1;
+	  plan->want_asdk = true;
 	  continue;
 	}
 
-      DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
-
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
-
-      if (!(*strval) || (**strval == '\0'))
-	continue;
-
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
+	plan->steps[plan->nsteps].size = 4;
+      else if (df->type == DMAP_TYPE_STRING)
+	plan->steps[plan->nsteps].size = -1;
+      else if ((plan->steps[plan->nsteps].size = dmap_type_size(df->type)) == 0)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  if (df->type != DMAP_TYPE_VERSION && df->type != DMAP_TYPE_LIST)
+	    DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
 	  continue;
 	}
 
-      dmap_add_field(song, df, *strval, 0);
-
-      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+      plan->steps[plan->nsteps].df = df;
+      plan->steps[plan->nsteps].mfi_offset = dfm->mfi_offset;
+      plan->nsteps++;
     }
 
-  /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
-  if (want_ased)
+  return plan;
+}
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan)
+{
+  if (!plan)
+    return;
+
+  free(plan->steps);
+  free(plan);
+}
+
+int
+dmap_encode_file_metadata(struct evbuffer *songlist, struct dmap_encode_plan *plan, struct db_media_file_info *dbmfi)
+{
+  struct evbuffer_iovec iov;
+  struct dmap_encode_step *step;
+  const char *sort_values[4] = { dbmfi->title_sort, dbmfi->artist_sort, dbmfi->album_sort, dbmfi->album_artist_sort };
+  const char *sort_tags[4] = { "assn", "assa", "assu", "assl" };
+  int sort_lens[4];
+  char **strval;
+  uint8_t *p;
+  size_t len;
+  int32_t val;
+  int i;
+  int ret;
+
+  /* First pass collects the values and works out the size of the song */
+  len = 0;
+  for (i = 0; i < plan->nsteps; i++)
     {
-      dmap_add_short(song, "ased", 1);
-      dmap_add_short(song, "asac", 1);
+      step = &plan->steps[i];
+      step->len = 0;
+
+      strval = (char **) ((char *)dbmfi + step->mfi_offset);
+
+      if (!(*strval) || (**strval == '\0'))
+	continue;
+
+      step->str = *strval;
+
+      if (step->size < 0)
+	step->len = strlen(*strval);
+      else if (step->df->dfm == &dfm_dmap_ascd || dmap_step_value_get(step, *strval))
+	step->len = step->size;
+      else
+	continue;
+
+      len += 8 + step->len;
     }
 
-  if (sort_tags)
+  if (plan->want_mikd)
+    len += 9;
+  if (plan->want_asdk)
+    len += 9;
+  if (plan->want_ased)
+    len += 2 * 10;
+
+  if (plan->sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      for (i = 0; i < 4; i++)
+	{
+	  sort_lens[i] = sort_values[i] ? strlen(sort_values[i]) : 0;
+	  len += 8 + sort_lens[i];
+	}
 
       if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+	len += 8 + strlen(dbmfi->composer_sort);
     }
 
-  val = 0;
-  if (want_mikd)
-    val += 9;
-  if (want_asdk)
-    val += 9;
+  ret = evbuffer_reserve_space(songlist, 8 + len, &iov, 1);
+  if (ret < 1)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
 
-  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
+      return -1;
+    }
 
-  /* Prepend mikd & asdk if needed */
-  if (want_mikd)
+  /* Second pass writes it */
+  p = dmap_put_header(iov.iov_base, "mlit", len);
+
+  /* dmap.itemkind must come first */
+  if (plan->want_mikd)
     {
-      /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
+      if (safe_atoi32(dbmfi->item_kind, &val) < 0)
 	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
+      p = dmap_put_header(p, "mikd", 1);
+      p = dmap_put_value(p, val, 1);
     }
-  if (want_asdk)
+  if (plan->want_asdk)
     {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
+      if (safe_atoi32(dbmfi->data_kind, &val) < 0)
 	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+      p = dmap_put_header(p, "asdk", 1);
+      p = dmap_put_value(p, val, 1);
     }
 
-  ret = evbuffer_add_buffer(songlist, song);
+  for (i = 0; i < plan->nsteps; i++)
+    {
+      step = &plan->steps[i];
+      if (step->len == 0)
+	continue;
+
+      if (step->size < 0)
+	p = dmap_put_string(p, step->df->tag, step->str, step->len);
+      else if (step->df->dfm == &dfm_dmap_ascd)
+	p = dmap_put_string(p, step->df->tag, step->str, 4);
+      else
+	{
+	  p = dmap_put_header(p, step->df->tag, step->len);
+	  p = dmap_put_value(p, step->val, step->len);
+	}
+    }
+
+  /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
+  if (plan->want_ased)
+    {
+      p = dmap_put_header(p, "ased", 2);
+      p = dmap_put_value(p, 1, 2);
+      p = dmap_put_header(p, "asac", 2);
+      p = dmap_put_value(p, 1, 2);
+    }
+
+  if (plan->sort_tags)
+    {
+      for (i = 0; i < 4; i++)
+	p = dmap_put_string(p, sort_tags[i], sort_values[i], sort_lens[i]);
+
+      if (dbmfi->composer_sort)
+	p = dmap_put_string(p, "assc", dbmfi->composer_sort, strlen(dbmfi->composer_sort));
+    }
+
+  iov.iov_len = p - (uint8_t *)iov.iov_base;
+
+  ret = evbuffer_commit_space(songlist, &iov, 1);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
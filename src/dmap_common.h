@@ -78,8 +78,20 @@ dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg);
 
+struct dmap_encode_plan;
+
+/* Resolves the requested meta fields (all fields if nmeta is 0) into a plan
+ * for dmap_encode_file_metadata(). A plan holds scratch for the song being
+ * encoded, so it must not be shared between threads.
+ */
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags);
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan);
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags);
+dmap_encode_file_metadata(struct evbuffer *songlist, struct dmap_encode_plan *plan, struct db_media_file_info *dbmfi);
 
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
@@ -33,6 +33,9 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 
@@ -47,6 +50,7 @@
 #include "evthr.h"
 #include "httpd.h"
 #include "httpd_internal.h"
+#include "httpd_router.h"
 #include "transcode.h"
 #include "cache.h"
 #include "listener.h"
@@ -59,6 +63,10 @@
 #endif
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// Compressed replies are built in blocks of this size
+#define GZIP_BLOCK_SIZE (64 * 1024)
+// Replies larger than this are compressed and sent in chunks of this much input
+#define GZIP_CHUNK_SIZE (1024 * 1024)
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -104,6 +112,32 @@ struct stream_ctx {
   off_t end_offset;
   int marked;
   struct transcode_ctx *xcode;
+  off_t xcode_offset;
+
+  // Identifies the transcoded output in the segment cache
+  uint32_t time_modified;
+  enum transcode_profile profile;
+  int bit_rate;
+  struct cache_xcode_segment segment;
+};
+
+struct static_file {
+  char *path; // Relative to the web root, e.g. /assets/index.js
+  const char *ctype;
+  char etag[24];
+  char gzetag[28];
+  bool is_hashed;
+  uint8_t *data;
+  size_t len;
+  uint8_t *gzdata; // NULL if gzip doesn't make the file smaller
+  size_t gzlen;
+};
+
+struct static_files {
+  int refcount;
+  struct static_file *files; // Sorted by path
+  int nfiles;
+  int size;
 };
 
 static const struct content_type_map ext2ctype[] =
@@ -127,22 +161,57 @@ static char webroot_directory[PATH_MAX];
 
 static const char *httpd_allow_origin;
 static int httpd_port;
+static int httpd_gzip_level = Z_DEFAULT_COMPRESSION;
+static size_t httpd_gzip_min_size = 512;
+
+// Limits for the in-memory cache of files in the web root
+#define STATIC_FILE_MAX_SIZE (4 * 1024 * 1024)
+#define STATIC_FILES_MAX_TOTAL (64 * 1024 * 1024)
+static struct static_files *static_files;
+static pthread_mutex_t static_files_lck = PTHREAD_MUTEX_INITIALIZER;
+// False after httpd_deinit(), so a reload still running won't install files
+static bool static_files_enabled;
+
+
+// The server is designed around httpd threads listening for requests (each
+// thread has its own socket bound to the port, and the kernel distributes the
+// connections). When received, the request is passed to a thread from one of
+// the lanes below, where a handler will process it and prepare a response for
+// the httpd thread to send back. The idea is that the httpd thread never
+// blocks. The handler in the lane thread can block, but shouldn't hold the
+// thread if it is a long-running request (e.g. a long poll), because then we
+// can run out of threads. The handler should use events to avoid this.
+// Handlers, that are non-blocking and where the response must not be delayed
+// can use HTTPD_HANDLER_REALTIME, then the httpd thread calls it directly
+// (sync) instead of the async worker. Streaming and artwork have their own
+// lanes, so e.g. transcoding can't hold up a JSON API call.
+#define THREADPOOL_NTHREADS_MAX 32
+
+static int httpd_nthreads;
+static struct evthr_pool *httpd_threadpool;
 
+struct lane
+{
+  const char *cfg_option;
+  int cfg_default;
+  struct evthr_pool *pool;
+  pthread_mutex_t lck;
+  struct httpd_lane_stats stats;
+};
 
-// The server is designed around a single thread listening for requests. When
-// received, the request is passed to a thread from the worker pool, where a
-// handler will process it and prepare a response for the httpd thread to send
-// back. The idea is that the httpd thread never blocks. The handler in the
-// worker thread can block, but shouldn't hold the thread if it is a long-
-// running request (e.g. a long poll), because then we can run out of worker
-// threads. The handler should use events to avoid this. Handlers, that are non-
-// blocking and where the response must not be delayed can use
-// HTTPD_HANDLER_REALTIME, then the httpd thread calls it directly (sync)
-// instead of the async worker. In short, you shouldn't need to increase the
-// below.
-#define THREADPOOL_NTHREADS 1
+struct lane_request
+{
+  struct httpd_request *hreq;
+  struct lane *lane;
+  struct timespec queued;
+};
 
-static struct evthr_pool *httpd_threadpool;
+static struct lane httpd_lanes[HTTPD_LANE_MAX] =
+{
+  [HTTPD_LANE_DEFAULT] = { .cfg_option = "httpd_threads_default", .cfg_default = 4, .stats.name = "default" },
+  [HTTPD_LANE_ARTWORK] = { .cfg_option = "httpd_threads_artwork", .cfg_default = 2, .stats.name = "artwork" },
+  [HTTPD_LANE_STREAM]  = { .cfg_option = "httpd_threads_stream",  .cfg_default = 2, .stats.name = "stream" },
+};
 
 
 /* -------------------------------- HELPERS --------------------------------- */
@@ -190,6 +259,16 @@ content_type_from_ext(const char *ext)
   return NULL;
 }
 
+static bool
+request_accepts_gzip(struct httpd_request *hreq)
+{
+  const char *param;
+
+  param = httpd_header_find(hreq->in_headers, "Accept-Encoding");
+
+  return (param && (strstr(param, "gzip") || strstr(param, "*")));
+}
+
 static const char *
 content_type_from_profile(enum transcode_profile profile)
 {
@@ -245,47 +324,20 @@ basic_auth_cred_extract(char **user, char **pwd, const char *auth)
 /* --------------------------- MODULES INTERFACE ---------------------------- */
 
 static void
-modules_handlers_unset(struct httpd_uri_map *uri_map)
+modules_handlers_unset(struct httpd_module *m)
 {
-  struct httpd_uri_map *uri;
-
-  for (uri = uri_map; uri->preg; uri++)
-    {
-      regfree(uri->preg); // Frees allocation by regcomp
-      free(uri->preg); // Frees our own calloc
-    }
+  httpd_router_free(m->router, m->handlers);
+  m->router = NULL;
 }
 
 static int
-modules_handlers_set(struct httpd_uri_map *uri_map)
+modules_handlers_set(struct httpd_module *m)
 {
-  struct httpd_uri_map *uri;
-  char buf[64];
-  int ret;
-
-  for (uri = uri_map; uri->handler; uri++)
-    {
-      uri->preg = calloc(1, sizeof(regex_t));
-      if (!uri->preg)
-	{
-	  DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, out of memory");
-	  goto error;
-	}
-
-      ret = regcomp(uri->preg, uri->regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-	{
-	  regerror(ret, uri->preg, buf, sizeof(buf));
-	  DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, regexp error: %s\n", buf);
-	  goto error;
-	}
-    }
+  m->router = httpd_router_new(m->handlers);
+  if (!m->router)
+    return -1;
 
   return 0;
-
- error:
-  modules_handlers_unset(uri_map);
-  return -1;
 }
 
 static int
@@ -304,7 +356,7 @@ modules_init(void)
 	  return -1;
 	}
 
-      if (modules_handlers_set(m->handlers) != 0)
+      if (modules_handlers_set(m) != 0)
 	{
 	  DPRINTF(E_FATAL, L_HTTPD, "%s handler configuration failed\n", m->name);
 	  return -1;
@@ -326,7 +378,7 @@ modules_deinit(void)
       if (m->initialized && m->deinit)
 	m->deinit();
 
-      modules_handlers_unset(m->handlers);
+      modules_handlers_unset(m);
     }
 }
 
@@ -358,6 +410,354 @@ modules_search(const char *path)
 }
 
 
+/* --------------------------- STATIC FILE CACHE ---------------------------- */
+
+// The files of the web interface are read into memory (and gzipped) when the
+// server starts or gets a SIGHUP, so serve_file() can reply without touching
+// the disk. Files that are too large, or that were added later, are still
+// served from disk.
+
+static int
+static_file_compare(const void *a, const void *b)
+{
+  const struct static_file *file_a = a;
+  const struct static_file *file_b = b;
+
+  return strcmp(file_a->path, file_b->path);
+}
+
+// The web interface build (vite) names files in assets/ like index-B2aF9x1c.js
+// if it is set up to include a content hash. Such files never change, so
+// clients may cache them for as long as they like.
+static bool
+static_file_is_hashed(const char *path)
+{
+  const char *ext;
+  const char *p;
+  bool has_lower = false;
+  bool has_other = false;
+
+  if (strncmp(path, "/assets/", strlen("/assets/")) != 0)
+    return false;
+
+  ext = strrchr(path, '.');
+  if (!ext)
+    return false;
+
+  for (p = ext - 1; p > path && (isalnum((unsigned char)*p) || *p == '_'); p--)
+    {
+      has_lower |= islower((unsigned char)*p);
+      has_other |= !islower((unsigned char)*p);
+    }
+
+  return (*p == '-' && ext - p - 1 == 8 && has_lower && has_other);
+}
+
+static void
+static_files_free(struct static_files *sf)
+{
+  int i;
+
+  for (i = 0; i < sf->nfiles; i++)
+    {
+      free(sf->files[i].path);
+      free(sf->files[i].data);
+      free(sf->files[i].gzdata);
+    }
+
+  free(sf->files);
+  free(sf);
+}
+
+static void
+static_files_unref(struct static_files *sf)
+{
+  if (__atomic_sub_fetch(&sf->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  static_files_free(sf);
+}
+
+static struct static_files *
+static_files_ref(void)
+{
+  struct static_files *sf;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&static_files_lck));
+  sf = static_files;
+  if (sf)
+    __atomic_add_fetch(&sf->refcount, 1, __ATOMIC_ACQ_REL);
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&static_files_lck));
+
+  return sf;
+}
+
+// Called by libevent when it is done sending data that we added by reference
+static void
+static_file_sent_cb(const void *data, size_t datalen, void *extra)
+{
+  static_files_unref(extra);
+}
+
+static int
+static_file_gzip(struct static_file *file)
+{
+  struct evbuffer *in;
+  struct evbuffer *gzbuf;
+
+  CHECK_NULL(L_HTTPD, in = evbuffer_new());
+  evbuffer_add_reference(in, file->data, file->len, NULL, NULL);
+
+  gzbuf = httpd_gzip_deflate(in);
+  evbuffer_free(in);
+  if (!gzbuf)
+    return -1;
+
+  // Not worth it for already compressed files like images
+  file->gzlen = evbuffer_get_length(gzbuf);
+  if (file->gzlen < file->len - file->len / 10)
+    {
+      CHECK_NULL(L_HTTPD, file->gzdata = malloc(file->gzlen));
+      evbuffer_remove(gzbuf, file->gzdata, file->gzlen);
+    }
+  else
+    file->gzlen = 0;
+
+  evbuffer_free(gzbuf);
+  return 0;
+}
+
+static int
+static_file_add(struct static_files *sf, size_t *total, const char *path, const char *fullpath)
+{
+  struct static_file *file;
+  char deref[PATH_MAX];
+  struct stat sb;
+  uint64_t hash;
+  ssize_t got;
+  int fd;
+
+  if (!realpath(fullpath, deref) || path_is_legal(deref) != 0)
+    return -1;
+
+  if (stat(deref, &sb) < 0 || !S_ISREG(sb.st_mode))
+    return -1;
+
+  if (sb.st_size > STATIC_FILE_MAX_SIZE || *total + sb.st_size > STATIC_FILES_MAX_TOTAL)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Not caching %s, too large\n", deref);
+      return -1;
+    }
+
+  fd = open(deref, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (sf->nfiles + 1 > sf->size)
+    {
+      sf->size += 64;
+      CHECK_NULL(L_HTTPD, sf->files = realloc(sf->files, sf->size * sizeof(struct static_file)));
+    }
+
+  file = &sf->files[sf->nfiles];
+  memset(file, 0, sizeof(struct static_file));
+
+  file->len = sb.st_size;
+  CHECK_NULL(L_HTTPD, file->data = malloc(file->len ? file->len : 1));
+
+  got = read(fd, file->data, file->len);
+  close(fd);
+  if (got != file->len)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not read %s for the file cache\n", deref);
+      free(file->data);
+      return -1;
+    }
+
+  CHECK_NULL(L_HTTPD, file->path = strdup(path));
+
+  file->ctype = content_type_from_ext(strrchr(path, '.'));
+  if (!file->ctype)
+    file->ctype = "application/octet-stream";
+
+  file->is_hashed = static_file_is_hashed(path);
+
+  // Strong ETag, since the content is exactly what we hash
+  hash = murmur_hash64(file->data, file->len, 0);
+  snprintf(file->etag, sizeof(file->etag), "\"%016" PRIx64 "\"", hash);
+  snprintf(file->gzetag, sizeof(file->gzetag), "\"%016" PRIx64 "-gz\"", hash);
+
+  static_file_gzip(file);
+
+  *total += file->len + file->gzlen;
+  sf->nfiles++;
+  return 0;
+}
+
+static void
+static_files_scan(struct static_files *sf, size_t *total, const char *dirpath, int depth)
+{
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char path[PATH_MAX];
+  char fullpath[PATH_MAX];
+  int ret;
+
+  // Guard against symlink loops
+  if (depth > 8)
+    return;
+
+  ret = snprintf(fullpath, sizeof(fullpath), "%s%s", webroot_directory, dirpath);
+  if ((ret < 0) || (ret >= sizeof(fullpath)))
+    return;
+
+  dir = opendir(fullpath);
+  if (!dir)
+    return;
+
+  while ((de = readdir(dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      ret = snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      ret = snprintf(fullpath, sizeof(fullpath), "%s%s", webroot_directory, path);
+      if ((ret < 0) || (ret >= sizeof(fullpath)) || stat(fullpath, &sb) < 0)
+	continue;
+
+      if (S_ISDIR(sb.st_mode))
+	static_files_scan(sf, total, path, depth + 1);
+      else
+	static_file_add(sf, total, path, fullpath);
+    }
+
+  closedir(dir);
+}
+
+static struct static_file *
+static_file_find(struct static_files *sf, const char *path)
+{
+  struct static_file key;
+  struct static_file *file;
+  char buf[PATH_MAX];
+  size_t len;
+
+  key.path = (char *)path;
+  file = bsearch(&key, sf->files, sf->nfiles, sizeof(struct static_file), static_file_compare);
+  if (file)
+    return file;
+
+  // Maybe a directory, then we serve its index.html like serve_file() does
+  len = strlen(path);
+  if (snprintf(buf, sizeof(buf), "%s%s", path, (len > 0 && path[len - 1] == '/') ? "index.html" : "/index.html") >= sizeof(buf))
+    return NULL;
+
+  key.path = buf;
+  return bsearch(&key, sf->files, sf->nfiles, sizeof(struct static_file), static_file_compare);
+}
+
+// Returns true if the request was served from the cache
+static bool
+static_file_serve(struct httpd_request *hreq)
+{
+  struct static_files *sf;
+  struct static_file *file;
+  bool use_gzip;
+
+  sf = static_files_ref();
+  if (!sf)
+    return false;
+
+  file = static_file_find(sf, hreq->path);
+  if (!file)
+    {
+      static_files_unref(sf);
+      return false;
+    }
+
+  use_gzip = file->gzdata && request_accepts_gzip(hreq);
+
+  httpd_header_add(hreq->out_headers, "Vary", "Accept-Encoding");
+
+  if (httpd_request_etag_matches(hreq, use_gzip ? file->gzetag : file->etag))
+    {
+      static_files_unref(sf);
+      httpd_send_reply(hreq, HTTP_NOTMODIFIED, NULL, HTTPD_SEND_NO_GZIP);
+      return true;
+    }
+
+  if (file->is_hashed)
+    {
+      httpd_header_remove(hreq->out_headers, "Cache-Control");
+      httpd_header_add(hreq->out_headers, "Cache-Control", "public,max-age=31536000,immutable");
+    }
+
+  httpd_header_add(hreq->out_headers, "Content-Type", file->ctype);
+
+  // The reference to sf is released by static_file_sent_cb when the data has
+  // been sent, so the data stays valid even if the cache is rebuilt meanwhile
+  if (use_gzip)
+    {
+      httpd_header_add(hreq->out_headers, "Content-Encoding", "gzip");
+      evbuffer_add_reference(hreq->out_body, file->gzdata, file->gzlen, static_file_sent_cb, sf);
+    }
+  else
+    evbuffer_add_reference(hreq->out_body, file->data, file->len, static_file_sent_cb, sf);
+
+  httpd_send_reply(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP);
+  return true;
+}
+
+static void
+static_files_load(void)
+{
+  struct static_files *sf;
+  struct static_files *old;
+  size_t total = 0;
+
+  CHECK_NULL(L_HTTPD, sf = calloc(1, sizeof(struct static_files)));
+  sf->refcount = 1; // Held by the static_files global
+
+  static_files_scan(sf, &total, "", 0);
+
+  qsort(sf->files, sf->nfiles, sizeof(struct static_file), static_file_compare);
+
+  DPRINTF(E_INFO, L_HTTPD, "Cached %d files from web root (%zu bytes)\n", sf->nfiles, total);
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&static_files_lck));
+  if (static_files_enabled)
+    {
+      old = static_files;
+      static_files = sf;
+    }
+  else
+    old = sf;
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&static_files_lck));
+
+  if (old)
+    static_files_unref(old);
+}
+
+static void
+static_files_unload(void)
+{
+  struct static_files *old;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&static_files_lck));
+  old = static_files;
+  static_files = NULL;
+  static_files_enabled = false;
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&static_files_lck));
+
+  if (old)
+    static_files_unref(old);
+}
+
+
 /* --------------------------- REQUEST HELPERS ------------------------------ */
 
 static void
@@ -382,7 +782,7 @@ void
 httpd_request_handler_set(struct httpd_request *hreq)
 {
   struct httpd_uri_map *map;
-  int ret;
+  struct httpd_router_match match;
 
   // Path with e.g. /api -> JSON module
   hreq->module = modules_search(hreq->path);
@@ -391,20 +791,45 @@ httpd_request_handler_set(struct httpd_request *hreq)
       return;
     }
 
-  for (map = hreq->module->handlers; map->handler; map++)
-    {
-      // Check if handler supports the current http request method
-      if (map->method && hreq->method && !(map->method & hreq->method))
-	continue;
+  if (!hreq->module->router)
+    return;
 
-      ret = regexec(map->preg, hreq->path, 0, NULL, 0);
-      if (ret != 0)
-	continue;
+  httpd_router_match(&match, hreq->module->router, hreq->module->handlers, hreq->path, hreq->method);
+  if (match.handler < 0)
+    return;
+
+  map = &hreq->module->handlers[match.handler];
+
+  hreq->handler = map->handler;
+  hreq->is_async = !(map->flags & HTTPD_HANDLER_REALTIME);
+
+  if (map->flags & HTTPD_HANDLER_STREAM)
+    hreq->lane = HTTPD_LANE_STREAM;
+  else if (map->flags & HTTPD_HANDLER_ARTWORK)
+    hreq->lane = HTTPD_LANE_ARTWORK;
+  else
+    hreq->lane = HTTPD_LANE_DEFAULT;
+
+  memcpy(hreq->path_ids, match.ids, match.nids * sizeof(int64_t));
+  hreq->path_nids = match.nids;
+}
 
-      hreq->handler = map->handler;
-      hreq->is_async = !(map->flags & HTTPD_HANDLER_REALTIME);
-      break;
+int
+httpd_lanes_stats_get(struct httpd_lane_stats *stats)
+{
+  struct lane *lane;
+  int i;
+
+  for (i = 0; i < HTTPD_LANE_MAX; i++)
+    {
+      lane = &httpd_lanes[i];
+
+      pthread_mutex_lock(&lane->lck);
+      stats[i] = lane->stats;
+      pthread_mutex_unlock(&lane->lck);
     }
+
+  return HTTPD_LANE_MAX;
 }
 
 void
@@ -504,6 +929,9 @@ serve_file(struct httpd_request *hreq)
   if (!httpd_request_is_authorized(hreq))
     return;
 
+  if (static_file_serve(hreq))
+    return;
+
   ret = snprintf(path, sizeof(path), "%s%s", webroot_directory, hreq->path);
   if ((ret < 0) || (ret >= sizeof(path)))
     {
@@ -649,6 +1077,7 @@ stream_free(struct stream_ctx *st)
   if (st->fd >= 0)
     close(st->fd);
 
+  cache_xcode_segment_close(&st->segment);
   transcode_cleanup(&st->xcode);
   free(st);
 }
@@ -685,6 +1114,7 @@ stream_new(struct media_file_info *mfi, struct httpd_request *hreq, event_callba
 
   CHECK_NULL(L_HTTPD, st = calloc(1, sizeof(struct stream_ctx)));
   st->fd = -1;
+  st->segment.fd = -1;
 
   st->ev = event_new(hreq->evbase, -1, EV_PERSIST, stream_cb, st);
   if (!st->ev)
@@ -770,6 +1200,16 @@ stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile
     st->stream_size -= (st->size - end_offset);
 
   st->start_offset = offset;
+  st->offset = offset;
+
+  st->time_modified = mfi->time_modified;
+  st->profile = profile;
+  st->bit_rate = quality.bit_rate;
+
+  // The client is seeking, so it might do so again. Have the rest of the file
+  // transcoded in the background, so next time we can skip the decoding.
+  if (offset > 0)
+    cache_xcode_segments_prefetch(mfi->id, mfi->time_modified, mfi->song_length, mfi->path, profile, quality.bit_rate);
 
   if (prepared_header)
     evbuffer_free(prepared_header);
@@ -787,7 +1227,6 @@ stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t
 {
   struct stream_ctx *st;
   struct stat sb;
-  off_t pos;
   int ret;
 
   st = stream_new(mfi, hreq, stream_cb);
@@ -824,14 +1263,9 @@ stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t
   st->offset = offset;
   st->end_offset = end_offset;
 
-  pos = lseek(st->fd, offset, SEEK_SET);
-  if (pos == (off_t) -1)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not seek into %s: %s\n", mfi->path, strerror(errno));
-
-      httpd_send_error(hreq, HTTP_BADREQUEST, "Bad Request");
-      goto error;
-    }
+  // Lets the file segments we add in stream_chunk_raw_cb() be sent with
+  // sendfile(), see evbuffer_add_file()
+  evbuffer_set_flags(hreq->out_body, EVBUFFER_FLAG_DRAINS_TO_FD);
 
   return st;
 
@@ -847,6 +1281,22 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
   int xcoded;
   int ret;
 
+  // If the output for the current position has been saved in the segment cache
+  // then we don't need to transcode it
+  ret = cache_xcode_segment_read(st->hreq->out_body, &st->segment, st->id, st->time_modified, st->profile, st->bit_rate, st->offset, STREAM_CHUNK_SIZE);
+  if (ret == 0)
+    {
+      DPRINTF(E_INFO, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+
+      stream_end(st);
+      return;
+    }
+  else if (ret > 0)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from segment cache; streaming file id %d\n", ret, st->id);
+      goto send;
+    }
+
   xcoded = transcode(st->hreq->out_body, NULL, st->xcode, STREAM_CHUNK_SIZE);
   if (xcoded <= 0)
     {
@@ -861,31 +1311,26 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
 
   DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
 
-  // Consume transcoded data until we meet start_offset
-  if (st->start_offset > st->offset)
-    {
-      ret = st->start_offset - st->offset;
-
-      if (ret < xcoded)
-	{
-	  evbuffer_drain(st->hreq->out_body, ret);
-	  st->offset += ret;
+  st->xcode_offset += xcoded;
 
-	  ret = xcoded - ret;
-	}
-      else
-	{
-	  evbuffer_drain(st->hreq->out_body, xcoded);
-	  st->offset += xcoded;
+  // Consume transcoded data until we meet the current position, which might be
+  // ahead because of the start offset or because of data from the cache
+  if (st->xcode_offset <= st->offset)
+    {
+      evbuffer_drain(st->hreq->out_body, xcoded);
 
-	  // Reschedule immediately - consume up to start_offset
-	  event_active(st->ev, 0, 0);
-	  return;
-	}
+      // Reschedule immediately - consume up to offset
+      event_active(st->ev, 0, 0);
+      return;
     }
-  else
-    ret = xcoded;
+  else if (st->xcode_offset - xcoded < st->offset)
+    {
+      evbuffer_drain(st->hreq->out_body, st->offset - (st->xcode_offset - xcoded));
+    }
+
+  ret = st->xcode_offset - st->offset;
 
+ send:
   httpd_send_reply_chunk(st->hreq, stream_chunk_resched_cb, st);
 
   st->offset += ret;
@@ -898,6 +1343,7 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
 {
   struct stream_ctx *st = arg;
   size_t chunk_size;
+  int segfd;
   int ret;
 
   if (st->end_offset && (st->offset > st->end_offset))
@@ -906,24 +1352,42 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
+  if (st->offset >= st->size)
+    {
+      DPRINTF(E_INFO, L_HTTPD, "Done streaming file id %d\n", st->id);
+
+      stream_end(st);
+      return;
+    }
+
   if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
     chunk_size = st->end_offset + 1 - st->offset;
   else
-    chunk_size = STREAM_CHUNK_SIZE;  
+    chunk_size = STREAM_CHUNK_SIZE;
 
-  ret = evbuffer_read(st->hreq->out_body, st->fd, chunk_size);
-  if (ret <= 0)
+  if (chunk_size > st->size - st->offset)
+    chunk_size = st->size - st->offset;
+
+  // Instead of reading the file into the buffer we add a reference to the file
+  // segment. Since out_body is marked as draining to a socket, libevent will
+  // use sendfile() when writing it to the connection, so the data never passes
+  // through userspace. The segment takes ownership of the fd it is given and
+  // may outlive st, hence the dup().
+  segfd = dup(st->fd);
+  if (segfd < 0 || evbuffer_add_file(st->hreq->out_body, segfd, st->offset, chunk_size) < 0)
     {
-      if (ret == 0)
-	DPRINTF(E_INFO, L_HTTPD, "Done streaming file id %d\n", st->id);
-      else
-	DPRINTF(E_LOG, L_HTTPD, "Streaming error, file id %d\n", st->id);
+      DPRINTF(E_LOG, L_HTTPD, "Streaming error, file id %d\n", st->id);
+
+      if (segfd >= 0)
+	close(segfd);
 
       stream_end(st);
       return;
     }
 
-  DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
+  ret = chunk_size;
+
+  DPRINTF(E_DBG, L_HTTPD, "Added %d bytes; streaming file id %d\n", ret, st->id);
 
   httpd_send_reply_chunk(st->hreq, stream_chunk_resched_cb, st);
 
@@ -976,19 +1440,74 @@ httpd_speaker_update_handler(short event_mask)
 
 /* ---------------------------- REQUEST CALLBACKS --------------------------- */
 
-// Worker thread, invoked by request_cb() below
+// Lane thread, invoked via request_async_dispatch() below
 static void
-request_async_cb(void *arg)
+request_async_cb(struct evthr *thr, void *arg, void *shared)
 {
-  struct httpd_request *hreq = *(struct httpd_request **)arg;
+  struct lane_request *lreq = arg;
+  struct httpd_request *hreq = lreq->hreq;
+  struct lane *lane = lreq->lane;
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&lane->lck);
+  lane->stats.queued--;
+  histogram_add(&lane->stats.wait_us, timespec_diff_us(start, lreq->queued));
+  pthread_mutex_unlock(&lane->lck);
 
 #ifdef HAVE_GETTID
-  DPRINTF(E_DBG, hreq->module->logdomain, "%s request '%s' in worker thread %d\n", hreq->module->name, hreq->uri, (int)gettid());
+  DPRINTF(E_DBG, hreq->module->logdomain, "%s request '%s' in %s lane thread %d\n", hreq->module->name, hreq->uri, lane->stats.name, (int)gettid());
 #endif
 
   // Some handlers require an evbase to schedule events
-  hreq->evbase = worker_evbase_get();
+  hreq->evbase = evthr_get_base(thr);
   hreq->module->request(hreq);
+
+  // hreq may have been freed now
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&lane->lck);
+  lane->stats.requests++;
+  histogram_add(&lane->stats.handler_us, timespec_diff_us(end, start));
+  pthread_mutex_unlock(&lane->lck);
+
+  free(lreq);
+}
+
+// httpd thread
+static void
+request_async_dispatch(struct httpd_request *hreq)
+{
+  struct lane_request *lreq;
+  struct lane *lane = &httpd_lanes[hreq->lane];
+  enum evthr_res res;
+
+  CHECK_NULL(L_HTTPD, lreq = calloc(1, sizeof(struct lane_request)));
+  lreq->hreq = hreq;
+  lreq->lane = lane;
+  clock_gettime(CLOCK_MONOTONIC, &lreq->queued);
+
+  pthread_mutex_lock(&lane->lck);
+  lane->stats.queued++;
+  pthread_mutex_unlock(&lane->lck);
+
+  res = evthr_pool_defer(lane->pool, request_async_cb, lreq);
+  if (res == EVTHR_RES_OK)
+    return;
+
+  DPRINTF(E_LOG, L_HTTPD, "Could not pass request '%s' to %s lane (error %d)\n", hreq->uri, lane->stats.name, res);
+
+  pthread_mutex_lock(&lane->lck);
+  lane->stats.queued--;
+  pthread_mutex_unlock(&lane->lck);
+
+  free(lreq);
+
+  // Still in the httpd thread, so the reply must be sent directly
+  hreq->is_async = false;
+  httpd_send_error(hreq, HTTP_SERVUNAVAIL, "Service Unavailable");
 }
 
 // httpd thread
@@ -1016,7 +1535,7 @@ request_cb(struct httpd_request *hreq, void *arg)
   httpd_request_handler_set(hreq);
   if (hreq->module && hreq->is_async)
     {
-      worker_execute(request_async_cb, &hreq, sizeof(struct httpd_request *), 0);
+      request_async_dispatch(hreq);
     }
   else if (hreq->module)
     {
@@ -1258,60 +1777,246 @@ httpd_xcode_profile_get(struct httpd_request *hreq)
   return XCODE_NONE;
 }
 
-struct evbuffer *
-httpd_gzip_deflate(struct evbuffer *in)
+static int
+gzip_init(z_stream *strm)
 {
-  struct evbuffer *out;
-  struct evbuffer_iovec iovec[1];
-  z_stream strm;
   int ret;
 
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-
-  // Just to keep Coverity from complaining about uninitialized values
-  strm.total_in = 0;
-  strm.total_out = 0;
+  // Sets zalloc, zfree and opaque to Z_NULL, and keeps Coverity from
+  // complaining about uninitialized values
+  memset(strm, 0, sizeof(z_stream));
 
   // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
-  ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  ret = deflateInit2(strm, httpd_gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
   if (ret != Z_OK)
     {
       DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
-      return NULL;
+      return -1;
     }
 
-  strm.next_in = evbuffer_pullup(in, -1);
-  strm.avail_in = evbuffer_get_length(in);
+  return 0;
+}
 
-  out = evbuffer_new();
-  if (!out)
+// Runs deflate on the input set in strm until it has all been consumed (or
+// until the gzip stream has been terminated if flush is Z_FINISH). The output
+// is added to out in blocks of GZIP_BLOCK_SIZE.
+static int
+gzip_deflate_block(struct evbuffer *out, z_stream *strm, int flush)
+{
+  struct evbuffer_iovec iovec[1];
+  int ret;
+
+  do
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
-      goto out_deflate_end;
+      ret = evbuffer_reserve_space(out, GZIP_BLOCK_SIZE, iovec, 1);
+      if (ret < 1)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
+	  return -1;
+	}
+
+      strm->next_out = iovec[0].iov_base;
+      strm->avail_out = iovec[0].iov_len;
+
+      ret = deflate(strm, flush);
+      if (ret == Z_STREAM_ERROR)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "zlib deflate failed\n");
+	  return -1;
+	}
+
+      iovec[0].iov_len -= strm->avail_out;
+      evbuffer_commit_space(out, iovec, 1);
+    }
+  while (strm->avail_out == 0);
+
+  if (flush == Z_FINISH && ret != Z_STREAM_END)
+    return -1;
+
+  return 0;
+}
+
+// Compresses the first len bytes of in, starting at pos, which is advanced past
+// them. The data is read directly from the chains of in, so a large reply is
+// never linearized. Nothing is drained, so in is intact if this fails.
+static int
+gzip_deflate_evbuf(struct evbuffer *out, z_stream *strm, struct evbuffer *in, struct evbuffer_ptr *pos, size_t len, bool finish)
+{
+  struct evbuffer_iovec iovec[1];
+  size_t consumed;
+  int ret;
+
+  while (len > 0 && evbuffer_peek(in, -1, pos, iovec, 1) == 1)
+    {
+      strm->next_in = iovec[0].iov_base;
+      strm->avail_in = MIN(iovec[0].iov_len, len);
+      consumed = strm->avail_in;
+
+      ret = gzip_deflate_block(out, strm, Z_NO_FLUSH);
+      if (ret < 0)
+	return -1;
+
+      evbuffer_ptr_set(in, pos, consumed, EVBUFFER_PTR_ADD);
+      len -= consumed;
     }
 
-  // We use this to avoid a memcpy. The 512 is an arbitrary padding to make sure
-  // there is enough space, even if the compressed output should be slightly
-  // larger than input (could happen with small inputs).
-  ret = evbuffer_reserve_space(out, strm.avail_in + 512, iovec, 1);
+  if (!finish)
+    return 0;
+
+  strm->next_in = Z_NULL;
+  strm->avail_in = 0;
+
+  return gzip_deflate_block(out, strm, Z_FINISH);
+}
+
+struct gzip_chunked
+{
+  struct httpd_request *hreq;
+  struct evbuffer *in;
+  struct event *deflateev;
+  z_stream strm;
+};
+
+static void
+gzip_chunked_free(struct gzip_chunked *gz)
+{
+  event_free(gz->deflateev);
+  evbuffer_free(gz->in);
+  deflateEnd(&gz->strm);
+  free(gz);
+}
+
+// Called on disconnect, in which case the chunk callback won't be. Since the
+// request is async, this runs in the worker thread, so not concurrently with
+// gzip_chunked_deflate_cb().
+static void
+gzip_chunked_fail_cb(void *arg)
+{
+  gzip_chunked_free(arg);
+}
+
+// httpd thread, called when the previous chunk has been sent. The compression
+// is done by the worker thread that owns the request, so the httpd loop only
+// gets the finished chunk.
+static void
+gzip_chunked_send_cb(httpd_connection *conn, void *arg)
+{
+  struct gzip_chunked *gz = arg;
+
+  event_active(gz->deflateev, 0, 0);
+}
+
+// Worker thread, compresses and sends the next chunk of input. The next one is
+// requested from the chunk callback, so we only produce output as fast as the
+// client takes it.
+static void
+gzip_chunked_deflate_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct gzip_chunked *gz = arg;
+  struct httpd_request *hreq = gz->hreq;
+  struct evbuffer_ptr pos;
+  size_t len;
+  bool finish;
+  int ret;
+
+  do
+    {
+      len = evbuffer_get_length(gz->in);
+      finish = (len <= GZIP_CHUNK_SIZE);
+
+      evbuffer_ptr_set(gz->in, &pos, 0, EVBUFFER_PTR_SET);
+      ret = gzip_deflate_evbuf(hreq->out_body, &gz->strm, gz->in, &pos, MIN(len, GZIP_CHUNK_SIZE), finish);
+      if (ret < 0)
+	{
+	  // Headers are already sent, so all we can do is cut the reply short
+	  DPRINTF(E_LOG, L_HTTPD, "Error gzipping response, reply will be incomplete\n");
+	  goto end;
+	}
+
+      evbuffer_drain(gz->in, MIN(len, GZIP_CHUNK_SIZE));
+    }
+  while (!finish && evbuffer_get_length(hreq->out_body) == 0); // deflate may buffer
+
+  if (!finish)
+    {
+      httpd_send(hreq, HTTPD_REPLY_CHUNK, 0, NULL, gzip_chunked_send_cb, gz);
+      return;
+    }
+
+  if (evbuffer_get_length(hreq->out_body) > 0)
+    httpd_send(hreq, HTTPD_REPLY_CHUNK, 0, NULL, NULL, NULL);
+
+ end:
+  httpd_send(hreq, HTTPD_REPLY_END, 0, NULL, NULL, NULL); // hreq is now deallocated
+  gzip_chunked_free(gz);
+}
+
+// For large replies we don't wait for the whole reply to be compressed, instead
+// it is sent in chunks as it is produced. Only for async requests, since the
+// chunks are compressed by the worker thread. Returns -1 if nothing was sent,
+// so the caller can send the reply in one go.
+static int
+send_reply_gzip_chunked(struct httpd_request *hreq, int code, const char *reason)
+{
+  struct gzip_chunked *gz;
+  int ret;
+
+  if (!hreq->is_async)
+    return -1;
+
+  CHECK_NULL(L_HTTPD, gz = calloc(1, sizeof(struct gzip_chunked)));
+
+  ret = gzip_init(&gz->strm);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
-      goto out_evbuf_free;
+      free(gz);
+      return -1;
     }
 
-  strm.next_out = iovec[0].iov_base;
-  strm.avail_out = iovec[0].iov_len;
+  CHECK_NULL(L_HTTPD, gz->deflateev = event_new(hreq->evbase, -1, 0, gzip_chunked_deflate_cb, gz));
 
-  ret = deflate(&strm, Z_FINISH);
-  if (ret != Z_STREAM_END)
-    goto out_evbuf_free;
+  gz->hreq = hreq;
+  gz->in = hreq->out_body;
+  CHECK_NULL(L_HTTPD, hreq->out_body = evbuffer_new());
+
+  DPRINTF(E_DBG, L_HTTPD, "Gzipping response (%zu bytes) in chunks\n", evbuffer_get_length(gz->in));
+
+  httpd_header_remove(hreq->out_headers, "Content-Length");
+  httpd_header_add(hreq->out_headers, "Content-Encoding", "gzip");
+
+  httpd_request_close_cb_set(hreq, gzip_chunked_fail_cb, gz);
+
+  httpd_send(hreq, HTTPD_REPLY_START, code, reason, NULL, NULL);
+
+  // Must be the last thing we do, since gz and hreq may be freed from now on
+  gzip_chunked_deflate_cb(-1, 0, gz);
+  return 0;
+}
+
+struct evbuffer *
+httpd_gzip_deflate(struct evbuffer *in)
+{
+  struct evbuffer_ptr pos;
+  struct evbuffer *out;
+  z_stream strm;
+  int ret;
 
-  iovec[0].iov_len -= strm.avail_out;
+  ret = gzip_init(&strm);
+  if (ret < 0)
+    return NULL;
+
+  out = evbuffer_new();
+  if (!out)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
+      goto out_deflate_end;
+    }
+
+  evbuffer_ptr_set(in, &pos, 0, EVBUFFER_PTR_SET);
+  ret = gzip_deflate_evbuf(out, &strm, in, &pos, evbuffer_get_length(in), true);
+  if (ret < 0)
+    goto out_evbuf_free;
 
-  evbuffer_commit_space(out, iovec, 1);
   deflateEnd(&strm);
 
   return out;
@@ -1336,20 +2041,21 @@ httpd_send_reply(struct httpd_request *hreq, int code, const char *reason, enum
 {
   struct evbuffer *gzbuf;
   struct evbuffer *save;
-  const char *param;
   int do_gzip;
 
   if (!hreq->backend)
     return;
 
   do_gzip = ( (!(flags & HTTPD_SEND_NO_GZIP)) &&
-              (evbuffer_get_length(hreq->out_body) > 512) &&
-              (param = httpd_header_find(hreq->in_headers, "Accept-Encoding")) &&
-              (strstr(param, "gzip") || strstr(param, "*"))
+              (evbuffer_get_length(hreq->out_body) > httpd_gzip_min_size) &&
+              request_accepts_gzip(hreq)
             );
 
   cors_headers_add(hreq, httpd_allow_origin);
 
+  if (do_gzip && (evbuffer_get_length(hreq->out_body) > GZIP_CHUNK_SIZE) && send_reply_gzip_chunked(hreq, code, reason) == 0)
+    return;
+
   if (do_gzip && (gzbuf = httpd_gzip_deflate(hreq->out_body)))
     {
       DPRINTF(E_DBG, L_HTTPD, "Gzipping response\n");
@@ -1558,6 +2264,90 @@ thread_exit_cb(struct evthr *thr, void *shared)
   db_perthread_deinit();
 }
 
+static void
+lane_thread_init_cb(struct evthr *thr, void *shared)
+{
+  struct lane *lane = shared;
+  char name[16];
+
+  snprintf(name, sizeof(name), "httpd %s", lane->stats.name);
+  thread_setname(pthread_self(), name);
+
+  CHECK_ERR(L_HTTPD, db_perthread_init());
+}
+
+static void
+lane_thread_exit_cb(struct evthr *thr, void *shared)
+{
+  db_perthread_deinit();
+}
+
+static int
+lanes_init(void)
+{
+  struct lane *lane;
+  int i;
+
+  for (i = 0; i < HTTPD_LANE_MAX; i++)
+    {
+      lane = &httpd_lanes[i];
+
+      CHECK_ERR(L_HTTPD, mutex_init(&lane->lck));
+
+      lane->stats.nthreads = cfg_getint(cfg_getsec(cfg, "general"), lane->cfg_option);
+      if (lane->stats.nthreads < 1 || lane->stats.nthreads > THREADPOOL_NTHREADS_MAX)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Invalid value for %s (%d), using default (%d)\n", lane->cfg_option, lane->stats.nthreads, lane->cfg_default);
+	  lane->stats.nthreads = lane->cfg_default;
+	}
+
+      lane->pool = evthr_pool_wexit_new(lane->stats.nthreads, lane_thread_init_cb, lane_thread_exit_cb, lane);
+      if (!lane->pool)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not create thread pool for %s lane\n", lane->stats.name);
+	  return -1;
+	}
+
+      if (evthr_pool_start(lane->pool) < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn threads for %s lane\n", lane->stats.name);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+// Stopping waits for handlers that are running, which may be sending a reply
+// via the httpd thread, so this must be called while the httpd threads still
+// run
+static void
+lanes_stop(void)
+{
+  int i;
+
+  for (i = 0; i < HTTPD_LANE_MAX; i++)
+    evthr_pool_stop(httpd_lanes[i].pool);
+}
+
+static void
+lanes_deinit(void)
+{
+  struct lane *lane;
+  int i;
+
+  for (i = 0; i < HTTPD_LANE_MAX; i++)
+    {
+      lane = &httpd_lanes[i];
+      if (!lane->pool)
+	continue;
+
+      evthr_pool_free(lane->pool);
+      lane->pool = NULL;
+      pthread_mutex_destroy(&lane->lck);
+    }
+}
+
 /* Thread: main */
 int
 httpd_init(const char *webroot)
@@ -1589,6 +2379,18 @@ httpd_init(const char *webroot)
   if (strlen(httpd_allow_origin) == 0)
     httpd_allow_origin = NULL;
 
+  httpd_gzip_level = cfg_getint(cfg_getsec(cfg, "general"), "gzip_level");
+  if (httpd_gzip_level < Z_DEFAULT_COMPRESSION || httpd_gzip_level > Z_BEST_COMPRESSION)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid gzip_level %d, using default\n", httpd_gzip_level);
+      httpd_gzip_level = Z_DEFAULT_COMPRESSION;
+    }
+  httpd_gzip_min_size = MAX(cfg_getint(cfg_getsec(cfg, "general"), "gzip_min_size"), 0);
+
+  // After reading config, since the files are gzipped with httpd_gzip_level
+  static_files_enabled = true;
+  static_files_load();
+
   // Test that the port is free. We do it here because we can make a nicer exit
   // than we can in thread_init_cb(), where the actual binding takes place.
   ret = bind_test(httpd_port);
@@ -1615,7 +2417,19 @@ httpd_init(const char *webroot)
     }
 #endif
 
-  httpd_threadpool = evthr_pool_wexit_new(THREADPOOL_NTHREADS, thread_init_cb, thread_exit_cb, NULL);
+  // Must be ready before the httpd threads start accepting requests
+  ret = lanes_init();
+  if (ret < 0)
+    goto error;
+
+  httpd_nthreads = cfg_getint(cfg_getsec(cfg, "general"), "httpd_threads");
+  if (httpd_nthreads < 1 || httpd_nthreads > THREADPOOL_NTHREADS_MAX)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid value for httpd_threads (%d), using 1\n", httpd_nthreads);
+      httpd_nthreads = 1;
+    }
+
+  httpd_threadpool = evthr_pool_wexit_new(httpd_nthreads, thread_init_cb, thread_exit_cb, NULL);
   if (!httpd_threadpool)
     {
       DPRINTF(E_LOG, L_HTTPD, "Could not create httpd thread pool\n");
@@ -1653,6 +2467,29 @@ httpd_deinit(void)
   websocket_deinit();
 #endif
 
+  lanes_stop();
+
   evthr_pool_stop(httpd_threadpool);
   evthr_pool_free(httpd_threadpool);
+  httpd_threadpool = NULL;
+
+  lanes_deinit();
+
+  static_files_unload();
+}
+
+// Thread: worker
+static void
+static_files_reload(void *arg)
+{
+  static_files_load();
+}
+
+/* Reading and compressing the web root takes a while, so it is done by a
+ * worker. Requests are served from the old files until the new are ready.
+ */
+void
+httpd_reload(void)
+{
+  worker_execute(static_files_reload, NULL, 0, 0);
 }
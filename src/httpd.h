@@ -5,7 +5,8 @@
 #include <event2/buffer.h>
 
 /*
- * Gzips an evbuffer
+ * Gzips an evbuffer. The input is read in place, so it is never linearized,
+ * and it is left unchanged.
  *
  * @in  in       Data to be compressed
  * @return       Compressed data - must be freed by caller
@@ -19,4 +20,11 @@ httpd_init(const char *webroot);
 void
 httpd_deinit(void);
 
+/*
+ * Rereads the files in the web root into the in-memory file cache, e.g. after
+ * the web interface was updated
+ */
+void
+httpd_reload(void);
+
 #endif /* !__HTTPD_H__ */
@@ -22,7 +22,9 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "httpd_internal.h"
 #include "logger.h"
@@ -30,6 +32,10 @@
 #include "player.h"
 #include "artwork.h"
 
+// Max number of ids in a /artwork/batch request
+#define ARTWORK_BATCH_MAX 100
+#define ARTWORK_BATCH_BOUNDARY "owntone-artwork-batch-7d1a4f0c92b3e865"
+
 static int
 request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
 {
@@ -104,10 +110,11 @@ artworkapi_reply_item(struct httpd_request *hreq)
   if (ret != 0)
     return ret;
 
-  ret = safe_atou32(hreq->path_parts[2], &id);
-  if (ret != 0)
+  if (hreq->path_nids != 1 || hreq->path_ids[0] < 0 || hreq->path_ids[0] > UINT32_MAX)
     return HTTP_BADREQUEST;
 
+  id = hreq->path_ids[0];
+
   ret = artwork_get_item(hreq->out_body, id, max_w, max_h, 0);
 
   return response_process(hreq, ret);
@@ -125,20 +132,161 @@ artworkapi_reply_group(struct httpd_request *hreq)
   if (ret != 0)
     return ret;
 
-  ret = safe_atou32(hreq->path_parts[2], &id);
-  if (ret != 0)
+  if (hreq->path_nids != 1 || hreq->path_ids[0] < 0 || hreq->path_ids[0] > UINT32_MAX)
     return HTTP_BADREQUEST;
 
+  id = hreq->path_ids[0];
+
   ret = artwork_get_group(hreq->out_body, id, max_w, max_h, 0);
 
   return response_process(hreq, ret);
 }
 
+struct batch_parse
+{
+  struct artwork_batch_item *items;
+  int nitems;
+  bool invalid;
+};
+
+/* Parses a comma separated list of ids like "1,2,3" from a "group" or "item"
+ * query parameter and adds them to the batch. Called for the query parameters
+ * in the order they appear in the request, so the items are in request order.
+ */
+static void
+batch_ids_parse_cb(const char *key, const char *val, void *arg)
+{
+  struct batch_parse *batch = arg;
+  char *ids;
+  char *id;
+  char *ptr;
+  uint32_t id_val;
+  bool is_group;
+
+  if (strcmp(key, "group") == 0)
+    is_group = true;
+  else if (strcmp(key, "item") == 0)
+    is_group = false;
+  else
+    return;
+
+  CHECK_NULL(L_WEB, ids = strdup(val));
+
+  for (id = strtok_r(ids, ",", &ptr); id && !batch->invalid; id = strtok_r(NULL, ",", &ptr))
+    {
+      if (batch->nitems >= ARTWORK_BATCH_MAX || safe_atou32(id, &id_val) < 0)
+	{
+	  batch->invalid = true;
+	  break;
+	}
+
+      batch->items[batch->nitems].is_group = is_group;
+      batch->items[batch->nitems].id = id_val;
+      batch->nitems++;
+    }
+
+  free(ids);
+}
+
+static const char *
+batch_content_type(int format)
+{
+  if (format == ART_FMT_PNG)
+    return "image/png";
+  else if (format == ART_FMT_JPEG)
+    return "image/jpeg";
+
+  return NULL;
+}
+
+/* Returns the artwork for a list of groups and/or items as a multipart/mixed
+ * response, so a client can fill e.g. an album grid with one request instead of
+ * one per album. Each part has its own ETag, and the response has an ETag made
+ * from those, so an unchanged grid gets a 304.
+ */
+static int
+artworkapi_reply_batch(struct httpd_request *hreq)
+{
+  struct artwork_batch_item items[ARTWORK_BATCH_MAX];
+  uint64_t hashes[ARTWORK_BATCH_MAX];
+  struct batch_parse batch = { .items = items };
+  const char *ctype;
+  char etag[32];
+  uint32_t max_w;
+  uint32_t max_h;
+  size_t len;
+  int nitems;
+  int i;
+  int ret;
+
+  ret = request_process(hreq, &max_w, &max_h);
+  if (ret != 0)
+    return ret;
+
+  httpd_query_iterate(hreq->query, batch_ids_parse_cb, &batch);
+  if (batch.invalid || batch.nitems == 0)
+    goto bad_request;
+
+  nitems = batch.nitems;
+
+  for (i = 0; i < nitems; i++)
+    CHECK_NULL(L_WEB, items[i].evbuf = evbuffer_new());
+
+  artwork_get_batch(items, nitems, max_w, max_h);
+
+  for (i = 0; i < nitems; i++)
+    {
+      len = evbuffer_get_length(items[i].evbuf);
+      hashes[i] = (len > 0) ? murmur_hash64(evbuffer_pullup(items[i].evbuf, -1), len, 0) : 0;
+    }
+
+  // If modified, httpd_request_etag_matches() adds the ETag to the 200 reply.
+  // A 304 should also have it, so the client can keep revalidating.
+  snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"", murmur_hash64(hashes, nitems * sizeof(uint64_t), 0));
+  if (httpd_request_etag_matches(hreq, etag))
+    {
+      httpd_header_add(hreq->out_headers, "ETag", etag);
+      ret = HTTP_NOTMODIFIED;
+      goto out;
+    }
+
+  for (i = 0; i < nitems; i++)
+    {
+      ctype = batch_content_type(items[i].format);
+      len = ctype ? evbuffer_get_length(items[i].evbuf) : 0;
+
+      evbuffer_add_printf(hreq->out_body, "--%s\r\n", ARTWORK_BATCH_BOUNDARY);
+      if (ctype)
+	evbuffer_add_printf(hreq->out_body, "Content-Type: %s\r\nETag: \"%016" PRIx64 "\"\r\n", ctype, hashes[i]);
+      evbuffer_add_printf(hreq->out_body, "Content-Location: /artwork/%s/%d\r\nContent-Length: %zu\r\n\r\n", items[i].is_group ? "group" : "item", items[i].id, len);
+      if (len > 0)
+	evbuffer_add_buffer(hreq->out_body, items[i].evbuf);
+      evbuffer_add(hreq->out_body, "\r\n", 2);
+    }
+
+  evbuffer_add_printf(hreq->out_body, "--%s--\r\n", ARTWORK_BATCH_BOUNDARY);
+
+  httpd_header_add(hreq->out_headers, "Content-Type", "multipart/mixed; boundary=" ARTWORK_BATCH_BOUNDARY);
+
+  ret = HTTP_OK;
+
+ out:
+  for (i = 0; i < nitems; i++)
+    evbuffer_free(items[i].evbuf);
+
+  return ret;
+
+ bad_request:
+  DPRINTF(E_LOG, L_WEB, "Invalid or too many ids in artwork batch request: '%s'\n", hreq->uri);
+  return HTTP_BADREQUEST;
+}
+
 static struct httpd_uri_map artworkapi_handlers[] =
 {
-  { HTTPD_METHOD_GET, "^/artwork/nowplaying$",         artworkapi_reply_nowplaying },
-  { HTTPD_METHOD_GET, "^/artwork/item/[[:digit:]]+$",  artworkapi_reply_item },
-  { HTTPD_METHOD_GET, "^/artwork/group/[[:digit:]]+$", artworkapi_reply_group },
+  { HTTPD_METHOD_GET, "^/artwork/nowplaying$",         artworkapi_reply_nowplaying, NULL, HTTPD_HANDLER_ARTWORK },
+  { HTTPD_METHOD_GET, "^/artwork/item/[[:digit:]]+$",  artworkapi_reply_item,       NULL, HTTPD_HANDLER_ARTWORK },
+  { HTTPD_METHOD_GET, "^/artwork/group/[[:digit:]]+$", artworkapi_reply_group,      NULL, HTTPD_HANDLER_ARTWORK },
+  { HTTPD_METHOD_GET, "^/artwork/batch$",              artworkapi_reply_batch,      NULL, HTTPD_HANDLER_ARTWORK },
   { 0, NULL, NULL }
 };
 
@@ -40,6 +40,7 @@
 
 #include <uninorm.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 
@@ -66,8 +67,15 @@
 #define DAAP_SESSION_TIMEOUT 604800            // One week in seconds
 /* We announce this timeout to the client when returning server capabilities */
 #define DAAP_SESSION_TIMEOUT_CAPABILITY 1800   // 30 minutes
-/* Update requests refresh interval in seconds */
-#define DAAP_UPDATE_REFRESH  0
+/* Update requests are long polls, so each one holds a connection until we
+ * answer it. A client (identified by its session, or its address if it has no
+ * session) only gets to park one, at most DAAP_UPDATE_MAX are parked in total,
+ * and they are answered with the current revision after DAAP_UPDATE_TIMEOUT.
+ * Otherwise the connections of clients that went away without closing them,
+ * e.g. a phone that went to sleep, would never be released.
+ */
+#define DAAP_UPDATE_MAX 64
+#define DAAP_UPDATE_TIMEOUT 1800               // 30 minutes
 
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
@@ -98,8 +106,13 @@ struct daap_session {
 struct daap_update_request {
   struct httpd_request *hreq;
 
-  /* Refresh tiemout */
-  struct event *timeout;
+  int session_id;
+  /* Our own copy, hreq's is invalid once the client has disconnected */
+  char *peer_address;
+
+  /* Timeout, also activated if the request is pushed out by a newer one */
+  struct event *expire_ev;
+  bool is_expiring;
 
   struct daap_update_request *next;
 };
@@ -124,7 +137,11 @@ static struct daap_session *daap_sessions;
 /* Update requests */
 static int current_rev;
 static struct daap_update_request *update_requests;
-static struct timeval daap_update_refresh_tv = { DAAP_UPDATE_REFRESH, 0 };
+static int update_nrequests;
+static struct timeval daap_update_timeout_tv = { DAAP_UPDATE_TIMEOUT, 0 };
+/* The update requests are parked by, and answered in, the thread that handled
+ * the request, but the list is shared */
+static pthread_mutex_t update_lck = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* -------------------------- SESSION HANDLING ------------------------------ */
@@ -251,43 +268,107 @@ update_free(struct daap_update_request *ur)
   if (!ur)
     return;
 
-  if (ur->timeout)
-    event_free(ur->timeout);
+  if (ur->expire_ev)
+    event_free(ur->expire_ev);
 
+  free(ur->peer_address);
   free(ur);
 }
 
+// Returns false if the request was already removed from the list
+static bool
+update_unlink(struct daap_update_request *ur)
+{
+  struct daap_update_request **p;
+  bool found;
+
+  pthread_mutex_lock(&update_lck);
+
+  for (p = &update_requests; *p && (*p != ur); p = &(*p)->next)
+    ;
+
+  found = (*p != NULL);
+  if (found)
+    {
+      *p = ur->next;
+      update_nrequests--;
+    }
+
+  pthread_mutex_unlock(&update_lck);
+
+  return found;
+}
+
 static void
 update_remove(struct daap_update_request *ur)
 {
-  struct daap_update_request *p;
+  if (!update_unlink(ur))
+    {
+      DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
+      return;
+    }
+
+  update_free(ur);
+}
+
+static bool
+update_is_same_client(struct daap_update_request *a, struct daap_update_request *b)
+{
+  if (a->session_id || b->session_id)
+    return (a->session_id == b->session_id);
 
-  if (ur == update_requests)
-    update_requests = ur->next;
-  else
+  return (a->peer_address && b->peer_address && strcmp(a->peer_address, b->peer_address) == 0);
+}
+
+// Must be called with update_lck locked. The requests are answered by
+// update_expire_cb() in the thread that parked them.
+static void
+update_evict(struct daap_update_request *new)
+{
+  struct daap_update_request *ur;
+  struct daap_update_request *oldest = NULL;
+  int n = 0;
+
+  for (ur = update_requests; ur; ur = ur->next)
     {
-      for (p = update_requests; p && (p->next != ur); p = p->next)
-	;
+      if (ur->is_expiring)
+	continue;
 
-      if (!p)
+      if (update_is_same_client(ur, new))
 	{
-	  DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
-	  return;
+	  ur->is_expiring = true;
+	  event_active(ur->expire_ev, 0, 0);
+	  continue;
 	}
 
-      p->next = ur->next;
+      // The list has the newest first
+      oldest = ur;
+      n++;
     }
 
-  update_free(ur);
+  if (oldest && n >= DAAP_UPDATE_MAX)
+    {
+      DPRINTF(E_WARN, L_DAAP, "Too many parked update requests, answering the oldest (from '%s')\n", oldest->peer_address);
+
+      oldest->is_expiring = true;
+      event_active(oldest->expire_ev, 0, 0);
+    }
 }
 
 static void
-update_refresh_cb(int fd, short event, void *arg)
+update_expire_cb(int fd, short event, void *arg)
 {
   struct daap_update_request *ur = arg;
   struct httpd_request *hreq = ur->hreq;
 
-  current_rev++;
+  DPRINTF(E_DBG, L_DAAP, "Answering update request from '%s' (%s)\n", ur->peer_address, (event & EV_TIMEOUT) ? "timeout" : "replaced");
+
+  if (!update_unlink(ur))
+    return;
+
+  // A live client will just ask again, and if it's gone we want to get rid of
+  // the connection
+  httpd_header_add(hreq->out_headers, "Connection", "close");
 
   /* Send back current revision */
   dmap_add_container(hreq->out_body, "mupd", 24);
@@ -296,7 +377,7 @@ update_refresh_cb(int fd, short event, void *arg)
 
   httpd_send_reply(hreq, HTTP_OK, "OK", 0);
 
-  update_remove(ur);
+  update_free(ur);
 }
 
 static void
@@ -1022,29 +1103,40 @@ daap_reply_update(struct httpd_request *hreq)
       return DAAP_REPLY_ERROR;
     }
 
-  if (DAAP_UPDATE_REFRESH > 0)
-    {
-      ur->timeout = evtimer_new(hreq->evbase, update_refresh_cb, ur);
-      if (ur->timeout)
-	ret = evtimer_add(ur->timeout, &daap_update_refresh_tv);
-      else
-	ret = -1;
+  ur->expire_ev = evtimer_new(hreq->evbase, update_expire_cb, ur);
+  if (ur->expire_ev)
+    ret = evtimer_add(ur->expire_ev, &daap_update_timeout_tv);
+  else
+    ret = -1;
 
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Out of memory for update request event\n");
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for update request event\n");
 
-	  dmap_error_make(hreq->out_body, "mupd", "Could not register timer");	
-	  update_free(ur);
-	  return DAAP_REPLY_ERROR;
-	}
+      dmap_error_make(hreq->out_body, "mupd", "Could not register timer");
+      update_free(ur);
+      return DAAP_REPLY_ERROR;
     }
 
   /* NOTE: we may need to keep reqd_rev in there too */
   ur->hreq = hreq;
+  ur->peer_address = safe_strdup(hreq->peer_address);
+
+  param = httpd_query_value_find(hreq->query, "session-id");
+  if (param)
+    safe_atoi32(param, &ur->session_id);
+
+  pthread_mutex_lock(&update_lck);
+
+  update_evict(ur);
 
   ur->next = update_requests;
   update_requests = ur;
+  update_nrequests++;
+
+  DPRINTF(E_DBG, L_DAAP, "Parked update request from '%s', %d parked\n", ur->peer_address, update_nrequests);
+
+  pthread_mutex_unlock(&update_lck);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -1140,10 +1232,10 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
-  struct evbuffer *song;
   struct evbuffer *songlist;
   struct daap_session *s;
   const struct dmap_field **meta = NULL;
+  struct dmap_encode_plan *plan = NULL;
   struct sort_ctx *sctx;
   const char *param;
   const char *accept_codecs;
@@ -1183,11 +1275,9 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
     }
 
   CHECK_NULL(L_DAAP, songlist = evbuffer_new());
-  CHECK_NULL(L_DAAP, song = evbuffer_new());
   CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->out_body, 61));
   CHECK_ERR(L_DAAP, evbuffer_expand(songlist, 4096));
-  CHECK_ERR(L_DAAP, evbuffer_expand(song, 512));
 
   param = httpd_query_value_find(hreq->query, "meta");
   if (!param)
@@ -1208,6 +1298,8 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	}
     }
 
+  plan = dmap_encode_plan_new(meta, nmeta, sort_headers);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1258,7 +1350,7 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	  dbmfi.bitrate     = xcode_metadata.bitrate;
 	}
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers);
+      ret = dmap_encode_file_metadata(songlist, plan, &dbmfi);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1324,18 +1416,18 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, sctx->headerlist));
     }
 
+  dmap_encode_plan_free(plan);
   free(meta);
   daap_sort_context_free(sctx);
-  evbuffer_free(song);
   evbuffer_free(songlist);
   free_query_params(&qp, 1);
 
   return DAAP_REPLY_OK;
 
  error:
+  dmap_encode_plan_free(plan);
   free(meta);
   daap_sort_context_free(sctx);
-  evbuffer_free(song);
   evbuffer_free(songlist);
   free_query_params(&qp, 1);
 
@@ -2169,11 +2261,13 @@ static struct httpd_uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+[.][^/]+$",
-      .handler = daap_stream
+      .handler = daap_stream,
+      .flags = HTTPD_HANDLER_STREAM,
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+/extra_data/artwork$",
-      .handler = daap_reply_extra_data
+      .handler = daap_reply_extra_data,
+      .flags = HTTPD_HANDLER_ARTWORK,
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers$",
@@ -2189,7 +2283,8 @@ static struct httpd_uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups/[[:digit:]]+/extra_data/artwork$",
-      .handler = daap_reply_extra_data
+      .handler = daap_reply_extra_data,
+      .flags = HTTPD_HANDLER_ARTWORK,
     },
 #ifdef DMAP_TEST
     {
@@ -2368,6 +2463,7 @@ daap_deinit(void)
       daap_session_free(s);
     }
 
+  pthread_mutex_lock(&update_lck);
   for (ur = update_requests; update_requests; ur = update_requests)
     {
       update_requests = ur->next;
@@ -2375,6 +2471,8 @@ daap_deinit(void)
       daap_reply_send(ur->hreq, DAAP_REPLY_SERVUNAVAIL);
       update_free(ur);
     }
+  update_nrequests = 0;
+  pthread_mutex_unlock(&update_lck);
 }
 
 struct httpd_module httpd_daap =
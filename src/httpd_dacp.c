@@ -2744,7 +2744,8 @@ static struct httpd_uri_map dacp_handlers[] =
     },
     {
       .regexp = "^/ctrl-int/[[:digit:]]+/nowplayingartwork$",
-      .handler = dacp_reply_nowplayingartwork
+      .handler = dacp_reply_nowplayingartwork,
+      .flags = HTTPD_HANDLER_ARTWORK,
     },
     {
       .regexp = "^/ctrl-int/[[:digit:]]+/getproperty$",
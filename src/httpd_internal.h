@@ -10,6 +10,8 @@
 # include <config.h>
 #endif
 
+#include "misc.h" // For struct histogram
+
 /* Response codes from event2/http.h */
 #define HTTP_CONTINUE          100	/**< client should proceed to send */
 #define HTTP_SWITCH_PROTOCOLS  101	/**< switching to another protocol */
@@ -56,6 +58,8 @@ typedef struct httpd_uri_parsed httpd_uri_parsed;
 typedef struct httpd_backend_data httpd_backend_data;
 
 typedef char *httpd_uri_path_parts[31];
+
+#define HTTPD_PATH_IDS_MAX 4
 typedef void (*httpd_request_cb)(struct httpd_request *hreq, void *arg);
 typedef void (*httpd_close_cb)(void *arg);
 typedef void (*httpd_connection_chunkcb)(httpd_connection *conn, void *arg);
@@ -109,8 +113,35 @@ enum httpd_handler_flags
   // requests that must be answered quickly. Can only be used for nonblocking
   // handlers.
   HTTPD_HANDLER_REALTIME = (1 << 0),
+  // Requests that are slow to handle or that keep the thread busy (streaming)
+  // get their own lane of threads, so they don't hold up the other requests
+  HTTPD_HANDLER_ARTWORK = (1 << 1),
+  HTTPD_HANDLER_STREAM = (1 << 2),
+};
+
+enum httpd_lane
+{
+  HTTPD_LANE_DEFAULT,
+  HTTPD_LANE_ARTWORK,
+  HTTPD_LANE_STREAM,
+  HTTPD_LANE_MAX,
 };
 
+struct httpd_lane_stats
+{
+  const char *name;
+  int nthreads;
+  // Number of requests waiting for a thread
+  int queued;
+  uint64_t requests;
+  // From the request was passed to the lane until the handler was called
+  struct histogram wait_us;
+  // Time spent in the handler, for streaming that is just the setup
+  struct histogram handler_us;
+};
+
+struct httpd_router;
+
 struct httpd_module
 {
   const char *name;
@@ -124,6 +155,8 @@ struct httpd_module
   const char *fullpaths[16];
   // Pointer to the module's handler definitions
   struct httpd_uri_map *handlers;
+  // The handlers compiled for routing, see httpd_request_handler_set()
+  struct httpd_router *router;
 
   int (*init)(void);
   void (*deinit)(void);
@@ -174,6 +207,12 @@ struct httpd_request {
   // "foo", [1] is "bar" and the rest is null. Each path_part is an allocated
   // URI decoded string.
   httpd_uri_path_parts path_parts;
+  // Values of the numeric path segments, as captured by the router from the
+  // handler's "[[:digit:]]+" segments, e.g. for /databases/1/items/23 path_ids
+  // is { 1, 23 }. Values that don't fit are -1. Not set if the handler's
+  // pattern can only be matched as a regex.
+  int64_t path_ids[HTTPD_PATH_IDS_MAX];
+  int path_nids;
   // Struct with the query, used with httpd_query_ functions
   httpd_query *query;
   // Backend private parser URI object
@@ -194,6 +233,8 @@ struct httpd_request {
   int (*handler)(struct httpd_request *hreq);
   // Is the processing defered to a worker thread
   bool is_async;
+  // Which lane of worker threads will handle the request, if async
+  enum httpd_lane lane;
   // Handler thread's evbase in case the handler needs to scehdule an event
   struct event_base *evbase;
   // A pointer to extra data that the module handling the request might need
@@ -212,6 +253,15 @@ httpd_xcode_profile_get(struct httpd_request *hreq);
 void
 httpd_request_handler_set(struct httpd_request *hreq);
 
+/*
+ * Gets queue depth and latency statistics for the lanes of worker threads
+ *
+ * @out stats    Array with room for HTTPD_LANE_MAX elements
+ * @return       Number of lanes
+ */
+int
+httpd_lanes_stats_get(struct httpd_lane_stats *stats);
+
 bool
 httpd_request_not_modified_since(struct httpd_request *hreq, time_t mtime);
 
@@ -319,6 +369,19 @@ httpd_server_new(struct event_base *evbase, unsigned short port, httpd_request_c
 void
 httpd_server_allow_origin_set(httpd_server *server, bool allow);
 
+struct httpd_connection_stats
+{
+  // Connections that have had at least one request and are still open
+  int open;
+  uint64_t accepted;
+  uint64_t requests;
+  // Requests that reused a connection kept alive from an earlier request
+  uint64_t requests_reused;
+};
+
+void
+httpd_server_connection_stats_get(struct httpd_connection_stats *stats);
+
 
 /*----------------- Only called by httpd.c to send raw replies ---------------*/
 
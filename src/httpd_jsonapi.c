@@ -41,6 +41,8 @@
 #include <time.h>
 
 #include "httpd_internal.h"
+#include "artwork.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
@@ -1166,8 +1168,10 @@ jsonapi_reply_library(struct httpd_request *hreq)
   char *s;
   int i;
   struct library_source **sources;
+  struct artwork_warmer_status warmer;
   json_object *jscanners;
   json_object *jsource;
+  json_object *jwarmer;
 
 
   CHECK_NULL(L_WEB, jreply = json_object_new_object());
@@ -1217,6 +1221,17 @@ jsonapi_reply_library(struct httpd_request *hreq)
 	}
     }
 
+  artwork_warmer_status_get(&warmer);
+  if (warmer.enabled)
+    {
+      jwarmer = json_object_new_object();
+      json_object_object_add(jwarmer, "active", json_object_new_boolean(warmer.active));
+      json_object_object_add(jwarmer, "paused", json_object_new_boolean(warmer.paused));
+      json_object_object_add(jwarmer, "albums_total", json_object_new_int(warmer.groups_total));
+      json_object_object_add(jwarmer, "albums_done", json_object_new_int(warmer.groups_done));
+      json_object_object_add(jreply, "artwork_warmer", jwarmer);
+    }
+
   CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
   jparse_free(jreply);
 
@@ -2139,6 +2154,182 @@ jsonapi_reply_player(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static json_object *
+histogram_to_json(struct histogram *h)
+{
+  json_object *jhist;
+  json_object *jbuckets;
+  json_object *jbucket;
+  int i;
+
+  jhist = json_object_new_object();
+  json_object_object_add(jhist, "count", json_object_new_int64(h->count));
+  json_object_object_add(jhist, "sum", json_object_new_int64(h->sum));
+  json_object_object_add(jhist, "max", json_object_new_int64(h->max));
+
+  // The last bucket has no upper limit, so "le" is null
+  jbuckets = json_object_new_array();
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      jbucket = json_object_new_object();
+      if (i < HISTOGRAM_BUCKETS - 1)
+	json_object_object_add(jbucket, "le", json_object_new_int64(histogram_bucket_limit(i)));
+      else
+	json_object_object_add(jbucket, "le", NULL);
+      json_object_object_add(jbucket, "count", json_object_new_int64(h->buckets[i]));
+      json_object_array_add(jbuckets, jbucket);
+    }
+  json_object_object_add(jhist, "buckets", jbuckets);
+
+  return jhist;
+}
+
+static int
+jsonapi_reply_stats_player(struct httpd_request *hreq)
+{
+  struct player_stats stats;
+  json_object *reply;
+  json_object *outputs;
+  json_object *output;
+  int ret;
+  int i;
+
+  ret = player_stats_get(&stats);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "ticks", json_object_new_int64(stats.ticks));
+  json_object_object_add(reply, "ticks_missed", json_object_new_int64(stats.ticks_missed));
+  json_object_object_add(reply, "underruns", json_object_new_int64(stats.underruns));
+  json_object_object_add(reply, "underrun_suspends", json_object_new_int64(stats.underrun_suspends));
+  json_object_object_add(reply, "overrun_resets", json_object_new_int64(stats.overrun_resets));
+  json_object_object_add(reply, "tick_lateness_us", histogram_to_json(&stats.tick_lateness_us));
+  json_object_object_add(reply, "input_buffer_ms", histogram_to_json(&stats.input_buffer_ms));
+
+  outputs = json_object_new_array();
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      output = json_object_new_object();
+      json_object_object_add(output, "type", json_object_new_string(stats.outputs[i].type));
+      json_object_object_add(output, "write_latency_us", histogram_to_json(&stats.outputs[i].write_latency_us));
+      json_object_array_add(outputs, output);
+    }
+  json_object_object_add(reply, "outputs", outputs);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_stats_httpd(struct httpd_request *hreq)
+{
+  struct httpd_lane_stats stats[HTTPD_LANE_MAX];
+  struct httpd_connection_stats conn_stats;
+  json_object *reply;
+  json_object *connections;
+  json_object *lanes;
+  json_object *lane;
+  int nlanes;
+  int i;
+
+  nlanes = httpd_lanes_stats_get(stats);
+  httpd_server_connection_stats_get(&conn_stats);
+
+  reply = json_object_new_object();
+
+  connections = json_object_new_object();
+  json_object_object_add(connections, "open", json_object_new_int(conn_stats.open));
+  json_object_object_add(connections, "accepted", json_object_new_int64(conn_stats.accepted));
+  json_object_object_add(connections, "requests", json_object_new_int64(conn_stats.requests));
+  json_object_object_add(connections, "requests_reused", json_object_new_int64(conn_stats.requests_reused));
+  json_object_object_add(reply, "connections", connections);
+
+  lanes = json_object_new_array();
+  for (i = 0; i < nlanes; i++)
+    {
+      lane = json_object_new_object();
+      json_object_object_add(lane, "name", json_object_new_string(stats[i].name));
+      json_object_object_add(lane, "threads", json_object_new_int(stats[i].nthreads));
+      json_object_object_add(lane, "queued", json_object_new_int(stats[i].queued));
+      json_object_object_add(lane, "requests", json_object_new_int64(stats[i].requests));
+      json_object_object_add(lane, "wait_us", histogram_to_json(&stats[i].wait_us));
+      json_object_object_add(lane, "handler_us", histogram_to_json(&stats[i].handler_us));
+      json_object_array_add(lanes, lane);
+    }
+  json_object_object_add(reply, "lanes", lanes);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_stats_xcode(struct httpd_request *hreq)
+{
+  struct cache_xcode_progress progress;
+  json_object *reply;
+  int ret;
+
+  ret = cache_xcode_progress_get(&progress);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "enabled", json_object_new_boolean(progress.is_enabled));
+  json_object_object_add(reply, "paused", json_object_new_boolean(progress.is_paused));
+  json_object_object_add(reply, "threads", json_object_new_int(progress.nthreads));
+  json_object_object_add(reply, "files_active", json_object_new_int(progress.files_active));
+  json_object_object_add(reply, "files_remaining", json_object_new_int(progress.files_remaining));
+  json_object_object_add(reply, "files_done", json_object_new_int(progress.files_done));
+  if (progress.eta_sec >= 0)
+    json_object_object_add(reply, "eta_sec", json_object_new_int(progress.eta_sec));
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_stats_cache(struct httpd_request *hreq)
+{
+  struct cache_daap_stats stats;
+  json_object *reply;
+  json_object *daap;
+  int ret;
+
+  ret = cache_daap_stats_get(&stats);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  reply = json_object_new_object();
+  daap = json_object_new_object();
+
+  json_object_object_add(daap, "snapshot_hits", json_object_new_int64(stats.snapshot_hits));
+  json_object_object_add(daap, "memory_hits", json_object_new_int64(stats.mem_hits));
+  json_object_object_add(daap, "db_hits", json_object_new_int64(stats.db_hits));
+  json_object_object_add(daap, "misses", json_object_new_int64(stats.misses));
+  json_object_object_add(daap, "memory_entries", json_object_new_int(stats.mem_entries));
+  json_object_object_add(daap, "memory_size", json_object_new_int64(stats.mem_size));
+  json_object_object_add(daap, "memory_size_max", json_object_new_int64(stats.mem_size_max));
+  json_object_object_add(reply, "daap", daap);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
 static json_object *
 queue_item_to_json(struct db_queue_item *queue_item, char shuffle)
 {
@@ -2867,9 +3058,7 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
-
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.media_kind = media_kind;
 
   ret = fetch_artists(&query_params, items, &total);
   if (ret < 0)
@@ -3016,9 +3205,7 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
-
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.media_kind = media_kind;
 
   ret = fetch_albums(&query_params, items, &total);
   if (ret < 0)
@@ -4102,6 +4289,26 @@ jsonapi_reply_library_add(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+// Uses the full-text index, so each word in the query matches as a prefix
+static char *
+search_filter_make(const char *column, const char *param_query, enum media_kind media_kind)
+{
+  char *fts;
+  char *filter;
+
+  fts = db_fts_filter(column, param_query);
+  if (!fts)
+    fts = db_mprintf("(%s LIKE '%%%q%%')", column, param_query);
+
+  if (media_kind)
+    filter = db_mprintf("(%s AND f.media_kind = %d)", fts, media_kind);
+  else
+    filter = db_mprintf("%s", fts);
+
+  free(fts);
+  return filter;
+}
+
 static int
 search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_query, struct smartpl *smartpl_expression, enum media_kind media_kind)
 {
@@ -4127,10 +4334,7 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter_make("f.title", param_query, media_kind);
     }
   else
     {
@@ -4188,10 +4392,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter_make("f.album_artist", param_query, media_kind);
     }
   else
     {
@@ -4250,10 +4451,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter_make("f.album", param_query, media_kind);
     }
   else
     {
@@ -4312,10 +4510,7 @@ search_composers(json_object *reply, struct httpd_request *hreq, const char *par
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter_make("f.composer", param_query, media_kind);
     }
   else
     {
@@ -4374,10 +4569,7 @@ search_genres(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter_make("f.genre", param_query, media_kind);
     }
   else
     {
@@ -4616,6 +4808,11 @@ static struct httpd_uri_map adm_handlers[] =
     { HTTPD_METHOD_PUT,    "^/api/player/volume$",                         jsonapi_reply_player_volume },
     { HTTPD_METHOD_PUT,    "^/api/player/seek$",                           jsonapi_reply_player_seek },
 
+    { HTTPD_METHOD_GET,    "^/api/stats/player$",                          jsonapi_reply_stats_player },
+    { HTTPD_METHOD_GET,    "^/api/stats/xcode$",                           jsonapi_reply_stats_xcode },
+    { HTTPD_METHOD_GET,    "^/api/stats/httpd$",                           jsonapi_reply_stats_httpd },
+    { HTTPD_METHOD_GET,    "^/api/stats/cache$",                           jsonapi_reply_stats_cache },
+
     { HTTPD_METHOD_GET,    "^/api/queue$",                                 jsonapi_reply_queue },
     { HTTPD_METHOD_PUT,    "^/api/queue/clear$",                           jsonapi_reply_queue_clear },
     { HTTPD_METHOD_POST,   "^/api/queue/items/add$",                       jsonapi_reply_queue_tracks_add },
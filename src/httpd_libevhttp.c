@@ -54,6 +54,14 @@ struct httpd_uri_parsed
   httpd_uri_path_parts path_parts;
 };
 
+// Connections that have had at least one request. Only touched by the httpd
+// thread that owns the server.
+struct httpd_conn
+{
+  httpd_connection *conn;
+  struct httpd_conn *next;
+};
+
 struct httpd_server
 {
   int fd;
@@ -61,6 +69,7 @@ struct httpd_server
   struct commands_base *cmdbase;
   httpd_request_cb request_cb;
   void *request_cb_arg;
+  struct httpd_conn *conns;
 };
 
 struct httpd_reply
@@ -89,6 +98,9 @@ struct httpd_backend_data
   struct httpd_disconnect disconnect;
 };
 
+// Totals for all the servers (one per httpd thread)
+static struct httpd_connection_stats connection_stats;
+
 // Forward
 static void
 closecb_worker(evutil_socket_t fd, short event, void *arg);
@@ -249,6 +261,69 @@ httpd_request_new(httpd_backend *backend, httpd_server *server, const char *uri,
   return NULL;
 }
 
+static void
+connection_track(httpd_server *server, httpd_connection *conn)
+{
+  struct httpd_conn *c;
+
+  __atomic_add_fetch(&connection_stats.requests, 1, __ATOMIC_RELAXED);
+
+  for (c = server->conns; c; c = c->next)
+    {
+      if (c->conn == conn)
+	{
+	  __atomic_add_fetch(&connection_stats.requests_reused, 1, __ATOMIC_RELAXED);
+	  return;
+	}
+    }
+
+  CHECK_NULL(L_HTTPD, c = calloc(1, sizeof(struct httpd_conn)));
+  c->conn = conn;
+  c->next = server->conns;
+  server->conns = c;
+
+  __atomic_add_fetch(&connection_stats.accepted, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&connection_stats.open, 1, __ATOMIC_RELAXED);
+}
+
+static void
+connection_untrack(httpd_server *server, httpd_connection *conn)
+{
+  struct httpd_conn **p;
+  struct httpd_conn *c;
+
+  for (p = &server->conns; *p && ((*p)->conn != conn); p = &(*p)->next)
+    ;
+
+  c = *p;
+  if (!c)
+    return;
+
+  *p = c->next;
+  free(c);
+
+  __atomic_sub_fetch(&connection_stats.open, 1, __ATOMIC_RELAXED);
+}
+
+// Connection close callback between requests, i.e. for a kept alive connection
+static void
+closecb_idle(httpd_connection *conn, void *arg)
+{
+  httpd_server *server = arg;
+
+  connection_untrack(server, conn);
+}
+
+void
+httpd_server_connection_stats_get(struct httpd_connection_stats *stats)
+{
+  stats->open = __atomic_load_n(&connection_stats.open, __ATOMIC_RELAXED);
+  stats->accepted = __atomic_load_n(&connection_stats.accepted, __ATOMIC_RELAXED);
+  stats->requests = __atomic_load_n(&connection_stats.requests, __ATOMIC_RELAXED);
+  stats->requests_reused = __atomic_load_n(&connection_stats.requests_reused, __ATOMIC_RELAXED);
+}
+
+
 // Since this is async, libevent will already have closed the connection, so
 // the parts of hreq that are from httpd_connection will now be invalid e.g.
 // peer_address.
@@ -276,6 +351,8 @@ closecb_httpd(httpd_connection *conn, void *arg)
 
   DPRINTF(E_WARN, hreq->module->logdomain, "Connection to '%s' was closed\n", hreq->peer_address);
 
+  connection_untrack(hreq->backend_data->server, conn);
+
   // The disconnect event may occur while a worker thread is accessing hreq, or
   // has an event scheduled that will do so, so we have to be careful to let it
   // finish and cancel events.
@@ -324,6 +401,8 @@ gencb_httpd(httpd_backend *backend, void *arg)
       return;
     }
 
+  connection_track(server, evhttp_request_get_connection(backend));
+
   // We must hook connection close, so we can assure that conn close callbacks
   // to handlers running in a worker are made in the same thread.
   evhttp_connection_set_closecb(evhttp_request_get_connection(backend), closecb_httpd, hreq);
@@ -343,6 +422,10 @@ httpd_server_free(httpd_server *server)
   if (server->evhttp)
     evhttp_free(server->evhttp);
 
+  // Connections that evhttp_free() closed without calling back
+  while (server->conns)
+    connection_untrack(server, server->conns->conn);
+
   commands_base_free(server->cmdbase);
   free(server);
 }
@@ -402,7 +485,7 @@ send_reply_and_free(struct httpd_reply *reply)
     {
       conn = evhttp_request_get_connection(hreq->backend);
       if (conn)
-	evhttp_connection_set_closecb(conn, NULL, NULL);
+	evhttp_connection_set_closecb(conn, closecb_idle, hreq->backend_data->server);
     }
 
   switch (reply->type)
@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2009-2010 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <regex.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "httpd_internal.h"
+#include "httpd_router.h"
+
+
+/* ------------------------------- URI ROUTER ------------------------------- */
+
+// The handler tables of the modules have regexes for matching the request path,
+// but nearly all of them are just literal segments and segments with an id.
+// Those are compiled into a trie of path segments, so a request can be routed
+// with a single walk of the path, and the ids are parsed on the way. Patterns
+// the router doesn't understand are still matched with regexec(). As before,
+// the first matching handler in the table wins.
+
+enum route_segment_type
+{
+  ROUTE_SEGMENT_LITERAL,
+  ROUTE_SEGMENT_DIGITS,
+  ROUTE_SEGMENT_WORD,
+  ROUTE_SEGMENT_ANY,
+};
+
+struct route_node
+{
+  enum route_segment_type type;
+  char *literal;
+  // Indices (ascending) of the handlers in the table that end at this node
+  int *handlers;
+  int nhandlers;
+  struct route_node *child;
+  struct route_node *next;
+};
+
+struct httpd_router
+{
+  struct route_node root;
+  // Indices (ascending) of the handlers that must be matched with regexec()
+  int *regex_handlers;
+  int nregex_handlers;
+};
+
+struct route_segment
+{
+  enum route_segment_type type;
+  const char *literal;
+  size_t len;
+};
+
+static const struct
+{
+  const char *pattern;
+  enum route_segment_type type;
+} route_segment_patterns[] =
+{
+  { "[[:digit:]]+",  ROUTE_SEGMENT_DIGITS },
+  { "[A-Za-z0-9_]+", ROUTE_SEGMENT_WORD },
+  { "[^/]+",         ROUTE_SEGMENT_ANY },
+};
+
+static bool
+route_char_is_word(char c)
+{
+  return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_');
+}
+
+// Splits a regex like "^/api/library/albums/[[:digit:]]+/tracks$" into
+// segments. Returns the number of segments or -1 if the regex has anything that
+// the router can't handle, e.g. alternations or patterns that aren't anchored.
+static int
+route_parse(struct route_segment *segments, int max_segments, const char *regexp)
+{
+  const char *ptr;
+  size_t len;
+  int n;
+  int i;
+
+  if (strncmp(regexp, "^/", 2) != 0)
+    return -1;
+
+  ptr = regexp + 2;
+  for (n = 0; n < max_segments; n++)
+    {
+      segments[n].type = ROUTE_SEGMENT_LITERAL;
+      segments[n].literal = ptr;
+
+      for (i = 0; i < ARRAY_SIZE(route_segment_patterns); i++)
+	{
+	  len = strlen(route_segment_patterns[i].pattern);
+	  if (strncmp(ptr, route_segment_patterns[i].pattern, len) == 0)
+	    {
+	      segments[n].type = route_segment_patterns[i].type;
+	      ptr += len;
+	      break;
+	    }
+	}
+
+      if (segments[n].type == ROUTE_SEGMENT_LITERAL)
+	{
+	  while (route_char_is_word(*ptr) || *ptr == '-')
+	    ptr++;
+	}
+
+      segments[n].len = ptr - segments[n].literal;
+
+      if (*ptr == '/')
+	ptr++;
+      else if (*ptr == '$' && *(ptr + 1) == '\0')
+	return n + 1;
+      else
+	return -1;
+    }
+
+  return -1;
+}
+
+static int
+route_handler_append(int **handlers, int *nhandlers, int idx)
+{
+  int *tmp;
+
+  tmp = realloc(*handlers, (*nhandlers + 1) * sizeof(int));
+  if (!tmp)
+    return -1;
+
+  *handlers = tmp;
+  (*handlers)[(*nhandlers)++] = idx;
+  return 0;
+}
+
+static int
+route_add(struct httpd_router *router, struct route_segment *segments, int nsegments, int idx)
+{
+  struct route_node *node;
+  struct route_node *child;
+  struct route_node **tail;
+  int i;
+
+  node = &router->root;
+  for (i = 0; i < nsegments; i++)
+    {
+      for (tail = &node->child; (child = *tail); tail = &child->next)
+	{
+	  if (child->type != segments[i].type)
+	    continue;
+	  if (child->type != ROUTE_SEGMENT_LITERAL)
+	    break;
+	  if (strlen(child->literal) == segments[i].len && strncmp(child->literal, segments[i].literal, segments[i].len) == 0)
+	    break;
+	}
+
+      if (!child)
+	{
+	  child = calloc(1, sizeof(struct route_node));
+	  if (!child)
+	    return -1;
+
+	  child->type = segments[i].type;
+	  if (child->type == ROUTE_SEGMENT_LITERAL && !(child->literal = strndup(segments[i].literal, segments[i].len)))
+	    {
+	      free(child);
+	      return -1;
+	    }
+
+	  *tail = child;
+	}
+
+      node = child;
+    }
+
+  return route_handler_append(&node->handlers, &node->nhandlers, idx);
+}
+
+static void
+route_node_free(struct route_node *node)
+{
+  struct route_node *child;
+
+  while ((child = node->child))
+    {
+      node->child = child->next;
+      route_node_free(child);
+      free(child);
+    }
+
+  free(node->literal);
+  free(node->handlers);
+}
+
+// Checks if seg (of length len) matches the node. For digit segments the value
+// is returned in id.
+static bool
+route_segment_matches(struct route_node *node, const char *seg, size_t len, int64_t *id)
+{
+  size_t i;
+
+  switch (node->type)
+    {
+      case ROUTE_SEGMENT_LITERAL:
+	return (strlen(node->literal) == len && strncmp(node->literal, seg, len) == 0);
+
+      case ROUTE_SEGMENT_DIGITS:
+	*id = 0;
+	for (i = 0; i < len; i++)
+	  {
+	    if (seg[i] < '0' || seg[i] > '9')
+	      return false;
+	    if (*id >= 0)
+	      *id = (*id > (INT64_MAX - 9) / 10) ? -1 : *id * 10 + (seg[i] - '0');
+	  }
+	return (len > 0);
+
+      case ROUTE_SEGMENT_WORD:
+	for (i = 0; i < len; i++)
+	  {
+	    if (!route_char_is_word(seg[i]))
+	      return false;
+	  }
+	return (len > 0);
+
+      case ROUTE_SEGMENT_ANY:
+	return (len > 0);
+    }
+
+  return false;
+}
+
+static bool
+route_method_matches(struct httpd_uri_map *map, int method)
+{
+  return !(map->method && method && !(map->method & method));
+}
+
+// Walks the trie with the path segment starting at seg. Since there may be more
+// than one handler matching (e.g. a literal and a "[^/]+" segment), all
+// branches are tried and best is the one earliest in the table.
+static void
+route_match(struct httpd_router_match *best, struct httpd_router_match *cur, struct route_node *node, const char *seg, int method, struct httpd_uri_map *handlers)
+{
+  struct route_node *child;
+  const char *end;
+  int64_t id;
+  bool has_id;
+  int idx;
+  int i;
+
+  end = strchr(seg, '/');
+  if (!end)
+    end = seg + strlen(seg);
+
+  for (child = node->child; child; child = child->next)
+    {
+      if (!route_segment_matches(child, seg, end - seg, &id))
+	continue;
+
+      has_id = (child->type == ROUTE_SEGMENT_DIGITS && cur->nids < HTTPD_PATH_IDS_MAX);
+      if (has_id)
+	cur->ids[cur->nids++] = id;
+
+      if (*end == '/')
+	route_match(best, cur, child, end + 1, method, handlers);
+
+      for (i = 0; *end == '\0' && i < child->nhandlers; i++)
+	{
+	  idx = child->handlers[i];
+	  if (best->handler >= 0 && idx > best->handler)
+	    break;
+	  if (!route_method_matches(&handlers[idx], method))
+	    continue;
+
+	  *best = *cur;
+	  best->handler = idx;
+	  break;
+	}
+
+      if (has_id)
+	cur->nids--;
+    }
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+void
+httpd_router_free(struct httpd_router *router, struct httpd_uri_map *handlers)
+{
+  struct httpd_uri_map *uri;
+
+  for (uri = handlers; uri->handler; uri++)
+    {
+      if (!uri->preg)
+	continue;
+
+      regfree(uri->preg); // Frees allocation by regcomp
+      free(uri->preg); // Frees our own calloc
+      uri->preg = NULL;
+    }
+
+  if (!router)
+    return;
+
+  route_node_free(&router->root);
+  free(router->regex_handlers);
+  free(router);
+}
+
+struct httpd_router *
+httpd_router_new(struct httpd_uri_map *handlers)
+{
+  struct route_segment segments[ARRAY_SIZE(((struct httpd_request *)0)->path_parts)];
+  struct httpd_router *router;
+  struct httpd_uri_map *uri;
+  char buf[64];
+  int nsegments;
+  int idx;
+  int ret;
+
+  CHECK_NULL(L_HTTPD, router = calloc(1, sizeof(struct httpd_router)));
+
+  for (uri = handlers, idx = 0; uri->handler; uri++, idx++)
+    {
+      nsegments = route_parse(segments, ARRAY_SIZE(segments), uri->regexp);
+      if (nsegments > 0)
+	{
+	  ret = route_add(router, segments, nsegments, idx);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, out of memory\n");
+	      goto error;
+	    }
+
+	  continue;
+	}
+
+      DPRINTF(E_DBG, L_HTTPD, "Handler '%s' will be matched as regex\n", uri->regexp);
+
+      uri->preg = calloc(1, sizeof(regex_t));
+      if (!uri->preg || route_handler_append(&router->regex_handlers, &router->nregex_handlers, idx) < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, out of memory");
+	  goto error;
+	}
+
+      ret = regcomp(uri->preg, uri->regexp, REG_EXTENDED | REG_NOSUB);
+      if (ret != 0)
+	{
+	  regerror(ret, uri->preg, buf, sizeof(buf));
+	  DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, regexp error: %s\n", buf);
+	  free(uri->preg); // Not compiled, so not for regfree()
+	  uri->preg = NULL;
+	  goto error;
+	}
+    }
+
+  return router;
+
+ error:
+  httpd_router_free(router, handlers);
+  return NULL;
+}
+
+void
+httpd_router_match(struct httpd_router_match *match, struct httpd_router *router, struct httpd_uri_map *handlers, const char *path, int method)
+{
+  struct httpd_router_match cur;
+  int idx;
+  int ret;
+  int i;
+
+  cur.nids = 0;
+  match->handler = -1;
+  match->nids = 0;
+  if (path[0] == '/')
+    route_match(match, &cur, &router->root, path + 1, method, handlers);
+
+  // Handlers that the router couldn't compile still take precedence if they
+  // are earlier in the table
+  for (i = 0; i < router->nregex_handlers; i++)
+    {
+      idx = router->regex_handlers[i];
+      if (match->handler >= 0 && idx > match->handler)
+	break;
+
+      // Check if handler supports the current http request method
+      if (!route_method_matches(&handlers[idx], method))
+	continue;
+
+      ret = regexec(handlers[idx].preg, path, 0, NULL, 0);
+      if (ret != 0)
+	continue;
+
+      match->handler = idx;
+      match->nids = 0;
+      break;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __HTTPD_ROUTER_H__
+#define __HTTPD_ROUTER_H__
+
+#include <stdint.h>
+
+#include "httpd_internal.h"
+
+struct httpd_router_match
+{
+  int handler; // Index in the handler table, -1 if no match
+  int64_t ids[HTTPD_PATH_IDS_MAX];
+  int nids;
+};
+
+/*
+ * Compiles a module's handler table (terminated by a NULL handler) into a
+ * router. Handlers with patterns the router can't parse get their preg set.
+ *
+ * @in  handlers The handler table, must outlive the router
+ * @return       Router to free with httpd_router_free(), NULL on error
+ */
+struct httpd_router *
+httpd_router_new(struct httpd_uri_map *handlers);
+
+void
+httpd_router_free(struct httpd_router *router, struct httpd_uri_map *handlers);
+
+/*
+ * Finds the first handler in the table that matches the path and the method,
+ * same as regexec() of each handler in table order would.
+ *
+ * @out match    Index of the handler (-1 if none) and values of its
+ *               "[[:digit:]]+" segments
+ * @in  path     Request path without query, e.g. "/api/library/albums/12"
+ * @in  method   A HTTPD_METHOD_ value, 0 matches any handler method
+ */
+void
+httpd_router_match(struct httpd_router_match *match, struct httpd_router *router, struct httpd_uri_map *handlers, const char *path, int method);
+
+#endif /* !__HTTPD_ROUTER_H__ */
@@ -756,6 +756,7 @@ static struct httpd_uri_map rsp_handlers[] =
     {
       .regexp = "^/rsp/stream/[[:digit:]]+$",
       .handler = rsp_stream,
+      .flags = HTTPD_HANDLER_STREAM,
     },
     { 
       .regexp = NULL,
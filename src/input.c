@@ -811,6 +811,18 @@ input_read(void *data, size_t size, short *flag, void **flagdata)
   return len;
 }
 
+size_t
+input_buffer_length(void)
+{
+  size_t len;
+
+  pthread_mutex_lock(&input_buffer.mutex);
+  len = evbuffer_get_length(input_buffer.evbuf);
+  pthread_mutex_unlock(&input_buffer.mutex);
+
+  return len;
+}
+
 void
 input_buffer_full_cb(input_cb cb)
 {
@@ -173,6 +173,13 @@ input_wait(void);
 int
 input_read(void *data, size_t size, short *flag, void **flagdata);
 
+/*
+ * Returns the number of bytes currently held in the input buffer, i.e. how much
+ * the input is ahead of the player. Will not block.
+ */
+size_t
+input_buffer_length(void);
+
 /*
  * Player can set this to get a callback from the input when the input buffer
  * is full. The player may use this to resume playback after an underrun.
@@ -33,6 +33,7 @@
 #include <event2/event.h>
 
 #include "library.h"
+#include "artwork.h"
 #include "cache.h"
 #include "commands.h"
 #include "conffile.h"
@@ -113,6 +114,12 @@ static bool scanning;
 static struct timeval library_update_wait = { 5, 0 };
 static struct event *updateev;
 
+// Rebuilds the stale cached membership of smart playlists, see
+// smartpl_cache_schedule(). The wait lets the change stamps (in seconds) pass,
+// and collects e.g. the play count updates of a playlist being played.
+static struct timeval smartpl_cache_wait = { 2, 0 };
+static struct event *smartplev;
+
 // Counts the number of changes made to the database between to DATABASE
 // event notifications
 static unsigned int deferred_update_notifications;
@@ -278,6 +285,28 @@ library_callback_schedule(library_cb cb, void *arg, struct timeval *wait, enum l
 /* ---------------------- LIBRARY ABSTRACTION --------------------- */
 /*                          thread: library                         */
 
+static void
+smartpl_cache_schedule(void)
+{
+  evtimer_add(smartplev, &smartpl_cache_wait);
+}
+
+static void
+smartpl_cache_cb(int fd, short what, void *arg)
+{
+  struct timeval wait = { 0, 0 };
+  int ret;
+
+  ret = db_smartpl_cache_refresh();
+  if (ret <= 0)
+    return;
+
+  // Rules with relative dates are rebuilt when they expire. Give the expiry
+  // time a second to pass, the stamps are in seconds.
+  wait.tv_sec = ret + 1;
+  evtimer_add(smartplev, &wait);
+}
+
 static bool
 handle_deferred_update_notifications(void)
 {
@@ -292,6 +321,11 @@ handle_deferred_update_notifications(void)
       update_time = time(NULL);
       db_admin_setint64(DB_ADMIN_DB_UPDATE, (int64_t) update_time);
       db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) update_time);
+
+      // Until these are done album and artist lists are grouped from files,
+      // and smart playlist rules are evaluated on each request
+      db_group_stats_refresh();
+      smartpl_cache_schedule();
     }
 
   return ret;
@@ -353,6 +387,7 @@ rescan(void *arg, int *ret)
 
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
+  artwork_warmer_trigger();
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
@@ -405,6 +440,7 @@ metarescan(void *arg, int *ret)
 
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
+  artwork_warmer_trigger();
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library meta rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
@@ -721,6 +757,21 @@ update_trigger_cb(int fd, short what, void *arg)
     }
 }
 
+static enum command_state
+playstate_trigger(void *arg, int *retval)
+{
+  // If the library is being updated the stats and smart playlists are
+  // refreshed after that anyway
+  if (!scanning)
+    {
+      db_group_stats_refresh();
+      smartpl_cache_schedule();
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
 static enum command_state
 update_trigger(void *arg, int *retval)
 {
@@ -830,6 +881,7 @@ initscan()
 
       DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
       db_hook_post_scan();
+      artwork_warmer_trigger();
     }
 
   endtime = time(NULL);
@@ -841,6 +893,9 @@ initscan()
     listener_notify(LISTENER_UPDATE | LISTENER_DATABASE);
   else
     listener_notify(LISTENER_UPDATE);
+
+  // Builds what is missing from the cache, e.g. after a restart
+  smartpl_cache_schedule();
 }
 
 bool
@@ -881,6 +936,17 @@ library_update_trigger(short update_events)
     }
 }
 
+void
+library_playstate_trigger(void)
+{
+  int ret;
+
+  if (pthread_equal(pthread_self(), tid_library))
+    playstate_trigger(NULL, &ret);
+  else
+    commands_exec_async(cmdbase, playstate_trigger, NULL);
+}
+
 int
 library_playlist_item_add(const char *vp_playlist, const char *vp_item)
 {
@@ -1047,6 +1113,7 @@ library_init(void)
 
   CHECK_NULL(L_LIB, evbase_lib = event_base_new());
   CHECK_NULL(L_LIB, updateev = evtimer_new(evbase_lib, update_trigger_cb, NULL));
+  CHECK_NULL(L_LIB, smartplev = evtimer_new(evbase_lib, smartpl_cache_cb, NULL));
 
   for (i = 0; sources[i]; i++)
     {
@@ -1103,6 +1170,7 @@ library_deinit()
 	event_free(library_cb_register[i].ev);
     }
 
+  event_free(smartplev);
   event_free(updateev);
   event_base_free(evbase_lib);
 }
@@ -213,6 +213,16 @@ library_set_scanning(bool is_scanning);
 void
 library_update_trigger(short update_events);
 
+/*
+ * Trigger for refreshing smart playlists that depend on play state
+ *
+ * Needs to be called after play count, skip count, seek etc. of a file was
+ * changed. The refresh is made by the library thread after a short delay, so
+ * it is safe to call this function from any thread.
+ */
+void
+library_playstate_trigger(void);
+
 int
 library_playlist_item_add(const char *vp_playlist, const char *vp_item);
 
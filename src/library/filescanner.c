@@ -1593,6 +1593,9 @@ inotify_cb(int fd, short event, void *arg)
 	    }
 	}
 
+      // Any change in the directory may add or remove an artwork file
+      artwork_dir_invalidate(wi.path);
+
       /* ie->len == 0 catches events on the subject of the watch itself.
        * As we only watch directories, this catches directories.
        * General watch events like IN_UNMOUNT and IN_IGNORED do not come
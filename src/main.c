@@ -69,6 +69,7 @@
 #include "player.h"
 #include "worker.h"
 #include "library.h"
+#include "artwork.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -387,7 +388,10 @@ signal_signalfd_cb(int fd, short event, void *arg)
 	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
 
 	    if (!main_exit)
-	      logger_reinit();
+	      {
+		logger_reinit();
+		httpd_reload();
+	      }
 	    break;
 	}
     }
@@ -432,7 +436,10 @@ signal_kqueue_cb(int fd, short event, void *arg)
 	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
 
 	    if (!main_exit)
-	      logger_reinit();
+	      {
+		logger_reinit();
+		httpd_reload();
+	      }
 	    break;
 	}
     }
@@ -798,6 +805,16 @@ main(int argc, char **argv)
       goto player_fail;
     }
 
+  /* Spawn artwork warmer thread (if enabled), batch and ladder pools */
+  ret = artwork_init();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Artwork init failed\n");
+
+      ret = EXIT_FAILURE;
+      goto artwork_fail;
+    }
+
   /* Spawn HTTPd thread */
   ret = httpd_init(webroot);
   if (ret != 0)
@@ -931,6 +948,10 @@ main(int argc, char **argv)
   httpd_deinit();
 
  httpd_fail:
+  DPRINTF(E_LOG, L_MAIN, "Artwork deinit\n");
+  artwork_deinit();
+
+ artwork_fail:
   DPRINTF(E_LOG, L_MAIN, "Player deinit\n");
   player_deinit();
 
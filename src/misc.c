@@ -1523,6 +1523,34 @@ ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf)
 }
 
 
+/* -------------------------------- Histogram ------------------------------- */
+
+void
+histogram_add(struct histogram *h, uint64_t value)
+{
+  int bucket;
+
+  bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+  if (bucket >= HISTOGRAM_BUCKETS)
+    bucket = HISTOGRAM_BUCKETS - 1;
+
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max)
+    h->max = value;
+}
+
+uint64_t
+histogram_bucket_limit(int bucket)
+{
+  if (bucket >= HISTOGRAM_BUCKETS - 1)
+    return UINT64_MAX;
+
+  return (UINT64_C(1) << bucket) - 1;
+}
+
+
 /* ------------------------- Clock utility functions ------------------------ */
 
 int
@@ -1591,6 +1619,12 @@ timespec_reltoabs(struct timespec relative)
   return timespec_add(absolute, relative);
 }
 
+int64_t
+timespec_diff_us(struct timespec time1, struct timespec time2)
+{
+  return (int64_t)(time1.tv_sec - time2.tv_sec) * 1000000 + (time1.tv_nsec - time2.tv_nsec) / 1000;
+}
+
 #if defined(HAVE_MACH_CLOCK) || defined(HAVE_MACH_TIMER)
 
 #include <mach/mach_time.h> /* mach_absolute_time */
@@ -211,6 +211,29 @@ size_t
 ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf);
 
 
+/* -------------------------------- Histogram ------------------------------- */
+
+// Cheap log2 histogram for instrumentation. Bucket 0 counts zero values, bucket
+// n counts values in [2^(n-1), 2^n - 1], and the last bucket also counts
+// anything larger. With 32 buckets microsecond values only saturate after
+// about 18 minutes, so slow requests and stalls still land in their own bucket.
+#define HISTOGRAM_BUCKETS 32
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void
+histogram_add(struct histogram *h, uint64_t value);
+
+// Returns the upper (inclusive) bound of the bucket, UINT64_MAX for the last
+uint64_t
+histogram_bucket_limit(int bucket);
+
+
 /* ------------------------- Clock utility functions ------------------------ */
 
 #include <time.h>
@@ -269,6 +292,10 @@ timespec_cmp(struct timespec time1, struct timespec time2);
 struct timespec
 timespec_reltoabs(struct timespec relative);
 
+// Returns time1 - time2 in microseconds
+int64_t
+timespec_diff_us(struct timespec time1, struct timespec time2);
+
 
 /* ------------------------------- Media quality ---------------------------- */
 
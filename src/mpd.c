@@ -67,6 +67,9 @@ enum mpd_type {
 #define MPD_RATING_FACTOR 10.0
 #define MPD_BINARY_SIZE 8192  /* MPD MAX_BINARY_SIZE */
 #define MPD_BINARY_SIZE_MIN 64  /* min size from MPD ClientCommands.cxx */
+#define MPD_IDLE_MESSAGE (1 << 14)  /* Not a listener event, for the "message" idle subsystem */
+#define MPD_CLIENT_MESSAGES_MAX 64  /* MPD CLIENT_MAX_MESSAGES */
+#define MPD_CHANNEL_PUBLISH_INTERVAL 10  /* seconds */
 
 static pthread_t tid_mpd;
 
@@ -77,6 +80,7 @@ static struct commands_base *cmdbase;
 static struct evhttp *evhttpd;
 
 static struct evconnlistener *mpd_listener;
+static struct event *mpd_channels_publish_ev;
 static int mpd_sockfd;
 
 static bool mpd_plugin_httpd;
@@ -262,6 +266,13 @@ struct mpd_client_ctx
   // The current binary limit size
   unsigned int binarylimit;
 
+  // Channels the client has subscribed to, bit n is set for mpd_channels[n]
+  unsigned int channels;
+
+  // Messages published to the subscribed channels, waiting for readmessages
+  struct evbuffer *messages;
+  int nmessages;
+
   // The output buffer for the client (used to send data to the client)
   struct evbuffer *evbuffer;
 
@@ -302,6 +313,9 @@ free_mpd_client_ctx(void *ctx)
       client = client->next;
     }
 
+  if (client_ctx->messages)
+    evbuffer_free(client_ctx->messages);
+
   free(client_ctx);
 }
 
@@ -1708,12 +1722,14 @@ mpd_command_idle(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	    ctx->idle_events |= LISTENER_STORED_PLAYLIST;
 	  else if (0 == strcmp(argv[i], "sticker"))
             ctx->idle_events |= LISTENER_RATING;
+	  else if (0 == strcmp(argv[i], "message"))
+	    ctx->idle_events |= MPD_IDLE_MESSAGE;
 	  else
 	    DPRINTF(E_DBG, L_MPD, "Idle command for '%s' not supported\n", argv[i]);
 	}
     }
   else
-    ctx->idle_events = MPD_ALL_IDLE_LISTENER_EVENTS;
+    ctx->idle_events = MPD_ALL_IDLE_LISTENER_EVENTS | MPD_IDLE_MESSAGE;
 
   // If events the client listens to occurred since the last idle call (or since the client connected,
   // if it is the first idle call), notify immediately.
@@ -5026,6 +5042,49 @@ channel_verification(const char *message)
   player_raop_verification_kickoff((char **)&message);
 }
 
+// Message values are separated by spaces, so e.g. "AirPlay 2" becomes
+// "airplay_2"
+static void
+channel_playerstats_key(char *key, size_t keylen, const char *name)
+{
+  size_t i;
+
+  for (i = 0; name[i] && i < keylen - 1; i++)
+    key[i] = isalnum((unsigned char)name[i]) ? tolower((unsigned char)name[i]) : '_';
+
+  key[i] = '\0';
+}
+
+static void
+channel_playerstats_publish(struct evbuffer *evbuf)
+{
+  struct player_stats stats;
+  char key[64];
+  int i;
+  int ret;
+
+  ret = player_stats_get(&stats);
+  if (ret < 0)
+    return;
+
+  evbuffer_add_printf(evbuf,
+      "ticks=%" PRIu64 " ticks_missed=%" PRIu64 " underruns=%" PRIu64 " underrun_suspends=%" PRIu64 " overrun_resets=%" PRIu64
+      " tick_lateness_avg_us=%" PRIu64 " tick_lateness_max_us=%" PRIu64 " input_buffer_avg_ms=%" PRIu64,
+      stats.ticks, stats.ticks_missed, stats.underruns, stats.underrun_suspends, stats.overrun_resets,
+      stats.tick_lateness_us.count ? stats.tick_lateness_us.sum / stats.tick_lateness_us.count : 0,
+      stats.tick_lateness_us.max,
+      stats.input_buffer_ms.count ? stats.input_buffer_ms.sum / stats.input_buffer_ms.count : 0);
+
+  // Only outputs that have been written to are included, so count is never 0
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      channel_playerstats_key(key, sizeof(key), stats.outputs[i].type);
+      evbuffer_add_printf(evbuf, " output_%s_write_avg_us=%" PRIu64 " output_%s_write_max_us=%" PRIu64,
+	key, stats.outputs[i].write_latency_us.sum / stats.outputs[i].write_latency_us.count,
+	key, stats.outputs[i].write_latency_us.max);
+    }
+}
+
 struct mpd_channel
 {
   /* The channel name */
@@ -5033,19 +5092,30 @@ struct mpd_channel
 
   /*
    * The function to execute the sendmessage command for a specific channel
+   * (NULL if the server doesn't act on messages sent to the channel)
    *
    * @param message message received on this channel
    */
   void (*handler)(const char *message);
+
+  /*
+   * The function that produces the message the server publishes to the
+   * channel every MPD_CHANNEL_PUBLISH_INTERVAL seconds while there are
+   * subscribers (NULL if the server doesn't publish to the channel)
+   *
+   * @param evbuf buffer to add the message to, without trailing newline
+   */
+  void (*publisher)(struct evbuffer *evbuf);
 };
 
 static struct mpd_channel mpd_channels[] =
   {
-    /* channel               | handler function */
-    { "outputvolume",          channel_outputvolume },
-    { "pairing",               channel_pairing },
-    { "verification",          channel_verification },
-    { NULL, NULL },
+    /* channel               | handler function        | publisher function */
+    { "outputvolume",          channel_outputvolume,     NULL },
+    { "pairing",               channel_pairing,          NULL },
+    { "verification",          channel_verification,     NULL },
+    { "playerstats",           NULL,                     channel_playerstats_publish },
+    { NULL, NULL, NULL },
   };
 
 /*
@@ -5059,7 +5129,7 @@ mpd_find_channel(const char *name)
 {
   int i;
 
-  for (i = 0; mpd_channels[i].handler; i++)
+  for (i = 0; mpd_channels[i].channel; i++)
     {
       if (0 == strcmp(name, mpd_channels[i].channel))
 	{
@@ -5070,12 +5140,81 @@ mpd_find_channel(const char *name)
   return NULL;
 }
 
+/*
+ * Queues the message for all clients subscribed to the channel, and notifies
+ * the ones waiting for the "message" idle event
+ *
+ * @return number of clients the message was queued for
+ */
+static int
+mpd_channel_publish(struct mpd_channel *channel, const char *message)
+{
+  struct mpd_client_ctx *client;
+  unsigned int mask;
+  int n;
+
+  mask = 1 << (channel - mpd_channels);
+
+  for (client = mpd_clients, n = 0; client; client = client->next)
+    {
+      if (!(client->channels & mask))
+	continue;
+
+      n++;
+
+      // Like MPD, drop messages when the client doesn't read them
+      if (client->nmessages >= MPD_CLIENT_MESSAGES_MAX)
+	continue;
+
+      evbuffer_add_printf(client->messages, "channel: %s\nmessage: %s\n", channel->channel, message);
+      client->nmessages++;
+
+      mpd_notify_idle_client(client, MPD_IDLE_MESSAGE);
+    }
+
+  return n;
+}
+
+static void
+mpd_channels_publish_cb(int fd, short what, void *arg)
+{
+  struct timeval interval = { MPD_CHANNEL_PUBLISH_INTERVAL, 0 };
+  struct evbuffer *evbuf;
+  char *message;
+  bool rearm;
+  int i;
+
+  CHECK_NULL(L_MPD, evbuf = evbuffer_new());
+
+  rearm = false;
+  for (i = 0; mpd_channels[i].channel; i++)
+    {
+      if (!mpd_channels[i].publisher)
+	continue;
+
+      mpd_channels[i].publisher(evbuf);
+      evbuffer_add(evbuf, "", 1);
+
+      message = (char *)evbuffer_pullup(evbuf, -1);
+      if (mpd_channel_publish(&mpd_channels[i], message) > 0)
+	rearm = true;
+
+      evbuffer_drain(evbuf, -1);
+    }
+
+  evbuffer_free(evbuf);
+
+  // Stops when nobody is subscribed anymore, mpd_command_subscribe restarts it
+  if (rearm)
+    evtimer_add(mpd_channels_publish_ev, &interval);
+}
+
 static int
 mpd_command_channels(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   int i;
 
-  for (i = 0; mpd_channels[i].handler; i++)
+  for (i = 0; mpd_channels[i].channel; i++)
     {
       evbuffer_add_printf(evbuf,
 	  "channel: %s\n",
@@ -5109,7 +5248,59 @@ mpd_command_sendmessage(struct evbuffer *evbuf, int argc, char **argv, char **er
       return 0;
     }
 
-  channel->handler(message);
+  if (channel->handler)
+    channel->handler(message);
+
+  mpd_channel_publish(channel, message);
+  return 0;
+}
+
+static int
+mpd_command_subscribe(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  struct timeval interval = { MPD_CHANNEL_PUBLISH_INTERVAL, 0 };
+  struct mpd_channel *channel;
+
+  if (argc < 2)
+    {
+      *errmsg = safe_asprintf("Missing argument for command '%s'", argv[0]);
+      return ACK_ERROR_ARG;
+    }
+
+  channel = mpd_find_channel(argv[1]);
+  if (!channel)
+    {
+      // Just ignore the subscription, we only support our own channels
+      DPRINTF(E_DBG, L_MPD, "Ignoring %s for unsupported channel '%s'\n", argv[0], argv[1]);
+      return 0;
+    }
+
+  if (strcmp(argv[0], "unsubscribe") == 0)
+    {
+      ctx->channels &= ~(1 << (channel - mpd_channels));
+      return 0;
+    }
+
+  if (!ctx->messages)
+    CHECK_NULL(L_MPD, ctx->messages = evbuffer_new());
+
+  ctx->channels |= (1 << (channel - mpd_channels));
+
+  if (channel->publisher && !evtimer_pending(mpd_channels_publish_ev, NULL))
+    evtimer_add(mpd_channels_publish_ev, &interval);
+
+  return 0;
+}
+
+static int
+mpd_command_readmessages(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  if (!ctx->messages)
+    return 0;
+
+  evbuffer_add_buffer(evbuf, ctx->messages);
+  ctx->nmessages = 0;
+
   return 0;
 }
 
@@ -5346,10 +5537,10 @@ static struct mpd_command mpd_handlers[] =
     { "decoders",                   mpd_command_decoders,                   -1 },
 
     // Client to client
-    { "subscribe",                  mpd_command_ignore,                     -1 },
-    { "unsubscribe",                mpd_command_ignore,                     -1 },
+    { "subscribe",                  mpd_command_subscribe,                  -1 },
+    { "unsubscribe",                mpd_command_subscribe,                  -1 },
     { "channels",                   mpd_command_channels,                   -1 },
-    { "readmessages",               mpd_command_ignore,                     -1 },
+    { "readmessages",               mpd_command_readmessages,               -1 },
     { "sendmessage",                mpd_command_sendmessage,                -1 },
 
     // Custom commands (not supported by mpd)
@@ -5740,6 +5931,8 @@ mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events)
     evbuffer_add(client_ctx->evbuffer, "changed: stored_playlist\n", 25);
   if (events & LISTENER_RATING)
     evbuffer_add(client_ctx->evbuffer, "changed: sticker\n", 17);
+  if (events & MPD_IDLE_MESSAGE)
+    evbuffer_add(client_ctx->evbuffer, "changed: message\n", 17);
 
   evbuffer_add(client_ctx->evbuffer, "OK\n", 3);
 
@@ -5955,6 +6148,7 @@ mpd_init(void)
 
   CHECK_NULL(L_MPD, evbase_mpd = event_base_new());
   CHECK_NULL(L_MPD, cmdbase = commands_base_new(evbase_mpd, NULL));
+  CHECK_NULL(L_MPD, mpd_channels_publish_ev = evtimer_new(evbase_mpd, mpd_channels_publish_cb, NULL));
 
   mpd_sockfd = net_bind(&port, SOCK_STREAM, "mpd");
   if (mpd_sockfd < 0)
@@ -6024,6 +6218,7 @@ mpd_init(void)
  connew_fail:
   close(mpd_sockfd);
  bind_fail:
+  event_free(mpd_channels_publish_ev);
   commands_base_free(cmdbase);
   event_base_free(evbase_mpd);
   evbase_mpd = NULL;
@@ -6067,6 +6262,8 @@ mpd_deinit(void)
 
   close(mpd_sockfd);
 
+  event_free(mpd_channels_publish_ev);
+
   // Free event base (should free events too)
   event_base_free(evbase_mpd);
 
@@ -34,6 +34,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "transcode.h"
+#include "pcm.h"
 #include "db.h"
 #include "player.h" //TODO remove me when player_pmap is removed again
 #include "worker.h"
@@ -304,10 +305,19 @@ encoding_reset(struct media_quality *quality)
     {
       subscription = &output_quality_subscriptions[i]; // Just for short-hand
 
-      transcode_encode_cleanup(&subscription->encode_ctx); // Will also point the ctx to NULL
+      if (quality_is_equal(quality, &subscription->quality) || pcm_convert_is_supported(&subscription->quality, quality))
+	{
+	  // No resampling required, or only bit depth changes so buffer_fill()
+	  // will use pcm_convert()
+	  transcode_encode_cleanup(&subscription->encode_ctx); // Will also point the ctx to NULL
+	  continue;
+	}
 
-      if (quality_is_equal(quality, &subscription->quality))
-	continue; // No resampling required
+      // Keep the encoder if we can, then only the resampler is recreated
+      if (subscription->encode_ctx && transcode_encode_reset(subscription->encode_ctx, encode_args.src_ctx) == 0)
+	continue;
+
+      transcode_encode_cleanup(&subscription->encode_ctx);
 
       encode_args.profile = quality_to_xcode(&subscription->quality);
       encode_args.quality = &subscription->quality;
@@ -323,10 +333,42 @@ encoding_reset(struct media_quality *quality)
   return 0;
 }
 
+// Converts to the subscription's bit depth without going through a transcode
+// context
+static int
+buffer_convert(struct evbuffer *evbuf, struct media_quality *dst, void *buf, struct media_quality *src, int nsamples)
+{
+  struct evbuffer_iovec iov;
+  int ret;
+
+  ret = evbuffer_reserve_space(evbuf, STOB(nsamples, dst->bits_per_sample, dst->channels), &iov, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory for converted audio buffer\n");
+      return -1;
+    }
+
+  ret = pcm_convert(iov.iov_base, dst, buf, src, nsamples);
+  if (ret < 0)
+    return -1;
+
+  iov.iov_len = ret;
+  return evbuffer_commit_space(evbuf, &iov, 1);
+}
+
+static int
+buffer_encode(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, void *buf, size_t bufsize, struct media_quality *src, int nsamples)
+{
+  if (!encode_ctx)
+    return -1;
+
+  return transcode_encode_raw(evbuf, encode_ctx, buf, bufsize, nsamples, src);
+}
+
 static void
 buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_quality *quality, int nsamples, struct timespec *pts)
 {
-  transcode_frame *frame;
+  struct output_quality_subscription *subscription;
   int ret;
   int i;
   int n;
@@ -353,24 +395,21 @@ buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_
 
   for (i = 0, n = 1; output_quality_subscriptions[i].count > 0; i++)
     {
-      if (quality_is_equal(&output_quality_subscriptions[i].quality, quality))
-	continue; // Skip, no resampling required and we have the data in element 0
-
-      if (!output_quality_subscriptions[i].encode_ctx)
-	continue;
+      subscription = &output_quality_subscriptions[i]; // Just for short-hand
 
-      frame = transcode_frame_new(buf, bufsize, nsamples, quality);
-      if (!frame)
-	continue;
+      if (quality_is_equal(&subscription->quality, quality))
+	continue; // Skip, no resampling required and we have the data in element 0
 
-      ret = transcode_encode(obuf->data[n].evbuf, output_quality_subscriptions[i].encode_ctx, frame, 0);
-      transcode_frame_free(frame);
+      if (pcm_convert_is_supported(&subscription->quality, quality))
+	ret = buffer_convert(obuf->data[n].evbuf, &subscription->quality, buf, quality, nsamples);
+      else
+	ret = buffer_encode(obuf->data[n].evbuf, subscription->encode_ctx, buf, bufsize, quality, nsamples);
       if (ret < 0)
 	continue;
 
       obuf->data[n].buffer  = evbuffer_pullup(obuf->data[n].evbuf, -1);
       obuf->data[n].bufsize = evbuffer_get_length(obuf->data[n].evbuf);
-      obuf->data[n].quality = output_quality_subscriptions[i].quality;
+      obuf->data[n].quality = subscription->quality;
       obuf->data[n].samples = BTOS(obuf->data[n].bufsize, obuf->data[n].quality.bits_per_sample, obuf->data[n].quality.channels);
       n++;
     }
@@ -1228,17 +1267,24 @@ outputs_sessions_count(void)
 void
 outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *quality, struct timespec *pts)
 {
+  struct timespec start;
+  struct timespec end;
   int i;
 
   buffer_fill(&output_buffer, buf, bufsize, quality, nsamples, pts);
 
   for (i = 0; outputs[i]; i++)
     {
-      if (outputs[i]->disabled)
+      if (outputs[i]->disabled || !outputs[i]->write)
 	continue;
 
-      if (outputs[i]->write)
-	outputs[i]->write(&output_buffer);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      outputs[i]->write(&output_buffer);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      // The backends write to all their sessions in one go, so the time can
+      // only be measured per output, not per device
+      histogram_add(&outputs[i]->write_latency_us, timespec_diff_us(end, start));
     }
 
   buffer_drain(&output_buffer);
@@ -1290,6 +1336,25 @@ outputs_list(void)
   return outputs_device_list;
 }
 
+int
+outputs_stats_get(struct player_output_stats *stats, int max)
+{
+  int n;
+  int i;
+
+  for (i = 0, n = 0; outputs[i] && n < max; i++)
+    {
+      if (outputs[i]->write_latency_us.count == 0)
+	continue;
+
+      stats[n].type = outputs[i]->name;
+      stats[n].write_latency_us = outputs[i]->write_latency_us;
+      n++;
+    }
+
+  return n;
+}
+
 int
 outputs_init(void)
 {
@@ -1299,6 +1364,8 @@ outputs_init(void)
 
   outputs_master_volume = -1;
 
+  pcm_init();
+
   CHECK_NULL(L_PLAYER, outputs_deferredev = evtimer_new(evbase_player, deferred_cb, NULL));
 
   no_output = 1;
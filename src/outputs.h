@@ -50,6 +50,7 @@
 // Forward declarations
 struct output_device;
 struct output_metadata;
+struct player_output_stats;
 enum output_device_state;
 
 typedef void (*output_status_cb)(struct output_device *device, enum output_device_state status);
@@ -214,6 +215,9 @@ struct output_definition
   // Set to 1 if the output initialization failed
   int disabled;
 
+  // Time spent in write() for all the output's sessions (microseconds)
+  struct histogram write_latency_us;
+
   // Initialization function called during startup
   // Output must call device_cb when an output device becomes available/unavailable
   int (*init)(void);
@@ -391,6 +395,11 @@ outputs_name(enum output_types type);
 struct output_device *
 outputs_list(void);
 
+// Fills stats with the write latency of the outputs that have written audio,
+// returns the number of entries filled (at most max)
+int
+outputs_stats_get(struct player_output_stats *stats, int max);
+
 int
 outputs_init(void);
 
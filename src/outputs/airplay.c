@@ -469,21 +469,12 @@ sequence_continue(struct airplay_seq_ctx *seq_ctx);
 static inline int
 alac_encode(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, uint8_t *rawbuf, size_t rawbuf_size, int nsamples, struct media_quality *quality)
 {
-  transcode_frame *frame;
   int len;
 
-  frame = transcode_frame_new(rawbuf, rawbuf_size, nsamples, quality);
-  if (!frame)
-    {
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not convert raw PCM to frame (bufsize=%zu)\n", rawbuf_size);
-      return -1;
-    }
-
-  len = transcode_encode(evbuf, encode_ctx, frame, 0);
-  transcode_frame_free(frame);
+  len = transcode_encode_raw(evbuf, encode_ctx, rawbuf, rawbuf_size, nsamples, quality);
   if (len < 0)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not ALAC encode frame\n");
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not ALAC encode frame (bufsize=%zu)\n", rawbuf_size);
       return -1;
     }
 
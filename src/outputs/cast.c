@@ -911,21 +911,12 @@ cast_msg_process(struct cast_session *cs, const uint8_t *data, size_t len)
 static int
 payload_encode(struct evbuffer *evbuf, uint8_t *rawbuf, size_t rawbuf_size, int nsamples, struct media_quality *quality)
 {
-  transcode_frame *frame;
   int len;
 
-  frame = transcode_frame_new(rawbuf, rawbuf_size, nsamples, quality);
-  if (!frame)
-    {
-      DPRINTF(E_LOG, L_CAST, "Could not convert raw PCM to frame (bufsize=%zu)\n", rawbuf_size);
-      return -1;
-    }
-
-  len = transcode_encode(evbuf, cast_encode_ctx, frame, 0);
-  transcode_frame_free(frame);
+  len = transcode_encode_raw(evbuf, cast_encode_ctx, rawbuf, rawbuf_size, nsamples, quality);
   if (len < 0)
     {
-      DPRINTF(E_LOG, L_CAST, "Could not Opus encode frame\n");
+      DPRINTF(E_LOG, L_CAST, "Could not Opus encode frame (bufsize=%zu)\n", rawbuf_size);
       return -1;
     }
 
@@ -0,0 +1,805 @@
+/*
+ * Copyright (C) 2026 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "pcm.h"
+
+// The SIMD kernels assume little endian, which is also what the raw PCM is
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PCM_X86 1
+# include <immintrin.h>
+#elif defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+# define PCM_NEON 1
+# include <arm_neon.h>
+#endif
+
+typedef void (*pcm_kernel)(uint8_t *out, const uint8_t *in, int nvalues);
+typedef void (*pcm_to_float_kernel)(float *out, const uint8_t *in, int nvalues);
+typedef void (*pcm_from_float_kernel)(uint8_t *out, const float *in, int nvalues);
+typedef void (*pcm_volume_kernel)(uint8_t *buf, int nvalues, int gain);
+typedef void (*pcm_interleave_kernel)(uint8_t *out, const uint8_t *left, const uint8_t *right, int nsamples);
+
+// Points to the fastest implementation this CPU supports, set by pcm_init()
+static pcm_kernel pcm_s16_to_s32;
+static pcm_kernel pcm_s32_to_s16;
+static pcm_to_float_kernel pcm_s16_to_float;
+static pcm_from_float_kernel pcm_float_to_s16;
+static pcm_volume_kernel pcm_s16_volume;
+static pcm_interleave_kernel pcm_s16_interleave2;
+
+// Gains for the volume kernels are Q15, i.e. 32768 would be unity
+#define PCM_GAIN_SHIFT 15
+
+
+/* ----------------------------- Scalar kernels ----------------------------- */
+
+// Values are assembled byte by byte, so these work regardless of host byte
+// order. Downconversion truncates, like libswresample does without dither.
+
+static void
+s16_to_s24(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 2, out += 3)
+    {
+      out[0] = 0;
+      out[1] = in[0];
+      out[2] = in[1];
+    }
+}
+
+static void
+s16_to_s32(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 2, out += 4)
+    {
+      out[0] = 0;
+      out[1] = 0;
+      out[2] = in[0];
+      out[3] = in[1];
+    }
+}
+
+static void
+s24_to_s16(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 3, out += 2)
+    {
+      out[0] = in[1];
+      out[1] = in[2];
+    }
+}
+
+static void
+s24_to_s32(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 3, out += 4)
+    {
+      out[0] = 0;
+      out[1] = in[0];
+      out[2] = in[1];
+      out[3] = in[2];
+    }
+}
+
+static void
+s32_to_s16(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 4, out += 2)
+    {
+      out[0] = in[2];
+      out[1] = in[3];
+    }
+}
+
+static void
+s32_to_s24(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 4, out += 3)
+    {
+      out[0] = in[1];
+      out[1] = in[2];
+      out[2] = in[3];
+    }
+}
+
+static inline int32_t
+s16_get(const uint8_t *in)
+{
+  return (int16_t)(in[0] | (in[1] << 8));
+}
+
+static inline void
+s16_put(uint8_t *out, int32_t value)
+{
+  out[0] = value;
+  out[1] = value >> 8;
+}
+
+// Sign extends from bit 23 by shifting into the top of a 32 bit value
+static inline int32_t
+s24_get(const uint8_t *in)
+{
+  return (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24) >> 8;
+}
+
+static inline void
+s24_put(uint8_t *out, int32_t value)
+{
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+}
+
+static inline int32_t
+s32_get(const uint8_t *in)
+{
+  return (int32_t)((uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24);
+}
+
+static inline void
+s32_put(uint8_t *out, int32_t value)
+{
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+// Float samples are in [-1.0, 1.0). Conversion to integer clamps and rounds to
+// nearest (even), which is also what the SIMD conversions do.
+
+static void
+s16_to_float(float *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 2)
+    out[i] = s16_get(in) * (1.0f / 32768.0f);
+}
+
+static void
+float_to_s16(uint8_t *out, const float *in, int nvalues)
+{
+  float v;
+  int i;
+
+  for (i = 0; i < nvalues; i++, out += 2)
+    {
+      v = in[i] * 32768.0f;
+      v = (v > 32767.0f) ? 32767.0f : ((v < -32768.0f) ? -32768.0f : v);
+      s16_put(out, lrintf(v));
+    }
+}
+
+static void
+s24_to_float(float *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 3)
+    out[i] = s24_get(in) * (1.0f / 8388608.0f);
+}
+
+static void
+float_to_s24(uint8_t *out, const float *in, int nvalues)
+{
+  float v;
+  int i;
+
+  for (i = 0; i < nvalues; i++, out += 3)
+    {
+      v = in[i] * 8388608.0f;
+      v = (v > 8388607.0f) ? 8388607.0f : ((v < -8388608.0f) ? -8388608.0f : v);
+      s24_put(out, lrintf(v));
+    }
+}
+
+static void
+s32_to_float(float *out, const uint8_t *in, int nvalues)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, in += 4)
+    out[i] = s32_get(in) * (1.0f / 2147483648.0f);
+}
+
+// Clamped as double, since 2147483647 can't be represented as a float
+static void
+float_to_s32(uint8_t *out, const float *in, int nvalues)
+{
+  double v;
+  int i;
+
+  for (i = 0; i < nvalues; i++, out += 4)
+    {
+      v = in[i] * 2147483648.0;
+      v = (v > 2147483647.0) ? 2147483647.0 : ((v < -2147483648.0) ? -2147483648.0 : v);
+      s32_put(out, lrint(v));
+    }
+}
+
+// The volume kernels are called with a gain below unity, so the results fit
+static void
+s16_volume(uint8_t *buf, int nvalues, int gain)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, buf += 2)
+    s16_put(buf, (s16_get(buf) * gain) >> PCM_GAIN_SHIFT);
+}
+
+static void
+s24_volume(uint8_t *buf, int nvalues, int gain)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, buf += 3)
+    s24_put(buf, ((int64_t)s24_get(buf) * gain) >> PCM_GAIN_SHIFT);
+}
+
+static void
+s32_volume(uint8_t *buf, int nvalues, int gain)
+{
+  int i;
+
+  for (i = 0; i < nvalues; i++, buf += 4)
+    s32_put(buf, ((int64_t)s32_get(buf) * gain) >> PCM_GAIN_SHIFT);
+}
+
+static void
+s16_interleave2(uint8_t *out, const uint8_t *left, const uint8_t *right, int nsamples)
+{
+  int i;
+
+  for (i = 0; i < nsamples; i++, left += 2, right += 2, out += 4)
+    {
+      memcpy(out, left, 2);
+      memcpy(out + 2, right, 2);
+    }
+}
+
+
+/* ------------------------------ SIMD kernels ------------------------------ */
+
+// The SIMD kernels handle as many full vectors as possible and leave the
+// remainder to the scalar kernels
+
+#ifdef PCM_X86
+__attribute__((target("sse2"))) static void
+s16_to_s32_sse2(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+      // Interleaving zeros below each 16 bit value gives value << 16
+      _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_unpacklo_epi16(zero, v));
+      _mm_storeu_si128((__m128i *)(out + 4 * i + 16), _mm_unpackhi_epi16(zero, v));
+    }
+
+  s16_to_s32(out + 4 * i, in + 2 * i, nvalues - i);
+}
+
+__attribute__((target("sse2"))) static void
+s32_to_s16_sse2(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  __m128i lo;
+  __m128i hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      lo = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + 4 * i)), 16);
+      hi = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + 4 * i + 16)), 16);
+      _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+
+  s32_to_s16(out + 2 * i, in + 4 * i, nvalues - i);
+}
+
+__attribute__((target("sse2"))) static void
+s16_to_float_sse2(float *out, const uint8_t *in, int nvalues)
+{
+  __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  __m128i v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+      // Unpacking a value with itself and shifting back sign extends it
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale));
+      _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale));
+    }
+
+  s16_to_float(out + i, in + 2 * i, nvalues - i);
+}
+
+__attribute__((target("sse2"))) static void
+float_to_s16_sse2(uint8_t *out, const float *in, int nvalues)
+{
+  __m128 scale = _mm_set1_ps(32768.0f);
+  __m128 max = _mm_set1_ps(32767.0f);
+  __m128 min = _mm_set1_ps(-32768.0f);
+  __m128i lo;
+  __m128i hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      lo = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), max), min));
+      hi = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), max), min));
+      _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+
+  float_to_s16(out + 2 * i, in + i, nvalues - i);
+}
+
+// The 32 bit products are put together from the low and high halves
+__attribute__((target("sse2"))) static void
+s16_volume_sse2(uint8_t *buf, int nvalues, int gain)
+{
+  __m128i g = _mm_set1_epi16(gain);
+  __m128i v;
+  __m128i lo;
+  __m128i hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = _mm_loadu_si128((const __m128i *)(buf + 2 * i));
+      lo = _mm_mullo_epi16(v, g);
+      hi = _mm_mulhi_epi16(v, g);
+      v = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), PCM_GAIN_SHIFT),
+                          _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), PCM_GAIN_SHIFT));
+      _mm_storeu_si128((__m128i *)(buf + 2 * i), v);
+    }
+
+  s16_volume(buf + 2 * i, nvalues - i, gain);
+}
+
+__attribute__((target("sse2"))) static void
+s16_interleave2_sse2(uint8_t *out, const uint8_t *left, const uint8_t *right, int nsamples)
+{
+  __m128i l;
+  __m128i r;
+  int i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8)
+    {
+      l = _mm_loadu_si128((const __m128i *)(left + 2 * i));
+      r = _mm_loadu_si128((const __m128i *)(right + 2 * i));
+      _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_unpacklo_epi16(l, r));
+      _mm_storeu_si128((__m128i *)(out + 4 * i + 16), _mm_unpackhi_epi16(l, r));
+    }
+
+  s16_interleave2(out + 4 * i, left + 2 * i, right + 2 * i, nsamples - i);
+}
+
+__attribute__((target("avx2"))) static void
+s16_to_s32_avx2(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  __m256i v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + 2 * i)));
+      _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_slli_epi32(v, 16));
+    }
+
+  s16_to_s32(out + 4 * i, in + 2 * i, nvalues - i);
+}
+
+__attribute__((target("avx2"))) static void
+s32_to_s16_avx2(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  __m256i lo;
+  __m256i hi;
+  __m256i packed;
+  int i;
+
+  for (i = 0; i + 16 <= nvalues; i += 16)
+    {
+      lo = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(in + 4 * i)), 16);
+      hi = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(in + 4 * i + 32)), 16);
+      // Packing works per 128 bit lane, so the 64 bit blocks must be reordered
+      packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+      _mm256_storeu_si256((__m256i *)(out + 2 * i), packed);
+    }
+
+  s32_to_s16(out + 2 * i, in + 4 * i, nvalues - i);
+}
+
+__attribute__((target("avx2"))) static void
+s16_to_float_avx2(float *out, const uint8_t *in, int nvalues)
+{
+  __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+  __m256i v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + 2 * i)));
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+
+  s16_to_float(out + i, in + 2 * i, nvalues - i);
+}
+
+__attribute__((target("avx2"))) static void
+float_to_s16_avx2(uint8_t *out, const float *in, int nvalues)
+{
+  __m256 scale = _mm256_set1_ps(32768.0f);
+  __m256 max = _mm256_set1_ps(32767.0f);
+  __m256 min = _mm256_set1_ps(-32768.0f);
+  __m256i lo;
+  __m256i hi;
+  __m256i packed;
+  int i;
+
+  for (i = 0; i + 16 <= nvalues; i += 16)
+    {
+      lo = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), max), min));
+      hi = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), max), min));
+      packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+      _mm256_storeu_si256((__m256i *)(out + 2 * i), packed);
+    }
+
+  float_to_s16(out + 2 * i, in + i, nvalues - i);
+}
+
+// Unpacking and packing both work per 128 bit lane, so the order is kept
+__attribute__((target("avx2"))) static void
+s16_volume_avx2(uint8_t *buf, int nvalues, int gain)
+{
+  __m256i g = _mm256_set1_epi16(gain);
+  __m256i v;
+  __m256i lo;
+  __m256i hi;
+  int i;
+
+  for (i = 0; i + 16 <= nvalues; i += 16)
+    {
+      v = _mm256_loadu_si256((const __m256i *)(buf + 2 * i));
+      lo = _mm256_mullo_epi16(v, g);
+      hi = _mm256_mulhi_epi16(v, g);
+      v = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), PCM_GAIN_SHIFT),
+                             _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), PCM_GAIN_SHIFT));
+      _mm256_storeu_si256((__m256i *)(buf + 2 * i), v);
+    }
+
+  s16_volume(buf + 2 * i, nvalues - i, gain);
+}
+#endif /* PCM_X86 */
+
+#ifdef PCM_NEON
+static void
+s16_to_s32_neon(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int16x8_t v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = vld1q_s16((const int16_t *)(in + 2 * i));
+      vst1q_s32((int32_t *)(out + 4 * i), vshlq_n_s32(vmovl_s16(vget_low_s16(v)), 16));
+      vst1q_s32((int32_t *)(out + 4 * i + 16), vshlq_n_s32(vmovl_s16(vget_high_s16(v)), 16));
+    }
+
+  s16_to_s32(out + 4 * i, in + 2 * i, nvalues - i);
+}
+
+static void
+s32_to_s16_neon(uint8_t *out, const uint8_t *in, int nvalues)
+{
+  int16x4_t lo;
+  int16x4_t hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      lo = vshrn_n_s32(vld1q_s32((const int32_t *)(in + 4 * i)), 16);
+      hi = vshrn_n_s32(vld1q_s32((const int32_t *)(in + 4 * i + 16)), 16);
+      vst1q_s16((int16_t *)(out + 2 * i), vcombine_s16(lo, hi));
+    }
+
+  s32_to_s16(out + 2 * i, in + 4 * i, nvalues - i);
+}
+
+static void
+s16_to_float_neon(float *out, const uint8_t *in, int nvalues)
+{
+  int16x8_t v;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = vld1q_s16((const int16_t *)(in + 2 * i));
+      vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), 1.0f / 32768.0f));
+      vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), 1.0f / 32768.0f));
+    }
+
+  s16_to_float(out + i, in + 2 * i, nvalues - i);
+}
+
+// vcvtq_s32_f32 truncates, so rounding is left to the scalar kernel on 32 bit
+// ARM, where there is no round to nearest conversion
+static void
+float_to_s16_neon(uint8_t *out, const float *in, int nvalues)
+{
+#ifdef __aarch64__
+  float32x4_t max = vdupq_n_f32(32767.0f);
+  float32x4_t min = vdupq_n_f32(-32768.0f);
+  int32x4_t lo;
+  int32x4_t hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      lo = vcvtnq_s32_f32(vmaxq_f32(vminq_f32(vmulq_n_f32(vld1q_f32(in + i), 32768.0f), max), min));
+      hi = vcvtnq_s32_f32(vmaxq_f32(vminq_f32(vmulq_n_f32(vld1q_f32(in + i + 4), 32768.0f), max), min));
+      vst1q_s16((int16_t *)(out + 2 * i), vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+    }
+
+  float_to_s16(out + 2 * i, in + i, nvalues - i);
+#else
+  float_to_s16(out, in, nvalues);
+#endif
+}
+
+static void
+s16_volume_neon(uint8_t *buf, int nvalues, int gain)
+{
+  int16x8_t v;
+  int32x4_t lo;
+  int32x4_t hi;
+  int i;
+
+  for (i = 0; i + 8 <= nvalues; i += 8)
+    {
+      v = vld1q_s16((const int16_t *)(buf + 2 * i));
+      lo = vshrq_n_s32(vmull_n_s16(vget_low_s16(v), gain), PCM_GAIN_SHIFT);
+      hi = vshrq_n_s32(vmull_n_s16(vget_high_s16(v), gain), PCM_GAIN_SHIFT);
+      vst1q_s16((int16_t *)(buf + 2 * i), vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+    }
+
+  s16_volume(buf + 2 * i, nvalues - i, gain);
+}
+
+static void
+s16_interleave2_neon(uint8_t *out, const uint8_t *left, const uint8_t *right, int nsamples)
+{
+  int16x8x2_t v;
+  int i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8)
+    {
+      v.val[0] = vld1q_s16((const int16_t *)(left + 2 * i));
+      v.val[1] = vld1q_s16((const int16_t *)(right + 2 * i));
+      vst2q_s16((int16_t *)(out + 4 * i), v);
+    }
+
+  s16_interleave2(out + 4 * i, left + 2 * i, right + 2 * i, nsamples - i);
+}
+#endif /* PCM_NEON */
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+static pcm_kernel
+kernel_get(int dst_bps, int src_bps)
+{
+  if (src_bps == 16 && dst_bps == 24)
+    return s16_to_s24;
+  else if (src_bps == 16 && dst_bps == 32)
+    return pcm_s16_to_s32;
+  else if (src_bps == 24 && dst_bps == 16)
+    return s24_to_s16;
+  else if (src_bps == 24 && dst_bps == 32)
+    return s24_to_s32;
+  else if (src_bps == 32 && dst_bps == 16)
+    return pcm_s32_to_s16;
+  else if (src_bps == 32 && dst_bps == 24)
+    return s32_to_s24;
+
+  return NULL;
+}
+
+bool
+pcm_convert_is_supported(struct media_quality *dst, struct media_quality *src)
+{
+  if (dst->sample_rate != src->sample_rate || dst->channels != src->channels)
+    return false;
+
+  // A bit rate means the quality is for an encoded format, e.g. mp3
+  if (dst->bit_rate != 0 || src->bit_rate != 0)
+    return false;
+
+  return (kernel_get(dst->bits_per_sample, src->bits_per_sample) != NULL);
+}
+
+int
+pcm_convert(uint8_t *out, struct media_quality *dst, const uint8_t *in, struct media_quality *src, int nsamples)
+{
+  pcm_kernel kernel;
+
+  kernel = kernel_get(dst->bits_per_sample, src->bits_per_sample);
+  if (!kernel)
+    return -1;
+
+  kernel(out, in, nsamples * src->channels);
+
+  return STOB(nsamples, dst->bits_per_sample, dst->channels);
+}
+
+int
+pcm_to_float(float *out, const uint8_t *in, int bits_per_sample, int nvalues)
+{
+  if (bits_per_sample == 16)
+    pcm_s16_to_float(out, in, nvalues);
+  else if (bits_per_sample == 24)
+    s24_to_float(out, in, nvalues);
+  else if (bits_per_sample == 32)
+    s32_to_float(out, in, nvalues);
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+pcm_from_float(uint8_t *out, int bits_per_sample, const float *in, int nvalues)
+{
+  if (bits_per_sample == 16)
+    pcm_float_to_s16(out, in, nvalues);
+  else if (bits_per_sample == 24)
+    float_to_s24(out, in, nvalues);
+  else if (bits_per_sample == 32)
+    float_to_s32(out, in, nvalues);
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+pcm_volume(uint8_t *buf, int bits_per_sample, int nvalues, int volume)
+{
+  int gain;
+
+  if (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32)
+    return -1;
+
+  if (volume >= 100)
+    return 0;
+  else if (volume <= 0)
+    {
+      memset(buf, 0, (size_t)nvalues * bits_per_sample / 8);
+      return 0;
+    }
+
+  gain = (volume << PCM_GAIN_SHIFT) / 100;
+
+  if (bits_per_sample == 16)
+    pcm_s16_volume(buf, nvalues, gain);
+  else if (bits_per_sample == 24)
+    s24_volume(buf, nvalues, gain);
+  else
+    s32_volume(buf, nvalues, gain);
+
+  return 0;
+}
+
+int
+pcm_interleave(uint8_t *out, const uint8_t **planes, int bits_per_sample, int channels, int nsamples)
+{
+  int bytes_per_sample = bits_per_sample / 8;
+  int i;
+  int j;
+
+  if (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32)
+    return -1;
+
+  if (bits_per_sample == 16 && channels == 2)
+    {
+      pcm_s16_interleave2(out, planes[0], planes[1], nsamples);
+      return 0;
+    }
+
+  for (i = 0; i < nsamples; i++)
+    {
+      for (j = 0; j < channels; j++, out += bytes_per_sample)
+	memcpy(out, planes[j] + i * bytes_per_sample, bytes_per_sample);
+    }
+
+  return 0;
+}
+
+void
+pcm_init(void)
+{
+  const char *simd = "none";
+
+  pcm_s16_to_s32 = s16_to_s32;
+  pcm_s32_to_s16 = s32_to_s16;
+  pcm_s16_to_float = s16_to_float;
+  pcm_float_to_s16 = float_to_s16;
+  pcm_s16_volume = s16_volume;
+  pcm_s16_interleave2 = s16_interleave2;
+
+#if defined(PCM_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    {
+      pcm_s16_to_s32 = s16_to_s32_avx2;
+      pcm_s32_to_s16 = s32_to_s16_avx2;
+      pcm_s16_to_float = s16_to_float_avx2;
+      pcm_float_to_s16 = float_to_s16_avx2;
+      pcm_s16_volume = s16_volume_avx2;
+      // No gain from AVX2, since unpacking works per 128 bit lane
+      pcm_s16_interleave2 = s16_interleave2_sse2;
+      simd = "avx2";
+    }
+  else if (__builtin_cpu_supports("sse2"))
+    {
+      pcm_s16_to_s32 = s16_to_s32_sse2;
+      pcm_s32_to_s16 = s32_to_s16_sse2;
+      pcm_s16_to_float = s16_to_float_sse2;
+      pcm_float_to_s16 = float_to_s16_sse2;
+      pcm_s16_volume = s16_volume_sse2;
+      pcm_s16_interleave2 = s16_interleave2_sse2;
+      simd = "sse2";
+    }
+#elif defined(PCM_NEON)
+  pcm_s16_to_s32 = s16_to_s32_neon;
+  pcm_s32_to_s16 = s32_to_s16_neon;
+  pcm_s16_to_float = s16_to_float_neon;
+  pcm_float_to_s16 = float_to_s16_neon;
+  pcm_s16_volume = s16_volume_neon;
+  pcm_s16_interleave2 = s16_interleave2_neon;
+  simd = "neon";
+#endif
+
+  DPRINTF(E_DBG, L_PLAYER, "PCM conversion kernels using SIMD: %s\n", simd);
+}
@@ -0,0 +1,71 @@
+
+#ifndef __PCM_H__
+#define __PCM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "misc.h" // for struct media_quality
+
+/* Kernels for raw interleaved little endian PCM with 16, 24 (packed in 3
+ * bytes) or 32 bits per sample: bit depth and float conversion, software
+ * volume and interleaving. The conversions are meant for the cases where only
+ * the bit depth changes, so we don't need to spin up a transcode context.
+ * SIMD versions are selected at runtime by pcm_init(), so that must be called
+ * first. See scripts/pcm_bench.c for a benchmark.
+ */
+
+// True if src can be converted to dst with pcm_convert(), i.e. the qualities
+// only differ in bits per sample
+bool
+pcm_convert_is_supported(struct media_quality *dst, struct media_quality *src);
+
+/*
+ * Converts nsamples of audio from src to dst. The caller must make sure that
+ * out can hold STOB(nsamples, dst->bits_per_sample, dst->channels) bytes.
+ *
+ * @out out      Converted audio
+ * @in  dst      Quality of the converted audio
+ * @in  in       Audio to convert
+ * @in  src      Quality of the audio to convert
+ * @in  nsamples Number of samples (per channel)
+ * @return       Bytes written to out, -1 if the conversion is not supported
+ */
+int
+pcm_convert(uint8_t *out, struct media_quality *dst, const uint8_t *in, struct media_quality *src, int nsamples);
+
+/*
+ * Converts nvalues (samples times channels) to or from float samples in the
+ * range [-1.0, 1.0). Out of range floats are clamped.
+ *
+ * @return       0 if ok, -1 if bits_per_sample is not supported
+ */
+int
+pcm_to_float(float *out, const uint8_t *in, int bits_per_sample, int nvalues);
+
+int
+pcm_from_float(uint8_t *out, int bits_per_sample, const float *in, int nvalues);
+
+/*
+ * Scales nvalues (samples times channels) in place by a linear software
+ * volume.
+ *
+ * @in  volume   0 - 100, where 100 leaves the audio as it is
+ * @return       0 if ok, -1 if bits_per_sample is not supported
+ */
+int
+pcm_volume(uint8_t *buf, int bits_per_sample, int nvalues, int volume);
+
+/*
+ * Interleaves planar audio, i.e. one buffer per channel, into out, which must
+ * hold STOB(nsamples, bits_per_sample, channels) bytes.
+ *
+ * @return       0 if ok, -1 if bits_per_sample is not supported
+ */
+int
+pcm_interleave(uint8_t *out, const uint8_t **planes, int bits_per_sample, int channels, int nsamples);
+
+void
+pcm_init(void);
+
+#endif /* !__PCM_H__ */
@@ -100,6 +100,9 @@
 // only 100 x 220 = 22000 samples each second.
 #define PLAYER_TICK_INTERVAL 10
 
+// The input buffer fill level is sampled for the stats every this many ticks
+#define PLAYER_STATS_BUFFER_SAMPLE_TICKS 10
+
 // For every tick_interval, we will read a frame from the input buffer and
 // write it to the outputs. If the input is empty, we will try to catch up next
 // tick. However, at some point we will owe the outputs so much data that we
@@ -334,6 +337,12 @@ static int pb_write_deficit_max;
 // True if we are trying to recover from a major playback timer overrun (write problems)
 static bool pb_write_recovery;
 
+// Timing and underrun instrumentation, see player_stats_get()
+static struct player_stats pb_stats;
+// Time when the playback timer was armed, and ticks since then
+static struct timespec pb_stats_timer_start;
+static uint64_t pb_stats_timer_ticks;
+
 // Audio source
 static uint32_t cur_plid;
 static uint32_t cur_plversion;
@@ -1246,6 +1255,33 @@ source_read(int *nbytes, int *nsamples, uint8_t *buf, int len)
   return 0;
 }
 
+// Records how late the tick is compared to when the timer should have fired,
+// and how much audio the input has buffered for us
+static inline void
+playback_stats_update(uint64_t overrun)
+{
+  struct timespec now;
+  int64_t lateness_us;
+  size_t bytes_per_sec;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pb_stats_timer_ticks += 1 + overrun;
+  lateness_us = timespec_diff_us(now, pb_stats_timer_start) - (int64_t)pb_stats_timer_ticks * PLAYER_TICK_INTERVAL * 1000;
+
+  pb_stats.ticks++;
+  pb_stats.ticks_missed += overrun;
+  histogram_add(&pb_stats.tick_lateness_us, (lateness_us > 0) ? lateness_us : 0);
+
+  // Reading the fill level means taking the input lock, so only sample it
+  if (pb_stats.ticks % PLAYER_STATS_BUFFER_SAMPLE_TICKS != 0)
+    return;
+
+  bytes_per_sec = STOB(pb_session.quality.sample_rate, pb_session.quality.bits_per_sample, pb_session.quality.channels);
+  if (bytes_per_sec > 0)
+    histogram_add(&pb_stats.input_buffer_ms, 1000 * (uint64_t)input_buffer_length() / bytes_per_sec);
+}
+
 static void
 playback_cb(int fd, short what, void *arg)
 {
@@ -1272,6 +1308,8 @@ playback_cb(int fd, short what, void *arg)
     overrun = ret;
 #endif /* HAVE_TIMERFD */
 
+  playback_stats_update(overrun);
+
   // We are too delayed, probably some output blocked: reset if first overrun or abort if second overrun
   if (overrun > pb_write_deficit_max)
     {
@@ -1283,6 +1321,7 @@ playback_cb(int fd, short what, void *arg)
 	}
 
       DPRINTF(E_LOG, L_PLAYER, "Output delay detected (behind=%" PRIu64 ", max=%d), resetting all outputs\n", overrun, pb_write_deficit_max);
+      pb_stats.overrun_resets++;
       pb_write_recovery = true;
       player_flush_pending = pb_suspend();
       // No devices to wait for, just set the restart cb right away. Otherwise
@@ -1337,6 +1376,8 @@ playback_cb(int fd, short what, void *arg)
 
 	  DPRINTF(E_DBG, L_PLAYER, "Incomplete read, wanted %zu, got %d (samples=%d/time=%lu), deficit %zu\n", pb_session.bufsize, nbytes, nsamples, ts.tv_nsec, pb_session.read_deficit);
 
+	  pb_stats.underruns++;
+
 	  pb_session.pts = timespec_add(pb_session.pts, ts);
 	}
       else
@@ -1355,6 +1396,7 @@ playback_cb(int fd, short what, void *arg)
       DPRINTF(E_LOG, L_PLAYER, "Source is not providing sufficient data, temporarily suspending playback (deficit=%zu/%zu bytes)\n",
 	pb_session.read_deficit, pb_session.read_deficit_max);
 
+      pb_stats.underrun_suspends++;
       player_flush_pending = pb_suspend();
       // No devices to wait for, just set the restart cb right away. Otherwise
       // the trigger will be set by device_flush_cb.
@@ -1680,6 +1722,9 @@ pb_timer_start(void)
   tick.it_interval = player_tick_interval;
   tick.it_value = player_tick_interval;
 
+  clock_gettime(CLOCK_MONOTONIC, &pb_stats_timer_start);
+  pb_stats_timer_ticks = 0;
+
 #ifdef HAVE_TIMERFD
   ret = timerfd_settime(pb_timer_fd, 0, &tick, NULL);
 #else
@@ -1942,6 +1987,18 @@ get_status(void *arg, int *retval)
   return COMMAND_END;
 }
 
+static enum command_state
+stats_get(void *arg, int *retval)
+{
+  struct player_stats *stats = arg;
+
+  *stats = pb_stats;
+  stats->noutputs = outputs_stats_get(stats->outputs, ARRAY_SIZE(stats->outputs));
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
 static enum command_state
 playing_now(void *arg, int *retval)
 {
@@ -3256,6 +3313,33 @@ player_get_status(struct player_status *status)
 }
 
 
+/*
+ * Copies the player's timing instrumentation, counted since the server started
+ *
+ * @param stats Pointer to the struct that will receive the stats
+ * @return 0 on success, -1 on failure
+ */
+int
+player_stats_get(struct player_stats *stats)
+{
+  int ret;
+
+  ret = commands_exec_sync(cmdbase, stats_get, NULL, stats);
+  return ret;
+}
+
+/*
+ * Returns the play state without a command to the player thread, so unlike
+ * player_get_status() it can be used in the LISTENER_PLAYER callbacks, which
+ * run in the player thread. Don't use it from other threads.
+ */
+enum play_status
+player_state_get(void)
+{
+  return player_state;
+}
+
+
 /* ------------------------------ Thread: httpd ----------------------------- */
 
 /*
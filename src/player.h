@@ -6,7 +6,7 @@
 #include <stdint.h>
 
 #include "db.h"
-#include "misc.h" // for struct media_quality
+#include "misc.h" // for struct media_quality and struct histogram
 
 // Maximum number of previously played songs that are remembered
 #define MAX_HISTORY_COUNT 20
@@ -70,6 +70,34 @@ struct player_status {
   uint32_t len_ms;
 };
 
+// Max number of output backends reported in player_stats
+#define PLAYER_STATS_OUTPUTS_MAX 16
+
+struct player_output_stats {
+  const char *type;
+  /* Time spent writing a tick of audio to all the output's devices */
+  struct histogram write_latency_us;
+};
+
+struct player_stats {
+  /* Number of playback timer events, and number of ticks we had to catch up */
+  uint64_t ticks;
+  uint64_t ticks_missed;
+  /* Reads where the input buffer gave us less than a full tick of audio */
+  uint64_t underruns;
+  /* Times playback was suspended because the input could not keep up */
+  uint64_t underrun_suspends;
+  /* Times the outputs were reset because the player fell too far behind */
+  uint64_t overrun_resets;
+  /* How late the playback timer events are compared to the ideal clock */
+  struct histogram tick_lateness_us;
+  /* Amount of audio the input has buffered ahead of the player */
+  struct histogram input_buffer_ms;
+
+  int noutputs;
+  struct player_output_stats outputs[PLAYER_STATS_OUTPUTS_MAX];
+};
+
 typedef void (*spk_enum_cb)(struct player_speaker_info *spk, void *arg);
 
 struct player_history
@@ -88,6 +116,12 @@ struct player_history
 int
 player_get_status(struct player_status *status);
 
+int
+player_stats_get(struct player_stats *stats);
+
+enum play_status
+player_state_get(void);
+
 int
 player_playing_now(uint32_t *id);
 
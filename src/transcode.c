@@ -48,6 +48,7 @@
 #define USE_NO_CLEAR_AVFMT_NOFILE (LIBAVFORMAT_VERSION_MAJOR > 59) || ((LIBAVFORMAT_VERSION_MAJOR == 59) && (LIBAVFORMAT_VERSION_MINOR > 15))
 #define USE_CH_LAYOUT (LIBAVCODEC_VERSION_MAJOR > 59) || ((LIBAVCODEC_VERSION_MAJOR == 59) && (LIBAVCODEC_VERSION_MINOR > 24))
 #define USE_CONST_AVIO_WRITE_PACKET (LIBAVFORMAT_VERSION_MAJOR > 61) || ((LIBAVFORMAT_VERSION_MAJOR == 61) && (LIBAVFORMAT_VERSION_MINOR > 0))
+#define USE_BUFFER_SIZE_T (LIBAVUTIL_VERSION_MAJOR > 56)
 
 // Interval between ICY metadata checks for streams, in seconds
 #define METADATA_ICY_INTERVAL 5
@@ -150,6 +151,10 @@ struct decode_ctx
   // Source duration in ms as provided by caller
   uint32_t len_ms;
 
+  // Size the caller will scale an image to, see lowres_get()
+  int max_w;
+  int max_h;
+
   // Used to determine if ICY metadata is relevant to look for
   bool is_http;
 
@@ -196,6 +201,19 @@ struct encode_ctx
   // Contains the most recent packet from avcodec_receive_packet()
   AVPacket *encoded_pkt;
 
+  // Reused by transcode_encode_raw() so that neither the frame nor its data
+  // buffer needs to be allocated for each chunk of raw input. The pool's
+  // buffers have the size of the largest chunk so far, smaller chunks use a
+  // slice. raw_pool_allocs counts the buffers the pool has allocated.
+  AVFrame *raw_frame;
+  AVBufferPool *raw_pool;
+  size_t raw_pool_size;
+  int raw_pool_allocs;
+
+  // True if the output settings don't depend on the source, meaning that the
+  // encoder can be kept when the source changes, see transcode_encode_reset()
+  bool resettable;
+
   // How many output bytes we have processed in total
   off_t bytes_processed;
 
@@ -1306,6 +1324,28 @@ make_mp4_header(struct evbuffer **mp4_header, const char *url)
 
 /* --------------------------- INPUT/OUTPUT INIT --------------------------- */
 
+/* The mjpeg decoder can do the IDCT at 1/2, 1/4 or 1/8 size, which is much
+ * faster than decoding a large cover in full just to make a thumbnail of it.
+ * Returns the largest reduction where the image is still at least as large as
+ * what the caller will scale it to, so the scaler still has enough to work with.
+ */
+static int
+lowres_get(AVCodecContext *dec_ctx, int max_w, int max_h)
+{
+  int lowres;
+
+  if (dec_ctx->codec_id != AV_CODEC_ID_MJPEG || max_w <= 0 || max_h <= 0)
+    return 0;
+
+  for (lowres = 3; lowres > 0; lowres--)
+    {
+      if ((dec_ctx->width >> lowres) >= max_w || (dec_ctx->height >> lowres) >= max_h)
+	break;
+    }
+
+  return lowres;
+}
+
 static int
 open_decoder(AVCodecContext **dec_ctx, unsigned int *stream_index, struct decode_ctx *ctx, enum AVMediaType type)
 {
@@ -1340,6 +1380,9 @@ open_decoder(AVCodecContext **dec_ctx, unsigned int *stream_index, struct decode
       return ret;
     }
 
+  if (type == AVMEDIA_TYPE_VIDEO)
+    (*dec_ctx)->lowres = lowres_get(*dec_ctx, ctx->max_w, ctx->max_h);
+
   ret = avcodec_open2(*dec_ctx, NULL, NULL);
   if (ret < 0)
     {
@@ -1912,6 +1955,44 @@ open_filters(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
 }
 
 
+static int
+frame_fill(AVFrame *f, void *data, size_t size, int nsamples, struct media_quality *quality)
+{
+  int ret;
+
+  f->format = bitdepth2format(quality->bits_per_sample);
+  if (f->format == AV_SAMPLE_FMT_NONE)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Raw frame with unsupported bps (%d)\n", quality->bits_per_sample);
+      return -1;
+    }
+
+  f->sample_rate    = quality->sample_rate;
+  f->nb_samples     = nsamples;
+#if USE_CH_LAYOUT
+  av_channel_layout_default(&f->ch_layout, quality->channels);
+#else
+  f->channel_layout = av_get_default_channel_layout(quality->channels);
+# ifdef HAVE_FFMPEG
+  f->channels       = quality->channels;
+# endif
+#endif
+  f->pts            = AV_NOPTS_VALUE;
+
+  // We don't align because the frame won't be given directly to the encoder
+  // anyway, it will first go through the filter (which might align it...?)
+  ret = avcodec_fill_audio_frame(f, quality->channels, f->format, data, size, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Error filling frame with rawbuf, size %zu, samples %d (%d/%d/%d): %s\n",
+	size, nsamples, quality->sample_rate, quality->bits_per_sample, quality->channels, err2str(ret));
+      return -1;
+    }
+
+  return 0;
+}
+
+
 /* ----------------------------- TRANSCODE API ----------------------------- */
 
 /*                                  Setup                                    */
@@ -1927,6 +2008,8 @@ transcode_decode_setup(struct transcode_decode_setup_args args)
   CHECK_NULL(L_XCODE, ctx->packet = av_packet_alloc());
 
   ctx->len_ms = args.len_ms;
+  ctx->max_w = args.max_w;
+  ctx->max_h = args.max_h;
 
   ret = init_settings(&ctx->settings, args.profile, args.quality);
   if (ret < 0)
@@ -1965,6 +2048,7 @@ transcode_encode_setup(struct transcode_encode_setup_args args)
 
   CHECK_NULL(L_XCODE, ctx = calloc(1, sizeof(struct encode_ctx)));
   CHECK_NULL(L_XCODE, ctx->filt_frame = av_frame_alloc());
+  CHECK_NULL(L_XCODE, ctx->raw_frame = av_frame_alloc());
   CHECK_NULL(L_XCODE, ctx->encoded_pkt = av_packet_alloc());
   CHECK_NULL(L_XCODE, ctx->evbuf_io.evbuf = evbuffer_new());
 
@@ -1976,6 +2060,11 @@ transcode_encode_setup(struct transcode_encode_setup_args args)
   if (init_settings(&ctx->settings, args.profile, args.quality) < 0)
     goto error;
 
+  // If the profile and the quality fix the output format then the source only
+  // matters to the filters, not to the encoder
+  ctx->resettable = ctx->settings.encode_audio && !ctx->settings.encode_video && ctx->settings.sample_format &&
+                    args.quality && args.quality->sample_rate && args.quality->channels;
+
   if (ctx->settings.encode_audio && init_settings_from_audio(&ctx->settings, args.profile, args.src_ctx, args.quality) < 0)
     goto error;
 
@@ -2001,6 +2090,22 @@ transcode_encode_setup(struct transcode_encode_setup_args args)
   return NULL;
 }
 
+int
+transcode_encode_reset(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
+{
+  if (!ctx->resettable)
+    return -1;
+
+  // Whatever the old filters were holding is dropped, which is no worse than
+  // starting over with a new encoder
+  close_filters(ctx);
+
+  if (open_filters(ctx, src_ctx) < 0)
+    return -1;
+
+  return 0;
+}
+
 struct transcode_ctx *
 transcode_setup(struct transcode_decode_setup_args decode_args, struct transcode_encode_setup_args encode_args)
 {
@@ -2210,6 +2315,8 @@ transcode_encode_cleanup(struct encode_ctx **ctx)
 
   evbuffer_free((*ctx)->evbuf_io.evbuf);
   av_packet_free(&(*ctx)->encoded_pkt);
+  av_frame_free(&(*ctx)->raw_frame);
+  av_buffer_pool_uninit(&(*ctx)->raw_pool);
   av_frame_free(&(*ctx)->filt_frame);
   free(*ctx);
   *ctx = NULL;
@@ -2307,6 +2414,72 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame
   return ret;
 }
 
+// The pool normally only needs a buffer or two, since the filters release the
+// previous frame before we get the next buffer. If allocations keep happening
+// then something is holding on to our frames.
+#if USE_BUFFER_SIZE_T
+static AVBufferRef *
+raw_pool_alloc(void *opaque, size_t size)
+#else
+static AVBufferRef *
+raw_pool_alloc(void *opaque, int size)
+#endif
+{
+  struct encode_ctx *ctx = opaque;
+
+  ctx->raw_pool_allocs++;
+  DPRINTF(E_DBG, L_XCODE, "Raw frame pool allocated buffer %d (%zu bytes)\n", ctx->raw_pool_allocs, (size_t)size);
+
+  return av_buffer_alloc(size);
+}
+
+int
+transcode_encode_raw(struct evbuffer *evbuf, struct encode_ctx *ctx, void *data, size_t size, int nsamples, struct media_quality *quality)
+{
+  AVFrame *f = ctx->raw_frame;
+  AVBufferRef *buf;
+  int ret;
+
+  // The pool only grows, e.g. when the quality goes up. Buffers from an old
+  // pool that the filters still hold are freed when the filters release them,
+  // so it is safe to uninit here.
+  if (size > ctx->raw_pool_size)
+    {
+      av_buffer_pool_uninit(&ctx->raw_pool);
+      CHECK_NULL(L_XCODE, ctx->raw_pool = av_buffer_pool_init2(size, ctx, raw_pool_alloc, NULL));
+      ctx->raw_pool_size = size;
+    }
+
+  buf = av_buffer_pool_get(ctx->raw_pool);
+  if (!buf)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for raw frame buffer\n");
+      return -1;
+    }
+
+  // Slice, the pool's buffers may be larger than this chunk
+  buf->size = size;
+
+  memcpy(buf->data, data, size);
+
+  ret = frame_fill(f, buf->data, size, nsamples, quality);
+  if (ret < 0)
+    {
+      av_buffer_unref(&buf);
+      av_frame_unref(f);
+      return -1;
+    }
+
+  // With a refcounted frame the filter graph takes over our pooled buffer,
+  // otherwise it would allocate a buffer and copy the data itself
+  f->buf[0] = buf;
+
+  ret = transcode_encode(evbuf, ctx, f, 0);
+  av_frame_unref(f);
+
+  return ret;
+}
+
 int
 transcode(struct evbuffer *evbuf, int *icy_timer, struct transcode_ctx *ctx, int want_bytes)
 {
@@ -2345,7 +2518,6 @@ transcode_frame *
 transcode_frame_new(void *data, size_t size, int nsamples, struct media_quality *quality)
 {
   AVFrame *f;
-  int ret;
 
   f = av_frame_alloc();
   if (!f)
@@ -2354,34 +2526,8 @@ transcode_frame_new(void *data, size_t size, int nsamples, struct media_quality
       return NULL;
     }
 
-  f->format = bitdepth2format(quality->bits_per_sample);
-  if (f->format == AV_SAMPLE_FMT_NONE)
-    {
-      DPRINTF(E_LOG, L_XCODE, "transcode_frame_new() called with unsupported bps (%d)\n", quality->bits_per_sample);
-      av_frame_free(&f);
-      return NULL;
-    }
-
-  f->sample_rate    = quality->sample_rate;
-  f->nb_samples     = nsamples;
-#if USE_CH_LAYOUT
-  av_channel_layout_default(&f->ch_layout, quality->channels);
-#else
-  f->channel_layout = av_get_default_channel_layout(quality->channels);
-# ifdef HAVE_FFMPEG
-  f->channels       = quality->channels;
-# endif
-#endif
-  f->pts            = AV_NOPTS_VALUE;
-
-  // We don't align because the frame won't be given directly to the encoder
-  // anyway, it will first go through the filter (which might align it...?)
-  ret = avcodec_fill_audio_frame(f, quality->channels, f->format, data, size, 1);
-  if (ret < 0)
+  if (frame_fill(f, data, size, nsamples, quality) < 0)
     {
-      DPRINTF(E_LOG, L_XCODE, "Error filling frame with rawbuf, size %zu, samples %d (%d/%d/%d): %s\n",
-	size, nsamples, quality->sample_rate, quality->bits_per_sample, quality->channels, err2str(ret));
-
       av_frame_free(&f);
       return NULL;
     }
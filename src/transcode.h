@@ -72,6 +72,11 @@ struct transcode_decode_setup_args
   bool is_http;
   uint32_t len_ms;
 
+  // For images, the size the caller will scale to (optional). JPEGs will then
+  // be decoded at the lowest resolution that is still large enough.
+  int max_w;
+  int max_h;
+
   // Source must be either of these
   const char *path;
   struct transcode_evbuf_io *evbuf_io;
@@ -105,6 +110,18 @@ transcode_decode_setup(struct transcode_decode_setup_args args);
 struct encode_ctx *
 transcode_encode_setup(struct transcode_encode_setup_args args);
 
+/* Makes an encode context ready for input from a new source, e.g. raw input
+ * with a different quality. Only the filters (resampler) are recreated, the
+ * muxer and encoder are kept. Not possible if the output was set up without a
+ * fixed quality, since then the encoder depends on the source.
+ *
+ * @in  ctx        Encode context to reset
+ * @in  src_ctx    Decode context describing the new source
+ * @return         0 if OK, -1 if the caller must set up a new context instead
+ */
+int
+transcode_encode_reset(struct encode_ctx *ctx, struct decode_ctx *src_ctx);
+
 struct transcode_ctx *
 transcode_setup(struct transcode_decode_setup_args decode_args, struct transcode_encode_setup_args encode_args);
 
@@ -148,6 +165,23 @@ transcode_decode(transcode_frame **frame, struct decode_ctx *ctx);
 int
 transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame *frame, int eof);
 
+/* Encodes a buffer with raw data, like transcode_frame_new() followed by
+ * transcode_encode(). The data is copied to a buffer from a pool owned by the
+ * encode context, and the context's frame is reused, so once the pool has
+ * buffers for the largest size there are no allocations for the frame or its
+ * data. Allocations by the pool are logged at debug level.
+ *
+ * @out evbuf      An evbuffer filled with remuxed data
+ * @in  ctx        Encode context
+ * @in  data       Buffer with raw data
+ * @in  size       Size of buffer
+ * @in  nsamples   Number of samples in the buffer
+ * @in  quality    Sample rate, bits per sample and channels
+ * @return         Bytes added if OK, negative if error
+ */
+int
+transcode_encode_raw(struct evbuffer *evbuf, struct encode_ctx *ctx, void *data, size_t size, int nsamples, struct media_quality *quality);
+
 /* Demuxes, decodes, encodes and remuxes from the input.
  *
  * @out evbuf      An evbuffer filled with remuxed data